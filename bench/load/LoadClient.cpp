@@ -0,0 +1,132 @@
+#include "LoadClient.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+LoadClient::LoadClient(std::string const& nick) :
+	_fd(-1), _outOffset(0), _inLength(0), _inStart(0), nickname(nick),
+	connectStart(0), joinStart(0), registered(false), joined(false), dead(false), writeArmed(false),
+	channel(0)
+{
+}
+
+LoadClient::~LoadClient()
+{
+	if (_fd >= 0)
+		close(_fd);
+}
+
+/**
+ * @brief Starts a non-blocking connect; completion shows up as
+ * writability in the caller's epoll set.
+ *
+ * @return false if the socket could not even be created.
+ */
+bool LoadClient::open(struct sockaddr_in const& address)
+{
+	_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (_fd < 0)
+		return false;
+	int one = 1;
+	setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(_fd, reinterpret_cast<struct sockaddr const*>(&address), sizeof(address)) < 0
+		&& errno != EINPROGRESS)
+	{
+		close(_fd);
+		_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+int LoadClient::getFd() const
+{
+	return _fd;
+}
+
+void LoadClient::queue(std::string const& line)
+{
+	_out += line;
+}
+
+bool LoadClient::wantsWrite() const
+{
+	return _outOffset < _out.size();
+}
+
+/**
+ * @brief Writes as much pending output as the socket takes.
+ *
+ * @return false on a hard socket error.
+ */
+bool LoadClient::flush()
+{
+	while (_outOffset < _out.size())
+	{
+		ssize_t n = send(_fd, _out.data() + _outOffset, _out.size() - _outOffset, MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+				break;
+			return false;
+		}
+		_outOffset += static_cast<size_t>(n);
+	}
+	if (_outOffset == _out.size())
+	{
+		_out.clear();
+		_outOffset = 0;
+	}
+	return true;
+}
+
+/**
+ * @brief Reads whatever the socket has into the input buffer.
+ *
+ * @return false once the server closed the connection or on error.
+ */
+bool LoadClient::fill()
+{
+	if (_inStart > 0)
+	{
+		std::memmove(_in, _in + _inStart, _inLength - _inStart);
+		_inLength -= _inStart;
+		_inStart = 0;
+	}
+	while (_inLength < sizeof(_in))
+	{
+		ssize_t n = recv(_fd, _in + _inLength, sizeof(_in) - _inLength, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (n == 0)
+			return false;
+		_inLength += static_cast<size_t>(n);
+	}
+	return true;
+}
+
+/**
+ * @brief Pops the next complete line, without its "\r\n".
+ */
+bool LoadClient::nextLine(std::string& line)
+{
+	char* start = _in + _inStart;
+	char* end = static_cast<char*>(std::memchr(start, '\n', _inLength - _inStart));
+	if (!end)
+		return false;
+	size_t length = static_cast<size_t>(end - start);
+	if (length > 0 && start[length - 1] == '\r')
+		--length;
+	line.assign(start, length);
+	_inStart += static_cast<size_t>(end - start) + 1;
+	return true;
+}
@@ -0,0 +1,57 @@
+#ifndef LOADCLIENT_HPP
+# define LOADCLIENT_HPP
+
+# include <string>
+# include <stdint.h>
+# include <netinet/in.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+# define LOAD_INPUT_SIZE 65536
+
+/**
+ * @class LoadClient
+ * @brief One simulated IRC connection driven by LoadGen.
+ *
+ * Owns a non-blocking socket, a pending output string and an input
+ * buffer framed on "\r\n". LoadGen decides what to send and reacts to
+ * the lines nextLine() hands back.
+ */
+class LoadClient
+{
+	private:
+		int _fd;
+		std::string _out;
+		size_t _outOffset;
+		char _in[LOAD_INPUT_SIZE];
+		size_t _inLength;
+		size_t _inStart;
+
+		LoadClient(LoadClient const&);
+		LoadClient& operator=(LoadClient const&);
+
+	public:
+		std::string nickname;
+		uint64_t connectStart;
+		uint64_t joinStart;
+		bool registered;
+		bool joined;
+		bool dead;
+		bool writeArmed;
+		size_t channel;
+
+		explicit LoadClient(std::string const& nick);
+		~LoadClient();
+
+		bool open(struct sockaddr_in const& address);
+		int getFd() const;
+		void queue(std::string const& line);
+		bool wantsWrite() const;
+		bool flush();
+		bool fill();
+		bool nextLine(std::string& line);
+};
+
+#endif // LOADCLIENT_HPP
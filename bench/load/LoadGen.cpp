@@ -0,0 +1,426 @@
+#include "LoadGen.hpp"
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+
+#define LOAD_EVENTS 512
+
+LoadOptions::LoadOptions() :
+	host("127.0.0.1"), ports(1, 6667), password("bench"), clients(1000), channels(10),
+	senders(50), messages(200), window(20000), payload(32), timeout(30)
+{
+}
+
+LoadGen::LoadGen(LoadOptions const& options) :
+	_options(options), _epollFD(-1), _current(NULL), _received(0), _joined(false)
+{
+	for (size_t i = 0; i < options.ports.size(); ++i)
+	{
+		struct sockaddr_in address;
+		std::memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(static_cast<uint16_t>(options.ports[i]));
+		if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1)
+			throw std::runtime_error("Invalid host address: " + options.host);
+		_addresses.push_back(address);
+	}
+	_epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (_epollFD < 0)
+		throw std::runtime_error("epoll_create1 failed: " + std::string(strerror(errno)));
+	_channelSize.assign(options.channels ? options.channels : 1, 0);
+}
+
+LoadGen::~LoadGen()
+{
+	for (size_t i = 0; i < _clients.size(); ++i)
+		delete _clients[i];
+	if (_epollFD >= 0)
+		close(_epollFD);
+}
+
+uint64_t LoadGen::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * static_cast<uint64_t>(1000000000) + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+void LoadGen::watch(LoadClient* client)
+{
+	struct epoll_event ev;
+	std::memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.fd = client->getFd();
+	client->writeArmed = true;
+	if (epoll_ctl(_epollFD, EPOLL_CTL_ADD, client->getFd(), &ev) == 0)
+		_byFd[client->getFd()] = client;
+	else
+		client->dead = true;
+}
+
+/**
+ * @brief Queues a line and flushes it, arming EPOLLOUT only while
+ * output is left over.
+ */
+void LoadGen::send(LoadClient* client, std::string const& line)
+{
+	if (client->dead)
+		return;
+	client->queue(line);
+	if (!client->flush())
+	{
+		client->dead = true;
+		return;
+	}
+	if (client->wantsWrite() && !client->writeArmed)
+	{
+		struct epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.fd = client->getFd();
+		epoll_ctl(_epollFD, EPOLL_CTL_MOD, client->getFd(), &ev);
+		client->writeArmed = true;
+	}
+}
+
+void LoadGen::poll(int timeoutMs)
+{
+	struct epoll_event events[LOAD_EVENTS];
+	int ready = epoll_wait(_epollFD, events, LOAD_EVENTS, timeoutMs);
+	for (int i = 0; i < ready; ++i)
+	{
+		std::map<int, LoadClient*>::iterator it = _byFd.find(events[i].data.fd);
+		if (it != _byFd.end())
+			handle(it->second, events[i].events);
+	}
+}
+
+void LoadGen::handle(LoadClient* client, uint32_t events)
+{
+	if (events & EPOLLOUT)
+	{
+		if (!client->flush())
+			client->dead = true;
+		else if (!client->wantsWrite())
+		{
+			struct epoll_event ev;
+			std::memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.fd = client->getFd();
+			epoll_ctl(_epollFD, EPOLL_CTL_MOD, client->getFd(), &ev);
+			client->writeArmed = false;
+		}
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	{
+		bool open = client->fill();
+		std::string line;
+		while (client->nextLine(line))
+			onLine(client, line);
+		if (!open)
+			client->dead = true;
+	}
+	if (client->dead)
+	{
+		epoll_ctl(_epollFD, EPOLL_CTL_DEL, client->getFd(), NULL);
+		_byFd.erase(client->getFd());
+	}
+}
+
+/**
+ * @brief Reacts to one server line: registration and join completion,
+ * PING, and time-stamped deliveries.
+ */
+void LoadGen::onLine(LoadClient* client, std::string const& line)
+{
+	if (line.compare(0, 5, "PING ") == 0)
+	{
+		send(client, "PONG " + line.substr(5) + "\r\n");
+		return;
+	}
+	std::string::size_type space = line.find(' ');
+	if (space == std::string::npos)
+		return;
+	char const* rest = line.c_str() + space + 1;
+
+	if (std::strncmp(rest, "001 ", 4) == 0 && !client->registered)
+	{
+		client->registered = true;
+		if (_current)
+			_current->latency.record(now() - client->connectStart);
+		++_received;
+	}
+	else if (std::strncmp(rest, "JOIN ", 5) == 0 && !client->joined
+		&& line.compare(1, client->nickname.size() + 1, client->nickname + "!") == 0)
+	{
+		client->joined = true;
+		if (_current)
+			_current->latency.record(now() - client->joinStart);
+		++_received;
+	}
+	else if (std::strncmp(rest, "PRIVMSG ", 8) == 0)
+	{
+		char const* stamp = std::strstr(rest, " :t=");
+		if (!stamp)
+			return;
+		uint64_t sent = std::strtoul(stamp + 4, NULL, 10);
+		uint64_t arrived = now();
+		if (_current && arrived >= sent)
+			_current->latency.record(arrived - sent);
+		++_received;
+	}
+	else if (std::strncmp(line.c_str(), "ERROR", 5) == 0)
+		client->dead = true;
+}
+
+/**
+ * @brief A PRIVMSG carrying the current monotonic time and the padding.
+ */
+std::string LoadGen::stamped(std::string const& target) const
+{
+	char stamp[32];
+	std::snprintf(stamp, sizeof(stamp), "%lu", static_cast<unsigned long>(now()));
+	return "PRIVMSG " + target + " :t=" + stamp + " " + std::string(_options.payload, 'x') + "\r\n";
+}
+
+/**
+ * @brief Runs the loop until counter reaches target or the deadline.
+ */
+bool LoadGen::waitFor(uint64_t target, uint64_t& counter, uint64_t deadline)
+{
+	while (counter < target && now() < deadline)
+		poll(10);
+	return counter >= target;
+}
+
+/**
+ * @brief With several servers, lets nicks and joins reach the servers
+ * that learn of them over a link before traffic depends on them.
+ */
+void LoadGen::settle()
+{
+	if (_addresses.size() < 2)
+		return;
+	uint64_t until = now() + static_cast<uint64_t>(500000000);
+	while (now() < until)
+		poll(10);
+}
+
+void LoadGen::runConnect(ScenarioResult& result)
+{
+	uint64_t deadline = now() + static_cast<uint64_t>(_options.timeout) * static_cast<uint64_t>(1000000000);
+	for (size_t i = 0; i < _options.clients; ++i)
+	{
+		std::ostringstream nick;
+		nick << "b" << i;
+		LoadClient* client = new LoadClient(nick.str());
+		_clients.push_back(client);
+		client->connectStart = now();
+		if (!client->open(_addresses[i % _addresses.size()]))
+		{
+			client->dead = true;
+			continue;
+		}
+		client->queue("PASS " + _options.password + "\r\n"
+			"NICK " + client->nickname + "\r\n"
+			"USER " + client->nickname + " 0 * :bench\r\n");
+		watch(client);
+		// Keep the accept queue moving during a large storm.
+		if (i % 256 == 255)
+			poll(0);
+	}
+	result.expected = _options.clients;
+	result.completed = waitFor(result.expected, _received, deadline);
+}
+
+void LoadGen::runJoin(ScenarioResult& result)
+{
+	uint64_t deadline = now() + static_cast<uint64_t>(_options.timeout) * static_cast<uint64_t>(1000000000);
+	result.expected = 0;
+	for (size_t i = 0; i < _clients.size(); ++i)
+	{
+		LoadClient* client = _clients[i];
+		if (!client->registered || client->dead)
+			continue;
+		client->channel = i % _channelSize.size();
+		client->joinStart = now();
+		std::ostringstream join;
+		join << "JOIN #bench" << client->channel << "\r\n";
+		send(client, join.str());
+		++_channelSize[client->channel];
+		++result.expected;
+		if (i % 256 == 255)
+			poll(0);
+	}
+	result.completed = waitFor(result.expected, _received, deadline);
+	_joined = true;
+}
+
+void LoadGen::runFanout(ScenarioResult& result)
+{
+	uint64_t deadline = now() + static_cast<uint64_t>(_options.timeout) * static_cast<uint64_t>(1000000000);
+	std::vector<LoadClient*> senders;
+	for (size_t i = 0; i < _clients.size() && senders.size() < _options.senders; ++i)
+	{
+		if (_clients[i]->joined && !_clients[i]->dead)
+			senders.push_back(_clients[i]);
+	}
+	result.expected = 0;
+	size_t total = senders.size() * _options.messages;
+	for (size_t sent = 0; sent < total && now() < deadline; )
+	{
+		if (_received < result.expected && result.expected - _received >= _options.window)
+		{
+			poll(1);
+			continue;
+		}
+		LoadClient* sender = senders[sent % senders.size()];
+		std::ostringstream target;
+		target << "#bench" << sender->channel;
+		send(sender, stamped(target.str()));
+		result.expected += _channelSize[sender->channel] - 1;
+		++sent;
+		if (sent % 64 == 0)
+			poll(0);
+	}
+	result.completed = waitFor(result.expected, _received, deadline);
+}
+
+void LoadGen::runChat(ScenarioResult& result)
+{
+	uint64_t deadline = now() + static_cast<uint64_t>(_options.timeout) * static_cast<uint64_t>(1000000000);
+	std::vector<LoadClient*> live;
+	for (size_t i = 0; i < _clients.size(); ++i)
+	{
+		if (_clients[i]->registered && !_clients[i]->dead)
+			live.push_back(_clients[i]);
+	}
+	size_t pairs = live.size() / 2;
+	result.expected = 0;
+	size_t total = pairs * 2 * _options.messages;
+	for (size_t sent = 0; sent < total && now() < deadline; )
+	{
+		if (_received < result.expected && result.expected - _received >= _options.window)
+		{
+			poll(1);
+			continue;
+		}
+		size_t slot = sent % (pairs * 2);
+		LoadClient* from = live[slot];
+		LoadClient* to = live[slot ^ 1];
+		send(from, stamped(to->nickname));
+		++result.expected;
+		++sent;
+		if (sent % 64 == 0)
+			poll(0);
+	}
+	result.completed = waitFor(result.expected, _received, deadline);
+}
+
+/**
+ * @brief Resets the per-scenario state and runs one scenario by name.
+ *
+ * @throws std::runtime_error for an unknown name.
+ */
+void LoadGen::runScenario(std::string const& name, ScenarioResult& result)
+{
+	result.name = name;
+	result.completed = false;
+	result.expected = 0;
+	if (name == "fanout" || name == "chat")
+		settle();
+	_current = &result;
+	_received = 0;
+	uint64_t start = now();
+	if (name == "connect")
+		runConnect(result);
+	else if (name == "join")
+		runJoin(result);
+	else if (name == "fanout")
+		runFanout(result);
+	else if (name == "chat")
+		runChat(result);
+	else
+		throw std::runtime_error("Unknown scenario: " + name);
+	result.seconds = static_cast<double>(now() - start) / 1e9;
+	result.operations = _received;
+	_current = NULL;
+}
+
+/**
+ * @brief Runs the requested scenarios in order, each appending one
+ * result. Connections and channel membership a scenario depends on are
+ * set up first, unreported, if no earlier scenario did it.
+ */
+void LoadGen::run(std::vector<ScenarioResult*>& results)
+{
+	for (size_t i = 0; i < _options.scenarios.size(); ++i)
+	{
+		std::string const& name = _options.scenarios[i];
+		ScenarioResult setup;
+		if (name != "connect" && _clients.empty())
+			runScenario("connect", setup);
+		if (name == "fanout" && !_joined)
+			runScenario("join", setup);
+
+		ScenarioResult* result = new ScenarioResult();
+		try
+		{
+			runScenario(name, *result);
+		}
+		catch (...)
+		{
+			delete result;
+			throw;
+		}
+		results.push_back(result);
+	}
+}
+
+/**
+ * @brief Formats the run as one JSON object, latencies in microseconds.
+ */
+std::string LoadGen::toJson(LoadOptions const& options, std::vector<ScenarioResult*> const& results)
+{
+	std::ostringstream os;
+	os.setf(std::ios::fixed);
+	os.precision(3);
+	os << "{\n"
+		<< "  \"target\": \"" << options.host << ":";
+	for (size_t i = 0; i < options.ports.size(); ++i)
+		os << (i ? "," : "") << options.ports[i];
+	os << "\",\n"
+		<< "  \"clients\": " << options.clients << ",\n"
+		<< "  \"channels\": " << options.channels << ",\n"
+		<< "  \"senders\": " << options.senders << ",\n"
+		<< "  \"messages\": " << options.messages << ",\n"
+		<< "  \"payload\": " << options.payload << ",\n"
+		<< "  \"scenarios\": [";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		ScenarioResult const& r = *results[i];
+		double rate = r.seconds > 0 ? static_cast<double>(r.operations) / r.seconds : 0;
+		os << (i ? "," : "") << "\n    {\n"
+			<< "      \"name\": \"" << r.name << "\",\n"
+			<< "      \"completed\": " << (r.completed ? "true" : "false") << ",\n"
+			<< "      \"operations\": " << r.operations << ",\n"
+			<< "      \"expected\": " << r.expected << ",\n"
+			<< "      \"seconds\": " << r.seconds << ",\n"
+			<< "      \"ops_per_sec\": " << rate << ",\n"
+			<< "      \"latency_us\": { "
+			<< "\"p50\": " << static_cast<double>(r.latency.quantile(0.5)) / 1e3 << ", "
+			<< "\"p99\": " << static_cast<double>(r.latency.quantile(0.99)) / 1e3 << ", "
+			<< "\"p999\": " << static_cast<double>(r.latency.quantile(0.999)) / 1e3 << ", "
+			<< "\"max\": " << static_cast<double>(r.latency.max()) / 1e3 << " }\n"
+			<< "    }";
+	}
+	os << "\n  ]\n}\n";
+	return os.str();
+}
@@ -0,0 +1,111 @@
+#ifndef LOADGEN_HPP
+# define LOADGEN_HPP
+
+# include <map>
+# include <string>
+# include <vector>
+# include <stdint.h>
+# include <netinet/in.h>
+# include "Histogram.hpp"
+# include "LoadClient.hpp"
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/**
+ * @struct LoadOptions
+ * @brief Knobs of one benchmark run, filled from the command line.
+ */
+struct LoadOptions
+{
+	std::string host;
+	std::vector<int> ports;	// clients are spread over them in turn
+	std::string password;
+	size_t clients;
+	size_t channels;
+	size_t senders;		// fan-out: clients posting to their channel
+	size_t messages;	// per sender, in fan-out and chat
+	size_t window;		// deliveries allowed in flight
+	size_t payload;		// extra bytes per message
+	int timeout;		// seconds per scenario
+	std::vector<std::string> scenarios;
+
+	LoadOptions();
+};
+
+/**
+ * @struct ScenarioResult
+ * @brief What one scenario reports in the JSON output.
+ */
+struct ScenarioResult
+{
+	std::string name;
+	bool completed;
+	uint64_t operations;
+	uint64_t expected;
+	double seconds;
+	Histogram latency;	// nanoseconds
+};
+
+/**
+ * @class LoadGen
+ * @brief Single-threaded epoll load generator for ircserv.
+ *
+ * Scenarios run in order on the same set of connections:
+ *  - connect: open and register every client (PASS/NICK/USER -> 001)
+ *  - join:    every client joins one of the bench channels
+ *  - fanout:  senders post into their channel; every member's copy is
+ *             a delivery
+ *  - chat:    clients pair up and message each other directly
+ *
+ * Each message carries the monotonic send time, so the receiver gets
+ * an end-to-end delivery latency. At most `window` deliveries are in
+ * flight, which keeps the run closed-loop and comparable across builds.
+ *
+ * Given several ports, e.g. servers linked into one network, client i
+ * connects to port i modulo their number, so channel and private
+ * traffic crosses the links and the totals are the network's.
+ */
+class LoadGen
+{
+	private:
+		LoadOptions const& _options;
+		std::vector<struct sockaddr_in> _addresses;
+		int _epollFD;
+		std::vector<LoadClient*> _clients;
+		std::map<int, LoadClient*> _byFd;
+		std::vector<size_t> _channelSize;
+		ScenarioResult* _current;
+		uint64_t _received;
+		bool _joined;
+
+		LoadGen(LoadGen const&);
+		LoadGen& operator=(LoadGen const&);
+
+		void watch(LoadClient* client);
+		void poll(int timeoutMs);
+		void handle(LoadClient* client, uint32_t events);
+		void onLine(LoadClient* client, std::string const& line);
+		void send(LoadClient* client, std::string const& line);
+		std::string stamped(std::string const& target) const;
+		bool waitFor(uint64_t target, uint64_t& counter, uint64_t deadline);
+		void settle();
+
+		void runConnect(ScenarioResult& result);
+		void runJoin(ScenarioResult& result);
+		void runFanout(ScenarioResult& result);
+		void runChat(ScenarioResult& result);
+		void runScenario(std::string const& name, ScenarioResult& result);
+
+	public:
+		explicit LoadGen(LoadOptions const& options);
+		~LoadGen();
+
+		void run(std::vector<ScenarioResult*>& results);
+		static uint64_t now();
+		static std::string toJson(LoadOptions const& options,
+			std::vector<ScenarioResult*> const& results);
+};
+
+#endif // LOADGEN_HPP
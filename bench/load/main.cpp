@@ -0,0 +1,133 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <sys/resource.h>
+#include "LoadGen.hpp"
+
+static void usage(char const* name)
+{
+	std::cerr << "Usage: " << name << " [--host H] [--port P[,P...]] [--password PW] [--clients N]"
+		<< " [--channels N] [--senders N] [--messages N] [--window N] [--payload BYTES]"
+		<< " [--timeout S] [--out FILE] [--scenarios connect,join,fanout,chat]" << std::endl;
+}
+
+template <typename T>
+static bool parseNumber(char const* text, T& value)
+{
+	std::stringstream ss(text);
+	return (ss >> value) && ss.eof();
+}
+
+/**
+ * @brief A port or a comma-separated list of them.
+ */
+static bool parsePorts(char const* text, std::vector<int>& ports)
+{
+	std::stringstream list(text);
+	std::string item;
+	ports.clear();
+	while (std::getline(list, item, ','))
+	{
+		int port;
+		if (!parseNumber(item.c_str(), port) || port <= 0 || port > 65535)
+			return false;
+		ports.push_back(port);
+	}
+	return !ports.empty();
+}
+
+/**
+ * @brief Thousands of sockets need more than the usual 1024 descriptors.
+ */
+static void raiseFileLimit()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	LoadOptions options;
+	std::string scenarios("connect,join,fanout,chat");
+	std::string out;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		bool ok = i + 1 < argc;
+		char const* value = ok ? argv[i + 1] : "";
+		if (std::strcmp(argv[i], "--host") == 0 && ok)
+			options.host = value;
+		else if (std::strcmp(argv[i], "--port") == 0 && ok)
+			ok = parsePorts(value, options.ports);
+		else if (std::strcmp(argv[i], "--password") == 0 && ok)
+			options.password = value;
+		else if (std::strcmp(argv[i], "--clients") == 0 && ok)
+			ok = parseNumber(value, options.clients);
+		else if (std::strcmp(argv[i], "--channels") == 0 && ok)
+			ok = parseNumber(value, options.channels) && options.channels > 0;
+		else if (std::strcmp(argv[i], "--senders") == 0 && ok)
+			ok = parseNumber(value, options.senders);
+		else if (std::strcmp(argv[i], "--messages") == 0 && ok)
+			ok = parseNumber(value, options.messages);
+		else if (std::strcmp(argv[i], "--window") == 0 && ok)
+			ok = parseNumber(value, options.window) && options.window > 0;
+		else if (std::strcmp(argv[i], "--payload") == 0 && ok)
+			ok = parseNumber(value, options.payload) && options.payload <= 400;
+		else if (std::strcmp(argv[i], "--timeout") == 0 && ok)
+			ok = parseNumber(value, options.timeout) && options.timeout > 0;
+		else if (std::strcmp(argv[i], "--out") == 0 && ok)
+			out = value;
+		else if (std::strcmp(argv[i], "--scenarios") == 0 && ok)
+			scenarios = value;
+		else
+			ok = false;
+		if (!ok)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		++i;
+	}
+
+	std::stringstream list(scenarios);
+	std::string name;
+	while (std::getline(list, name, ','))
+	{
+		if (!name.empty())
+			options.scenarios.push_back(name);
+	}
+
+	raiseFileLimit();
+	std::vector<ScenarioResult*> results;
+	int status = 0;
+	try
+	{
+		LoadGen generator(options);
+		generator.run(results);
+		std::string json = LoadGen::toJson(options, results);
+		std::cout << json;
+		if (!out.empty())
+		{
+			std::ofstream file(out.c_str());
+			file << json;
+		}
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			if (!results[i]->completed)
+				status = 2;
+		}
+	}
+	catch (std::exception const& e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		status = 1;
+	}
+	for (size_t i = 0; i < results.size(); ++i)
+		delete results[i];
+	return status;
+}
@@ -0,0 +1,107 @@
+#include "MicroBench.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <time.h>
+
+uint64_t MicroBench::allocations = 0;
+uint64_t MicroBench::allocatedBytes = 0;
+
+namespace
+{
+	uint64_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * static_cast<uint64_t>(1000000000) + static_cast<uint64_t>(ts.tv_nsec);
+	}
+
+	/* Defeats dead-code elimination of results nobody reads. */
+	volatile uint64_t sink;
+}
+
+/**
+ * @brief Reads a capture with one IRC line per row, CRLF or LF.
+ */
+bool Corpus::load(std::string const& path)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if (!file)
+		return false;
+	std::ostringstream data;
+	data << file.rdbuf();
+	raw = data.str();
+
+	std::string::size_type slash = path.find_last_of('/');
+	name = slash == std::string::npos ? path : path.substr(slash + 1);
+	lines.clear();
+	std::string::size_type start = 0;
+	std::string::size_type nl;
+	while ((nl = raw.find('\n', start)) != std::string::npos)
+	{
+		std::string::size_type end = nl;
+		if (end > start && raw[end - 1] == '\r')
+			--end;
+		if (end > start)
+			lines.push_back(raw.substr(start, end - start));
+		start = nl + 1;
+	}
+	return !lines.empty();
+}
+
+void MicroBench::run(char const* name, MicroCase fn, Corpus const& corpus)
+{
+	sink = fn(corpus);
+
+	uint64_t ops = 0;
+	uint64_t allocs = allocations;
+	uint64_t bytes = allocatedBytes;
+	uint64_t start = now();
+	uint64_t elapsed = 0;
+	while (elapsed < MICRO_MIN_NS)
+	{
+		ops += fn(corpus);
+		elapsed = now() - start;
+	}
+
+	MicroResult result;
+	result.name = name;
+	result.corpus = corpus.name;
+	result.ops = ops;
+	result.nsPerOp = ops ? static_cast<double>(elapsed) / static_cast<double>(ops) : 0;
+	result.allocsPerOp = ops ? static_cast<double>(allocations - allocs) / static_cast<double>(ops) : 0;
+	result.bytesPerOp = ops ? static_cast<double>(allocatedBytes - bytes) / static_cast<double>(ops) : 0;
+	_results.push_back(result);
+}
+
+void MicroBench::print() const
+{
+	std::cout << std::left << std::setw(14) << "case" << std::setw(22) << "corpus"
+		<< std::right << std::setw(12) << "ops" << std::setw(11) << "ns/op"
+		<< std::setw(12) << "allocs/op" << std::setw(12) << "B/op" << "\n";
+	std::cout << std::fixed << std::setprecision(2);
+	for (size_t i = 0; i < _results.size(); ++i)
+	{
+		MicroResult const& r = _results[i];
+		std::cout << std::left << std::setw(14) << r.name << std::setw(22) << r.corpus
+			<< std::right << std::setw(12) << r.ops << std::setw(11) << r.nsPerOp
+			<< std::setw(12) << r.allocsPerOp << std::setw(12) << r.bytesPerOp << "\n";
+	}
+}
+
+std::string MicroBench::toJson() const
+{
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(3) << "[";
+	for (size_t i = 0; i < _results.size(); ++i)
+	{
+		MicroResult const& r = _results[i];
+		os << (i ? "," : "") << "\n  { \"case\": \"" << r.name << "\", \"corpus\": \"" << r.corpus
+			<< "\", \"ops\": " << r.ops << ", \"ns_per_op\": " << r.nsPerOp
+			<< ", \"allocs_per_op\": " << r.allocsPerOp << ", \"bytes_per_op\": " << r.bytesPerOp << " }";
+	}
+	os << "\n]\n";
+	return os.str();
+}
@@ -0,0 +1,71 @@
+#ifndef MICROBENCH_HPP
+# define MICROBENCH_HPP
+
+# include <string>
+# include <vector>
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Minimum wall time per case; iterations grow until it is reached. */
+# define MICRO_MIN_NS (static_cast<uint64_t>(200000000))
+
+/**
+ * @struct Corpus
+ * @brief A capture file loaded once: the raw bytes as they would arrive
+ * on the socket, and the same traffic split into lines.
+ */
+struct Corpus
+{
+	std::string name;
+	std::string raw;
+	std::vector<std::string> lines;
+	std::vector<std::string> names;	// first parameter of each line
+
+	bool load(std::string const& path);
+};
+
+/**
+ * @struct MicroResult
+ * @brief One measured case.
+ */
+struct MicroResult
+{
+	std::string name;
+	std::string corpus;
+	uint64_t ops;
+	double nsPerOp;
+	double allocsPerOp;
+	double bytesPerOp;
+};
+
+/* Runs one pass over the corpus and returns how many operations it did. */
+typedef uint64_t (*MicroCase)(Corpus const& corpus);
+
+/**
+ * @class MicroBench
+ * @brief Times a case over whole passes of a corpus and reports ns/op
+ * and heap allocations/op.
+ *
+ * Each case gets one untimed warm-up pass, so pools and lazily built
+ * tables are in their steady state, then repeats passes until
+ * MICRO_MIN_NS has elapsed. Allocations are counted by the operator
+ * new replacement in the harness's main.cpp.
+ */
+class MicroBench
+{
+	private:
+		std::vector<MicroResult> _results;
+
+	public:
+		static uint64_t allocations;
+		static uint64_t allocatedBytes;
+
+		void run(char const* name, MicroCase fn, Corpus const& corpus);
+		void print() const;
+		std::string toJson() const;
+};
+
+#endif // MICROBENCH_HPP
@@ -0,0 +1,181 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include "MicroBench.hpp"
+#include "InputRing.hpp"
+#include "Message.hpp"
+#include "Command.hpp"
+#include "Client.hpp"
+#include "Utils.hpp"
+
+/*
+ * Every heap allocation made through operator new is counted, which
+ * covers std::string, the containers and the objects of the server.
+ */
+void* operator new(size_t size) throw(std::bad_alloc)
+{
+	++MicroBench::allocations;
+	MicroBench::allocatedBytes += size;
+	void* ptr = std::malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc)
+{
+	return operator new(size);
+}
+
+void operator delete(void* ptr) throw()
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) throw()
+{
+	std::free(ptr);
+}
+
+/* Segment size used to feed the framer, like one TCP segment per read. */
+#define MICRO_SEGMENT 1460
+
+/**
+ * @brief CRLF framing: the capture is fed through InputRing in
+ * segment-sized pieces and every line is framed. One op per line.
+ */
+static uint64_t benchFraming(Corpus const& corpus)
+{
+	InputRing* ring = new InputRing();
+	uint64_t lines = 0;
+	size_t offset = 0;
+	LineView line;
+
+	while (offset < corpus.raw.size())
+	{
+		size_t chunk = corpus.raw.size() - offset;
+		if (chunk > MICRO_SEGMENT)
+			chunk = MICRO_SEGMENT;
+		offset += ring->append(corpus.raw.data() + offset, chunk);
+		while (ring->next(line) != InputRing::LINE_NONE)
+			++lines;
+	}
+	delete ring;
+	return lines;
+}
+
+/**
+ * @brief Tokenizing one line into tags, prefix, verb and parameters.
+ */
+static uint64_t benchParse(Corpus const& corpus)
+{
+	uint64_t params = 0;
+	for (size_t i = 0; i < corpus.lines.size(); ++i)
+	{
+		Message msg;
+		if (msg.parse(corpus.lines[i].data(), corpus.lines[i].size()))
+			params += msg.paramCount;
+	}
+	return params ? corpus.lines.size() : 0;
+}
+
+/**
+ * @brief Parse plus the verb table lookup, i.e. everything
+ * handleCommand does before calling a handler.
+ */
+static uint64_t benchDispatch(Corpus const& corpus)
+{
+	uint64_t known = 0;
+	for (size_t i = 0; i < corpus.lines.size(); ++i)
+	{
+		Message msg;
+		if (msg.parse(corpus.lines[i].data(), corpus.lines[i].size())
+			&& Command::lookup(msg.data(msg.verb), msg.verb.length))
+			++known;
+	}
+	return known ? corpus.lines.size() : 0;
+}
+
+/**
+ * @brief Formatting and queueing a numeric reply whose parameters come
+ * from the line, on a detached client so nothing reaches a socket.
+ */
+static uint64_t benchReply(Corpus const& corpus)
+{
+	static Client* client = NULL;
+	if (!client)
+	{
+		client = new Client(-1, NULL);
+		client->setNickname("benchmark");
+		client->detach();
+	}
+	for (size_t i = 0; i < corpus.lines.size(); ++i)
+	{
+		Message msg;
+		msg.parse(corpus.lines[i].data(), corpus.lines[i].size());
+		std::string target = msg.paramCount ? msg.param(0) : std::string("*");
+		Command::reply(client, "401", target + " :No such nick/channel");
+	}
+	return corpus.lines.size();
+}
+
+/**
+ * @brief RFC 1459 case-folding of the first parameter of every line,
+ * which is a nick or channel name for most traffic.
+ */
+static uint64_t benchFold(Corpus const& corpus)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < corpus.names.size(); ++i)
+		total += ircFold(corpus.names[i]).size();
+	return total ? corpus.names.size() : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> paths;
+	std::string out;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			out = argv[++i];
+		else
+			paths.push_back(argv[i]);
+	}
+	if (paths.empty())
+	{
+		std::cerr << "Usage: " << argv[0] << " [--out FILE] <corpus.irc>..." << std::endl;
+		return 1;
+	}
+
+	MicroBench bench;
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		Corpus corpus;
+		if (!corpus.load(paths[i]))
+		{
+			std::cerr << "Cannot load corpus: " << paths[i] << std::endl;
+			return 1;
+		}
+		for (size_t l = 0; l < corpus.lines.size(); ++l)
+		{
+			Message msg;
+			if (msg.parse(corpus.lines[l].data(), corpus.lines[l].size()) && msg.paramCount)
+				corpus.names.push_back(msg.param(0));
+		}
+		bench.run("framing", &benchFraming, corpus);
+		bench.run("parse", &benchParse, corpus);
+		bench.run("dispatch", &benchDispatch, corpus);
+		bench.run("reply", &benchReply, corpus);
+		bench.run("casefold", &benchFold, corpus);
+	}
+	bench.print();
+	if (!out.empty())
+	{
+		std::ofstream file(out.c_str());
+		file << bench.toJson();
+	}
+	return 0;
+}
@@ -77,6 +77,8 @@ std::string	setObjColor(int const& color);
 bool		checkInput(const std::string& str, int (*check_type)(int));
 bool		isOnlySpaces(const std::string& str);
 std::string toUpperCase(std::string const& str);
+char		ircLower(char c);
+std::string	ircFold(std::string const& str);
 size_t		maxStringLength(int fieldSize, std::string* arrayData);
 std::string	center(const std::string& s, std::string::size_type width);
 std::string errorFmt(const std::string& s, int width = 22);
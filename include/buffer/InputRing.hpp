@@ -0,0 +1,79 @@
+#ifndef INPUTRING_HPP
+# define INPUTRING_HPP
+
+# include <cstddef>
+# include <sys/types.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* RFC 1459 line limit, CRLF included. */
+# ifndef IRC_LINE_MAX
+# define IRC_LINE_MAX 512
+# endif
+
+# ifndef INPUT_RING_SIZE
+# define INPUT_RING_SIZE 4096
+# endif
+
+/**
+ * @brief Non-owning view of one line inside an InputRing. Valid until
+ * the next InputRing::fill().
+ */
+struct LineView
+{
+	char const* data;
+	size_t size;
+};
+
+/**
+ * @class InputRing
+ * @brief Fixed-capacity per-client receive buffer with CRLF framing.
+ *
+ * recv() writes straight into the free tail. Consumed lines only move
+ * the head forward, and the delimiter scan resumes where the previous
+ * one stopped, so pipelined commands cost O(bytes) instead of the
+ * find()/erase() quadratic pattern. When the tail reaches the end of
+ * the storage the unconsumed partial line (at most IRC_LINE_MAX bytes)
+ * is moved back to the front, which keeps every line contiguous and
+ * lets next() hand out views without copying.
+ *
+ * Both "\r\n" and a bare "\n" terminate a line. A line longer than
+ * IRC_LINE_MAX is reported once as LINE_TOO_LONG and then discarded up
+ * to its terminator.
+ */
+class InputRing
+{
+	public:
+		enum Status
+		{
+			LINE_NONE,
+			LINE_READY,
+			LINE_TOO_LONG
+		};
+
+		InputRing();
+		ssize_t fill(int fd);
+		size_t append(char const* data, size_t length);
+		Status next(LineView& line);
+		bool hasLine() const;
+		bool full() const;
+		size_t pending() const;
+		char const* front() const;
+
+	private:
+		char _data[INPUT_RING_SIZE];
+		size_t _head;
+		size_t _scan;
+		size_t _tail;
+		bool _discarding;
+
+		InputRing(InputRing const&);
+		InputRing& operator=(InputRing const&);
+
+		void compact();
+		void makeRoom();
+};
+
+#endif // INPUTRING_HPP
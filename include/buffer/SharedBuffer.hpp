@@ -0,0 +1,59 @@
+#ifndef SHAREDBUFFER_HPP
+# define SHAREDBUFFER_HPP
+
+# include <string>
+# include <cstddef>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Largest payload capacity served from a pool; bigger buffers use malloc. */
+# define BUFFER_CLASS_MAX 4096
+
+/**
+ * @class SharedBuffer
+ * @brief Immutable, reference-counted byte buffer for outbound lines.
+ *
+ * The header and the bytes live in a single allocation. Copying a
+ * SharedBuffer only bumps an atomic counter, so a line fanned out to
+ * thousands of send queues is serialized and allocated exactly once.
+ * The contents may only be written through append() while the handle
+ * is still unique, i.e. before it has been queued anywhere.
+ *
+ * Blocks for up to BUFFER_CLASS_MAX bytes come from per-size-class slab
+ * pools, so the lines that fill send queues recycle the same memory
+ * instead of going through malloc/free per message.
+ */
+class SharedBuffer
+{
+	private:
+		struct Block
+		{
+			int refs;
+			int sizeClass;	// index into the buffer pools, -1 if malloc'd
+			size_t size;
+			size_t capacity;
+			char data[1];
+		};
+		Block* _block;
+
+		void release();
+
+	public:
+		SharedBuffer();
+		explicit SharedBuffer(size_t capacity);
+		SharedBuffer(std::string const& str);
+		SharedBuffer(SharedBuffer const& rhs);
+		SharedBuffer& operator=(SharedBuffer const& rhs);
+		~SharedBuffer();
+
+		SharedBuffer& append(char const* data, size_t length);
+		SharedBuffer& append(std::string const& str);
+		char const* data() const;
+		size_t size() const;
+		bool empty() const;
+		int useCount() const;
+};
+
+#endif // SHAREDBUFFER_HPP
@@ -3,44 +3,137 @@
 
 # include <string>
 # include <vector>
+# include <set>
+# include <algorithm>
 # include <pthread.h>
 # include "Client.hpp"
+# include "SharedBuffer.hpp"
+# include "MemberList.hpp"
+# include "ChannelHistory.hpp"
 
 # ifndef DEBUG
 #  define DEBUG 0
 # endif
 
+/**
+ * @class Channel
+ * @brief Channel membership and modes (+i +t +k +l +o).
+ *
+ * Members may live on different reactors. Membership is a copy-on-write
+ * MemberList: JOIN/PART/KICK serialize on mutex, build a new list and
+ * swap it in under snapshotLock, which is only ever held for a pointer
+ * copy. Readers and broadcasters take a snapshot and then fan out with
+ * no lock held, so socket writes never delay membership changes. The
+ * remaining fields are guarded by mutex.
+ *
+ * Members may also be users of other servers. A routed broadcast
+ * queues the line once on each server link that leads to at least one
+ * of them; an unrouted one only reaches local members, for lines the
+ * caller propagates to every link itself.
+ *
+ * PRIVMSG and NOTICE lines are also kept in history, which has a lock
+ * of its own, for CHATHISTORY.
+ *
+ * A channel whose last member leaves is closed: it takes no members
+ * any more, and the server frees it once no reactor can still hold a
+ * pointer to it (Server::leaveChannel).
+ */
 class Channel
 {
+	private:
+		MemberList* _members;
+		pthread_spinlock_t _snapshotLock;
+		bool _closed;	// guarded by mutex
+
+		Channel(Channel const&);
+		Channel& operator=(Channel const&);
+
+		void publish(std::vector<Client*> const& members);
+
 	public:
 		std::string name;
-		std::vector<Client*> members;
+		std::set<Client*> operators;
+		std::set<std::string> invited;
+		std::string topic;
+		std::string key;
+		size_t limit;
+		bool inviteOnly;
+		bool topicRestricted;
 		pthread_mutex_t mutex;
+		ChannelHistory history;
 
 		Channel(std::string const& name);
 		~Channel();
-		void addMember(Client *client);
-		void removeMember(Client *client);
-		void broadcast(std::string const &message, Client *exclude = NULL);
+		static void* operator new(size_t size);
+		static void operator delete(void* ptr, size_t size);
+		int join(Client *client, std::string const& key);
+		bool addMember(Client *client, bool chanop = false);
+		bool removeMember(Client *client);
+		bool close();
+		bool isMember(Client *client);
+		bool isOperator(Client *client);
+		ClientRef findMember(std::string const& nickname);
+		size_t size();
+		MemberSnapshot getMembers();
+		std::string getTopic();
+		void setTopic(std::string const& topic);
+		void invite(std::string const& nickname);
+		bool setMode(char mode, bool enable, std::string const& arg, Client* target = NULL);
+		std::string modeString(bool withKey = true);
+		std::string namesList();
+		void broadcast(SharedBuffer const &message, Client *exclude = NULL, bool routed = true,
+			HistoryStamp const* stamp = NULL);
 };
 
+/**
+ * @brief Queues one already-serialized line on every member except
+ * exclude. Each member's queue takes a reference, never a copy.
+ *
+ * With a stamp, local members that acknowledged server-time or
+ * message-tags get the line with those tags instead; each tagged
+ * variant is built once, by the first member needing it.
+ *
+ * Remote members are reached through their link, once per link, and
+ * never through exclude's own link, which the line came from. With
+ * routed unset they are skipped.
+ */
 class SendMessageFunctor
 {
 	private:
 		Client* exclude;
-		std::string message;
+		Client* origin;
+		SharedBuffer const& message;
+		HistoryStamp const* stamp;
+		bool routed;
+		SharedBuffer tagged[CAP_MESSAGE_TAGS | CAP_SERVER_TIME];
+
+		SharedBuffer const& lineFor(Client* client);
 
 	public:
-		SendMessageFunctor(Client* exclude, const std::string& message)
-			: exclude(exclude), message(message) {}
+		size_t sent;
+		std::vector<Client*> links;
+
+		SendMessageFunctor(Client* exclude, SharedBuffer const& message, bool routed,
+			HistoryStamp const* stamp = NULL)
+			: exclude(exclude), origin(exclude ? exclude->getRoute() : NULL), message(message),
+			stamp(stamp), routed(routed), sent(0) {}
 
-		void operator()(Client* client) const
+		void operator()(Client* client)
 		{
-			if (client != exclude)
+			if (client == exclude)
+				return;
+			Client* route = client->getRoute();
+			if (!route)
+				client->sendMessage(lineFor(client));
+			else if (!routed || route == origin
+				|| std::find(links.begin(), links.end(), route) != links.end())
+				return;
+			else
 			{
-				client->sendMessage(message);
+				links.push_back(route);
+				route->sendMessage(message);
 			}
-    }
+			++sent;
+		}
 };
 #endif // CHANNEL_HPP
-
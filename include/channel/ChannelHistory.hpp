@@ -0,0 +1,161 @@
+#ifndef CHANNELHISTORY_HPP
+# define CHANNELHISTORY_HPP
+
+# include <string>
+# include <vector>
+# include <cstddef>
+# include <stdint.h>
+# include <pthread.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Messages one channel keeps. */
+# ifndef HISTORY_LINES
+#  define HISTORY_LINES 500
+# endif
+
+/* Largest arena of one channel, headers included. */
+# ifndef HISTORY_BYTES
+#  define HISTORY_BYTES 131072
+# endif
+
+/* First arena of a channel; it doubles up to HISTORY_BYTES. */
+# ifndef HISTORY_MIN_BYTES
+#  define HISTORY_MIN_BYTES 4096
+# endif
+
+/* Default bytes of history all channels together may hold; 0 disables
+ * history. */
+# ifndef HISTORY_BUDGET
+#  define HISTORY_BUDGET 67108864
+# endif
+
+/* Most messages one CHATHISTORY request returns (ISUPPORT CHATHISTORY). */
+# ifndef HISTORY_REPLAY_MAX
+#  define HISTORY_REPLAY_MAX 100
+# endif
+
+/**
+ * @struct HistoryRef
+ * @brief A position in history: a msgid, a server time in milliseconds,
+ * or neither (the start or end).
+ */
+struct HistoryRef
+{
+	enum Kind
+	{
+		NONE,
+		MSGID,
+		TIME
+	};
+
+	Kind kind;
+	uint64_t value;
+
+	HistoryRef(Kind kind = NONE, uint64_t value = 0) : kind(kind), value(value) {}
+	static bool parse(std::string const& text, HistoryRef& ref);
+};
+
+/**
+ * @struct HistoryStamp
+ * @brief The msgid and time ChannelHistory::append() gave a message.
+ */
+struct HistoryStamp
+{
+	uint64_t id;
+	uint64_t time;		// milliseconds since the epoch
+};
+
+/**
+ * @struct HistoryLine
+ * @brief One replayed message: the line as it was broadcast, without
+ * CRLF, and its tags.
+ */
+struct HistoryLine
+{
+	uint64_t id;
+	uint64_t time;		// milliseconds since the epoch
+	std::string text;
+};
+
+/**
+ * @class ChannelHistory
+ * @brief The last PRIVMSG and NOTICE lines of one channel, for
+ * CHATHISTORY.
+ *
+ * Messages are packed into a single byte arena used as a ring: a
+ * fixed-size header (msgid, time, length) followed by the line, either
+ * of which may wrap around the end. Appending drops the oldest messages
+ * until the new one fits within HISTORY_LINES and the arena. The arena
+ * starts at HISTORY_MIN_BYTES and doubles, linearized on the way, up to
+ * HISTORY_BYTES, so a quiet channel costs a few kilobytes and a busy
+ * one never more than its cap. Queries walk the headers, which keeps the
+ * ring free of any per-message allocation.
+ *
+ * Msgids come from one process-wide counter seeded with the start time
+ * in microseconds, so they increase across channels and restarts and a
+ * msgid that aged out still orders against those kept. Both are taken
+ * under the channel's lock, so neither goes backwards within a channel.
+ *
+ * Every arena is charged to a process-wide budget. An arena that would
+ * exceed it evicts the whole history of the channels appended to least
+ * recently, never the one asking. A channel busy in another thread is
+ * skipped (its lock is only tried), which keeps the budget lock free of
+ * waits on channel locks. If nothing can be evicted the arena does not
+ * grow, or a channel without one records nothing.
+ */
+class ChannelHistory
+{
+	private:
+		struct Header
+		{
+			uint64_t id;
+			uint64_t time;
+			uint32_t length;
+		};
+
+		pthread_mutex_t _lock;
+		char* _arena;
+		size_t _capacity;
+		size_t _head;		// offset of the oldest message
+		size_t _used;		// bytes of messages, headers included
+		size_t _count;
+		uint64_t _lastTime;
+		uint64_t _lastAppend;	// Metrics::now() of the last append, read unlocked
+		size_t _slot;			// index in _arenas while it has an arena
+
+		static pthread_mutex_t _budgetLock;
+		static std::vector<ChannelHistory*> _arenas;
+		static size_t _budget;
+		static size_t _charged;
+		static uint64_t _lastId;
+
+		ChannelHistory(ChannelHistory const&);
+		ChannelHistory& operator=(ChannelHistory const&);
+
+		void read(size_t offset, void* out, size_t length) const;
+		void write(size_t offset, void const* data, size_t length);
+		void dropOldest();
+		bool reserve(size_t length);
+		void freeArena();
+		static bool charge(ChannelHistory* owner, size_t bytes);
+		static void refund(ChannelHistory* owner, size_t bytes);
+		static void unlist(ChannelHistory* owner);
+		static bool evictColdest(ChannelHistory* owner);
+
+	public:
+		ChannelHistory();
+		~ChannelHistory();
+		static void setBudget(size_t bytes);
+		static bool enabled();
+		static std::string formatTime(uint64_t time);
+		static std::string formatId(uint64_t id);
+		bool append(char const* line, size_t length, HistoryStamp& stamp);
+		void query(HistoryRef const& after, HistoryRef const& before, size_t limit, bool oldest,
+			std::vector<HistoryLine>& out);
+		uint64_t lastTime();
+};
+
+#endif // CHANNELHISTORY_HPP
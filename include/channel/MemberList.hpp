@@ -0,0 +1,65 @@
+#ifndef MEMBERLIST_HPP
+# define MEMBERLIST_HPP
+
+# include <vector>
+# include <cstddef>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+class Client;
+
+/**
+ * @class MemberList
+ * @brief Immutable, reference-counted channel membership.
+ *
+ * A channel never edits a published list: JOIN/PART build a new one
+ * and swap the pointer. Each list holds a reference on every Client it
+ * names, so a broadcaster that took a snapshot can keep sending after
+ * the member has left or disconnected.
+ */
+class MemberList
+{
+	private:
+		int _refs;
+		std::vector<Client*> _clients;
+
+		explicit MemberList(std::vector<Client*> const& clients);
+		~MemberList();
+		MemberList(MemberList const&);
+		MemberList& operator=(MemberList const&);
+
+	public:
+		static void* operator new(size_t size);
+		static void operator delete(void* ptr, size_t size);
+		static MemberList* create(std::vector<Client*> const& clients);
+		void retain();
+		void release();
+		std::vector<Client*> const& clients() const;
+};
+
+/**
+ * @class MemberSnapshot
+ * @brief RAII handle on a MemberList; copies share the same list.
+ */
+class MemberSnapshot
+{
+	private:
+		MemberList* _list;
+
+	public:
+		typedef std::vector<Client*>::const_iterator const_iterator;
+
+		explicit MemberSnapshot(MemberList* list);
+		MemberSnapshot(MemberSnapshot const& rhs);
+		MemberSnapshot& operator=(MemberSnapshot const& rhs);
+		~MemberSnapshot();
+
+		const_iterator begin() const;
+		const_iterator end() const;
+		size_t size() const;
+		bool contains(Client* client) const;
+};
+
+#endif // MEMBERLIST_HPP
@@ -1,12 +1,20 @@
 #ifndef CLIENT_HPP
 # define CLIENT_HPP
 
-# include <pthread.h>
 # include <string>
+# include <deque>
+# include <set>
+# include <vector>
+# include <pthread.h>
 # include <Utils.hpp>
+# include "SharedBuffer.hpp"
+# include "InputRing.hpp"
+# include "FloodBucket.hpp"
+# include "TimerWheel.hpp"
 # include <cerrno>
 # include <cstring> // strerror
 # include <sys/socket.h>
+# include <sys/uio.h>
 
 
 
@@ -18,21 +26,217 @@
 # ifndef MAX_BUFFER
 # define MAX_BUFFER 4096
 # endif
+
+/* Default upper bound of bytes waiting in a client's outbound queue. */
+# ifndef MAX_SENDQ
+# define MAX_SENDQ 1048576
+# endif
+
+/* Watermarks, in percent of the SendQ limit, at which a client stops
+ * and resumes having its own commands run. */
+# ifndef SENDQ_HIGH_PERCENT
+# define SENDQ_HIGH_PERCENT 75
+# endif
+
+# ifndef SENDQ_LOW_PERCENT
+# define SENDQ_LOW_PERCENT 25
+# endif
+
+/* SendQ limit of a server link, which carries many users' traffic. */
+# ifndef LINK_SENDQ
+# define LINK_SENDQ 16777216
+# endif
+
+/* Maximum number of queued messages handed to a single writev(). */
+# ifndef MAX_IOV
+# define MAX_IOV 64
+# endif
+
+class Reactor;
+class Channel;
+
+/**
+ * @brief Capabilities acknowledged with CAP REQ that change what a
+ * client is sent: tags on live channel messages.
+ */
+enum ClientCapability
+{
+	CAP_MESSAGE_TAGS = 1,	// msgid=
+	CAP_SERVER_TIME = 2		// time=
+};
+
+/**
+ * @class Client
+ * @brief One connection, owned by the reactor that accepted it.
+ *
+ * Outbound data is never written straight to the socket: sendMessage()
+ * appends to a bounded queue that is flushed with writev() whenever the
+ * socket accepts more data. EPOLLOUT is only registered while the queue
+ * is non-empty, so any thread can send to any client without blocking
+ * on its socket. Channel member snapshots may outlive the connection,
+ * so a Client is reference counted: the owning reactor drops its
+ * reference after detach(), and the object is destroyed by whoever
+ * releases last. Queued entries are SharedBuffer references, so a
+ * broadcast line is shared by every member queue instead of copied.
+ * The queue is guarded by its own mutex because channel
+ * broadcasts reach clients owned by other reactors. For the same reason
+ * the nickname, which the owner changes while any reactor may be
+ * building a line for or about the client, is only read as a copy
+ * taken under a lock of its own. Its capabilities are read the same
+ * way by every broadcaster, and are stored atomically.
+ *
+ * The queue is bounded by a process-wide SendQ limit. Above the high
+ * watermark the client is congested: the reactor stops running its
+ * commands, which mostly generate more output for it, until the queue
+ * drains below the low watermark. A message that would push the queue
+ * past the limit evicts the client with "Excess SendQ" instead.
+ *
+ * On a reactor with the io_uring backend nothing is written or read
+ * from sendMessage() or handleRead(): a message only schedules the
+ * client for the reactor's next batch of sends, which prepareSend()
+ * and completeSend() carry out, and received data is handed in by
+ * receive(). Buffers referenced by a send in flight are kept alive
+ * until it completes, even if the client is detached meanwhile.
+ *
+ * A connection can also be a link to another server (isLink), whose
+ * queue is bounded by LINK_SENDQ instead. Users of other servers are
+ * Clients without a socket: they are built with the link they are
+ * reached through as their route, and whatever is sent to them is
+ * queued on that link.
+ */
 class Client 
 {
 	private:
 		int _clientFD;
+		int _refs;
+		Reactor* _reactor;
+		Client* _route;
+		pthread_mutex_t _sendMutex;
+		std::deque<SharedBuffer> _sendQueue;
+		size_t _sendOffset;
+		size_t _sendQueueBytes;
+		bool _writePending;
+		bool _closing;
+		bool _congested;
+		bool _ringBacked;
+		bool _sendInFlight;
+		std::vector<SharedBuffer> _inFlight;
+		std::vector<struct iovec> _iov;
+		struct msghdr _message;
+		InputRing _input;
+		std::string _overflow;
+		bool _inputPending;
+		pthread_mutex_t _channelsMutex;
+		std::set<Channel*> _channels;
+		mutable pthread_mutex_t _nickMutex;
+		std::string _nickname;
+		unsigned _capabilities;	// ClientCapability bits
+		std::string _quitReason;
+		static size_t _sendQLimit;
+		static size_t _sendQHigh;
+		static size_t _sendQLow;
+
+		Client(const Client&);
+		Client& operator=(const Client&);
+
+		void flushLocked();
+		void consumeLocked(size_t written);
+		void setWriteInterest(bool enable);
+		void setCongested(bool congested);
+		size_t queueLimit() const;
+		void abort();
+		void evict();
+
 	public:
-		std::string nickname;
 		std::string username;
-		std::string buffer;
-		pthread_t thread;
+		std::string realname;
+		std::string hostname;
+		std::string server;		// remote user: its server; link: the peer's name
+		std::string password;	// PASS parameter, until registration
+		uint64_t admissionKey;	// AdmissionTable::keyOf() the peer
+		bool passAccepted;
+		bool registered;
+		bool isOperator;
+		bool isLink;		// a connection to another server
+		// Owned by the reactor thread, never touched elsewhere.
+		FloodBucket flood;
+		int backlog;		// Reactor::Backlog
+		Timer liveness;		// registration, idle PING or PONG deadline
+		Timer floodWakeup;
+		uint64_t lastActivity;	// Metrics::now() of the last read
+		bool receiving;		// io_uring backend: a receive is armed
 
-		Client(int fd);
+		Client(int fd, Reactor* reactor);
+		explicit Client(Client* route);
 		~Client();
+		static void* operator new(size_t size);
+		static void operator delete(void* ptr, size_t size);
+		void retain();
+		void release();
+		void detach();
+		void disconnect(std::string const& reason);
+		std::string getQuitReason();
 		int getFd() const;
+		Client* getRoute() const;
+		std::string getNickname() const;
+		void setNickname(std::string const& nickname);
+		unsigned getCapabilities() const;
+		void setCapabilities(unsigned capabilities);
+		std::string prefix() const;
+		void addChannel(Channel* channel);
+		void removeChannel(Channel* channel);
+		std::vector<Channel*> getChannels();
 		void sendMessage(const std::string &message);
-		void handleRead();
+		void sendMessage(SharedBuffer const& message);
+		void flush();
+		size_t getSendQueueBytes();
+		bool isCongested();
+		static void setSendQLimit(size_t bytes);
+		struct msghdr* prepareSend();
+		bool completeSend(int result);
+		bool handleRead();
+		void receive(char const* data, size_t length);
+		bool hasPendingInput() const;
+		bool hasBufferedLine() const;
+		InputRing::Status nextCommand(LineView& line);
+		std::string pendingInput() const;
+		void restoreInput(std::string const& input);
+		std::string unsentOutput();
+};
+
+/**
+ * @class ClientRef
+ * @brief RAII owner of one reference on a Client, e.g. the one returned
+ * by NickIndex::find().
+ */
+class ClientRef
+{
+	private:
+		Client* _client;
+
+	public:
+		explicit ClientRef(Client* adopted = NULL) : _client(adopted) {}
+		ClientRef(ClientRef const& rhs) : _client(rhs._client)
+		{
+			if (_client)
+				_client->retain();
+		}
+		ClientRef& operator=(ClientRef const& rhs)
+		{
+			if (rhs._client)
+				rhs._client->retain();
+			if (_client)
+				_client->release();
+			_client = rhs._client;
+			return *this;
+		}
+		~ClientRef()
+		{
+			if (_client)
+				_client->release();
+		}
+		Client* get() const { return _client; }
+		Client* operator->() const { return _client; }
 };
 
 // std::ostream& operator << (std::ostream& os, Client& rhs);
@@ -0,0 +1,48 @@
+#ifndef FLOODBUCKET_HPP
+# define FLOODBUCKET_HPP
+
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Sustained commands per second a client may run; 0 disables the limit. */
+# ifndef FLOOD_RATE
+# define FLOOD_RATE 10
+# endif
+
+/* Commands a quiet client may send back to back before being paced. */
+# ifndef FLOOD_BURST
+# define FLOOD_BURST 20
+# endif
+
+/**
+ * @class FloodBucket
+ * @brief RFC 1459 style penalty clock, i.e. a token bucket kept as a
+ * single timestamp.
+ *
+ * Every command pushes the client's clock one interval (1s / rate) into
+ * the future, starting from now if it had fallen behind. A command may
+ * run while that leaves the clock at most `burst` intervals ahead of
+ * now; otherwise the client has to wait for real time to catch up.
+ * Nothing is dropped: the reactor just stops framing the client's
+ * input until delay() has passed. The limits are process-wide and set
+ * once at startup.
+ */
+class FloodBucket
+{
+	private:
+		static uint64_t _interval;
+		static uint64_t _window;
+		uint64_t _clock;
+
+	public:
+		FloodBucket();
+		static void configure(unsigned rate, unsigned burst);
+		bool ready(uint64_t now) const;
+		void charge(uint64_t now);
+		uint64_t delay(uint64_t now) const;
+};
+
+#endif // FLOODBUCKET_HPP
@@ -5,19 +5,100 @@
 #include <map>
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "Server.hpp"
+#include "Message.hpp"
 # include <Utils.hpp>
 
 # ifndef DEBUG
 #  define DEBUG 0
 # endif
 
+# ifndef SERVER_NAME
+#  define SERVER_NAME "ircserv"
+# endif
+
+# ifndef NICKLEN
+#  define NICKLEN 30
+# endif
+
+/* Slots in the verb hash index; a power of two. */
+# ifndef COMMAND_SLOTS
+#  define COMMAND_SLOTS 64
+# endif
+
+/**
+ * @class Command
+ * @brief Verb dispatch and command handlers.
+ *
+ * Verbs are looked up in a fixed open-addressed table indexed by a
+ * case-insensitive FNV-1a hash of the verb. The seed is chosen so that
+ * every verb in specs lands in its own slot, which makes a lookup one
+ * hash plus one compare; probing only exists as a safety net for verbs
+ * added later. Each entry carries the minimum parameter count and
+ * whether the client has to be registered, so handlers never repeat
+ * those checks. Lines from a registered server link bypass the table
+ * and go to the Network. Channel PRIVMSG and NOTICE lines are recorded
+ * in the channel's history, which CHATHISTORY replays.
+ */
 class Command
 {
 	public:
-		static void handleCommand(const std::string &command, Client *client, std::map<std::string, Channel*> &channels);
+		typedef void (*Handler)(Message const& msg, Client* client, Server& server);
+
+		struct Spec
+		{
+			char const* name;
+			Handler handler;
+			size_t minParams;
+			bool needsRegistration;
+		};
+
+		static void handleCommand(LineView const &line, Client *client, Server &server);
+		static Spec const* lookup(char const* verb, size_t length);
+		static void reply(Client* client, char const* code, std::string const& params);
+		static size_t verbCount();
+		static char const* verbName(size_t index);
+		static void setServerName(std::string const& name);
+		static std::string const& serverName();
+
+	private:
+		static Spec const specs[];
+		static size_t const specCount;
+		static short index[COMMAND_SLOTS];
+		static std::string _serverName;
+
+		static uint32_t hash(char const* verb, size_t length);
+		static bool buildIndex();
+		static void welcome(Client* client, Server& server);
+
+		static void cap(Message const& msg, Client* client, Server& server);
+		static void pass(Message const& msg, Client* client, Server& server);
+		static void nick(Message const& msg, Client* client, Server& server);
+		static void user(Message const& msg, Client* client, Server& server);
+		static void ping(Message const& msg, Client* client, Server& server);
+		static void pong(Message const& msg, Client* client, Server& server);
+		static void quit(Message const& msg, Client* client, Server& server);
+		static void join(Message const& msg, Client* client, Server& server);
+		static void part(Message const& msg, Client* client, Server& server);
+		static void privmsg(Message const& msg, Client* client, Server& server);
+		static void notice(Message const& msg, Client* client, Server& server);
+		static void kick(Message const& msg, Client* client, Server& server);
+		static void invite(Message const& msg, Client* client, Server& server);
+		static void topic(Message const& msg, Client* client, Server& server);
+		static void mode(Message const& msg, Client* client, Server& server);
+		static void who(Message const& msg, Client* client, Server& server);
+		static void names(Message const& msg, Client* client, Server& server);
+		static void whois(Message const& msg, Client* client, Server& server);
+		static void oper(Message const& msg, Client* client, Server& server);
+		static void kill(Message const& msg, Client* client, Server& server);
+		static void stats(Message const& msg, Client* client, Server& server);
+		static void upgrade(Message const& msg, Client* client, Server& server);
+		static void server(Message const& msg, Client* client, Server& server);
+		static void links(Message const& msg, Client* client, Server& server);
+		static void chathistory(Message const& msg, Client* client, Server& server);
 };
 
 
 // std::ostream& operator << (std::ostream& os, Command& rhs);
 
-#endif // COMMAND_HPP
\ No newline at end of file
+#endif // COMMAND_HPP
@@ -0,0 +1,56 @@
+#ifndef MESSAGE_HPP
+# define MESSAGE_HPP
+
+# include <string>
+# include <cstddef>
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/**
+ * @brief Offset/length view of one field inside the parsed line.
+ */
+struct Token
+{
+	uint32_t offset;
+	uint32_t length;
+};
+
+/**
+ * @class Message
+ * @brief Allocation-free IRC line parser.
+ *
+ * Splits `[@tags] [:prefix] VERB [middle ...] [:trailing]` into Tokens
+ * that point back into the caller's buffer; nothing is copied and the
+ * heap is never touched. Up to MAX_MIDDLE middle parameters are kept,
+ * anything after them is treated as the trailing parameter. The
+ * trailing parameter is always the last entry of params.
+ *
+ * The line must outlive the Message.
+ */
+class Message
+{
+	public:
+		enum { MAX_MIDDLE = 15, MAX_PARAMS = MAX_MIDDLE + 1 };
+
+		char const* line;
+		Token tags;
+		Token prefix;
+		Token verb;
+		Token params[MAX_PARAMS];
+		size_t paramCount;
+		bool hasTrailing;
+
+		Message();
+		bool parse(char const* data, size_t length);
+
+		char const* data(Token const& token) const;
+		std::string str(Token const& token) const;
+		std::string param(size_t index) const;
+		bool verbIs(char const* name) const;
+		bool equals(Token const& token, char const* str) const;
+};
+
+#endif // MESSAGE_HPP
@@ -0,0 +1,107 @@
+#ifndef SERVERCONFIG_HPP
+# define SERVERCONFIG_HPP
+
+# include <string>
+# include <vector>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Address of the listener made from the command line port. */
+# ifndef LISTEN_ADDRESS
+#  define LISTEN_ADDRESS "127.0.0.1"
+# endif
+
+/* Listen queue length when a listener does not set one. */
+# ifndef LISTEN_BACKLOG
+#  define LISTEN_BACKLOG 4096
+# endif
+
+/**
+ * @struct ListenerSpec
+ * @brief Address and socket options of one listening port. Zero (or -1
+ * for v6Only) leaves an option at the kernel default.
+ */
+struct ListenerSpec
+{
+	std::string address;	// numeric IPv4 or IPv6, "::" for dual-stack
+	int port;
+	int backlog;
+	int v6Only;				// IPV6_V6ONLY: -1 default, 0 dual-stack, 1 IPv6 only
+	bool noDelay;			// TCP_NODELAY
+	int sendBuffer;			// SO_SNDBUF bytes
+	int receiveBuffer;		// SO_RCVBUF bytes
+	int deferAccept;		// TCP_DEFER_ACCEPT seconds
+	int keepIdle;			// SO_KEEPALIVE on, with TCP_KEEPIDLE seconds
+	int keepInterval;		// TCP_KEEPINTVL seconds
+	int keepCount;			// TCP_KEEPCNT probes
+	int userTimeout;		// TCP_USER_TIMEOUT milliseconds
+
+	ListenerSpec(int port = 0);
+	std::string describe() const;
+};
+
+/**
+ * @struct LinkSpec
+ * @brief A server this one may link with. The password is shared: it
+ * is sent in PASS and expected back in the peer's PASS.
+ */
+struct LinkSpec
+{
+	std::string name;
+	std::string address;
+	int port;
+	std::string password;
+	bool autoconnect;		// connect out, and again after every split
+
+	LinkSpec();
+};
+
+/**
+ * @struct ServerConfig
+ * @brief What a configuration file sets: this server's name in the
+ * network, its listeners and the servers it links with.
+ *
+ * The file is a list of sections of `key = value` lines; `#` starts a
+ * comment. At most one [server] section, any number of the others:
+ *
+ *     [server]
+ *     name = hub.irc          # default SERVER_NAME
+ *     description = The hub
+ *
+ *     [listener]              # every listener needs a port
+ *     address = ::            # default LISTEN_ADDRESS
+ *     port = 6667
+ *     v6only = no             # yes | no, IPv6 addresses only
+ *     backlog = 4096
+ *     nodelay = yes
+ *     sndbuf = 262144
+ *     rcvbuf = 65536
+ *     defer_accept = 5        # seconds
+ *     keepalive = 60 10 5     # idle seconds, interval seconds, probes
+ *     user_timeout = 30000    # milliseconds
+ *
+ *     [link]                  # name, port and password are required
+ *     name = leaf1.irc
+ *     address = 127.0.0.1     # default LISTEN_ADDRESS
+ *     port = 6668
+ *     password = secret
+ *     autoconnect = yes       # default no: wait for the peer to connect
+ *
+ * Listener options are set on the listening socket, from which Linux
+ * copies them to every accepted connection, so they cost nothing per
+ * accept. Without a [listener] section the command line port is used.
+ * Any error names the file and line and aborts startup.
+ */
+struct ServerConfig
+{
+	std::string name;			// empty keeps SERVER_NAME
+	std::string description;
+	std::vector<ListenerSpec> listeners;
+	std::vector<LinkSpec> links;
+
+	static ServerConfig load(std::string const& path);
+};
+
+#endif // SERVERCONFIG_HPP
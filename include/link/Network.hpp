@@ -0,0 +1,152 @@
+#ifndef NETWORK_HPP
+# define NETWORK_HPP
+
+# include <string>
+# include <vector>
+# include <map>
+# include <set>
+# include <cstddef>
+# include <pthread.h>
+# include "SharedBuffer.hpp"
+# include "ServerConfig.hpp"
+# include "Message.hpp"
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Seconds between attempts to connect an autoconnect link that is down. */
+# ifndef LINK_RETRY
+#  define LINK_RETRY 10
+# endif
+
+/* Description of this server in SERVER, LINKS and WHOIS. */
+# ifndef SERVER_DESCRIPTION
+#  define SERVER_DESCRIPTION "ft_irc server"
+# endif
+
+class Server;
+class Client;
+class Channel;
+class Reactor;
+
+/**
+ * @class Network
+ * @brief Links with other servers, in the style of RFC 2813, so users
+ * spread over several processes or hosts share nicks and channels.
+ *
+ * Servers form a tree: a link is a connection that registered with
+ * `PASS <password> 0210 IRC|` and `SERVER <name> 1 :<description>`
+ * instead of NICK/USER, matching a configured [link] on both ends.
+ * Once registered, each side bursts what it knows: the servers behind
+ * it (SERVER), every user (NICK with all seven parameters) and every
+ * channel's members (NJOIN) with its modes and topic. From then on
+ * state changes travel the whole tree, each server passing them on to
+ * all its other links: NICK, QUIT, JOIN, PART, KICK, MODE, TOPIC,
+ * SERVER and SQUIT. PRIVMSG and NOTICE to a channel are routed: a
+ * server queues the line only on the links that lead to members of the
+ * channel, so a server without members never sees it. Messages to a
+ * user go down that user's link only.
+ *
+ * Users of other servers are Clients without a socket (see Client),
+ * indexed by nick and listed in channels like local users, so local
+ * commands need no special cases. Lines from links carry the full
+ * nick!user@host prefix and are relayed to local members as they are.
+ * A line whose source is not reached through the link it came on is
+ * dropped, which also disposes of stale lines after a collision.
+ *
+ * When a link goes away, every server and user reached through it is
+ * removed: local members of their channels see a QUIT whose reason
+ * names the two servers, and the other links are told with SQUIT. A
+ * nick introduced while already in use kills both users, as RFC 2813
+ * does. Autoconnect links are retried every LINK_RETRY seconds by the
+ * first reactor while down.
+ *
+ * Link lines are handled on the reactor owning the link; the server
+ * table, the list of links and the remote users are guarded by one
+ * mutex, never held while channel or nick locks are taken.
+ */
+class Network
+{
+	public:
+		typedef void (Network::*Handler)(Message const& msg, Client* link, Client* source);
+
+		struct Spec
+		{
+			char const* name;
+			Handler handler;
+			size_t minParams;
+			bool needsUser;		// the prefix has to be a known user
+		};
+
+	private:
+		struct Peer
+		{
+			std::string name;
+			std::string uplink;		// server it is linked behind
+			std::string description;
+			size_t hops;
+			Client* route;			// the link it is reached through
+		};
+
+		Server& _server;
+		std::string _description;
+		std::vector<LinkSpec> _links;
+		pthread_mutex_t _lock;
+		std::map<std::string, Peer> _servers;	// by folded name, not this one
+		std::vector<Client*> _peers;			// established links
+		std::set<Client*> _remote;				// remote users, each holding one reference
+		std::set<std::string> _connecting;		// folded names of outbound attempts
+		static Spec const specs[];
+		static size_t const specCount;
+
+		Network(Network const&);
+		Network& operator=(Network const&);
+
+		LinkSpec const* findLink(std::string const& name) const;
+		std::string greeting(LinkSpec const& link) const;
+		std::string introduction(Client* user);
+		bool establish(Client* link, std::string const& description);
+		void burst(Client* link);
+		void remove(Client* user, std::string const& reason);
+		void dropRoute(Client* link, std::set<std::string> const& lost, std::string const& reason);
+		void collide(Client* link, std::string const& nickname, Client* holder);
+		void applyModes(Channel* channel, Message const& msg);
+		SharedBuffer relay(Message const& msg, Client* link, Client* source) const;
+
+		void privmsg(Message const& msg, Client* link, Client* source);
+		void nick(Message const& msg, Client* link, Client* source);
+		void quit(Message const& msg, Client* link, Client* source);
+		void join(Message const& msg, Client* link, Client* source);
+		void njoin(Message const& msg, Client* link, Client* source);
+		void part(Message const& msg, Client* link, Client* source);
+		void kick(Message const& msg, Client* link, Client* source);
+		void mode(Message const& msg, Client* link, Client* source);
+		void topic(Message const& msg, Client* link, Client* source);
+		void invite(Message const& msg, Client* link, Client* source);
+		void kill(Message const& msg, Client* link, Client* source);
+		void server(Message const& msg, Client* link, Client* source);
+		void squit(Message const& msg, Client* link, Client* source);
+		void ping(Message const& msg, Client* link, Client* source);
+		void pong(Message const& msg, Client* link, Client* source);
+		void error(Message const& msg, Client* link, Client* source);
+		void numeric(Message const& msg, Client* link, Client* source);
+
+	public:
+		explicit Network(Server& server);
+		~Network();
+		void configure(std::string const& description, std::vector<LinkSpec> const& links);
+		bool autoconnects() const;
+		std::string const& description() const;
+		void connectLinks(Reactor& reactor);
+		void accept(Message const& msg, Client* client);
+		void handle(Message const& msg, Client* link);
+		void split(Client* link, std::string const& reason);
+		void introduce(Client* user);
+		void propagate(SharedBuffer const& line, Client* except);
+		void announce(Channel* channel, SharedBuffer const& line, Client* except);
+		void killUser(Client* victim, std::string const& source, std::string const& reason);
+		void list(std::vector<std::string>& lines);
+};
+
+#endif // NETWORK_HPP
@@ -0,0 +1,89 @@
+#ifndef LOGGER_HPP
+# define LOGGER_HPP
+
+# include <cstddef>
+# include <stdint.h>
+# include <pthread.h>
+# include <time.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Records in the ring; a power of two. */
+# ifndef LOG_RING_SIZE
+#  define LOG_RING_SIZE 4096
+# endif
+
+/* Bytes of key=value text carried by one record; longer text is cut. */
+# define LOG_TEXT_MAX 232
+
+/* Upper bound of one flushed batch. */
+# define LOG_BATCH_BYTES 65536
+
+enum LogLevel
+{
+	LOG_DEBUG = 0,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR
+};
+
+/**
+ * @class Logger
+ * @brief Asynchronous structured logger.
+ *
+ * log() fills a fixed-size record (timestamp, level, event name and a
+ * printf-formatted key=value field string) and publishes it into a
+ * bounded lock-free ring; it never allocates, locks or makes a system
+ * call. A background thread drains the ring, renders each record as
+ *
+ *     2026-01-01T12:00:00.123Z INFO  client.connect fd=7 reactor=0
+ *
+ * and writes whole batches with a single write(). The level is only
+ * colored when the sink is a terminal. When the ring is full the
+ * record is dropped and counted instead of stalling the caller; the
+ * count is reported with the next batch.
+ *
+ * The ring is Vyukov's bounded MPMC queue: each cell carries a
+ * sequence number that tells producers and the consumer whose turn
+ * it is, so producers only contend on one compare-and-swap.
+ */
+class Logger
+{
+	private:
+		struct Record
+		{
+			volatile size_t sequence;
+			struct timespec when;
+			LogLevel level;
+			char const* event;
+			unsigned short length;
+			char text[LOG_TEXT_MAX];
+		};
+
+		static Record _ring[LOG_RING_SIZE];
+		static volatile size_t _enqueuePos;
+		static size_t _dequeuePos;
+		static volatile size_t _dropped;
+		static volatile int _running;
+		static LogLevel _threshold;
+		static int _fd;
+		static bool _color;
+		static pthread_t _thread;
+
+		Logger();
+
+		static void* drainLoop(void* arg);
+		static size_t drain();
+		static size_t render(Record const& record, char* out, size_t room);
+
+	public:
+		static void start(int fd, LogLevel threshold);
+		static void stop();
+		static bool enabled(LogLevel level);
+		static void log(LogLevel level, char const* event, char const* fmt, ...)
+			__attribute__((format(printf, 3, 4)));
+};
+
+#endif // LOGGER_HPP
@@ -0,0 +1,119 @@
+#ifndef SLABPOOL_HPP
+# define SLABPOOL_HPP
+
+# include <cstddef>
+# include <string>
+# include <vector>
+# include <pthread.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Every slot is rounded up to this so any object type fits. */
+# define SLAB_ALIGN 16
+
+/* Slots a thread moves between its cache and the shared free list at
+ * once; a cache holds at most twice that. Capped by the slab size. */
+# ifndef SLAB_CACHE_BATCH
+#  define SLAB_CACHE_BATCH 32
+# endif
+
+/* Pools that get thread caches; later ones always take the lock. */
+# ifndef SLAB_MAX_POOLS
+#  define SLAB_MAX_POOLS 16
+# endif
+
+/**
+ * @struct PoolStats
+ * @brief Occupancy snapshot of one SlabPool.
+ */
+struct PoolStats
+{
+	char const* name;
+	size_t objectSize;
+	size_t slabs;
+	size_t capacity;	// slots carved so far
+	size_t inUse;		// slots handed out, not counting thread caches
+	size_t cached;		// slots held in thread caches
+	size_t peak;		// most slots ever outside the shared free list
+	size_t allocations;	// allocate() calls, up to a batch late per thread
+	size_t recycled;	// slots reused from the free list, not a new slab
+};
+
+/**
+ * @class SlabPool
+ * @brief Fixed-size object allocator backed by slabs of slots.
+ *
+ * Freed slots go on an intrusive free list and are handed out again
+ * before a new slab is carved, so once a pool has grown to the peak
+ * working set, connect/disconnect churn never reaches malloc. Slabs
+ * are kept for the life of the pool. A spinlock guards the free list.
+ *
+ * Every thread keeps a small free list of its own per pool, so the
+ * common allocate()/deallocate() pair touches no shared cache line: an
+ * empty cache takes a batch of slots from the shared list under the
+ * lock, and a full one gives a batch back. Slots freed on another
+ * thread than the one that allocated them simply join that thread's
+ * cache. A thread's caches are listed from its first use of a pool
+ * until it exits, when a thread-specific key's destructor gives every
+ * one of them back. The pool's destructor only flushes the calling
+ * thread's cache; threads still running at exit keep theirs. STATS
+ * reports cached slots apart from the ones handed out.
+ *
+ * Pools register themselves in a global list that collect() walks for
+ * STATS reporting. They are meant to be namespace-scope statics.
+ */
+class SlabPool
+{
+	private:
+		struct Slot
+		{
+			Slot* next;
+		};
+
+		char const* _name;
+		size_t _objectSize;
+		size_t _slotSize;
+		size_t _perSlab;
+		size_t _batch;
+		size_t _cacheIndex;	// in each thread's caches, or SLAB_MAX_POOLS
+		pthread_spinlock_t _lock;
+		Slot* _free;
+		std::vector<void*> _slabs;
+		size_t _inUse;
+		size_t _peak;
+		size_t _allocations;
+		size_t _recycled;
+		SlabPool* _nextPool;
+
+		static SlabPool* _pools;
+		static size_t _poolCount;
+		static pthread_mutex_t _poolsMutex;
+
+		SlabPool(SlabPool const&);
+		SlabPool& operator=(SlabPool const&);
+
+		void grow();
+		void take(Slot*& list, size_t count);
+		void give(Slot* list, size_t count);
+		void flushCache();
+		size_t cachedSlots() const;
+		PoolStats stats();
+
+		static void listThread();
+		static void createExitKey();
+		static void flushThread(void* caches);
+
+	public:
+		SlabPool(char const* name, size_t objectSize, size_t perSlab);
+		~SlabPool();
+
+		void* allocate();
+		void deallocate(void* ptr);
+		size_t objectSize() const;
+
+		static void collect(std::vector<PoolStats>& out);
+};
+
+#endif // SLABPOOL_HPP
@@ -0,0 +1,50 @@
+#ifndef HISTOGRAM_HPP
+# define HISTOGRAM_HPP
+
+# include <cstddef>
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Sub-buckets per power of two: 2^3 = 8, i.e. about 12% resolution. */
+# define HISTO_SUB_BITS 3
+# define HISTO_SUB (1 << HISTO_SUB_BITS)
+/* Linear buckets 0..2*HISTO_SUB-1, then HISTO_SUB per remaining octave. */
+# define HISTO_BUCKETS (2 * HISTO_SUB + (64 - HISTO_SUB_BITS - 1) * HISTO_SUB)
+
+/**
+ * @class Histogram
+ * @brief Log-linear (HDR-style) histogram of unsigned 64-bit values.
+ *
+ * Values below 16 get a bucket each; above that every power of two is
+ * split into 8 equal sub-buckets, so any recorded value is reported
+ * within 1/8 of itself. Recording is an index computation and an
+ * increment with no allocation. Histograms of the same layout merge by
+ * adding buckets, which is how per-thread copies are combined.
+ */
+class Histogram
+{
+	private:
+		uint64_t _counts[HISTO_BUCKETS];
+		uint64_t _total;
+		uint64_t _sum;
+		uint64_t _max;
+
+		static size_t bucketOf(uint64_t value);
+		static uint64_t upperBound(size_t bucket);
+
+	public:
+		Histogram();
+
+		void record(uint64_t value);
+		void merge(Histogram const& other);
+		void clear();
+		uint64_t count() const;
+		uint64_t sum() const;
+		uint64_t max() const;
+		uint64_t quantile(double q) const;
+};
+
+#endif // HISTOGRAM_HPP
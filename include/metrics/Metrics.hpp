@@ -0,0 +1,131 @@
+#ifndef METRICS_HPP
+# define METRICS_HPP
+
+# include <string>
+# include <vector>
+# include <stdint.h>
+# include <pthread.h>
+# include "Histogram.hpp"
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Per-verb counters; must cover every entry of Command::specs plus one
+ * slot for unknown verbs. */
+# define METRICS_VERBS 64
+
+class Server;
+
+enum MetricCounter
+{
+	M_CONNECTIONS_ACCEPTED = 0,
+	M_CONNECTIONS_CLOSED,
+	M_CONNECTIONS_REJECTED,
+	M_LOOP_WAKEUPS,
+	M_READ_CALLS,
+	M_BYTES_IN,
+	M_LINES_IN,
+	M_LINES_OUT,
+	M_BYTES_OUT,
+	M_SENDQ_BYTES,		// gauge: sum of per-thread deltas
+	M_SENDQ_CONGESTED,	// gauge: clients above the high watermark
+	M_SENDQ_HIGH_WATER,
+	M_SENDQ_EVICTIONS,
+	M_BROADCASTS,
+	M_FANOUT_DELIVERIES,
+	M_DEFERRED_TURNS,
+	M_TIMEOUTS,
+	M_RING_ENTERS,
+	M_RING_COMPLETIONS,
+	M_LINKS,			// gauge: established server links
+	M_REMOTE_USERS,		// gauge: users of other servers
+	M_LINK_DELIVERIES,
+	M_NETSPLITS,
+	M_HISTORY_BYTES,	// gauge: arenas of channel history
+	M_HISTORY_EVICTIONS,
+	M_HISTORY_REPLAYED,
+	M_COUNTER_COUNT
+};
+
+enum MetricHistogram
+{
+	H_LOOP_BUSY_NS = 0,
+	H_READ_NS,
+	H_COMMAND_NS,
+	H_BROADCAST_NS,
+	H_FANOUT,
+	H_HISTOGRAM_COUNT
+};
+
+/**
+ * @struct MetricsShard
+ * @brief The counters and histograms written by one thread.
+ *
+ * Only the owning thread writes a shard, with plain word-sized stores,
+ * so recording never touches a shared cache line or a lock. Readers
+ * merge every shard on demand and tolerate values that are a few
+ * increments stale.
+ */
+struct MetricsShard
+{
+	int64_t counters[M_COUNTER_COUNT];
+	uint64_t verbs[METRICS_VERBS];
+	Histogram histograms[H_HISTOGRAM_COUNT];
+
+	MetricsShard();
+};
+
+/**
+ * @class Metrics
+ * @brief Per-thread metrics, merged when STATS or the admin socket
+ * asks for them.
+ *
+ * Each reactor thread calls attachThread() once and from then on
+ * records into its own shard through a thread-local pointer. Threads
+ * that never attached share a fallback shard; nothing on the hot path
+ * runs there.
+ */
+class Metrics
+{
+	private:
+		static std::vector<MetricsShard*> _shards;
+		static pthread_mutex_t _shardsMutex;
+		static MetricsShard _fallback;
+
+		Metrics();
+
+	public:
+		static void attachThread();
+		static MetricsShard& local();
+		static uint64_t now();
+
+		static void add(MetricCounter counter, int64_t delta = 1);
+		static void countVerb(size_t index);
+		static void record(MetricHistogram histogram, uint64_t value);
+
+		static void merge(MetricsShard& out);
+		static std::string prometheus(Server& server);
+		static void statsLines(std::vector<std::string>& out);
+};
+
+/**
+ * @class MetricTimer
+ * @brief Records the nanoseconds between construction and destruction
+ * into one histogram.
+ */
+class MetricTimer
+{
+	private:
+		MetricHistogram _histogram;
+		uint64_t _start;
+
+		MetricTimer(MetricTimer const&);
+		MetricTimer& operator=(MetricTimer const&);
+
+	public:
+		explicit MetricTimer(MetricHistogram histogram);
+		~MetricTimer();
+};
+
+#endif // METRICS_HPP
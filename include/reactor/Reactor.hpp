@@ -0,0 +1,223 @@
+#ifndef REACTOR_HPP
+# define REACTOR_HPP
+
+# include <map>
+# include <deque>
+# include <vector>
+# include <string>
+# include <stdint.h>
+# include <pthread.h>
+# include <sys/epoll.h>
+# include <netinet/in.h>
+# include "TimerWheel.hpp"
+# include "IoRing.hpp"
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+# ifndef MAX_EVENTS
+#  define MAX_EVENTS 256
+# endif
+
+/* Commands one client may run per turn before the others get theirs. */
+# ifndef DISPATCH_QUANTUM
+#  define DISPATCH_QUANTUM 32
+# endif
+
+/* Seconds a connection has to complete PASS/NICK/USER. */
+# ifndef REGISTRATION_TIMEOUT
+#  define REGISTRATION_TIMEOUT 30
+# endif
+
+/* Seconds of silence before a client is sent a PING. */
+# ifndef PING_INTERVAL
+#  define PING_INTERVAL 120
+# endif
+
+/* Seconds a pinged client has to send anything back. */
+# ifndef PING_TIMEOUT
+#  define PING_TIMEOUT 60
+# endif
+
+/* Connections accepted per loop iteration before other events get a
+ * turn; the rest of the backlog waits for the next iteration. */
+# ifndef ACCEPT_BUDGET
+#  define ACCEPT_BUDGET 64
+# endif
+
+/* Milliseconds before a failed io_uring accept is armed again. */
+# ifndef ACCEPT_RETRY_MS
+#  define ACCEPT_RETRY_MS 100
+# endif
+
+class Server;
+class Client;
+
+/**
+ * @class Reactor
+ * @brief Edge-triggered epoll event loop owning one socket per
+ * configured listener and the clients accepted on them.
+ *
+ * Every descriptor is registered once with EPOLLET. Readiness is only
+ * reported on state changes, so the handlers must drain a descriptor
+ * until EAGAIN before going back to wait(), or remember to come back:
+ * each listener is drained ACCEPT_BUDGET connections per iteration and
+ * a leftover backlog makes the next wait non-blocking. Every accepted
+ * connection is checked against the server's AdmissionTable first and
+ * refused with a single ERROR line, before any Client exists, when
+ * the server or its source address is full. With several reactors each
+ * one has its own SO_REUSEPORT socket per listener and the kernel
+ * spreads incoming connections between them; a client never migrates
+ * once accepted.
+ *
+ * A client runs at most DISPATCH_QUANTUM commands per turn, and only
+ * as many as its FloodBucket and SendQ allow. Whatever is left stays in
+ * its input ring. A client that only ran out of quantum joins the
+ * deferred queue, served round-robin at the start of every loop
+ * iteration; one over its flood budget waits on a timer first. Server
+ * links have no flood budget, only the quantum.
+ *
+ * Registration deadlines, idle PINGs, PONG deadlines and flood wakeups
+ * all live in the reactor's TimerWheel, and epoll_wait sleeps until the
+ * next tick that has one due. Timers without an owner belong to the
+ * reactor itself, like the first reactor's channel snapshot and its
+ * attempts to connect server links that are down.
+ *
+ * With useRing() set before the reactors are created, each one drives
+ * its sockets through an IoRing instead: a multishot accept per
+ * listener, a multishot receive per client into provided buffers, and
+ * one sendmsg per client with output, all submitted together with the
+ * wait in a single io_uring_enter per loop iteration. Output queued by
+ * other threads reaches the batch through scheduleSend(). The admin
+ * socket, signal pipe and wake eventfd stay in the epoll set, which
+ * the ring polls. A reactor whose ring cannot be set up logs why and
+ * falls back to epoll.
+ */
+class Reactor
+{
+	public:
+		/* Why a client's input is waiting (Client::backlog). */
+		enum Backlog
+		{
+			BACKLOG_NONE,
+			BACKLOG_QUEUED,		// in the round-robin queue
+			BACKLOG_FLOOD,		// on its flood wakeup timer
+			BACKLOG_SENDQ		// until its SendQ drains
+		};
+
+		enum TimerKind
+		{
+			TIMER_REGISTRATION,
+			TIMER_IDLE,
+			TIMER_PONG,
+			TIMER_FLOOD,
+			TIMER_SNAPSHOT,
+			TIMER_ACCEPT,
+			TIMER_LINK
+		};
+
+	private:
+		Server& _server;
+		size_t _id;
+		int _epollFD;
+		std::vector<int> _listenFDs;
+		int _adminFD;
+		int _signalFD;
+		int _wakeFD;
+		pthread_t _thread;
+		std::vector<struct epoll_event> _events;
+		std::map<int, Client*> _clients;
+		std::deque<Client*> _deferred;
+		TimerWheel _timers;
+		std::vector<Timer*> _expired;
+		Timer _snapshotTimer;
+		uint64_t _snapshotInterval;
+		Timer _linkTimer;
+		uint64_t _linkRetry;
+		IoRing* _ring;
+		std::vector<bool> _acceptArmed;	// per listener, io_uring backend
+		size_t _acceptsArmed;
+		std::vector<bool> _backlogged;	// the budget ran out before EAGAIN
+		bool _acceptBacklog;			// any listener backlogged
+		bool _multishotRecv;
+		bool _quiescing;
+		size_t _inFlight;	// ring receives and sends holding a client
+		Timer _acceptTimer;
+		pthread_t _loopThread;
+		uint64_t _epoch;	// odd while an iteration runs, see getEpoch()
+		pthread_mutex_t _sendLock;
+		std::vector<Client*> _sendRequests;	// guarded by _sendLock
+		std::vector<Client*> _sending;
+		bool _sendWake;
+		static bool _useRing;
+
+		Reactor(const Reactor&);
+		Reactor& operator=(const Reactor&);
+
+		void control(int op, int fd, uint32_t events);
+		void handleEvent(struct epoll_event const& ev);
+		void handleNewConnection(size_t listener);
+		void addClient(int clientFD, struct sockaddr_storage const& address);
+		bool admit(int clientFD, uint64_t key, std::string const& host);
+		void handleAdmin();
+		void handleSignal();
+		void handleWake();
+		void handleClient(int clientFD, uint32_t events);
+		void serve(Client* client, uint32_t events);
+		Backlog runCommands(Client* client);
+		void park(Client* client, Backlog backlog);
+		void enqueue(Client* client);
+		void serviceDeferred();
+		void arm(Timer& timer, int kind, uint64_t now, uint64_t delayNs);
+		void expireTimers();
+		void onTimer(Client* client, int kind, uint64_t now);
+		void onReactorTimer(int kind, uint64_t now);
+		void timeOut(Client* client, std::string const& reason);
+		void drop(Client* client, std::string const& reason);
+		bool owns(Client* client) const;
+		int nextTimeout() const;
+		void removeClient(int clientFD, std::string const& reason);
+		void armAccept(size_t listener);
+		void armAccepts();
+		void armPoll();
+		void armReceive(Client* client);
+		void cancel(uint64_t userData);
+		void submitSend(Client* client);
+		void submitSends();
+		void enterRing(int timeout);
+		bool reapRing();
+		void onAccept(size_t listener, struct io_uring_cqe const& cqe);
+		void onReceive(Client* client, struct io_uring_cqe const& cqe);
+		void onSent(Client* client, int result);
+		static void* start(void* arg);
+
+	public:
+		Reactor(Server& server, size_t id, std::vector<int> const& listenFDs);
+		~Reactor();
+		void add(int fd, uint32_t events);
+		void modify(int fd, uint32_t events);
+		void remove(int fd);
+		int wait(int timeout);
+		struct epoll_event const& event(int i) const;
+		void run();
+		void spawn();
+		void broadcast(std::string const& message);
+		void setAdminListener(int fd);
+		void setSignalListener(int fd);
+		void setSnapshotInterval(unsigned seconds);
+		void setLinkRetry(unsigned seconds);
+		static void useRing(bool enable);
+		bool usesRing() const;
+		void scheduleSend(Client* client);
+		void quiesce();
+		void resume();
+		void wake();
+		void adopt(Client* client, std::string const& output);
+		std::map<int, Client*> const& getClients() const;
+		std::vector<int> const& getListenFds() const;
+		size_t getId() const;
+		uint64_t getEpoch() const;
+};
+
+#endif // REACTOR_HPP
@@ -0,0 +1,97 @@
+#ifndef ADMISSIONTABLE_HPP
+# define ADMISSIONTABLE_HPP
+
+# include <stddef.h>
+# include <stdint.h>
+# include <string>
+# include <pthread.h>
+# include <sys/socket.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+# ifndef REGISTRY_SHARDS
+#  define REGISTRY_SHARDS 64
+# endif
+
+/* Connections the whole server accepts; 0 disables the limit. */
+# ifndef MAX_CLIENTS
+#  define MAX_CLIENTS 65536
+# endif
+
+/* Connections accepted from one address; 0 disables the limit. */
+# ifndef MAX_CLIENTS_PER_IP
+#  define MAX_CLIENTS_PER_IP 64
+# endif
+
+/* Distinct addresses each shard can track, a power of two. */
+# ifndef ADMISSION_SLOTS
+#  define ADMISSION_SLOTS 1024
+# endif
+
+/**
+ * @class AdmissionTable
+ * @brief Server-wide connection counts, in total and per source,
+ * checked before a Client is allocated.
+ *
+ * A source is an IPv4 address or an IPv6 /64, the block a single host
+ * usually gets, so rotating through one's own prefix does not dodge
+ * the per-address limit. IPv4-mapped IPv6 peers count as IPv4.
+ *
+ * The total is a single atomic counter. Per-address counts live in
+ * fixed-size open-addressed shards (linear probing, backward-shift
+ * deletion) each behind its own mutex, so admitting a connection costs
+ * one atomic add and one short critical section and never allocates.
+ * A shard that runs out of slots rejects new addresses as if the
+ * server were full, which keeps memory bounded under a storm of
+ * distinct sources.
+ */
+class AdmissionTable
+{
+	public:
+		enum Verdict
+		{
+			ADMIT,
+			REJECT_FULL,	// global limit, or no slot left for the address
+			REJECT_HOST		// per-address limit
+		};
+
+	private:
+		struct Slot
+		{
+			uint64_t key;
+			uint32_t count;		// 0 marks a free slot
+		};
+
+		struct Shard
+		{
+			pthread_mutex_t lock;
+			Slot slots[ADMISSION_SLOTS];
+		};
+
+		Shard _shards[REGISTRY_SHARDS];
+		size_t _total;
+		size_t _maxTotal;
+		size_t _maxPerAddress;
+
+		AdmissionTable(AdmissionTable const&);
+		AdmissionTable& operator=(AdmissionTable const&);
+
+		static uint32_t hash(uint64_t key);
+		Verdict charge(uint64_t key, bool force);
+		void discharge(uint64_t key);
+
+	public:
+		AdmissionTable();
+		~AdmissionTable();
+		void configure(size_t maxTotal, size_t maxPerAddress);
+		static uint64_t keyOf(struct sockaddr const* address);
+		static uint64_t keyOf(std::string const& host);
+		Verdict admit(uint64_t key);
+		void track(uint64_t key);
+		void release(uint64_t key);
+		size_t size() const;
+};
+
+#endif // ADMISSIONTABLE_HPP
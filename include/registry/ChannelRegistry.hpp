@@ -0,0 +1,73 @@
+#ifndef CHANNELREGISTRY_HPP
+# define CHANNELREGISTRY_HPP
+
+# include <string>
+# include <pthread.h>
+# include "FoldedTable.hpp"
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Number of independently locked shards; a power of two. */
+# ifndef REGISTRY_SHARDS
+#  define REGISTRY_SHARDS 64
+# endif
+
+class Channel;
+
+/**
+ * @class ChannelRegistry
+ * @brief Server-wide channel map, sharded by the hash of the folded name.
+ *
+ * Names are folded with the RFC 1459 casemapping, so "#Foo" and "#foo"
+ * are the same channel. The high bits of the hash pick a shard, the
+ * low bits a bucket inside that shard's FoldedTable. Each shard has its
+ * own read/write lock: lookups from different reactors only share a
+ * lock when they hit the same shard, and then only as readers.
+ * remove() takes an empty channel out, but does not free it: other
+ * reactors may still hold the pointer, so the caller retires it (see
+ * Server::leaveChannel). The destructor frees the channels still in.
+ */
+class ChannelRegistry
+{
+	private:
+		struct Shard
+		{
+			pthread_rwlock_t lock;
+			FoldedTable<Channel*> table;
+		};
+		Shard _shards[REGISTRY_SHARDS];
+
+		ChannelRegistry(ChannelRegistry const&);
+		ChannelRegistry& operator=(ChannelRegistry const&);
+
+		Shard& shardFor(uint32_t hash);
+
+	public:
+		ChannelRegistry();
+		~ChannelRegistry();
+		Channel* find(std::string const& name);
+		Channel* findOrCreate(std::string const& name);
+		bool remove(Channel* channel);
+		size_t size();
+		template <typename F>
+		void forEach(F& functor);
+};
+
+/**
+ * @brief Calls functor(Channel*) for every channel, one shard at a time
+ * under that shard's read lock.
+ */
+template <typename F>
+void ChannelRegistry::forEach(F& functor)
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+	{
+		pthread_rwlock_rdlock(&_shards[i].lock);
+		_shards[i].table.forEach(functor);
+		pthread_rwlock_unlock(&_shards[i].lock);
+	}
+}
+
+#endif // CHANNELREGISTRY_HPP
@@ -0,0 +1,72 @@
+#ifndef CHANNELSNAPSHOT_HPP
+# define CHANNELSNAPSHOT_HPP
+
+# include <string>
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Seconds between two snapshots when --snapshot is given. */
+# ifndef SNAPSHOT_INTERVAL
+# define SNAPSHOT_INTERVAL 60
+# endif
+
+class ChannelRegistry;
+
+/**
+ * @class ChannelSnapshot
+ * @brief Binary image of the channel registry that is loaded with one
+ * mmap() and no parsing.
+ *
+ * Layout, host byte order:
+ *  - SnapshotHeader
+ *  - `count` fixed-size SnapshotRecord entries
+ *  - a pool with every name, topic and key back to back
+ *
+ * Records locate their strings by offset and length inside the pool,
+ * so loading is a bounds check and a copy per field. The header has a
+ * checksum of everything after it; a torn or foreign file is ignored
+ * and the server starts empty. Files are written to a temporary name
+ * and renamed, so a reader never sees a partial snapshot.
+ *
+ * Members are not kept, so channels come back empty with their name,
+ * topic, key, limit, +i and +t.
+ */
+class ChannelSnapshot
+{
+	public:
+		struct Header
+		{
+			char magic[8];
+			uint32_t count;
+			uint32_t checksum;
+			uint64_t poolSize;
+			uint64_t written;	// seconds since the epoch
+		};
+
+		struct Record
+		{
+			uint32_t nameOffset;
+			uint32_t nameLength;
+			uint32_t topicOffset;
+			uint32_t topicLength;
+			uint32_t keyOffset;
+			uint32_t keyLength;
+			uint32_t limit;
+			uint32_t flags;
+		};
+
+		enum Flags
+		{
+			INVITE_ONLY = 1,
+			TOPIC_RESTRICTED = 2
+		};
+
+		static std::string capture(ChannelRegistry& registry, size_t& count);
+		static void store(std::string const& path, std::string const& image);
+		static size_t load(std::string const& path, ChannelRegistry& registry);
+};
+
+#endif // CHANNELSNAPSHOT_HPP
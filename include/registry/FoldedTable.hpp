@@ -0,0 +1,58 @@
+#ifndef FOLDEDTABLE_HPP
+# define FOLDEDTABLE_HPP
+
+# include <string>
+# include <vector>
+# include <cstddef>
+# include <stdint.h>
+# include <Utils.hpp>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/**
+ * @class FoldedTable
+ * @brief Chained hash table keyed by RFC 1459 case-folded names.
+ *
+ * Keys are stored folded together with their hash, so a lookup folds
+ * and hashes the name once, walks one short chain and compares hashes
+ * before strings. The table doubles when the load factor reaches 1.
+ * It is not synchronized; owners wrap it in their own lock.
+ *
+ * @tparam T Value type, usually a pointer.
+ */
+template <typename T>
+class FoldedTable
+{
+	private:
+		struct Node
+		{
+			std::string key;
+			uint32_t hash;
+			T value;
+			Node* next;
+		};
+		std::vector<Node*> _buckets;
+		size_t _size;
+
+		FoldedTable(FoldedTable const&);
+		FoldedTable& operator=(FoldedTable const&);
+
+		void grow();
+
+	public:
+		FoldedTable();
+		~FoldedTable();
+
+		static uint32_t hash(std::string const& folded);
+		T* find(std::string const& folded, uint32_t hash) const;
+		T* insert(std::string const& folded, uint32_t hash, T const& value);
+		bool erase(std::string const& folded, uint32_t hash, T* removed = NULL);
+		size_t size() const;
+		template <typename F>
+		void forEach(F& functor) const;
+};
+
+# include "FoldedTable.tpp"
+#endif // FOLDEDTABLE_HPP
@@ -0,0 +1,146 @@
+#ifndef FOLDEDTABLE_TPP
+# define FOLDEDTABLE_TPP
+
+# include "FoldedTable.hpp"
+
+template <typename T>
+FoldedTable<T>::FoldedTable() : _buckets(16, static_cast<Node*>(NULL)), _size(0) {}
+
+template <typename T>
+FoldedTable<T>::~FoldedTable()
+{
+	for (size_t i = 0; i < _buckets.size(); ++i)
+	{
+		Node* node = _buckets[i];
+		while (node)
+		{
+			Node* next = node->next;
+			delete node;
+			node = next;
+		}
+	}
+}
+
+/**
+ * @brief FNV-1a over an already folded name.
+ */
+template <typename T>
+uint32_t FoldedTable<T>::hash(std::string const& folded)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < folded.size(); ++i)
+	{
+		h ^= static_cast<unsigned char>(folded[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Looks up a folded key.
+ *
+ * @return Pointer to the stored value, or NULL.
+ */
+template <typename T>
+T* FoldedTable<T>::find(std::string const& folded, uint32_t hash) const
+{
+	Node* node = _buckets[hash & (_buckets.size() - 1)];
+	for (; node; node = node->next)
+	{
+		if (node->hash == hash && node->key == folded)
+			return &node->value;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Inserts a key that must not be present yet.
+ *
+ * @return Pointer to the stored value.
+ */
+template <typename T>
+T* FoldedTable<T>::insert(std::string const& folded, uint32_t hash, T const& value)
+{
+	if (_size >= _buckets.size())
+		grow();
+	size_t slot = hash & (_buckets.size() - 1);
+	Node* node = new Node;
+	node->key = folded;
+	node->hash = hash;
+	node->value = value;
+	node->next = _buckets[slot];
+	_buckets[slot] = node;
+	++_size;
+	return &node->value;
+}
+
+/**
+ * @brief Removes a key.
+ *
+ * @param removed Receives the value that was stored, if not NULL.
+ * @return false if the key was not present.
+ */
+template <typename T>
+bool FoldedTable<T>::erase(std::string const& folded, uint32_t hash, T* removed)
+{
+	Node** link = &_buckets[hash & (_buckets.size() - 1)];
+	for (; *link; link = &(*link)->next)
+	{
+		Node* node = *link;
+		if (node->hash == hash && node->key == folded)
+		{
+			if (removed)
+				*removed = node->value;
+			*link = node->next;
+			delete node;
+			--_size;
+			return true;
+		}
+	}
+	return false;
+}
+
+template <typename T>
+size_t FoldedTable<T>::size() const
+{
+	return _size;
+}
+
+/**
+ * @brief Calls functor(value) for every entry.
+ */
+template <typename T>
+template <typename F>
+void FoldedTable<T>::forEach(F& functor) const
+{
+	for (size_t i = 0; i < _buckets.size(); ++i)
+	{
+		for (Node* node = _buckets[i]; node; node = node->next)
+			functor(node->value);
+	}
+}
+
+/**
+ * @brief Doubles the bucket count; stored hashes make this a relink.
+ */
+template <typename T>
+void FoldedTable<T>::grow()
+{
+	std::vector<Node*> buckets(_buckets.size() * 2, static_cast<Node*>(NULL));
+	for (size_t i = 0; i < _buckets.size(); ++i)
+	{
+		Node* node = _buckets[i];
+		while (node)
+		{
+			Node* next = node->next;
+			size_t slot = node->hash & (buckets.size() - 1);
+			node->next = buckets[slot];
+			buckets[slot] = node;
+			node = next;
+		}
+	}
+	_buckets.swap(buckets);
+}
+
+#endif // FOLDEDTABLE_TPP
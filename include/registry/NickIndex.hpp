@@ -0,0 +1,70 @@
+#ifndef NICKINDEX_HPP
+# define NICKINDEX_HPP
+
+# include <string>
+# include <pthread.h>
+# include "FoldedTable.hpp"
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+# ifndef REGISTRY_SHARDS
+#  define REGISTRY_SHARDS 64
+# endif
+
+class Client;
+
+/**
+ * @class NickIndex
+ * @brief Server-wide map from case-folded nickname to Client.
+ *
+ * Sharded like ChannelRegistry. claim() moves a client from its old
+ * nick to a new one under the write locks of both shards (taken in
+ * shard order), so the collision check and the rename are one atomic
+ * step. find() takes a reference on the client under the shard lock,
+ * which keeps it alive even if its reactor drops it right after.
+ */
+class NickIndex
+{
+	private:
+		struct Shard
+		{
+			pthread_rwlock_t lock;
+			FoldedTable<Client*> table;
+		};
+		Shard _shards[REGISTRY_SHARDS];
+
+		NickIndex(NickIndex const&);
+		NickIndex& operator=(NickIndex const&);
+
+		size_t shardOf(uint32_t hash) const;
+
+	public:
+		NickIndex();
+		~NickIndex();
+		bool claim(Client* client, std::string const& previous, std::string const& nickname);
+		void release(Client* client, std::string const& nickname);
+		Client* find(std::string const& nickname);
+		size_t size();
+		template <typename F>
+		void forEach(F& functor);
+};
+
+/**
+ * @brief Calls functor(Client*) for every nick holder, one shard at a
+ * time under that shard's read lock. A functor keeping a client beyond
+ * the call has to retain() it there.
+ */
+template <typename F>
+void NickIndex::forEach(F& functor)
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+	{
+		pthread_rwlock_rdlock(&_shards[i].lock);
+		_shards[i].table.forEach(functor);
+		pthread_rwlock_unlock(&_shards[i].lock);
+	}
+}
+
+#endif // NICKINDEX_HPP
@@ -0,0 +1,48 @@
+#ifndef SNAPSHOTWRITER_HPP
+# define SNAPSHOTWRITER_HPP
+
+# include <string>
+# include <cstddef>
+# include <pthread.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/**
+ * @class SnapshotWriter
+ * @brief Background thread that puts ChannelSnapshot images on disk.
+ *
+ * The reactor that takes a snapshot only copies the registry into an
+ * image with ChannelSnapshot::capture() and hands it over; the write,
+ * fdatasync and rename happen here, so no event loop waits on the disk.
+ * An image submitted while another is still pending replaces it: only
+ * the newest state is worth writing. stop() writes whatever is pending
+ * before the thread exits.
+ */
+class SnapshotWriter
+{
+	private:
+		pthread_t _thread;
+		pthread_mutex_t _lock;
+		pthread_cond_t _wake;
+		std::string _path;
+		std::string _image;
+		size_t _count;
+		bool _pending;
+		bool _running;
+
+		SnapshotWriter(SnapshotWriter const&);
+		SnapshotWriter& operator=(SnapshotWriter const&);
+
+		static void* writeLoop(void* arg);
+
+	public:
+		SnapshotWriter();
+		~SnapshotWriter();
+		void start(std::string const& path);
+		void submit(std::string& image, size_t count);
+		void stop();
+};
+
+#endif // SNAPSHOTWRITER_HPP
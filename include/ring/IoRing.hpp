@@ -0,0 +1,87 @@
+#ifndef IORING_HPP
+# define IORING_HPP
+
+# include <stddef.h>
+# include <stdint.h>
+# include <linux/io_uring.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Submission queue entries per reactor; completions get four times as
+ * many slots. */
+# ifndef RING_ENTRIES
+# define RING_ENTRIES 1024
+# endif
+
+/* Provided receive buffers per reactor, a power of two, and their size. */
+# ifndef RING_BUFFERS
+# define RING_BUFFERS 512
+# endif
+
+# ifndef RING_BUFFER_SIZE
+# define RING_BUFFER_SIZE 4096
+# endif
+
+/**
+ * @class IoRing
+ * @brief Minimal io_uring through the raw syscalls: one submission and
+ * completion ring pair plus one ring of provided receive buffers.
+ *
+ * prepare() hands out zeroed SQEs and only publishes them to the
+ * kernel; nothing is submitted until enter(), which submits everything
+ * prepared since the previous call and waits for completions in the
+ * same syscall. Receives use buffer selection from group 0, so no
+ * memory is pinned per connection: the kernel picks a buffer when data
+ * arrives and the caller recycles it once copied.
+ *
+ * Not thread-safe: each reactor owns one and only touches it from its
+ * own thread. The constructor throws on kernels without the features
+ * used here (5.19 for provided buffer rings and multishot accept), so
+ * the caller can fall back to epoll.
+ */
+class IoRing
+{
+	private:
+		int _fd;
+		void* _ringMap;
+		size_t _ringSize;
+		struct io_uring_sqe* _sqes;
+		size_t _sqesSize;
+		unsigned* _sqHead;
+		unsigned* _sqTail;
+		unsigned* _sqArray;
+		unsigned _sqMask;
+		unsigned _sqEntries;
+		unsigned* _cqHead;
+		unsigned* _cqTail;
+		unsigned _cqMask;
+		struct io_uring_cqe* _cqes;
+		unsigned _prepared;
+		struct io_uring_buf* _buffers;	// ring of RING_BUFFERS entries
+		size_t _buffersSize;
+		char* _bufferData;
+		unsigned short _bufferTail;
+
+		IoRing(IoRing const&);
+		IoRing& operator=(IoRing const&);
+
+		void release();
+		void setupRings(unsigned entries);
+		void setupBuffers();
+		void requireOps() const;
+		int submit(unsigned wait, void* arg, size_t argSize);
+
+	public:
+		IoRing(unsigned entries);
+		~IoRing();
+
+		struct io_uring_sqe* prepare(uint8_t opcode, int fd, uint64_t userData);
+		int enter(int timeoutMs);
+		bool next(struct io_uring_cqe& cqe);
+		char const* buffer(unsigned id) const;
+		void recycle(unsigned id);
+};
+
+#endif // IORING_HPP
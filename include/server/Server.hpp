@@ -3,14 +3,25 @@
 
 # include <vector>
 # include <map>
-# include <poll.h>
 # include <pthread.h>
+# include <stdint.h>
 # include <netinet/in.h>
 # include <arpa/inet.h> 
 # include <string>
 # include <iostream>
 # include <cerrno>
 # include <cstring> // strerror
+# include <stdexcept>
+# include "Reactor.hpp"
+# include "SharedBuffer.hpp"
+# include "ChannelRegistry.hpp"
+# include "NickIndex.hpp"
+# include "AdmissionTable.hpp"
+# include "SnapshotWriter.hpp"
+# include "ServerConfig.hpp"
+# include "Client.hpp"
+# include "Handoff.hpp"
+# include "Network.hpp"
 
 
 # ifndef DEBUG
@@ -22,140 +33,189 @@ class Channel;
 
 
 typedef std::map<int, Client*>::iterator ClientsIte;
-typedef std::map<std::string, Channel*>::iterator ChannelIte;
 
+/**
+ * @class Server
+ * @brief Owns the reactors and the state they share.
+ *
+ * Each reactor runs its own event loop on its own socket for every
+ * configured listener and owns the clients it accepted. Channels are global and live in the
+ * sharded ChannelRegistry, which does its own locking. A channel its
+ * last member leaves is taken out of the registry and retired; it is
+ * freed once every reactor has been idle or finished the loop iteration
+ * it was in when the channel was retired (Reactor::getEpoch).
+ *
+ * A hot upgrade (SIGUSR2 or the UPGRADE command) parks every other
+ * reactor, forks and execs the binary again with --upgrade-fd, and
+ * hands the new process every listening and client socket plus the
+ * client and channel state over a socketpair. Once it acknowledges, the
+ * old process exits without closing anything; if it does not, the old
+ * process resumes as if nothing happened.
+ *
+ * With snapshots enabled the channel registry is also captured into a
+ * ChannelSnapshot image by the first reactor and at shutdown, and a
+ * SnapshotWriter thread puts it on disk; a fresh start loads it before
+ * the first client is accepted.
+ *
+ * Links to other servers are handled by the Network; their users are
+ * in the nick index and channels too, without a socket. Links are not
+ * handed over by an upgrade: they drop and are connected again, and
+ * local clients see the remote users quit as in a netsplit, then come
+ * back with the burst.
+ */
 class Server
 {
 	private:
-		int serverFD;
-		std::vector<struct pollfd> pollFDs;
-		std::map<int, Client*> clients;
-		std::map<std::string, Channel*> channels;
-		pthread_mutex_t clientsMutex;
-		pthread_mutex_t channelsMutex;
+		std::vector<Reactor*> reactors;
+		ChannelRegistry channels;
+		NickIndex nicks;
+		AdmissionTable admissions;
 		std::string const password;
-		std::string const lockFilePath;
+		Network network;
+		std::string operPassword;
+		std::string adminPath;
+		std::string snapshotPath;
+		SnapshotWriter snapshots;
+		std::string executable;
+		std::vector<std::string> arguments;
+		int signalPipe[2];
+		pthread_mutex_t pauseMutex;
+		pthread_cond_t pauseCond;
+		bool pausing;
+		size_t paused;
+		struct Retired
+		{
+			Channel* channel;
+			std::vector<uint64_t> epochs;	// of each reactor, at retirement
+		};
+		std::vector<Retired> retired;	// guarded by retireMutex
+		size_t retiredCount;
+		pthread_mutex_t retireMutex;
 		static Server* instance;
 
-		void setNonBlocking(int fd);
+		void init();
+		int createListener(ListenerSpec const& spec, bool reusePort);
 		void setupSignalHandlers();
-		void createLockFile();
-		void removeLockFile();
-		void removeClient(int clientFD);
+		void pauseReactors();
+		void resumeReactors();
+		void retire(Channel* channel);
+		bool reclaimable(Retired const& entry) const;
+		void capture(Handoff& handoff);
+		void restore(Handoff& handoff);
+		pid_t launchSuccessor(int socket);
 		// Disable copy constructor and assignment operator
 		Server(const Server&);
 		Server& operator=(const Server&);
 
 	public:
-		Server(int& port, std::string const& password);
+		Server(std::vector<ListenerSpec> const& listeners, std::string const& password,
+			size_t reactorCount = 1);
+		Server(std::string const& password, Handoff& handoff);
 		static void signalHandler(int signum); // does it need to be static ?
-		void handleNewConnection();
-		void handleClient(int clientFD);
+		static void setNonBlocking(int fd);
 		static Server* getInstance(); // is it the only solution?
 		~Server();
 		void run();
-
-		friend class ClientHandler;
+		void shutdown(int signum);
+		void handleSignal(int signum);
+		void setArguments(int argc, char* argv[]);
+		void requestUpgrade();
+		void upgrade();
+		void checkpoint();
+		bool isPausing();
+		void enableSnapshots(std::string const& path, unsigned interval, bool load);
+		void writeSnapshot();
+		void enableLinks(ServerConfig const& config);
+		Network& getNetwork();
+
+		Channel* findChannel(std::string const& name);
+		Channel* joinChannel(std::string const& name);
+		bool leaveChannel(Channel* channel, Client* client);
+		void reclaimChannels();
+		void leaveChannels(Client* client, std::string const& reason);
+		void notifyPeers(Client* client, SharedBuffer const& message);
+		bool checkPassword(std::string const& candidate) const;
+		void setOperPassword(std::string const& secret);
+		bool checkOperPassword(std::string const& candidate) const;
+		bool claimNick(Client* client, std::string const& nickname);
+		void releaseNick(Client* client);
+		ClientRef findClient(std::string const& nickname);
+		void setConnectionLimits(size_t total, size_t perAddress);
+		AdmissionTable::Verdict admitConnection(uint64_t key);
+		void trackConnection(uint64_t key);
+		void releaseConnection(uint64_t key);
+		template <typename F>
+		void collectUsers(F& functor) { nicks.forEach(functor); }
+		void collectChannels(std::vector<Channel*>& out);
+		size_t nickCount();
+		size_t channelCount();
+		void openAdminSocket(std::string const& path);
 };
 
 /**
- * @class ClientHandler
- * @brief Handles client connections for the server.
+ * @class SockAddressInitializer
+ * @brief A class to initialize and store the socket address of a
+ * listener.
  *
- * This class is responsible for managing individual client connections
- * by invoking the server's client handling function.
+ * This class provides a convenient way to build a sockaddr_in or
+ * sockaddr_in6 from a numeric IPv4 or IPv6 address and a port.
  */
 
 /**
- * @brief Constructs a new ClientHandler object.
- * 
- * @param srv Pointer to the server instance.
- * @param fd File descriptor for the client connection.
- */
- 
-/**
- * @brief Static method to start the client handler in a new thread.
- * 
- * This method is intended to be used as the entry point for a new thread.
- * It casts the argument to a ClientHandler pointer, invokes the handler,
- * and then deletes the handler object.
- * 
- * @param arg Pointer to the ClientHandler object.
- * @return Always returns NULL.
+ * @brief Constructor to initialize the socket address.
+ *
+ * @param address Numeric address, such as 127.0.0.1, 0.0.0.0 or ::.
+ * @param port The port number to be set in the socket address.
+ * @throws std::runtime_error if address is not a numeric address.
  */
- 
+
 /**
- * @brief Functor operator to handle the client connection.
- * 
- * This operator invokes the server's handleClient method with the client
- * file descriptor.
+ * @brief Get the initialized socket address, to pass to bind() along
+ * with getLength().
  */
-class ClientHandler
+class SockAddressInitializer
 {
-	private:
-		Server* server;
-		int clientFD;
-
 	public:
-		ClientHandler(Server* srv, int fd) : server(srv), clientFD(fd) {}
-
-		static void* start(void* arg)
+		SockAddressInitializer(std::string const& address, int port)
 		{
-			ClientHandler* handler = static_cast<ClientHandler*>(arg);
-			(*handler)();
-			delete handler;
-			return NULL;
+			memset(&addr, 0, sizeof(addr));
+			uint16_t networkPort = htons(static_cast<uint16_t>(port));
+			struct sockaddr_in* v4 = reinterpret_cast<struct sockaddr_in*>(&addr);
+			struct sockaddr_in6* v6 = reinterpret_cast<struct sockaddr_in6*>(&addr);
+			if (inet_pton(AF_INET, address.c_str(), &v4->sin_addr) == 1)
+			{
+				v4->sin_family = AF_INET;
+				v4->sin_port = networkPort;
+				length = sizeof(*v4);
+			}
+			else if (inet_pton(AF_INET6, address.c_str(), &v6->sin6_addr) == 1)
+			{
+				v6->sin6_family = AF_INET6;
+				v6->sin6_port = networkPort;
+				length = sizeof(*v6);
+			}
+			else
+				throw std::runtime_error("Invalid listen address: " + address);
 		}
 
-		void operator()() const
+		struct sockaddr const* getAddress() const
 		{
-			server->handleClient(clientFD);
+			return reinterpret_cast<struct sockaddr const*>(&addr);
 		}
-};
-
-/**
- * @class SockAddressInitializer
- * @brief A class to initialize and store a sockaddr_in structure.
- *
- * This class provides a convenient way to initialize a sockaddr_in structure
- * with a specified port and the loopback address (127.0.0.1).
- */
-
-/**
- * @brief Constructor to initialize the sockaddr_in structure.
- * 
- * This constructor initializes the sockaddr_in structure with the specified
- * port number and sets the address to the loopback address (127.0.0.1).
- * 
- * @param port The port number to be set in the sockaddr_in structure.
- */
 
-/**
- * @brief Get the initialized sockaddr_in structure.
- * 
- * This function returns the initialized sockaddr_in structure.
- * 
- * @return The initialized sockaddr_in structure.
- */
-class SockAddressInitializer
-{
-	public:
-		SockAddressInitializer(int port)
+		socklen_t getLength() const
 		{
-			memset(&addr, 0, sizeof(addr));
-			addr.sin_family = AF_INET;
-			//tp change
-			inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-			addr.sin_port = htons(port);
+			return length;
 		}
 
-		struct sockaddr_in getAddress() const
+		int family() const
 		{
-			return addr;
+			return addr.ss_family;
 		}
 
 	private:
-		struct sockaddr_in addr;
+		struct sockaddr_storage addr;
+		socklen_t length;
 };
 
 
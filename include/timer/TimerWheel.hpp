@@ -0,0 +1,83 @@
+#ifndef TIMERWHEEL_HPP
+# define TIMERWHEEL_HPP
+
+# include <vector>
+# include <stddef.h>
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Resolution of every timer. */
+# ifndef TIMER_TICK_MS
+# define TIMER_TICK_MS 10
+# endif
+
+/* Slots per level are 1 << TIMER_BITS; TIMER_LEVELS levels of 64 slots
+ * at 10 ms cover 46 hours, anything later is clamped to the last slot. */
+# define TIMER_BITS 6
+# define TIMER_SLOTS (1 << TIMER_BITS)
+# define TIMER_LEVELS 4
+
+/**
+ * @struct Timer
+ * @brief Intrusive wheel entry, embedded in whatever it times.
+ *
+ * `kind` and `owner` are not interpreted by the wheel; they tell the
+ * caller what an expired timer was for.
+ */
+struct Timer
+{
+	Timer* prev;
+	Timer* next;
+	uint64_t expires;	// absolute tick
+	int level;		// wheel level it is linked in
+	int kind;
+	void* owner;
+
+	Timer();
+	bool armed() const;
+};
+
+/**
+ * @class TimerWheel
+ * @brief Hierarchical hashed timing wheel with O(1) arm and cancel.
+ *
+ * Level 0 has one slot per tick; each higher level has slots 64 times
+ * wider. A timer goes to the lowest level whose span covers its delay.
+ * Every time level 0 wraps, the next due slot of level 1 is re-inserted
+ * one level down (and so on upwards), so a timer is moved at most
+ * TIMER_LEVELS - 1 times over its life and a tick only ever touches the
+ * slot that is due. Slots are circular lists with a sentinel, so a
+ * timer unlinks itself without knowing where it sits.
+ *
+ * Not thread-safe: each reactor owns one and only touches it from its
+ * own thread.
+ */
+class TimerWheel
+{
+	private:
+		Timer _slots[TIMER_LEVELS][TIMER_SLOTS];
+		size_t _counts[TIMER_LEVELS];
+		uint64_t _current;	// last tick processed
+		size_t _size;
+
+		TimerWheel(TimerWheel const&);
+		TimerWheel& operator=(TimerWheel const&);
+
+		void insert(Timer& timer);
+		void unlink(Timer& timer);
+		size_t cascade(int level);
+		static uint64_t tickOf(uint64_t ns);
+
+	public:
+		explicit TimerWheel(uint64_t now);
+		void arm(Timer& timer, uint64_t now, uint64_t delayNs);
+		void cancel(Timer& timer);
+		void advance(uint64_t now, std::vector<Timer*>& expired);
+		int timeout(uint64_t now) const;
+		size_t size() const;
+};
+
+#endif // TIMERWHEEL_HPP
@@ -0,0 +1,63 @@
+#ifndef HANDOFF_HPP
+# define HANDOFF_HPP
+
+# include <string>
+# include <vector>
+# include <stddef.h>
+# include <stdint.h>
+
+# ifndef DEBUG
+#  define DEBUG 0
+# endif
+
+/* Descriptors per SCM_RIGHTS message; the kernel caps it at 253. */
+# ifndef HANDOFF_FDS_PER_MESSAGE
+# define HANDOFF_FDS_PER_MESSAGE 250
+# endif
+
+/* Seconds the old process waits for the new one to take over. */
+# ifndef UPGRADE_TIMEOUT
+# define UPGRADE_TIMEOUT 10
+# endif
+
+/**
+ * @class Handoff
+ * @brief Descriptors plus serialized state passed from a running server
+ * to its replacement over a Unix stream socket.
+ *
+ * On the wire: a fixed header (magic, descriptor count, state size),
+ * the descriptors in batches of HANDOFF_FDS_PER_MESSAGE as SCM_RIGHTS
+ * on one byte each, then the state bytes. The receiver answers with a
+ * single byte once it has taken everything over. State is a flat
+ * sequence of host-order integers and length-prefixed strings; both
+ * ends are the same program on the same machine, so no portability is
+ * attempted beyond a version check in the magic.
+ */
+class Handoff
+{
+	private:
+		std::string _state;
+		size_t _cursor;
+		std::vector<int> _fds;
+
+		void need(size_t bytes) const;
+
+	public:
+		Handoff();
+
+		uint32_t addFd(int fd);
+		int fd(uint32_t index) const;
+		size_t fdCount() const;
+
+		void putU32(uint32_t value);
+		void putString(std::string const& value);
+		uint32_t getU32();
+		std::string getString();
+
+		void send(int socket) const;
+		void receive(int socket);
+		static void acknowledge(int socket);
+		static bool awaitAcknowledge(int socket, int timeoutMs);
+};
+
+#endif // HANDOFF_HPP
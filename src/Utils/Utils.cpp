@@ -1,4 +1,5 @@
 #include "Utils.hpp"
+#include "Logger.hpp"
 
 /**
  * Prints the specified number of new lines.
@@ -12,15 +13,19 @@ void nl(size_t newLines)
 }
 
 /**
- * @brief Prints the given string to the standard error stream if the DEBUG flag is enabled.
+ * @brief Queues the given string as a DEBUG log record.
  *
- * @param eColor The color of the string.
- * @param str The string to be printed.
+ * The logger colors the level itself when the sink is a terminal, so
+ * no escape codes are built here.
+ *
+ * @param eColor Kept for existing callers; unused.
+ * @param str The string to be logged.
  */
 void debug(int eColor, std::string str)
 {
+	(void)eColor;
 	if (DEBUG)
-		std::cerr << getColorStr(eColor, str);
+		Logger::log(LOG_DEBUG, "debug", "%s", str.c_str());
 }
 
 /**
@@ -310,6 +315,38 @@ std::string toUpperCase(std::string const& str)
 	return (upperCase);
 }
 
+/**
+ * @brief Folds one character using the RFC 1459 casemapping.
+ *
+ * A-Z map to a-z and, because of IRC's Scandinavian origin, [ \ ] ^
+ * map to { | } ~ (CASEMAPPING=rfc1459).
+ *
+ * @param c The character to fold.
+ * @return The folded character.
+ */
+char ircLower(char c)
+{
+	if (c >= 'A' && c <= '^')
+		return static_cast<char>(c + ('a' - 'A'));
+	return c;
+}
+
+/**
+ * @brief Folds a nickname or channel name with ircLower(), so names
+ * differing only in case compare equal.
+ *
+ * @param str The name to fold.
+ * @return The folded name.
+ */
+std::string ircFold(std::string const& str)
+{
+	std::string folded(str);
+
+	for (size_t i = 0; i < folded.size(); ++i)
+		folded[i] = ircLower(folded[i]);
+	return (folded);
+}
+
 /**
  * @brief Finds the maximum string length in an array.
  *
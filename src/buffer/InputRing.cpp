@@ -0,0 +1,144 @@
+#include "InputRing.hpp"
+#include <cstring>
+#include <sys/socket.h>
+
+InputRing::InputRing() : _head(0), _scan(0), _tail(0), _discarding(false) {}
+
+/**
+ * @brief Moves the unconsumed bytes back to the start of the storage.
+ */
+void InputRing::compact()
+{
+	if (_head == 0)
+		return;
+	size_t used = _tail - _head;
+	if (used > 0)
+		std::memmove(_data, _data + _head, used);
+	_scan -= _head;
+	_tail = used;
+	_head = 0;
+}
+
+/**
+ * @brief Rewinds an empty ring, or compacts a full one, before new
+ * bytes are written at the tail.
+ */
+void InputRing::makeRoom()
+{
+	if (_head == _tail)
+		_head = _scan = _tail = 0;
+	else if (_tail == sizeof(_data))
+		compact();
+}
+
+/**
+ * @brief Receives directly into the free tail of the ring.
+ *
+ * @param fd Socket to read from.
+ * @return recv()'s result; errno is left untouched for the caller.
+ */
+ssize_t InputRing::fill(int fd)
+{
+	makeRoom();
+	ssize_t nbytes = recv(fd, _data + _tail, sizeof(_data) - _tail, 0);
+	if (nbytes > 0)
+		_tail += static_cast<size_t>(nbytes);
+	return nbytes;
+}
+
+/**
+ * @brief Copies already-received bytes into the ring, e.g. input
+ * carried over from another process or a recorded corpus.
+ *
+ * @return How many bytes fit; the caller drains lines and retries with
+ * the rest.
+ */
+size_t InputRing::append(char const* data, size_t length)
+{
+	makeRoom();
+	size_t room = sizeof(_data) - _tail;
+	if (length > room)
+		length = room;
+	std::memcpy(_data + _tail, data, length);
+	_tail += length;
+	return length;
+}
+
+/**
+ * @brief Frames the next line, resuming the scan where it last stopped.
+ *
+ * Empty lines are skipped. The view excludes the terminator.
+ *
+ * @param line Receives the line on LINE_READY.
+ * @return LINE_READY, LINE_NONE if no complete line is buffered, or
+ * LINE_TOO_LONG once for every line exceeding IRC_LINE_MAX.
+ */
+InputRing::Status InputRing::next(LineView& line)
+{
+	while (true)
+	{
+		char const* nl = static_cast<char const*>(
+			std::memchr(_data + _scan, '\n', _tail - _scan));
+		if (!nl)
+		{
+			_scan = _tail;
+			if (_discarding)
+				_head = _tail;
+			else if (_tail - _head >= IRC_LINE_MAX)
+			{
+				_discarding = true;
+				_head = _tail;
+				return LINE_TOO_LONG;
+			}
+			return LINE_NONE;
+		}
+		size_t end = static_cast<size_t>(nl - _data);
+		size_t start = _head;
+		_head = _scan = end + 1;
+		if (_discarding)
+		{
+			_discarding = false;
+			continue;
+		}
+		size_t size = end - start;
+		if (size > 0 && _data[end - 1] == '\r')
+			--size;
+		if (size > IRC_LINE_MAX - 2)
+			return LINE_TOO_LONG;
+		if (size == 0)
+			continue;
+		line.data = _data + start;
+		line.size = size;
+		return LINE_READY;
+	}
+}
+
+/**
+ * @brief True when a terminator is buffered, i.e. next() has a line
+ * (or the end of a discarded one) to frame without further input.
+ */
+bool InputRing::hasLine() const
+{
+	return std::memchr(_data + _scan, '\n', _tail - _scan) != NULL;
+}
+
+/**
+ * @brief True when no byte can be received before lines are consumed.
+ */
+bool InputRing::full() const
+{
+	return _head == 0 && _tail == sizeof(_data);
+}
+
+size_t InputRing::pending() const
+{
+	return _tail - _head;
+}
+
+/**
+ * @brief First unconsumed byte; pending() bytes follow it.
+ */
+char const* InputRing::front() const
+{
+	return _data + _head;
+}
@@ -0,0 +1,151 @@
+#include "SharedBuffer.hpp"
+#include "SlabPool.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+/* Upper bound on the Block header, checked in the constructor. */
+#define BUFFER_HEADER 32
+
+namespace
+{
+	size_t blockSize(size_t capacity)
+	{
+		return BUFFER_HEADER + capacity + 1;
+	}
+
+	/* Payload capacities of the size classes. Most lines fit the first
+	 * three; 512 takes a full RFC line. */
+	size_t const classCapacity[] = { 64, 128, 256, 512, 1024, BUFFER_CLASS_MAX };
+	int const classCount = sizeof(classCapacity) / sizeof(classCapacity[0]);
+
+	SlabPool buffer64("buffer64", blockSize(64), 512);
+	SlabPool buffer128("buffer128", blockSize(128), 512);
+	SlabPool buffer256("buffer256", blockSize(256), 256);
+	SlabPool buffer512("buffer512", blockSize(512), 256);
+	SlabPool buffer1k("buffer1k", blockSize(1024), 64);
+	SlabPool buffer4k("buffer4k", blockSize(BUFFER_CLASS_MAX), 16);
+
+	SlabPool* const classPool[] = {
+		&buffer64, &buffer128, &buffer256, &buffer512, &buffer1k, &buffer4k
+	};
+
+	int sizeClassOf(size_t capacity)
+	{
+		for (int i = 0; i < classCount; ++i)
+		{
+			if (capacity <= classCapacity[i])
+				return i;
+		}
+		return -1;
+	}
+}
+
+SharedBuffer::SharedBuffer() : _block(NULL) {}
+
+/**
+ * @brief Allocates an empty buffer able to hold capacity bytes.
+ */
+SharedBuffer::SharedBuffer(size_t capacity) : _block(NULL)
+{
+	typedef char headerFits[offsetof(Block, data) <= BUFFER_HEADER ? 1 : -1];
+	(void)sizeof(headerFits);
+
+	int sizeClass = sizeClassOf(capacity);
+	if (sizeClass >= 0)
+		_block = static_cast<Block*>(classPool[sizeClass]->allocate());
+	else
+		_block = static_cast<Block*>(std::malloc(offsetof(Block, data) + capacity + 1));
+	if (!_block)
+		throw std::bad_alloc();
+	_block->refs = 1;
+	_block->sizeClass = sizeClass;
+	_block->size = 0;
+	_block->capacity = capacity;
+	_block->data[0] = '\0';
+}
+
+SharedBuffer::SharedBuffer(std::string const& str) : _block(NULL)
+{
+	*this = SharedBuffer(str.size());
+	append(str);
+}
+
+SharedBuffer::SharedBuffer(SharedBuffer const& rhs) : _block(rhs._block)
+{
+	if (_block)
+		__sync_add_and_fetch(&_block->refs, 1);
+}
+
+SharedBuffer& SharedBuffer::operator=(SharedBuffer const& rhs)
+{
+	if (_block != rhs._block)
+	{
+		if (rhs._block)
+			__sync_add_and_fetch(&rhs._block->refs, 1);
+		release();
+		_block = rhs._block;
+	}
+	return *this;
+}
+
+SharedBuffer::~SharedBuffer()
+{
+	release();
+}
+
+void SharedBuffer::release()
+{
+	if (_block && __sync_sub_and_fetch(&_block->refs, 1) == 0)
+	{
+		if (_block->sizeClass >= 0)
+			classPool[_block->sizeClass]->deallocate(_block);
+		else
+			std::free(_block);
+	}
+	_block = NULL;
+}
+
+/**
+ * @brief Appends bytes while the buffer is being built.
+ *
+ * @throws std::logic_error if the buffer is already shared or the
+ * bytes do not fit in the capacity given at construction.
+ */
+SharedBuffer& SharedBuffer::append(char const* data, size_t length)
+{
+	if (!_block || _block->refs != 1)
+		throw std::logic_error("SharedBuffer: append on a shared buffer");
+	if (_block->size + length > _block->capacity)
+		throw std::logic_error("SharedBuffer: capacity exceeded");
+	std::memcpy(_block->data + _block->size, data, length);
+	_block->size += length;
+	_block->data[_block->size] = '\0';
+	return *this;
+}
+
+SharedBuffer& SharedBuffer::append(std::string const& str)
+{
+	return append(str.data(), str.size());
+}
+
+char const* SharedBuffer::data() const
+{
+	return _block ? _block->data : "";
+}
+
+size_t SharedBuffer::size() const
+{
+	return _block ? _block->size : 0;
+}
+
+bool SharedBuffer::empty() const
+{
+	return size() == 0;
+}
+
+int SharedBuffer::useCount() const
+{
+	return _block ? _block->refs : 0;
+}
@@ -1,33 +1,405 @@
 #include "Channel.hpp"
+#include "SlabPool.hpp"
+#include "Metrics.hpp"
 #include <algorithm>
+#include <sstream>
 
-Channel::Channel(const std::string &name) : name(name)
+namespace
 {
+	SlabPool channelPool("channel", sizeof(Channel), 64);
+}
+
+/**
+ * @brief Pooled like Client so channel creation packs into slabs.
+ */
+void* Channel::operator new(size_t size)
+{
+	if (size != sizeof(Channel))
+		return ::operator new(size);
+	return channelPool.allocate();
+}
+
+void Channel::operator delete(void* ptr, size_t size)
+{
+	if (size != sizeof(Channel))
+		::operator delete(ptr);
+	else
+		channelPool.deallocate(ptr);
+}
+
+Channel::Channel(const std::string &name)
+	: _members(MemberList::create(std::vector<Client*>())), _closed(false),
+	name(name), limit(0), inviteOnly(false), topicRestricted(true)
+{
+	pthread_spin_init(&_snapshotLock, PTHREAD_PROCESS_PRIVATE);
 	pthread_mutex_init(&mutex, NULL);
 }
 
 Channel::~Channel()
 {
+	_members->release();
+	pthread_spin_destroy(&_snapshotLock);
 	pthread_mutex_destroy(&mutex);
 }
 
-void Channel::addMember(Client *client)
+/**
+ * @brief Swaps in a new member list. mutex must be held so writers do
+ * not lose each other's changes; the spinlock only covers the swap.
+ */
+void Channel::publish(std::vector<Client*> const& members)
+{
+	MemberList* next = MemberList::create(members);
+
+	pthread_spin_lock(&_snapshotLock);
+	MemberList* previous = _members;
+	_members = next;
+	pthread_spin_unlock(&_snapshotLock);
+	previous->release();
+}
+
+/**
+ * @brief Takes a reference on the current member list.
+ */
+MemberSnapshot Channel::getMembers()
+{
+	pthread_spin_lock(&_snapshotLock);
+	MemberList* current = _members;
+	current->retain();
+	pthread_spin_unlock(&_snapshotLock);
+	return MemberSnapshot(current);
+}
+
+/**
+ * @brief Admits a client after checking +i, +k and +l.
+ *
+ * The first member becomes channel operator. A pending invite is used
+ * up by the join. +i does not stop the first member: a channel only
+ * exists empty when it was restored from a snapshot, and with no one
+ * left to INVITE it would stay closed for good. +k still applies.
+ *
+ * @return 0 on success, -1 if already a member, -2 if the channel was
+ * closed meanwhile and must be looked up again, or the numeric of the
+ * failed check (471 full, 473 invite only, 475 bad key).
+ */
+int Channel::join(Client *client, std::string const& key)
 {
+	int err = 0;
+	std::string folded = ircFold(client->getNickname());
+
 	pthread_mutex_lock(&mutex);
+	std::vector<Client*> members(_members->clients());
+	if (_closed)
+		err = -2;
+	else if (std::find(members.begin(), members.end(), client) != members.end())
+		err = -1;
+	else
+	{
+		bool isInvited = invited.count(folded) > 0;
+		if (inviteOnly && !isInvited && !members.empty())
+			err = 473;
+		else if (!this->key.empty() && key != this->key && !isInvited)
+			err = 475;
+		else if (limit > 0 && members.size() >= limit)
+			err = 471;
+		else
+		{
+			if (members.empty())
+				operators.insert(client);
+			members.push_back(client);
+			publish(members);
+			client->addChannel(this);
+			invited.erase(folded);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return err;
+}
+
+/**
+ * @brief Adds a member without any of join()'s checks, e.g. one that
+ * joined on another server.
+ *
+ * @param chanop Make it a channel operator too.
+ * @return false if the channel was closed meanwhile and must be looked
+ * up again.
+ */
+bool Channel::addMember(Client *client, bool chanop)
+{
+	pthread_mutex_lock(&mutex);
+	if (_closed)
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+	std::vector<Client*> members(_members->clients());
 	members.push_back(client);
+	publish(members);
+	if (chanop)
+		operators.insert(client);
+	client->addChannel(this);
 	pthread_mutex_unlock(&mutex);
+	return true;
 }
 
-void Channel::removeMember(Client *client)
+/**
+ * @return true if the client was a member.
+ */
+bool Channel::removeMember(Client *client)
 {
+	if (!getMembers().contains(client))
+		return false;
 	pthread_mutex_lock(&mutex);
+	std::vector<Client*> members(_members->clients());
+	size_t before = members.size();
 	members.erase(std::remove(members.begin(), members.end(), client), members.end());
+	bool removed = members.size() != before;
+	if (removed)
+	{
+		publish(members);
+		client->removeChannel(this);
+	}
+	operators.erase(client);
+	pthread_mutex_unlock(&mutex);
+	return removed;
+}
+
+/**
+ * @brief Closes the channel if it has no members, so no one can join
+ * it any more. Called by the registry while it removes the channel.
+ *
+ * @return true if this call closed it.
+ */
+bool Channel::close()
+{
+	pthread_mutex_lock(&mutex);
+	bool closing = !_closed && _members->clients().empty();
+	if (closing)
+		_closed = true;
 	pthread_mutex_unlock(&mutex);
+	return closing;
+}
+
+bool Channel::isMember(Client *client)
+{
+	return getMembers().contains(client);
 }
 
-void Channel::broadcast(const std::string &message, Client *exclude)
+bool Channel::isOperator(Client *client)
 {
 	pthread_mutex_lock(&mutex);
-	std::for_each(members.begin(), members.end(), SendMessageFunctor(exclude, message));
+	bool found = operators.count(client) > 0;
 	pthread_mutex_unlock(&mutex);
-}
\ No newline at end of file
+	return found;
+}
+
+/**
+ * @brief Finds a member by nickname, ignoring case.
+ *
+ * @return A reference on the member, taken while the snapshot still
+ * held one, or an empty ClientRef. The member may leave or disconnect
+ * meanwhile; the reference only keeps the object alive.
+ */
+ClientRef Channel::findMember(std::string const& nickname)
+{
+	std::string folded = ircFold(nickname);
+	MemberSnapshot members = getMembers();
+
+	for (MemberSnapshot::const_iterator it = members.begin(); it != members.end(); ++it)
+	{
+		if (ircFold((*it)->getNickname()) == folded)
+		{
+			(*it)->retain();
+			return ClientRef(*it);
+		}
+	}
+	return ClientRef();
+}
+
+size_t Channel::size()
+{
+	return getMembers().size();
+}
+
+std::string Channel::getTopic()
+{
+	pthread_mutex_lock(&mutex);
+	std::string copy(topic);
+	pthread_mutex_unlock(&mutex);
+	return copy;
+}
+
+void Channel::setTopic(std::string const& topic)
+{
+	pthread_mutex_lock(&mutex);
+	this->topic = topic;
+	pthread_mutex_unlock(&mutex);
+}
+
+void Channel::invite(std::string const& nickname)
+{
+	pthread_mutex_lock(&mutex);
+	invited.insert(ircFold(nickname));
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Applies one channel mode change.
+ *
+ * @param mode One of i, t, k, l, o.
+ * @param enable true for '+', false for '-'.
+ * @param arg Key for +k, limit for +l.
+ * @param target Member affected by +o/-o. +o is refused if it is no
+ * longer a member, so operators never names a client that left.
+ * @return false if the argument is invalid or the mode is unknown.
+ */
+bool Channel::setMode(char mode, bool enable, std::string const& arg, Client* target)
+{
+	bool ok = true;
+
+	pthread_mutex_lock(&mutex);
+	switch (mode)
+	{
+		case 'i':
+			inviteOnly = enable;
+			break;
+		case 't':
+			topicRestricted = enable;
+			break;
+		case 'k':
+			if (enable && arg.empty())
+				ok = false;
+			else
+				key = enable ? arg : "";
+			break;
+		case 'l':
+		{
+			if (!enable)
+			{
+				limit = 0;
+				break;
+			}
+			std::istringstream iss(arg);
+			size_t value = 0;
+			if (!(iss >> value) || value == 0)
+				ok = false;
+			else
+				limit = value;
+			break;
+		}
+		case 'o':
+			if (!target)
+				ok = false;
+			else if (enable)
+			{
+				std::vector<Client*> const& members = _members->clients();
+				ok = std::find(members.begin(), members.end(), target) != members.end();
+				if (ok)
+					operators.insert(target);
+			}
+			else
+				operators.erase(target);
+			break;
+		default:
+			ok = false;
+	}
+	pthread_mutex_unlock(&mutex);
+	return ok;
+}
+
+/**
+ * @brief Current modes formatted for RPL_CHANNELMODEIS, e.g. "+tkl key 10".
+ *
+ * @param withKey Include the key itself; otherwise only the k flag is
+ * shown, for those who may not learn it.
+ */
+std::string Channel::modeString(bool withKey)
+{
+	std::ostringstream flags;
+	std::ostringstream args;
+
+	pthread_mutex_lock(&mutex);
+	flags << "+";
+	if (inviteOnly)
+		flags << "i";
+	if (topicRestricted)
+		flags << "t";
+	if (!key.empty())
+	{
+		flags << "k";
+		if (withKey)
+			args << " " << key;
+	}
+	if (limit > 0)
+	{
+		flags << "l";
+		args << " " << limit;
+	}
+	pthread_mutex_unlock(&mutex);
+	return flags.str() + args.str();
+}
+
+/**
+ * @brief Space-separated member list for RPL_NAMREPLY, operators
+ * prefixed with '@'.
+ */
+std::string Channel::namesList()
+{
+	std::string names;
+	MemberSnapshot members = getMembers();
+
+	pthread_mutex_lock(&mutex);
+	for (MemberSnapshot::const_iterator it = members.begin(); it != members.end(); ++it)
+	{
+		if (!names.empty())
+			names += " ";
+		if (operators.count(*it))
+			names += "@";
+		names += (*it)->getNickname();
+	}
+	pthread_mutex_unlock(&mutex);
+	return names;
+}
+
+/**
+ * @brief Queues message on every member of the current snapshot. No
+ * channel lock is held while the members' queues are written.
+ *
+ * @param routed Also forward it to the links leading to remote members.
+ */
+void Channel::broadcast(SharedBuffer const &message, Client *exclude, bool routed,
+	HistoryStamp const* stamp)
+{
+	MetricTimer timer(H_BROADCAST_NS);
+	MemberSnapshot members = getMembers();
+	SendMessageFunctor fanout = std::for_each(members.begin(), members.end(),
+		SendMessageFunctor(exclude, message, routed, stamp));
+	Metrics::add(M_BROADCASTS);
+	Metrics::add(M_FANOUT_DELIVERIES, static_cast<int64_t>(fanout.sent));
+	Metrics::add(M_LINK_DELIVERIES, static_cast<int64_t>(fanout.links.size()));
+	Metrics::record(H_FANOUT, fanout.sent);
+}
+
+/**
+ * @brief The line as client asked for it: untagged, or prefixed with
+ * the time and msgid tags of its capabilities.
+ */
+SharedBuffer const& SendMessageFunctor::lineFor(Client* client)
+{
+	unsigned caps = stamp ? client->getCapabilities() & (CAP_MESSAGE_TAGS | CAP_SERVER_TIME) : 0;
+	if (!caps)
+		return message;
+	SharedBuffer& line = tagged[caps - 1];
+	if (line.empty())
+	{
+		std::string tags = "@";
+		if (caps & CAP_SERVER_TIME)
+			tags += "time=" + ChannelHistory::formatTime(stamp->time);
+		if (caps & CAP_MESSAGE_TAGS)
+			tags += std::string(caps & CAP_SERVER_TIME ? ";" : "") + "msgid="
+				+ ChannelHistory::formatId(stamp->id);
+		tags += " ";
+		line = SharedBuffer(tags.size() + message.size());
+		line.append(tags).append(message.data(), message.size());
+	}
+	return line;
+}
@@ -0,0 +1,430 @@
+#include "ChannelHistory.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/time.h>
+
+pthread_mutex_t ChannelHistory::_budgetLock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<ChannelHistory*> ChannelHistory::_arenas;
+size_t ChannelHistory::_budget = HISTORY_BUDGET;
+size_t ChannelHistory::_charged = 0;
+uint64_t ChannelHistory::_lastId = 0;
+
+namespace
+{
+	size_t const NO_SLOT = static_cast<size_t>(-1);
+
+	uint64_t wallClockMs()
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		return static_cast<uint64_t>(now.tv_sec) * 1000 + static_cast<uint64_t>(now.tv_usec) / 1000;
+	}
+
+	int hexDigit(char c)
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	uint64_t keyOf(HistoryRef const& ref, uint64_t id, uint64_t time)
+	{
+		return ref.kind == HistoryRef::MSGID ? id : time;
+	}
+}
+
+/**
+ * @brief Reads `*`, `msgid=<id>` or `timestamp=YYYY-MM-DDThh:mm:ss.sssZ`.
+ *
+ * @return false if the text is none of them.
+ */
+bool HistoryRef::parse(std::string const& text, HistoryRef& ref)
+{
+	if (text == "*")
+	{
+		ref = HistoryRef();
+		return true;
+	}
+	if (text.compare(0, 6, "msgid=") == 0 && text.size() > 6)
+	{
+		if (text.size() > 6 + 16)
+			return false;
+		uint64_t id = 0;
+		for (size_t i = 6; i < text.size(); ++i)
+		{
+			int digit = hexDigit(text[i]);
+			if (digit < 0)
+				return false;
+			id = id << 4 | static_cast<uint64_t>(digit);
+		}
+		ref = HistoryRef(MSGID, id);
+		return true;
+	}
+	if (text.compare(0, 10, "timestamp=") != 0)
+		return false;
+	struct tm parts;
+	int millis = 0;
+	char zone = '\0';
+	std::memset(&parts, 0, sizeof(parts));
+	if (std::sscanf(text.c_str() + 10, "%4d-%2d-%2dT%2d:%2d:%2d.%3d%c", &parts.tm_year, &parts.tm_mon,
+			&parts.tm_mday, &parts.tm_hour, &parts.tm_min, &parts.tm_sec, &millis, &zone) != 8
+		|| zone != 'Z')
+		return false;
+	parts.tm_year -= 1900;
+	parts.tm_mon -= 1;
+	time_t seconds = timegm(&parts);
+	if (seconds < 0)
+		return false;
+	ref = HistoryRef(TIME, static_cast<uint64_t>(seconds) * 1000 + static_cast<uint64_t>(millis));
+	return true;
+}
+
+ChannelHistory::ChannelHistory()
+	: _arena(NULL), _capacity(0), _head(0), _used(0), _count(0), _lastTime(0), _lastAppend(0),
+	_slot(NO_SLOT)
+{
+	pthread_mutex_init(&_lock, NULL);
+}
+
+ChannelHistory::~ChannelHistory()
+{
+	pthread_mutex_lock(&_lock);
+	freeArena();
+	pthread_mutex_unlock(&_lock);
+	pthread_mutex_destroy(&_lock);
+}
+
+/**
+ * @brief Sets the budget shared by every channel, 0 disabling history.
+ * Called once at startup before any reactor runs, which also seeds the
+ * msgids.
+ */
+void ChannelHistory::setBudget(size_t bytes)
+{
+	_budget = bytes;
+	_lastId = wallClockMs() * 1000;
+}
+
+bool ChannelHistory::enabled()
+{
+	return _budget > 0;
+}
+
+/**
+ * @brief The IRCv3 server-time form, 2026-01-31T12:00:00.000Z.
+ */
+std::string ChannelHistory::formatTime(uint64_t time)
+{
+	time_t seconds = static_cast<time_t>(time / 1000);
+	struct tm parts;
+	char text[32];
+	gmtime_r(&seconds, &parts);
+	std::snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ", parts.tm_year + 1900,
+		parts.tm_mon + 1, parts.tm_mday, parts.tm_hour, parts.tm_min, parts.tm_sec,
+		static_cast<unsigned>(time % 1000));
+	return text;
+}
+
+/**
+ * @brief Lowercase hex without leading zeros, as HistoryRef::parse()
+ * reads it back.
+ */
+std::string ChannelHistory::formatId(uint64_t id)
+{
+	char text[17];
+	size_t start = sizeof(text) - 1;
+	text[start] = '\0';
+	do
+	{
+		text[--start] = "0123456789abcdef"[id & 0xf];
+		id >>= 4;
+	} while (id);
+	return text + start;
+}
+
+void ChannelHistory::read(size_t offset, void* out, size_t length) const
+{
+	size_t first = std::min(length, _capacity - offset);
+	std::memcpy(out, _arena + offset, first);
+	std::memcpy(static_cast<char*>(out) + first, _arena, length - first);
+}
+
+void ChannelHistory::write(size_t offset, void const* data, size_t length)
+{
+	size_t first = std::min(length, _capacity - offset);
+	std::memcpy(_arena + offset, data, first);
+	std::memcpy(_arena, static_cast<char const*>(data) + first, length - first);
+}
+
+void ChannelHistory::dropOldest()
+{
+	Header header;
+	read(_head, &header, sizeof(header));
+	size_t size = sizeof(header) + header.length;
+	_head = (_head + size) % _capacity;
+	_used -= size;
+	--_count;
+}
+
+/**
+ * @brief Makes room for `length` more bytes, growing the arena while
+ * the budget allows and dropping the oldest messages otherwise. The
+ * channel lock is held.
+ *
+ * @return false if there is no arena and the budget has no room for one.
+ */
+bool ChannelHistory::reserve(size_t length)
+{
+	while (_count > 0 && _count >= HISTORY_LINES)
+		dropOldest();
+	if (_capacity - _used >= length)
+		return true;
+	size_t capacity = _capacity ? _capacity : HISTORY_MIN_BYTES;
+	while (capacity < HISTORY_BYTES && capacity - _used < length)
+		capacity *= 2;
+	if (capacity > HISTORY_BYTES)
+		capacity = HISTORY_BYTES;
+	if (capacity > _capacity && charge(this, capacity - _capacity))
+	{
+		char* arena = static_cast<char*>(std::malloc(capacity));
+		if (!arena)
+			refund(this, capacity - _capacity);
+		else
+		{
+			if (_used)
+				read(_head, arena, _used);
+			std::free(_arena);
+			_arena = arena;
+			_capacity = capacity;
+			_head = 0;
+		}
+	}
+	if (_capacity < length)
+		return false;
+	while (_capacity - _used < length)
+		dropOldest();
+	return true;
+}
+
+/**
+ * @brief Forgets every message and gives the arena back to the budget.
+ */
+void ChannelHistory::freeArena()
+{
+	size_t capacity = _capacity;
+	std::free(_arena);
+	_arena = NULL;
+	_capacity = 0;
+	_head = 0;
+	_used = 0;
+	_count = 0;
+	if (capacity)
+		refund(this, capacity);
+}
+
+/**
+ * @brief Takes `bytes` more from the budget for owner, whose lock is
+ * held, evicting colder channels while it does not fit.
+ *
+ * @return false if not enough could be evicted.
+ */
+bool ChannelHistory::charge(ChannelHistory* owner, size_t bytes)
+{
+	bool fits = true;
+
+	pthread_mutex_lock(&_budgetLock);
+	while (_charged + bytes > _budget && fits)
+		fits = evictColdest(owner);
+	if (fits)
+	{
+		_charged += bytes;
+		if (owner->_slot == NO_SLOT)
+		{
+			owner->_slot = _arenas.size();
+			_arenas.push_back(owner);
+		}
+	}
+	pthread_mutex_unlock(&_budgetLock);
+	if (fits)
+		Metrics::add(M_HISTORY_BYTES, static_cast<int64_t>(bytes));
+	return fits;
+}
+
+/**
+ * @brief Gives back what charge() took; an owner left without an arena
+ * leaves the eviction list.
+ */
+void ChannelHistory::refund(ChannelHistory* owner, size_t bytes)
+{
+	pthread_mutex_lock(&_budgetLock);
+	_charged -= bytes;
+	if (owner->_capacity == 0)
+		unlist(owner);
+	pthread_mutex_unlock(&_budgetLock);
+	Metrics::add(M_HISTORY_BYTES, -static_cast<int64_t>(bytes));
+}
+
+/**
+ * @brief Removes owner from the eviction list. The budget lock is held.
+ */
+void ChannelHistory::unlist(ChannelHistory* owner)
+{
+	if (owner->_slot == NO_SLOT)
+		return;
+	ChannelHistory* last = _arenas.back();
+	_arenas[owner->_slot] = last;
+	last->_slot = owner->_slot;
+	_arenas.pop_back();
+	owner->_slot = NO_SLOT;
+}
+
+/**
+ * @brief Frees the arena of the channel appended to least recently,
+ * other than owner and any channel whose lock is taken. The budget
+ * lock is held.
+ *
+ * @return false if there was no such channel.
+ */
+bool ChannelHistory::evictColdest(ChannelHistory* owner)
+{
+	std::vector<ChannelHistory*> busy;
+	while (true)
+	{
+		ChannelHistory* coldest = NULL;
+		uint64_t oldest = 0;
+		for (size_t i = 0; i < _arenas.size(); ++i)
+		{
+			ChannelHistory* candidate = _arenas[i];
+			uint64_t used = __atomic_load_n(&candidate->_lastAppend, __ATOMIC_RELAXED);
+			if (candidate == owner || (coldest && used >= oldest)
+				|| std::find(busy.begin(), busy.end(), candidate) != busy.end())
+				continue;
+			coldest = candidate;
+			oldest = used;
+		}
+		if (!coldest)
+			return false;
+		if (pthread_mutex_trylock(&coldest->_lock) != 0)
+		{
+			busy.push_back(coldest);
+			continue;
+		}
+		size_t capacity = coldest->_capacity;
+		std::free(coldest->_arena);
+		coldest->_arena = NULL;
+		coldest->_capacity = 0;
+		coldest->_head = 0;
+		coldest->_used = 0;
+		coldest->_count = 0;
+		unlist(coldest);
+		pthread_mutex_unlock(&coldest->_lock);
+		_charged -= capacity;
+		Metrics::add(M_HISTORY_BYTES, -static_cast<int64_t>(capacity));
+		Metrics::add(M_HISTORY_EVICTIONS);
+		return true;
+	}
+}
+
+/**
+ * @brief Records one broadcast line, CRLF included or not, with a new
+ * msgid and the current time, both returned in stamp. The stamp is set
+ * even if the line could not be kept.
+ *
+ * @return false if history is disabled, leaving stamp unset.
+ */
+bool ChannelHistory::append(char const* line, size_t length, HistoryStamp& stamp)
+{
+	if (!enabled())
+		return false;
+	while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		--length;
+	Header header;
+	header.length = static_cast<uint32_t>(length);
+
+	pthread_mutex_lock(&_lock);
+	__atomic_store_n(&_lastAppend, Metrics::now(), __ATOMIC_RELAXED);
+	header.id = __sync_add_and_fetch(&_lastId, 1);
+	header.time = std::max(wallClockMs(), _lastTime);
+	_lastTime = header.time;
+	if (reserve(sizeof(header) + length))
+	{
+		size_t tail = (_head + _used) % _capacity;
+		write(tail, &header, sizeof(header));
+		write((tail + sizeof(header)) % _capacity, line, length);
+		_used += sizeof(header) + length;
+		++_count;
+	}
+	pthread_mutex_unlock(&_lock);
+	stamp.id = header.id;
+	stamp.time = header.time;
+	return true;
+}
+
+/**
+ * @brief Copies the messages strictly between two positions, oldest
+ * first. When more than `limit` qualify, the oldest of them are kept if
+ * `oldest` is set, the newest otherwise.
+ */
+void ChannelHistory::query(HistoryRef const& after, HistoryRef const& before, size_t limit,
+	bool oldest, std::vector<HistoryLine>& out)
+{
+	std::vector<Header> headers;
+	std::vector<size_t> offsets;
+
+	pthread_mutex_lock(&_lock);
+	headers.reserve(_count);
+	offsets.reserve(_count);
+	size_t offset = _head;
+	for (size_t i = 0; i < _count; ++i)
+	{
+		Header header;
+		read(offset, &header, sizeof(header));
+		size_t text = (offset + sizeof(header)) % _capacity;
+		offset = (text + header.length) % _capacity;
+		if (after.kind != HistoryRef::NONE && keyOf(after, header.id, header.time) <= after.value)
+			continue;
+		if (before.kind != HistoryRef::NONE && keyOf(before, header.id, header.time) >= before.value)
+			break;
+		headers.push_back(header);
+		offsets.push_back(text);
+	}
+	size_t first = 0;
+	size_t last = headers.size();
+	if (last - first > limit)
+	{
+		if (oldest)
+			last = first + limit;
+		else
+			first = last - limit;
+	}
+	for (size_t i = first; i < last; ++i)
+	{
+		HistoryLine line;
+		line.id = headers[i].id;
+		line.time = headers[i].time;
+		line.text.resize(headers[i].length);
+		if (headers[i].length)
+			read(offsets[i], &line.text[0], headers[i].length);
+		out.push_back(line);
+	}
+	pthread_mutex_unlock(&_lock);
+}
+
+/**
+ * @brief Time of the newest message, 0 if none is kept.
+ */
+uint64_t ChannelHistory::lastTime()
+{
+	pthread_mutex_lock(&_lock);
+	uint64_t time = _count ? _lastTime : 0;
+	pthread_mutex_unlock(&_lock);
+	return time;
+}
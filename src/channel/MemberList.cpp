@@ -0,0 +1,114 @@
+#include "MemberList.hpp"
+#include "SlabPool.hpp"
+#include "Client.hpp"
+#include <algorithm>
+
+namespace
+{
+	SlabPool memberListPool("memberlist", sizeof(MemberList), 256);
+}
+
+/**
+ * @brief Every JOIN and PART publishes a new list, so these are the
+ * highest-churn objects in the server; recycle them through a pool.
+ */
+void* MemberList::operator new(size_t size)
+{
+	if (size != sizeof(MemberList))
+		return ::operator new(size);
+	return memberListPool.allocate();
+}
+
+void MemberList::operator delete(void* ptr, size_t size)
+{
+	if (size != sizeof(MemberList))
+		::operator delete(ptr);
+	else
+		memberListPool.deallocate(ptr);
+}
+
+MemberList::MemberList(std::vector<Client*> const& clients) : _refs(1), _clients(clients)
+{
+	for (std::vector<Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		(*it)->retain();
+	}
+}
+
+MemberList::~MemberList()
+{
+	for (std::vector<Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		(*it)->release();
+	}
+}
+
+/**
+ * @brief Publishes a new list with one reference owned by the caller.
+ */
+MemberList* MemberList::create(std::vector<Client*> const& clients)
+{
+	return new MemberList(clients);
+}
+
+void MemberList::retain()
+{
+	__sync_add_and_fetch(&_refs, 1);
+}
+
+void MemberList::release()
+{
+	if (__sync_sub_and_fetch(&_refs, 1) == 0)
+		delete this;
+}
+
+std::vector<Client*> const& MemberList::clients() const
+{
+	return _clients;
+}
+
+/**
+ * @brief Adopts a reference already taken on list.
+ */
+MemberSnapshot::MemberSnapshot(MemberList* list) : _list(list) {}
+
+MemberSnapshot::MemberSnapshot(MemberSnapshot const& rhs) : _list(rhs._list)
+{
+	_list->retain();
+}
+
+MemberSnapshot& MemberSnapshot::operator=(MemberSnapshot const& rhs)
+{
+	if (_list != rhs._list)
+	{
+		rhs._list->retain();
+		_list->release();
+		_list = rhs._list;
+	}
+	return *this;
+}
+
+MemberSnapshot::~MemberSnapshot()
+{
+	_list->release();
+}
+
+MemberSnapshot::const_iterator MemberSnapshot::begin() const
+{
+	return _list->clients().begin();
+}
+
+MemberSnapshot::const_iterator MemberSnapshot::end() const
+{
+	return _list->clients().end();
+}
+
+size_t MemberSnapshot::size() const
+{
+	return _list->clients().size();
+}
+
+bool MemberSnapshot::contains(Client* client) const
+{
+	return std::find(begin(), end(), client) != end();
+}
@@ -1,42 +1,669 @@
 #include "Client.hpp"
+#include "SlabPool.hpp"
+#include "Reactor.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
 #include <unistd.h>
 #include <cstring>
+#include <stdexcept>
+#include <sys/uio.h>
 
-Client::Client(int fd) : _clientFD(fd), nickname(""), username(""), buffer("") {}
+namespace
+{
+	SlabPool clientPool("client", sizeof(Client), 64);
+}
+
+size_t Client::_sendQLimit = MAX_SENDQ;
+size_t Client::_sendQHigh = MAX_SENDQ / 100 * SENDQ_HIGH_PERCENT;
+size_t Client::_sendQLow = MAX_SENDQ / 100 * SENDQ_LOW_PERCENT;
+
+/**
+ * @brief Sets the SendQ limit, and the watermarks derived from it, for
+ * every client. Call before the reactors start.
+ */
+void Client::setSendQLimit(size_t bytes)
+{
+	_sendQLimit = bytes;
+	_sendQHigh = bytes / 100 * SENDQ_HIGH_PERCENT;
+	_sendQLow = bytes / 100 * SENDQ_LOW_PERCENT;
+}
+
+/**
+ * @brief SendQ limit of this connection: the process-wide one, or
+ * LINK_SENDQ for a server link.
+ */
+size_t Client::queueLimit() const
+{
+	return isLink ? LINK_SENDQ : _sendQLimit;
+}
+
+/**
+ * @brief Client objects come from a slab pool; anything else of a
+ * different size (a subclass) falls back to the global heap.
+ */
+void* Client::operator new(size_t size)
+{
+	if (size != sizeof(Client))
+		return ::operator new(size);
+	return clientPool.allocate();
+}
+
+void Client::operator delete(void* ptr, size_t size)
+{
+	if (size != sizeof(Client))
+		::operator delete(ptr);
+	else
+		clientPool.deallocate(ptr);
+}
+
+Client::Client(int fd, Reactor* reactor)
+	: _clientFD(fd), _refs(1), _reactor(reactor), _route(NULL), _sendOffset(0), _sendQueueBytes(0),
+	_writePending(false), _closing(false), _congested(false), _ringBacked(reactor && reactor->usesRing()),
+	_sendInFlight(false), _inputPending(false), _capabilities(0), username(""), realname(""), hostname(""),
+	admissionKey(0), passAccepted(false), registered(false), isOperator(false), isLink(false), backlog(0),
+	lastActivity(0), receiving(false)
+{
+	std::memset(&_message, 0, sizeof(_message));
+	liveness.owner = this;
+	floodWakeup.owner = this;
+	pthread_mutex_init(&_sendMutex, NULL);
+	pthread_mutex_init(&_channelsMutex, NULL);
+	pthread_mutex_init(&_nickMutex, NULL);
+}
+
+/**
+ * @brief A user of another server, reached through the link `route`,
+ * on which it keeps a reference. It has no socket and never belongs to
+ * a reactor.
+ */
+Client::Client(Client* route)
+	: _clientFD(-1), _refs(1), _reactor(NULL), _route(route), _sendOffset(0), _sendQueueBytes(0),
+	_writePending(false), _closing(false), _congested(false), _ringBacked(false),
+	_sendInFlight(false), _inputPending(false), _capabilities(0), username(""), realname(""), hostname(""),
+	admissionKey(0), passAccepted(true), registered(true), isOperator(false), isLink(false), backlog(0),
+	lastActivity(0), receiving(false)
+{
+	std::memset(&_message, 0, sizeof(_message));
+	liveness.owner = this;
+	floodWakeup.owner = this;
+	pthread_mutex_init(&_sendMutex, NULL);
+	pthread_mutex_init(&_channelsMutex, NULL);
+	pthread_mutex_init(&_nickMutex, NULL);
+	_route->retain();
+}
+
+Client::~Client()
+{
+	if (_route)
+		_route->release();
+	pthread_mutex_destroy(&_nickMutex);
+	pthread_mutex_destroy(&_channelsMutex);
+	pthread_mutex_destroy(&_sendMutex);
+}
+
+void Client::retain()
+{
+	__sync_add_and_fetch(&_refs, 1);
+}
+
+/**
+ * @brief Drops one reference and destroys the client with the last one.
+ */
+void Client::release()
+{
+	if (__sync_sub_and_fetch(&_refs, 1) == 0)
+		delete this;
+}
+
+/**
+ * @brief Stops all further output before the owning reactor closes the
+ * descriptor, so a broadcaster still holding this client can never
+ * write to a closed or reused fd.
+ */
+void Client::detach()
+{
+	pthread_mutex_lock(&_sendMutex);
+	_closing = true;
+	setCongested(false);
+	Metrics::add(M_SENDQ_BYTES, -static_cast<int64_t>(_sendQueueBytes));
+	_sendQueue.clear();
+	_sendOffset = 0;
+	_sendQueueBytes = 0;
+	pthread_mutex_unlock(&_sendMutex);
+}
 
 void Client::sendMessage(const std::string &message)
 {
-	write(_clientFD, message.c_str(), message.length());
+	if (!message.empty())
+		sendMessage(SharedBuffer(message));
 }
 
-Client::~Client() {}
+/**
+ * @brief Asks the owning reactor to drop this client. Safe from any
+ * thread: the reason is recorded and the read side is shut down, which
+ * the owning reactor sees as end of stream on its next wait. Output
+ * already queued keeps flushing until then.
+ */
+void Client::disconnect(std::string const& reason)
+{
+	pthread_mutex_lock(&_sendMutex);
+	if (_quitReason.empty())
+		_quitReason = reason;
+	pthread_mutex_unlock(&_sendMutex);
+	shutdown(_clientFD, SHUT_RD);
+}
 
-void Client::handleRead() {
-	char buffer[MAX_BUFFER];
-	int nbytes = recv(_clientFD, buffer, sizeof(buffer) - 1, 0);
-	if (nbytes < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			return; // No data available
+std::string Client::getQuitReason()
+{
+	pthread_mutex_lock(&_sendMutex);
+	std::string reason(_quitReason);
+	pthread_mutex_unlock(&_sendMutex);
+	return reason;
+}
+
+/**
+ * @brief Queues a message for delivery and tries to flush it at once,
+ * or, with the io_uring backend, leaves it to the reactor's next batch.
+ *
+ * Never blocks: whatever the socket does not take now stays queued and
+ * is written by the owning reactor on EPOLLOUT. A client whose queue
+ * would exceed the SendQ limit is evicted instead of losing data
+ * silently.
+ *
+ * A remote user's messages go to the link it is reached through, until
+ * it is detached.
+ *
+ * @param message Wire-formatted message; only a reference is queued.
+ */
+void Client::sendMessage(SharedBuffer const& message)
+{
+	if (message.empty())
+		return;
+	pthread_mutex_lock(&_sendMutex);
+	if (_route)
+	{
+		bool closing = _closing;
+		pthread_mutex_unlock(&_sendMutex);
+		if (!closing)
+			_route->sendMessage(message);
+		return;
+	}
+	if (!_closing)
+	{
+		if (_sendQueueBytes + message.size() > queueLimit())
+			evict();
 		else
+		{
+			_sendQueue.push_back(message);
+			_sendQueueBytes += message.size();
+			Metrics::add(M_LINES_OUT);
+			Metrics::add(M_SENDQ_BYTES, static_cast<int64_t>(message.size()));
+			if (_sendQueueBytes > (isLink ? LINK_SENDQ / 100 * SENDQ_HIGH_PERCENT : _sendQHigh))
+				setCongested(true);
+			if (_ringBacked)
+				setWriteInterest(true);
+			else if (!_writePending)
+				flushLocked();
+		}
+	}
+	pthread_mutex_unlock(&_sendMutex);
+}
+
+/**
+ * @brief Writes as much of the queue as the socket accepts. Called by
+ * the owning reactor when the socket becomes writable, and with the
+ * io_uring backend before the client goes away, unless a send is
+ * still in flight.
+ */
+void Client::flush()
+{
+	pthread_mutex_lock(&_sendMutex);
+	if (!_closing && !_sendInFlight)
+		flushLocked();
+	pthread_mutex_unlock(&_sendMutex);
+}
+
+/**
+ * @brief True while the queue is between the high watermark and its
+ * drain below the low one.
+ */
+bool Client::isCongested()
+{
+	pthread_mutex_lock(&_sendMutex);
+	bool congested = _congested;
+	pthread_mutex_unlock(&_sendMutex);
+	return congested;
+}
+
+size_t Client::getSendQueueBytes()
+{
+	pthread_mutex_lock(&_sendMutex);
+	size_t bytes = _sendQueueBytes;
+	pthread_mutex_unlock(&_sendMutex);
+	return bytes;
+}
+
+/**
+ * @brief Gathers up to MAX_IOV queued messages per writev() until the
+ * queue is empty or the socket would block. _sendMutex must be held.
+ */
+void Client::flushLocked()
+{
+	while (!_sendQueue.empty())
+	{
+		struct iovec iov[MAX_IOV];
+		int count = 0;
+		for (std::deque<SharedBuffer>::iterator it = _sendQueue.begin();
+			it != _sendQueue.end() && count < MAX_IOV; ++it, ++count)
+		{
+			size_t skip = (count == 0) ? _sendOffset : 0;
+			iov[count].iov_base = const_cast<char*>(it->data() + skip);
+			iov[count].iov_len = it->size() - skip;
+		}
+		ssize_t written = writev(_clientFD, iov, count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			abort();
+			return;
+		}
+		consumeLocked(static_cast<size_t>(written));
+	}
+	if (_sendQueueBytes <= (isLink ? LINK_SENDQ / 100 * SENDQ_LOW_PERCENT : _sendQLow))
+		setCongested(false);
+	setWriteInterest(!_sendQueue.empty());
+}
+
+/**
+ * @brief Drops what the socket took from the front of the queue.
+ * _sendMutex must be held.
+ */
+void Client::consumeLocked(size_t written)
+{
+	size_t left = written;
+	_sendQueueBytes -= left;
+	Metrics::add(M_BYTES_OUT, static_cast<int64_t>(left));
+	Metrics::add(M_SENDQ_BYTES, -static_cast<int64_t>(left));
+	while (left > 0)
+	{
+		size_t front = _sendQueue.front().size() - _sendOffset;
+		if (left < front)
+		{
+			_sendOffset += left;
+			break;
+		}
+		left -= front;
+		_sendOffset = 0;
+		_sendQueue.pop_front();
+	}
+}
+
+/**
+ * @brief io_uring backend: describes the front of the queue, up to
+ * MAX_IOV messages, for one sendmsg submission. The reactor thread
+ * calls it when the client's turn in a batch comes.
+ *
+ * @return The message header, valid until completeSend(), or NULL if
+ * there is nothing to send, which ends the pending write.
+ */
+struct msghdr* Client::prepareSend()
+{
+	pthread_mutex_lock(&_sendMutex);
+	if (_closing || _sendQueue.empty())
+	{
+		_writePending = false;
+		pthread_mutex_unlock(&_sendMutex);
+		return NULL;
+	}
+	_iov.clear();
+	_inFlight.clear();
+	for (std::deque<SharedBuffer>::iterator it = _sendQueue.begin();
+		it != _sendQueue.end() && _iov.size() < MAX_IOV; ++it)
+	{
+		size_t skip = _iov.empty() ? _sendOffset : 0;
+		struct iovec iov;
+		iov.iov_base = const_cast<char*>(it->data() + skip);
+		iov.iov_len = it->size() - skip;
+		_iov.push_back(iov);
+		_inFlight.push_back(*it);
+	}
+	std::memset(&_message, 0, sizeof(_message));
+	_message.msg_iov = &_iov[0];
+	_message.msg_iovlen = _iov.size();
+	_sendInFlight = true;
+	pthread_mutex_unlock(&_sendMutex);
+	return &_message;
+}
+
+/**
+ * @brief io_uring backend: accounts for a finished sendmsg.
+ *
+ * @param result Bytes written or a negated errno; a cancelled send
+ * wrote nothing and any other error shuts the connection down.
+ * @return true if more data is queued, in which case the write stays
+ * pending and the reactor prepares the next send straight away.
+ */
+bool Client::completeSend(int result)
+{
+	pthread_mutex_lock(&_sendMutex);
+	_sendInFlight = false;
+	_inFlight.clear();
+	if (!_closing)
+	{
+		if (result >= 0)
+			consumeLocked(static_cast<size_t>(result));
+		else if (result != -ECANCELED)
+			abort();
+	}
+	bool more = !_closing && !_sendQueue.empty();
+	if (!more)
+		_writePending = false;
+	if (_sendQueueBytes <= (isLink ? LINK_SENDQ / 100 * SENDQ_LOW_PERCENT : _sendQLow))
+		setCongested(false);
+	pthread_mutex_unlock(&_sendMutex);
+	return more;
+}
+
+/**
+ * @brief Tracks watermark crossings. _sendMutex must be held.
+ */
+void Client::setCongested(bool congested)
+{
+	if (congested == _congested)
+		return;
+	_congested = congested;
+	Metrics::add(M_SENDQ_CONGESTED, congested ? 1 : -1);
+	if (congested)
+	{
+		Metrics::add(M_SENDQ_HIGH_WATER);
+		Logger::log(LOG_WARN, "client.sendq_high", "fd=%d nick=%s bytes=%lu",
+			_clientFD, getNickname().c_str(), static_cast<unsigned long>(_sendQueueBytes));
+	}
+}
+
+/**
+ * @brief Registers EPOLLOUT on the owning reactor only while there is
+ * queued data, so idle connections never wake the loop for writability.
+ * With the io_uring backend the client is scheduled for the reactor's
+ * next batch of sends instead; the write stays pending until
+ * prepareSend() or completeSend() find the queue empty.
+ */
+void Client::setWriteInterest(bool enable)
+{
+	if (_ringBacked)
+	{
+		if (enable && !_writePending)
+		{
+			_writePending = true;
+			_reactor->scheduleSend(this);
+		}
+		return;
+	}
+	if (enable == _writePending)
+		return;
+	_writePending = enable;
+	uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (enable)
+		events |= EPOLLOUT;
+	try
+	{
+		_reactor->modify(_clientFD, events);
+	}
+	catch (const std::exception& e)
+	{
+		abort();
+	}
+}
+
+/**
+ * @brief Drops the queue and shuts the socket down. The owning reactor
+ * sees the hangup on its next wait and removes the client.
+ */
+void Client::abort()
+{
+	_closing = true;
+	setCongested(false);
+	Metrics::add(M_SENDQ_BYTES, -static_cast<int64_t>(_sendQueueBytes));
+	_sendQueue.clear();
+	_sendOffset = 0;
+	_sendQueueBytes = 0;
+	shutdown(_clientFD, SHUT_RDWR);
+}
+
+/**
+ * @brief Disconnects a client whose SendQ overflowed. _sendMutex must
+ * be held.
+ *
+ * When the socket sits on a line boundary, a best-effort ERROR is
+ * written straight past the queue so the user learns why; the queue
+ * itself is dropped, which is what bounds memory.
+ */
+void Client::evict()
+{
+	Metrics::add(M_SENDQ_EVICTIONS);
+	Logger::log(LOG_WARN, "client.sendq_exceeded", "fd=%d nick=%s bytes=%lu limit=%lu",
+		_clientFD, getNickname().c_str(), static_cast<unsigned long>(_sendQueueBytes),
+		static_cast<unsigned long>(queueLimit()));
+	if (_quitReason.empty())
+		_quitReason = "Excess SendQ";
+	if (_sendOffset == 0 && !_sendInFlight)
+	{
+		std::string error = "ERROR :Closing Link: " + hostname + " (Excess SendQ)\r\n";
+		ssize_t written = send(_clientFD, error.data(), error.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		(void)written;
+	}
+	abort();
+}
+
+/**
+ * @brief Drains the socket into the input ring.
+ *
+ * The descriptor is edge-triggered, so recv() is repeated until the
+ * kernel reports EAGAIN. If the ring fills up first, reading stops and
+ * hasPendingInput() tells the reactor to consume the buffered lines and
+ * call again. With the io_uring backend it only moves bytes that
+ * receive() could not fit into the ring.
+ *
+ * @return false once the peer has closed the connection.
+ */
+bool Client::handleRead()
+{
+	if (_ringBacked)
+	{
+		std::string overflow;
+		overflow.swap(_overflow);
+		_inputPending = false;
+		receive(overflow.data(), overflow.size());
+		return true;
+	}
+	MetricTimer timer(H_READ_NS);
+	Metrics::add(M_READ_CALLS);
+	_inputPending = false;
+	while (true)
+	{
+		if (_input.full())
+		{
+			_inputPending = true;
+			return true;
+		}
+		ssize_t nbytes = _input.fill(_clientFD);
+		if (nbytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true; // No data available
+			if (errno == EINTR)
+				continue;
 			throw std::runtime_error("Error on recv: " + std::string(strerror(errno)));
-	} else if (nbytes == 0) {
-		throw std::runtime_error("Client disconnected");
+		}
+		else if (nbytes == 0)
+			return false;
+		Metrics::add(M_BYTES_IN, nbytes);
 	}
-	buffer[nbytes] = '\0';
-	this->buffer += buffer;
+}
 
-	// Process commands
-	size_t pos;
-	while ((pos = this->buffer.find("\r\n")) != std::string::npos)
+/**
+ * @brief io_uring backend: takes the data of one receive completion.
+ * Whatever does not fit in the input ring is kept aside and reported
+ * by hasPendingInput() until handleRead() moves it in.
+ */
+void Client::receive(char const* data, size_t length)
+{
+	size_t done = 0;
+	if (_overflow.empty())
 	{
-		std::string command = this->buffer.substr(0, pos);
-		this->buffer.erase(0, pos + 2);
-		std::cout << "Received command from " << _clientFD << ": " << command << std::endl;
-		// Handle command
+		while (done < length)
+		{
+			size_t accepted = _input.append(data + done, length - done);
+			if (accepted == 0)
+				break;
+			done += accepted;
+		}
 	}
+	_overflow.append(data + done, length - done);
+	_inputPending = !_overflow.empty();
+}
+
+bool Client::hasPendingInput() const
+{
+	return _inputPending;
+}
+
+bool Client::hasBufferedLine() const
+{
+	return _input.hasLine();
+}
+
+/**
+ * @brief Frames the next buffered line.
+ *
+ * @param line View into the input ring, valid until the next read.
+ * @return See InputRing::next().
+ */
+InputRing::Status Client::nextCommand(LineView& line)
+{
+	return _input.next(line);
+}
+
+/**
+ * @brief Received bytes not framed yet, for a hot upgrade.
+ */
+std::string Client::pendingInput() const
+{
+	return std::string(_input.front(), _input.pending());
+}
+
+/**
+ * @brief Puts input carried over by a hot upgrade back in the ring.
+ */
+void Client::restoreInput(std::string const& input)
+{
+	size_t done = 0;
+	while (done < input.size())
+	{
+		size_t accepted = _input.append(input.data() + done, input.size() - done);
+		if (accepted == 0)
+			break;
+		done += accepted;
+	}
+}
+
+/**
+ * @brief Queued bytes the socket has not taken yet, starting mid-line
+ * if a write was cut short, for a hot upgrade.
+ */
+std::string Client::unsentOutput()
+{
+	std::string output;
+	pthread_mutex_lock(&_sendMutex);
+	for (std::deque<SharedBuffer>::iterator it = _sendQueue.begin(); it != _sendQueue.end(); ++it)
+	{
+		size_t skip = (it == _sendQueue.begin()) ? _sendOffset : 0;
+		output.append(it->data() + skip, it->size() - skip);
+	}
+	pthread_mutex_unlock(&_sendMutex);
+	return output;
 }
 
 int Client::getFd() const
 {
 	return _clientFD;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief The link a remote user is reached through, NULL for a local
+ * connection.
+ */
+Client* Client::getRoute() const
+{
+	return _route;
+}
+
+std::string Client::getNickname() const
+{
+	pthread_mutex_lock(&_nickMutex);
+	std::string copy(_nickname);
+	pthread_mutex_unlock(&_nickMutex);
+	return copy;
+}
+
+/**
+ * @brief Changes the nickname. Only the thread handling this client's
+ * commands (its reactor, or its link's for a remote user) calls it.
+ */
+void Client::setNickname(std::string const& nickname)
+{
+	pthread_mutex_lock(&_nickMutex);
+	_nickname = nickname;
+	pthread_mutex_unlock(&_nickMutex);
+}
+
+unsigned Client::getCapabilities() const
+{
+	return __atomic_load_n(&_capabilities, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Replaces the ClientCapability set. Like the nickname, only the
+ * thread handling this client's commands calls it.
+ */
+void Client::setCapabilities(unsigned capabilities)
+{
+	__atomic_store_n(&_capabilities, capabilities, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Message source for this client, "nick!user@host".
+ */
+std::string Client::prefix() const
+{
+	return getNickname() + "!" + username + "@" + hostname;
+}
+
+/**
+ * @brief Records channel membership so disconnects and nick changes
+ * only visit the client's own channels. Maintained by Channel.
+ */
+void Client::addChannel(Channel* channel)
+{
+	pthread_mutex_lock(&_channelsMutex);
+	_channels.insert(channel);
+	pthread_mutex_unlock(&_channelsMutex);
+}
+
+void Client::removeChannel(Channel* channel)
+{
+	pthread_mutex_lock(&_channelsMutex);
+	_channels.erase(channel);
+	pthread_mutex_unlock(&_channelsMutex);
+}
+
+std::vector<Channel*> Client::getChannels()
+{
+	pthread_mutex_lock(&_channelsMutex);
+	std::vector<Channel*> channels(_channels.begin(), _channels.end());
+	pthread_mutex_unlock(&_channelsMutex);
+	return channels;
+}
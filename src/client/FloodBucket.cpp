@@ -0,0 +1,47 @@
+#include "FloodBucket.hpp"
+
+uint64_t FloodBucket::_interval = FLOOD_RATE ? static_cast<uint64_t>(1000000000) / FLOOD_RATE : 0;
+uint64_t FloodBucket::_window = (FLOOD_RATE ? static_cast<uint64_t>(1000000000) / FLOOD_RATE : 0) * FLOOD_BURST;
+
+FloodBucket::FloodBucket() : _clock(0) {}
+
+/**
+ * @brief Sets the limits for every client. Call before the reactors
+ * start.
+ *
+ * @param rate Commands per second, 0 for no limit.
+ * @param burst Commands allowed at once after a quiet period (min 1).
+ */
+void FloodBucket::configure(unsigned rate, unsigned burst)
+{
+	_interval = rate ? static_cast<uint64_t>(1000000000) / rate : 0;
+	_window = _interval * (burst ? burst : 1);
+}
+
+/**
+ * @brief True when one more command fits in the budget.
+ */
+bool FloodBucket::ready(uint64_t now) const
+{
+	return delay(now) == 0;
+}
+
+/**
+ * @brief Accounts for one command that is about to run.
+ */
+void FloodBucket::charge(uint64_t now)
+{
+	if (_clock < now)
+		_clock = now;
+	_clock += _interval;
+}
+
+/**
+ * @brief Nanoseconds until the next command fits, 0 if it does now.
+ */
+uint64_t FloodBucket::delay(uint64_t now) const
+{
+	uint64_t next = (_clock > now ? _clock : now) + _interval;
+	uint64_t limit = now + _window;
+	return next > limit ? next - limit : 0;
+}
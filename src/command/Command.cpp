@@ -1,40 +1,1065 @@
 #include "Command.hpp"
-#include <sstream>
+#include "SlabPool.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <cstring>
+#include <strings.h>
+#include <cstdlib>
+#include <algorithm>
+
+Command::Spec const Command::specs[] = {
+	{ "CAP",     &Command::cap,     0, false },
+	{ "PASS",    &Command::pass,    1, false },
+	{ "NICK",    &Command::nick,    0, false },
+	{ "USER",    &Command::user,    4, false },
+	{ "PING",    &Command::ping,    1, false },
+	{ "PONG",    &Command::pong,    0, false },
+	{ "QUIT",    &Command::quit,    0, false },
+	{ "JOIN",    &Command::join,    1, true },
+	{ "PART",    &Command::part,    1, true },
+	{ "PRIVMSG", &Command::privmsg, 0, true },
+	{ "NOTICE",  &Command::notice,  0, true },
+	{ "KICK",    &Command::kick,    2, true },
+	{ "INVITE",  &Command::invite,  2, true },
+	{ "TOPIC",   &Command::topic,   1, true },
+	{ "MODE",    &Command::mode,    1, true },
+	{ "WHO",     &Command::who,     0, true },
+	{ "NAMES",   &Command::names,   0, true },
+	{ "WHOIS",   &Command::whois,   1, true },
+	{ "OPER",    &Command::oper,    2, true },
+	{ "KILL",    &Command::kill,    2, true },
+	{ "STATS",   &Command::stats,   0, true },
+	{ "UPGRADE", &Command::upgrade, 0, true },
+	{ "SERVER",  &Command::server,  3, false },
+	{ "LINKS",   &Command::links,   0, true },
+	{ "CHATHISTORY", &Command::chathistory, 0, true }
+};
+
+size_t const Command::specCount = sizeof(Command::specs) / sizeof(Command::specs[0]);
+
+short Command::index[COMMAND_SLOTS];
+
+std::string Command::_serverName(SERVER_NAME);
+
+namespace
+{
+	/* FNV-1a with its offset basis replaced by a seed that keeps every
+	 * verb in specs in a slot of its own. */
+	uint32_t const HASH_SEED = 129;
+
+	std::vector<std::string> splitList(std::string const& list)
+	{
+		std::vector<std::string> items;
+		std::string::size_type start = 0;
+		std::string::size_type comma;
+
+		while ((comma = list.find(',', start)) != std::string::npos)
+		{
+			items.push_back(list.substr(start, comma - start));
+			start = comma + 1;
+		}
+		items.push_back(list.substr(start));
+		return items;
+	}
+
+	bool isChannelName(std::string const& name)
+	{
+		if (name.size() < 2 || name.size() > 50 || (name[0] != '#' && name[0] != '&'))
+			return false;
+		return name.find_first_of(" ,\a") == std::string::npos;
+	}
+
+	bool isSpecial(char c)
+	{
+		return c == '[' || c == ']' || c == '\\' || c == '`'
+			|| c == '_' || c == '^' || c == '{' || c == '|' || c == '}';
+	}
+
+	bool isValidNick(std::string const& nick)
+	{
+		if (nick.empty() || nick.size() > NICKLEN)
+			return false;
+		if (!std::isalpha(static_cast<unsigned char>(nick[0])) && !isSpecial(nick[0]))
+			return false;
+		for (size_t i = 1; i < nick.size(); ++i)
+		{
+			unsigned char c = static_cast<unsigned char>(nick[i]);
+			if (!std::isalnum(c) && !isSpecial(nick[i]) && nick[i] != '-')
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Builds ":<source> <verb> <middle>[ :<trailing>]\r\n" into a single
+	 * shared buffer.
+	 */
+	SharedBuffer userLine(Client* client, char const* verb, std::string const& middle,
+		char const* trailing = NULL, size_t trailingLen = 0)
+	{
+		std::string source = client->prefix();
+		size_t verbLen = std::strlen(verb);
+		size_t size = 1 + source.size() + 1 + verbLen + 1 + middle.size() + 2;
+		if (trailing)
+			size += 2 + trailingLen;
+		SharedBuffer line(size);
+		line.append(":", 1).append(source).append(" ", 1).append(verb, verbLen);
+		if (!middle.empty())
+			line.append(" ", 1).append(middle);
+		if (trailing)
+			line.append(" :", 2).append(trailing, trailingLen);
+		line.append("\r\n", 2);
+		return line;
+	}
+
+	SharedBuffer userLine(Client* client, char const* verb, std::string const& middle,
+		std::string const& trailing)
+	{
+		return userLine(client, verb, middle, trailing.data(), trailing.size());
+	}
+
+	/* Capabilities offered while history is enabled, and the
+	 * ClientCapability bit each one sets, if any. */
+	struct HistoryCap
+	{
+		char const* name;
+		unsigned bit;
+	};
+
+	HistoryCap const HISTORY_CAPS[] = {
+		{ "batch", 0 },
+		{ "draft/chathistory", 0 },
+		{ "message-tags", CAP_MESSAGE_TAGS },
+		{ "server-time", CAP_SERVER_TIME }
+	};
+
+	uint64_t lastBatch = 0;
+
+	std::string nextBatch()
+	{
+		return ChannelHistory::formatId(__sync_add_and_fetch(&lastBatch, 1));
+	}
+
+	void fail(Client* client, char const* code, std::string const& context, char const* text)
+	{
+		client->sendMessage(":" + Command::serverName() + " FAIL CHATHISTORY " + code + " "
+			+ context + " :" + text + "\r\n");
+	}
+
+	bool parseLimit(std::string const& text, size_t& limit)
+	{
+		char* end;
+		unsigned long value = std::strtoul(text.c_str(), &end, 10);
+		if (text.empty() || *end != '\0' || value == 0)
+			return false;
+		limit = value < HISTORY_REPLAY_MAX ? value : HISTORY_REPLAY_MAX;
+		return true;
+	}
+}
+
+uint32_t Command::hash(char const* verb, size_t length)
+{
+	uint32_t h = HASH_SEED;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		h ^= static_cast<uint32_t>(static_cast<unsigned char>(verb[i]) & 0xDF);
+		h *= 16777619u;
+	}
+	return h >> 8;
+}
+
+bool Command::buildIndex()
+{
+	for (size_t slot = 0; slot < COMMAND_SLOTS; ++slot)
+		index[slot] = -1;
+	for (size_t i = 0; i < specCount; ++i)
+	{
+		size_t slot = hash(specs[i].name, std::strlen(specs[i].name)) & (COMMAND_SLOTS - 1);
+		while (index[slot] >= 0)
+		{
+			Logger::log(LOG_DEBUG, "command.hash_collision", "verb=%s", specs[i].name);
+			slot = (slot + 1) & (COMMAND_SLOTS - 1);
+		}
+		index[slot] = static_cast<short>(i);
+	}
+	return true;
+}
+
+/**
+ * @brief Finds the table entry for a verb, ignoring case.
+ *
+ * @return The entry, or NULL for an unknown verb.
+ */
+Command::Spec const* Command::lookup(char const* verb, size_t length)
+{
+	static bool built = buildIndex();
+	(void)built;
+
+	size_t slot = hash(verb, length) & (COMMAND_SLOTS - 1);
+	while (index[slot] >= 0)
+	{
+		Spec const& spec = specs[index[slot]];
+		if (std::strlen(spec.name) == length && strncasecmp(spec.name, verb, length) == 0)
+			return &spec;
+		slot = (slot + 1) & (COMMAND_SLOTS - 1);
+	}
+	return NULL;
+}
+
+size_t Command::verbCount()
+{
+	return specCount;
+}
+
+char const* Command::verbName(size_t index)
+{
+	return index < specCount ? specs[index].name : NULL;
+}
+
+/**
+ * @brief Replaces SERVER_NAME, e.g. with the [server] name of the
+ * config file. Called once at startup before any reactor runs.
+ */
+void Command::setServerName(std::string const& name)
+{
+	_serverName = name;
+}
+
+std::string const& Command::serverName()
+{
+	return _serverName;
+}
+
+/**
+ * @brief Sends a numeric reply, ":ircserv <code> <nick> <params>".
+ */
+void Command::reply(Client* client, char const* code, std::string const& params)
+{
+	std::string target = client->getNickname();
+	if (target.empty())
+		target = "*";
+	client->sendMessage(":" + _serverName + " " + std::string(code) + " " + target + " " + params + "\r\n");
+}
+
+/**
+ * @brief Parses one framed line and runs the matching command.
+ *
+ * The line is tokenized in place by Message; the verb costs one hash
+ * and one compare, then the table entry's registration and parameter
+ * requirements are enforced before the handler runs.
+ */
+void Command::handleCommand(LineView const &line, Client *client, Server &server)
+{
+	MetricTimer timer(H_COMMAND_NS);
+	Metrics::add(M_LINES_IN);
+	Message msg;
+	if (!msg.parse(line.data, line.size))
+		return;
+	if (client->isLink && client->registered)
+	{
+		server.getNetwork().handle(msg, client);
+		return;
+	}
+
+	Spec const* spec = lookup(msg.data(msg.verb), msg.verb.length);
+	Metrics::countVerb(spec ? static_cast<size_t>(spec - specs) : specCount);
+	if (!spec)
+	{
+		// Numerics from a link that is still registering get no reply,
+		// or two servers could answer each other forever.
+		if (client->isLink)
+			return;
+		if (client->registered)
+			reply(client, "421", msg.str(msg.verb) + " :Unknown command");
+		else
+			reply(client, "451", ":You have not registered");
+		return;
+	}
+	if (spec->needsRegistration && !client->registered)
+	{
+		reply(client, "451", ":You have not registered");
+		return;
+	}
+	if (msg.paramCount < spec->minParams)
+	{
+		reply(client, "461", std::string(spec->name) + " :Not enough parameters");
+		return;
+	}
+	spec->handler(msg, client, server);
+}
+
+/**
+ * @brief Completes registration once PASS, NICK and USER were all seen.
+ *
+ * @throws std::runtime_error if the password was missing or wrong.
+ */
+void Command::welcome(Client* client, Server& server)
+{
+	if (client->registered || client->getNickname().empty() || client->username.empty())
+		return;
+	if (!client->passAccepted)
+	{
+		reply(client, "464", ":Password incorrect");
+		throw std::runtime_error("Password incorrect");
+	}
+	client->registered = true;
+	client->password.clear();
+	reply(client, "001", ":Welcome to the Internet Relay Network " + client->prefix());
+	reply(client, "002", ":Your host is " + _serverName + ", running version 1.0");
+	reply(client, "003", ":This server was created for ft_irc");
+	reply(client, "004", _serverName + " 1.0 o itklo");
+	if (ChannelHistory::enabled())
+	{
+		std::ostringstream isupport;
+		isupport << "CHATHISTORY=" << HISTORY_REPLAY_MAX << " :are supported by this server";
+		reply(client, "005", isupport.str());
+	}
+	reply(client, "422", ":MOTD File is missing");
+	server.getNetwork().introduce(client);
+}
+
+/**
+ * @brief CAP LS lists the CHATHISTORY capabilities while history is
+ * enabled; REQ acknowledges a request made only of those, and applies
+ * all of it or, on NAK, none. Live channel messages carry time and
+ * msgid tags for clients that enabled server-time and message-tags;
+ * CHATHISTORY replies carry them in any case.
+ */
+void Command::cap(Message const& msg, Client* client, Server& server)
+{
+	(void)server;
+	if (msg.paramCount == 0)
+		return;
+	size_t const capCount = ChannelHistory::enabled() ? sizeof(HISTORY_CAPS) / sizeof(HISTORY_CAPS[0]) : 0;
+	if (msg.equals(msg.params[0], "LS"))
+	{
+		std::string caps;
+		for (size_t i = 0; i < capCount; ++i)
+			caps += (i ? " " : "") + std::string(HISTORY_CAPS[i].name);
+		client->sendMessage(":" + _serverName + " CAP * LS :" + caps + "\r\n");
+	}
+	else if (msg.equals(msg.params[0], "REQ"))
+	{
+		std::string requested = msg.param(1);
+		std::istringstream words(requested);
+		std::string word;
+		unsigned caps = client->getCapabilities();
+		bool known = !requested.empty();
+		while (known && words >> word)
+		{
+			bool disable = word[0] == '-';
+			if (disable)
+				word.erase(0, 1);
+			known = false;
+			for (size_t i = 0; i < capCount && !known; ++i)
+			{
+				if (word != HISTORY_CAPS[i].name)
+					continue;
+				known = true;
+				caps = disable ? caps & ~HISTORY_CAPS[i].bit : caps | HISTORY_CAPS[i].bit;
+			}
+		}
+		if (known)
+			client->setCapabilities(caps);
+		client->sendMessage(":" + _serverName + " CAP * " + (known ? "ACK" : "NAK") + " :"
+			+ requested + "\r\n");
+	}
+}
+
+void Command::pass(Message const& msg, Client* client, Server& server)
+{
+	if (client->registered)
+	{
+		reply(client, "462", ":You may not reregister");
+		return;
+	}
+	client->password = msg.param(0);
+	client->passAccepted = server.checkPassword(client->password);
+	// A server's PASS carries its version too; it is checked by SERVER.
+	if (!client->passAccepted && msg.paramCount == 1)
+		reply(client, "464", ":Password incorrect");
+}
+
+void Command::nick(Message const& msg, Client* client, Server& server)
+{
+	if (msg.paramCount == 0 || msg.params[0].length == 0)
+	{
+		reply(client, "431", ":No nickname given");
+		return;
+	}
+	std::string nickname = msg.param(0);
+	if (!isValidNick(nickname))
+	{
+		reply(client, "432", nickname + " :Erroneous nickname");
+		return;
+	}
+	if (ircFold(nickname) != ircFold(client->getNickname()) && !server.claimNick(client, nickname))
+	{
+		reply(client, "433", nickname + " :Nickname is already in use");
+		return;
+	}
+	if (client->registered)
+	{
+		SharedBuffer line = userLine(client, "NICK", "", nickname);
+		client->sendMessage(line);
+		server.notifyPeers(client, line);
+		server.getNetwork().propagate(line, NULL);
+	}
+	client->setNickname(nickname);
+	welcome(client, server);
+}
+
+void Command::user(Message const& msg, Client* client, Server& server)
+{
+	(void)server;
+	if (client->registered)
+	{
+		reply(client, "462", ":You may not reregister");
+		return;
+	}
+	client->username = msg.param(0);
+	client->realname = msg.param(3);
+	welcome(client, server);
+}
+
+void Command::ping(Message const& msg, Client* client, Server& server)
+{
+	(void)server;
+	client->sendMessage(":" + _serverName + " PONG " + _serverName + " :" + msg.param(0) + "\r\n");
+}
+
+void Command::pong(Message const& msg, Client* client, Server& server)
+{
+	(void)msg;
+	(void)client;
+	(void)server;
+}
+
+/**
+ * @throws std::runtime_error always; the reactor drops the client and
+ * announces the quit to its channels with this reason.
+ */
+void Command::quit(Message const& msg, Client* client, Server& server)
+{
+	(void)server;
+	std::string reason = "Quit: " + (msg.paramCount > 0 ? msg.param(msg.paramCount - 1) : client->getNickname());
+	client->sendMessage("ERROR :Closing Link: " + client->hostname + " (" + reason + ")\r\n");
+	throw std::runtime_error(reason);
+}
+
+void Command::join(Message const& msg, Client* client, Server& server)
+{
+	if (msg.equals(msg.params[0], "0"))
+	{
+		std::vector<Channel*> joined = client->getChannels();
+		for (std::vector<Channel*>::iterator it = joined.begin(); it != joined.end(); ++it)
+		{
+			server.getNetwork().announce(*it, userLine(client, "PART", (*it)->name, client->getNickname()), NULL);
+			server.leaveChannel(*it, client);
+		}
+		return;
+	}
+	std::vector<std::string> names = splitList(msg.param(0));
+	std::vector<std::string> keys = splitList(msg.param(1));
+
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		if (!isChannelName(names[i]))
+		{
+			reply(client, "403", names[i] + " :No such channel");
+			continue;
+		}
+		Channel* channel;
+		int err;
+		do
+		{
+			channel = server.joinChannel(names[i]);
+			err = channel->join(client, i < keys.size() ? keys[i] : "");
+		} while (err == -2);
+		if (err == 473)
+			reply(client, "473", names[i] + " :Cannot join channel (+i)");
+		else if (err == 475)
+			reply(client, "475", names[i] + " :Cannot join channel (+k)");
+		else if (err == 471)
+			reply(client, "471", names[i] + " :Cannot join channel (+l)");
+		if (err != 0)
+			continue;
+		server.getNetwork().announce(channel, userLine(client, "JOIN", channel->name), NULL);
+		std::string topic = channel->getTopic();
+		if (!topic.empty())
+			reply(client, "332", channel->name + " :" + topic);
+		reply(client, "353", "= " + channel->name + " :" + channel->namesList());
+		reply(client, "366", channel->name + " :End of /NAMES list");
+	}
+}
+
+void Command::part(Message const& msg, Client* client, Server& server)
+{
+	std::vector<std::string> names = splitList(msg.param(0));
+	std::string reason = msg.paramCount > 1 ? msg.param(1) : client->getNickname();
+
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		Channel* channel = server.findChannel(names[i]);
+		if (!channel)
+		{
+			reply(client, "403", names[i] + " :No such channel");
+			continue;
+		}
+		if (!channel->isMember(client))
+		{
+			reply(client, "442", names[i] + " :You're not on that channel");
+			continue;
+		}
+		server.getNetwork().announce(channel, userLine(client, "PART", channel->name, reason), NULL);
+		server.leaveChannel(channel, client);
+	}
+}
+
+/**
+ * @brief Shared body of PRIVMSG and NOTICE. NOTICE never generates
+ * error replies.
+ */
+static void deliver(Message const& msg, Client* client, Server& server, char const* verb, bool isNotice)
+{
+	if (msg.paramCount == 0)
+	{
+		if (!isNotice)
+			Command::reply(client, "411", std::string(":No recipient given (") + verb + ")");
+		return;
+	}
+	if (msg.paramCount < 2 || msg.params[msg.paramCount - 1].length == 0)
+	{
+		if (!isNotice)
+			Command::reply(client, "412", ":No text to send");
+		return;
+	}
+	Token const& text = msg.params[msg.paramCount - 1];
+	std::vector<std::string> targets = splitList(msg.param(0));
+
+	for (size_t i = 0; i < targets.size(); ++i)
+	{
+		if (!isChannelName(targets[i]))
+		{
+			ClientRef target = server.findClient(targets[i]);
+			if (!target.get() || !target->registered)
+			{
+				if (!isNotice)
+					Command::reply(client, "401", targets[i] + " :No such nick/channel");
+				continue;
+			}
+			target->sendMessage(userLine(client, verb, target->getNickname(), msg.data(text), text.length));
+			continue;
+		}
+		Channel* channel = server.findChannel(targets[i]);
+		if (!channel)
+		{
+			if (!isNotice)
+				Command::reply(client, "401", targets[i] + " :No such nick/channel");
+			continue;
+		}
+		if (!channel->isMember(client))
+		{
+			if (!isNotice)
+				Command::reply(client, "404", targets[i] + " :Cannot send to channel");
+			continue;
+		}
+		// Serialized once; every untagged member queue and the history share it.
+		SharedBuffer line = userLine(client, verb, channel->name, msg.data(text), text.length);
+		HistoryStamp stamp;
+		bool stamped = channel->history.append(line.data(), line.size(), stamp);
+		channel->broadcast(line, client, true, stamped ? &stamp : NULL);
+	}
+}
+
+void Command::privmsg(Message const& msg, Client* client, Server& server)
+{
+	deliver(msg, client, server, "PRIVMSG", false);
+}
 
-void Command::handleCommand(const std::string &command, Client *client, std::map<std::string, Channel*> &channels)
+void Command::notice(Message const& msg, Client* client, Server& server)
 {
-	std::istringstream iss(command);
-	std::string cmd;
-	iss >> cmd;
+	deliver(msg, client, server, "NOTICE", true);
+}
 
-	if (cmd == "NICK")
+void Command::kick(Message const& msg, Client* client, Server& server)
+{
+	std::string name = msg.param(0);
+	Channel* channel = server.findChannel(name);
+	if (!channel)
+	{
+		reply(client, "403", name + " :No such channel");
+		return;
+	}
+	if (!channel->isMember(client))
 	{
-		iss >> client->nickname;
+		reply(client, "442", name + " :You're not on that channel");
+		return;
 	}
-	else if (cmd == "USER")
+	if (!channel->isOperator(client))
 	{
-		iss >> client->username;
+		reply(client, "482", name + " :You're not channel operator");
+		return;
 	}
-	else if (cmd == "JOIN")
+	std::string comment = msg.paramCount > 2 ? msg.param(2) : client->getNickname();
+	std::vector<std::string> targets = splitList(msg.param(1));
+	for (size_t i = 0; i < targets.size(); ++i)
 	{
-		std::string channelName;
-		iss >> channelName;
-		if (channels.find(channelName) == channels.end())
+		ClientRef target = channel->findMember(targets[i]);
+		if (!target.get())
 		{
-			channels.insert(std::make_pair(channelName, new Channel(channelName)));
+			reply(client, "441", targets[i] + " " + name + " :They aren't on that channel");
+			continue;
 		}
-		channels[channelName]->addMember(client);
-		channels[channelName]->broadcast(client->nickname + " has joined the channel.\n", client);
+		server.getNetwork().announce(channel,
+			userLine(client, "KICK", name + " " + target->getNickname(), comment), NULL);
+		server.leaveChannel(channel, target.get());
+	}
+}
+
+void Command::invite(Message const& msg, Client* client, Server& server)
+{
+	std::string nickname = msg.param(0);
+	std::string name = msg.param(1);
+	Channel* channel = server.findChannel(name);
+	if (!channel)
+	{
+		reply(client, "403", name + " :No such channel");
+		return;
+	}
+	if (!channel->isMember(client))
+	{
+		reply(client, "442", name + " :You're not on that channel");
+		return;
+	}
+	if (channel->inviteOnly && !channel->isOperator(client))
+	{
+		reply(client, "482", name + " :You're not channel operator");
+		return;
+	}
+	ClientRef target = server.findClient(nickname);
+	if (!target.get() || !target->registered)
+	{
+		reply(client, "401", nickname + " :No such nick/channel");
+		return;
+	}
+	if (channel->isMember(target.get()))
+	{
+		reply(client, "443", nickname + " " + name + " :is already on channel");
+		return;
+	}
+	nickname = target->getNickname();
+	channel->invite(nickname);
+	reply(client, "341", nickname + " " + name);
+	target->sendMessage(userLine(client, "INVITE", nickname, channel->name));
+}
+
+void Command::topic(Message const& msg, Client* client, Server& server)
+{
+	std::string name = msg.param(0);
+	Channel* channel = server.findChannel(name);
+	if (!channel)
+	{
+		reply(client, "403", name + " :No such channel");
+		return;
+	}
+	if (!channel->isMember(client))
+	{
+		reply(client, "442", name + " :You're not on that channel");
+		return;
+	}
+	if (msg.paramCount == 1)
+	{
+		std::string topic = channel->getTopic();
+		if (topic.empty())
+			reply(client, "331", name + " :No topic is set");
+		else
+			reply(client, "332", name + " :" + topic);
+		return;
+	}
+	if (channel->topicRestricted && !channel->isOperator(client))
+	{
+		reply(client, "482", name + " :You're not channel operator");
+		return;
+	}
+	std::string topic = msg.param(1);
+	channel->setTopic(topic);
+	server.getNetwork().announce(channel, userLine(client, "TOPIC", name, topic), NULL);
+}
+
+/**
+ * @brief MODE for channels (+i +t +k +l +o). User modes are accepted
+ * for the sender's own nick and otherwise refused.
+ */
+void Command::mode(Message const& msg, Client* client, Server& server)
+{
+	std::string target = msg.param(0);
+	if (!isChannelName(target))
+	{
+		if (ircFold(target) != ircFold(client->getNickname()))
+			reply(client, "502", ":Cant change mode for other users");
+		else if (msg.paramCount == 1)
+			reply(client, "221", "+");
+		return;
 	}
-	else if (cmd == "PRIVMSG")
+	Channel* channel = server.findChannel(target);
+	if (!channel)
 	{
-		std::string target, message;
-		iss >> target;
-		std::getline(iss, message);
-		if (channels.find(target) != channels.end())
+		reply(client, "403", target + " :No such channel");
+		return;
+	}
+	if (msg.paramCount == 1)
+	{
+		reply(client, "324", target + " " + channel->modeString(channel->isMember(client)));
+		return;
+	}
+	if (!channel->isOperator(client))
+	{
+		reply(client, "482", target + " :You're not channel operator");
+		return;
+	}
+
+	std::string modes = msg.param(1);
+	size_t argIndex = 2;
+	bool enable = true;
+	char appliedSign = '\0';
+	std::string applied;
+	std::string appliedArgs;
+	for (size_t i = 0; i < modes.size(); ++i)
+	{
+		char c = modes[i];
+		if (c == '+' || c == '-')
+		{
+			enable = (c == '+');
+			continue;
+		}
+		std::string arg;
+		ClientRef member;
+		bool takesArg = (c == 'o') || (enable && (c == 'k' || c == 'l'));
+		if (c != 'i' && c != 't' && c != 'k' && c != 'l' && c != 'o')
 		{
-			channels[target]->broadcast(client->nickname + ": " + message + "\n", client);
+			reply(client, "472", std::string(1, c) + " :is unknown mode char to me");
+			continue;
 		}
+		if (takesArg)
+		{
+			if (argIndex >= msg.paramCount)
+			{
+				reply(client, "461", "MODE :Not enough parameters");
+				continue;
+			}
+			arg = msg.param(argIndex++);
+		}
+		else if (c == 'k' && argIndex < msg.paramCount)
+			++argIndex;
+		if (c == 'o')
+		{
+			member = channel->findMember(arg);
+			if (!member.get())
+			{
+				reply(client, "441", arg + " " + target + " :They aren't on that channel");
+				continue;
+			}
+		}
+		if (!channel->setMode(c, enable, arg, member.get()))
+			continue;
+		if (appliedSign != (enable ? '+' : '-'))
+		{
+			appliedSign = enable ? '+' : '-';
+			applied += appliedSign;
+		}
+		applied += c;
+		if (takesArg)
+			appliedArgs += " " + (member.get() ? member->getNickname() : arg);
+	}
+	if (!applied.empty())
+		server.getNetwork().announce(channel,
+			userLine(client, "MODE", target + " " + applied + appliedArgs), NULL);
+}
+
+void Command::who(Message const& msg, Client* client, Server& server)
+{
+	std::string mask = msg.paramCount > 0 ? msg.param(0) : "*";
+	Channel* channel = isChannelName(mask) ? server.findChannel(mask) : NULL;
+	if (channel)
+	{
+		MemberSnapshot members = channel->getMembers();
+		for (MemberSnapshot::const_iterator it = members.begin(); it != members.end(); ++it)
+		{
+			Client* member = *it;
+			std::string flags = channel->isOperator(member) ? "H@" : "H";
+			std::string const& home = member->server.empty() ? _serverName : member->server;
+			reply(client, "352", mask + " " + member->username + " " + member->hostname + " "
+				+ home + " " + member->getNickname() + " " + flags + " :0 " + member->realname);
+		}
+	}
+	reply(client, "315", mask + " :End of WHO list");
+}
+
+void Command::names(Message const& msg, Client* client, Server& server)
+{
+	if (msg.paramCount == 0)
+	{
+		reply(client, "366", "* :End of /NAMES list");
+		return;
+	}
+	std::vector<std::string> names = splitList(msg.param(0));
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		Channel* channel = server.findChannel(names[i]);
+		if (channel)
+			reply(client, "353", "= " + names[i] + " :" + channel->namesList());
+		reply(client, "366", names[i] + " :End of /NAMES list");
+	}
+}
+
+void Command::whois(Message const& msg, Client* client, Server& server)
+{
+	std::string nickname = msg.param(msg.paramCount - 1);
+	ClientRef target = server.findClient(nickname);
+	if (!target.get() || !target->registered)
+	{
+		reply(client, "401", nickname + " :No such nick/channel");
+		reply(client, "318", nickname + " :End of /WHOIS list");
+		return;
+	}
+	nickname = target->getNickname();
+	reply(client, "311", nickname + " " + target->username + " "
+		+ target->hostname + " * :" + target->realname);
+
+	std::string list;
+	std::vector<Channel*> channels = target->getChannels();
+	for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		if (!list.empty())
+			list += " ";
+		if ((*it)->isOperator(target.get()))
+			list += "@";
+		list += (*it)->name;
+	}
+	if (!list.empty())
+		reply(client, "319", nickname + " :" + list);
+	if (target->server.empty())
+		reply(client, "312", nickname + " " + _serverName + " :"
+			+ server.getNetwork().description());
+	else
+		reply(client, "312", nickname + " " + target->server + " :remote server");
+	if (target->isOperator)
+		reply(client, "313", nickname + " :is an IRC operator");
+	reply(client, "318", nickname + " :End of /WHOIS list");
+}
+
+void Command::oper(Message const& msg, Client* client, Server& server)
+{
+	if (!server.checkOperPassword(msg.param(1)))
+	{
+		reply(client, "464", ":Password incorrect");
+		return;
+	}
+	client->isOperator = true;
+	reply(client, "381", ":You are now an IRC operator");
+}
+
+/**
+ * @brief Disconnects a user by nick. The victim may live on another
+ * reactor, so it is only told to close; its own reactor tears it down.
+ * A user of another server is killed there (Network::killUser).
+ */
+void Command::kill(Message const& msg, Client* client, Server& server)
+{
+	if (!client->isOperator)
+	{
+		reply(client, "481", ":Permission Denied- You're not an IRC operator");
+		return;
+	}
+	std::string nickname = msg.param(0);
+	ClientRef target = server.findClient(nickname);
+	if (!target.get())
+	{
+		reply(client, "401", nickname + " :No such nick/channel");
+		return;
+	}
+	server.getNetwork().killUser(target.get(), client->getNickname(), msg.param(1));
+}
+
+/**
+ * @brief UPGRADE: replaces the running binary without dropping anyone.
+ * The handoff itself runs on the first reactor.
+ */
+void Command::upgrade(Message const& msg, Client* client, Server& server)
+{
+	(void)msg;
+	if (!client->isOperator)
+	{
+		reply(client, "481", ":Permission Denied- You're not an IRC operator");
+		return;
+	}
+	client->sendMessage(":" + _serverName + " NOTICE " + client->getNickname() + " :Upgrading\r\n");
+	server.requestUpgrade();
+}
+
+/**
+ * @brief SERVER from a connection that has not registered: another
+ * server linking in, or answering our own connection. See Network.
+ */
+void Command::server(Message const& msg, Client* client, Server& server)
+{
+	if (client->registered)
+	{
+		reply(client, "462", ":You may not reregister");
+		return;
+	}
+	server.getNetwork().accept(msg, client);
+}
+
+/**
+ * @brief LINKS: every server of the network, this one first.
+ */
+void Command::links(Message const& msg, Client* client, Server& server)
+{
+	(void)msg;
+	std::vector<std::string> lines;
+	server.getNetwork().list(lines);
+	for (size_t i = 0; i < lines.size(); ++i)
+		reply(client, "364", lines[i]);
+	reply(client, "365", "* :End of /LINKS list");
+}
+
+/**
+ * @brief CHATHISTORY LATEST|BEFORE|AFTER|AROUND|BETWEEN of a channel
+ * the client is in, replayed as one chathistory batch of tagged lines,
+ * and CHATHISTORY TARGETS, the client's channels with messages between
+ * two times. Limits above HISTORY_REPLAY_MAX are lowered to it.
+ */
+void Command::chathistory(Message const& msg, Client* client, Server& server)
+{
+	std::string sub = msg.param(0);
+	for (size_t i = 0; i < sub.size(); ++i)
+		sub[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(sub[i])));
+	bool twoRefs = sub == "BETWEEN" || sub == "TARGETS";
+	if (sub != "LATEST" && sub != "BEFORE" && sub != "AFTER" && sub != "AROUND" && !twoRefs)
+	{
+		fail(client, "UNKNOWN_COMMAND", sub.empty() ? "*" : sub, "Unknown command");
+		return;
+	}
+	size_t const needed = sub == "TARGETS" ? 4 : twoRefs ? 5 : 4;
+	if (msg.paramCount < needed)
+	{
+		fail(client, "NEED_MORE_PARAMS", sub, "Missing parameters");
+		return;
+	}
+	size_t limit;
+	HistoryRef first;
+	HistoryRef second;
+	size_t refAt = sub == "TARGETS" ? 1 : 2;
+	if (!parseLimit(msg.param(needed - 1), limit) || !HistoryRef::parse(msg.param(refAt), first)
+		|| (twoRefs && !HistoryRef::parse(msg.param(refAt + 1), second))
+		|| (first.kind == HistoryRef::NONE && sub != "LATEST")
+		|| (twoRefs && second.kind == HistoryRef::NONE))
+	{
+		fail(client, "INVALID_PARAMS", sub, "Invalid parameters");
+		return;
+	}
+	if (sub == "TARGETS")
+	{
+		if (first.kind != HistoryRef::TIME || second.kind != HistoryRef::TIME)
+		{
+			fail(client, "INVALID_PARAMS", sub, "Invalid parameters");
+			return;
+		}
+		uint64_t low = std::min(first.value, second.value);
+		uint64_t high = std::max(first.value, second.value);
+		std::vector<Channel*> channels = client->getChannels();
+		std::string batch = nextBatch();
+		std::string lines = ":" + _serverName + " BATCH +" + batch + " draft/chathistory-targets\r\n";
+		size_t sent = 0;
+		for (size_t i = 0; i < channels.size() && sent < limit; ++i)
+		{
+			uint64_t time = channels[i]->history.lastTime();
+			if (time <= low || time >= high)
+				continue;
+			lines += "@batch=" + batch + " :" + _serverName + " CHATHISTORY TARGETS " + channels[i]->name
+				+ " " + ChannelHistory::formatTime(time) + "\r\n";
+			++sent;
+		}
+		client->sendMessage(lines + ":" + _serverName + " BATCH -" + batch + "\r\n");
+		return;
+	}
+
+	std::string target = msg.param(1);
+	Channel* channel = isChannelName(target) ? server.findChannel(target) : NULL;
+	if (!channel || !channel->isMember(client))
+	{
+		fail(client, "INVALID_TARGET", sub + " " + target, "Messages could not be retrieved");
+		return;
+	}
+	std::vector<HistoryLine> found;
+	if (sub == "LATEST")
+		channel->history.query(first, HistoryRef(), limit, false, found);
+	else if (sub == "BEFORE")
+		channel->history.query(HistoryRef(), first, limit, false, found);
+	else if (sub == "AFTER")
+		channel->history.query(first, HistoryRef(), limit, true, found);
+	else if (sub == "AROUND")
+	{
+		channel->history.query(HistoryRef(), first, limit / 2, false, found);
+		HistoryRef from(first.kind, first.value ? first.value - 1 : 0);
+		channel->history.query(from, HistoryRef(), limit - found.size(), true, found);
+	}
+	else if (first.kind != second.kind)
+	{
+		fail(client, "INVALID_PARAMS", sub, "Invalid parameters");
+		return;
+	}
+	else if (first.value < second.value)
+		channel->history.query(first, second, limit, true, found);
+	else
+		channel->history.query(second, first, limit, false, found);
+
+	std::string batch = nextBatch();
+	std::string lines = ":" + _serverName + " BATCH +" + batch + " chathistory " + channel->name + "\r\n";
+	for (size_t i = 0; i < found.size(); ++i)
+		lines += "@batch=" + batch + ";time=" + ChannelHistory::formatTime(found[i].time) + ";msgid="
+			+ ChannelHistory::formatId(found[i].id) + " " + found[i].text + "\r\n";
+	client->sendMessage(lines + ":" + _serverName + " BATCH -" + batch + "\r\n");
+	Metrics::add(M_HISTORY_REPLAYED, static_cast<int64_t>(found.size()));
+}
+
+/**
+ * @brief STATS z: occupancy of every slab pool, one 249 line each.
+ * STATS m: merged counters and latency quantiles.
+ */
+void Command::stats(Message const& msg, Client* client, Server& server)
+{
+	(void)server;
+	std::string query = msg.paramCount ? msg.param(0) : "";
+	if (query == "z")
+	{
+		std::vector<PoolStats> pools;
+		SlabPool::collect(pools);
+		for (size_t i = 0; i < pools.size(); ++i)
+		{
+			std::ostringstream line;
+			line << "z :" << pools[i].name << " size=" << pools[i].objectSize
+				<< " inuse=" << pools[i].inUse << "/" << pools[i].capacity
+				<< " cached=" << pools[i].cached
+				<< " peak=" << pools[i].peak << " slabs=" << pools[i].slabs
+				<< " allocs=" << pools[i].allocations
+				<< " recycled=" << pools[i].recycled;
+			reply(client, "249", line.str());
+		}
+	}
+	else if (query == "m")
+	{
+		std::vector<std::string> lines;
+		Metrics::statsLines(lines);
+		for (size_t i = 0; i < lines.size(); ++i)
+			reply(client, "249", "m :" + lines[i]);
 	}
-}
\ No newline at end of file
+	reply(client, "219", (query.empty() ? "*" : query) + " :End of /STATS report");
+}
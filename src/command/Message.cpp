@@ -0,0 +1,135 @@
+#include "Message.hpp"
+#include <cstring>
+
+namespace
+{
+	Token makeToken(size_t offset, size_t length)
+	{
+		Token token;
+		token.offset = static_cast<uint32_t>(offset);
+		token.length = static_cast<uint32_t>(length);
+		return token;
+	}
+
+	size_t skipSpaces(char const* data, size_t pos, size_t length)
+	{
+		while (pos < length && data[pos] == ' ')
+			++pos;
+		return pos;
+	}
+
+	size_t findSpace(char const* data, size_t pos, size_t length)
+	{
+		char const* sp = static_cast<char const*>(std::memchr(data + pos, ' ', length - pos));
+		return sp ? static_cast<size_t>(sp - data) : length;
+	}
+
+	char lower(char c)
+	{
+		return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+	}
+}
+
+Message::Message() : line(NULL), paramCount(0), hasTrailing(false)
+{
+	tags = prefix = verb = makeToken(0, 0);
+}
+
+/**
+ * @brief Tokenizes one line (without CRLF).
+ *
+ * @param data Start of the line; referenced, not copied.
+ * @param length Line length in bytes.
+ * @return false if the line has no verb.
+ */
+bool Message::parse(char const* data, size_t length)
+{
+	size_t pos = 0;
+	size_t end;
+
+	line = data;
+	paramCount = 0;
+	hasTrailing = false;
+	tags = prefix = verb = makeToken(0, 0);
+
+	if (pos < length && data[pos] == '@')
+	{
+		end = findSpace(data, pos, length);
+		tags = makeToken(pos + 1, end - pos - 1);
+		pos = skipSpaces(data, end, length);
+	}
+	if (pos < length && data[pos] == ':')
+	{
+		end = findSpace(data, pos, length);
+		prefix = makeToken(pos + 1, end - pos - 1);
+		pos = skipSpaces(data, end, length);
+	}
+	end = findSpace(data, pos, length);
+	if (end == pos)
+		return false;
+	verb = makeToken(pos, end - pos);
+	pos = end;
+
+	while (true)
+	{
+		pos = skipSpaces(data, pos, length);
+		if (pos >= length)
+			break;
+		if (data[pos] == ':' || paramCount == MAX_MIDDLE)
+		{
+			if (data[pos] == ':')
+				++pos;
+			params[paramCount++] = makeToken(pos, length - pos);
+			hasTrailing = true;
+			break;
+		}
+		end = findSpace(data, pos, length);
+		params[paramCount++] = makeToken(pos, end - pos);
+		pos = end;
+	}
+	return true;
+}
+
+char const* Message::data(Token const& token) const
+{
+	return line + token.offset;
+}
+
+std::string Message::str(Token const& token) const
+{
+	return std::string(line + token.offset, token.length);
+}
+
+/**
+ * @brief Copies one parameter out, or returns "" if it is missing.
+ */
+std::string Message::param(size_t index) const
+{
+	if (index >= paramCount)
+		return std::string();
+	return str(params[index]);
+}
+
+/**
+ * @brief Case-insensitive comparison of the verb with an upper-case name.
+ */
+bool Message::verbIs(char const* name) const
+{
+	return equals(verb, name);
+}
+
+/**
+ * @brief ASCII case-insensitive comparison of a token with a C string.
+ */
+bool Message::equals(Token const& token, char const* str) const
+{
+	char const* p = line + token.offset;
+	size_t i = 0;
+
+	for (; i < token.length; ++i)
+	{
+		if (str[i] == '\0' || lower(p[i]) != lower(str[i]))
+			return false;
+	}
+	return str[i] == '\0';
+}
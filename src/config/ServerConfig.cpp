@@ -0,0 +1,244 @@
+#include "ServerConfig.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cctype>
+
+ListenerSpec::ListenerSpec(int port)
+	: address(LISTEN_ADDRESS), port(port), backlog(LISTEN_BACKLOG), v6Only(-1), noDelay(false),
+	sendBuffer(0), receiveBuffer(0), deferAccept(0), keepIdle(0), keepInterval(0), keepCount(0),
+	userTimeout(0)
+{
+}
+
+/**
+ * @brief The address and port as one would type them, brackets around
+ * IPv6, for logs.
+ */
+std::string ListenerSpec::describe() const
+{
+	std::stringstream ss;
+	if (address.find(':') != std::string::npos)
+		ss << "[" << address << "]:" << port;
+	else
+		ss << address << ":" << port;
+	return ss.str();
+}
+
+LinkSpec::LinkSpec() : address(LISTEN_ADDRESS), port(0), autoconnect(false)
+{
+}
+
+namespace
+{
+	enum Section
+	{
+		SECTION_NONE,
+		SECTION_SERVER,
+		SECTION_LISTENER,
+		SECTION_LINK
+	};
+
+	std::string trim(std::string const& text)
+	{
+		std::string::size_type start = text.find_first_not_of(" \t\r");
+		if (start == std::string::npos)
+			return "";
+		std::string::size_type end = text.find_last_not_of(" \t\r");
+		return text.substr(start, end - start + 1);
+	}
+
+	bool parseInt(std::string const& text, int min, int max, int& value)
+	{
+		std::stringstream ss(text);
+		long parsed;
+		if (!(ss >> parsed) || !ss.eof() || parsed < min || parsed > max)
+			return false;
+		value = static_cast<int>(parsed);
+		return true;
+	}
+
+	bool parseFlag(std::string const& text, bool& value)
+	{
+		if (text == "yes" || text == "on" || text == "true" || text == "1")
+			value = true;
+		else if (text == "no" || text == "off" || text == "false" || text == "0")
+			value = false;
+		else
+			return false;
+		return true;
+	}
+
+	bool parseKeepalive(std::string const& text, ListenerSpec& spec)
+	{
+		bool enabled;
+		if (parseFlag(text, enabled))
+		{
+			spec.keepIdle = enabled ? 7200 : 0;
+			return true;
+		}
+		std::stringstream ss(text);
+		std::string idle, interval, count;
+		if (!(ss >> idle >> interval >> count) || !(ss >> std::ws).eof())
+			return false;
+		return parseInt(idle, 1, 32767, spec.keepIdle) && parseInt(interval, 1, 32767, spec.keepInterval)
+			&& parseInt(count, 1, 127, spec.keepCount);
+	}
+
+	/* Server names travel as a single token in prefixes and SERVER
+	 * lines. */
+	bool isServerName(std::string const& name)
+	{
+		if (name.empty() || name.size() > 63)
+			return false;
+		for (size_t i = 0; i < name.size(); ++i)
+		{
+			unsigned char c = static_cast<unsigned char>(name[i]);
+			if (!std::isalnum(c) && c != '.' && c != '-' && c != '_')
+				return false;
+		}
+		return true;
+	}
+
+	bool applyServer(ServerConfig& config, std::string const& key, std::string const& value)
+	{
+		if (key == "name" && isServerName(value))
+			config.name = value;
+		else if (key == "description")
+			config.description = value;
+		else
+			return false;
+		return true;
+	}
+
+	bool applyLink(LinkSpec& spec, std::string const& key, std::string const& value)
+	{
+		if (key == "name" && isServerName(value))
+			spec.name = value;
+		else if (key == "address")
+			spec.address = value;
+		else if (key == "port")
+			return parseInt(value, 1, 65535, spec.port);
+		else if (key == "password" && !value.empty() && value.find(' ') == std::string::npos)
+			spec.password = value;
+		else if (key == "autoconnect")
+			return parseFlag(value, spec.autoconnect);
+		else
+			return false;
+		return true;
+	}
+
+	bool applyListener(ListenerSpec& spec, std::string const& key, std::string const& value)
+	{
+		int const bytes = 1 << 30;
+		if (key == "address")
+			spec.address = value;
+		else if (key == "port")
+			return parseInt(value, 1, 65535, spec.port);
+		else if (key == "backlog")
+			return parseInt(value, 1, 1 << 20, spec.backlog);
+		else if (key == "v6only")
+		{
+			bool only;
+			if (!parseFlag(value, only))
+				return false;
+			spec.v6Only = only;
+		}
+		else if (key == "nodelay")
+			return parseFlag(value, spec.noDelay);
+		else if (key == "sndbuf")
+			return parseInt(value, 0, bytes, spec.sendBuffer);
+		else if (key == "rcvbuf")
+			return parseInt(value, 0, bytes, spec.receiveBuffer);
+		else if (key == "defer_accept")
+			return parseInt(value, 0, 3600, spec.deferAccept);
+		else if (key == "keepalive")
+			return parseKeepalive(value, spec);
+		else if (key == "user_timeout")
+			return parseInt(value, 0, 24 * 3600 * 1000, spec.userTimeout);
+		else
+			return false;
+		return true;
+	}
+}
+
+/**
+ * @brief Parses the [server], [listener] and [link] sections of the
+ * file.
+ *
+ * @throws std::runtime_error with file and line on any error, or if a
+ * listener or link lacks a required key.
+ */
+ServerConfig ServerConfig::load(std::string const& path)
+{
+	std::ifstream file(path.c_str());
+	if (!file)
+		throw std::runtime_error("Can't open config " + path);
+
+	ServerConfig config;
+	Section section = SECTION_NONE;
+	bool seenServer = false;
+	std::string line;
+	size_t number = 0;
+	while (std::getline(file, line))
+	{
+		++number;
+		std::stringstream where;
+		where << path << ":" << number << ": ";
+		std::string::size_type comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+		line = trim(line);
+		if (line.empty())
+			continue;
+		if (line == "[server]")
+		{
+			if (seenServer)
+				throw std::runtime_error(where.str() + "duplicate [server] section");
+			seenServer = true;
+			section = SECTION_SERVER;
+			continue;
+		}
+		if (line == "[listener]")
+		{
+			config.listeners.push_back(ListenerSpec());
+			section = SECTION_LISTENER;
+			continue;
+		}
+		if (line == "[link]")
+		{
+			config.links.push_back(LinkSpec());
+			section = SECTION_LINK;
+			continue;
+		}
+		std::string::size_type equals = line.find('=');
+		if (equals == std::string::npos)
+			throw std::runtime_error(where.str() + "expected a [section] or key = value");
+		if (section == SECTION_NONE)
+			throw std::runtime_error(where.str() + "option outside a section");
+		std::string key = trim(line.substr(0, equals));
+		std::string value = trim(line.substr(equals + 1));
+		bool valid;
+		if (section == SECTION_SERVER)
+			valid = applyServer(config, key, value);
+		else if (section == SECTION_LISTENER)
+			valid = applyListener(config.listeners.back(), key, value);
+		else
+			valid = applyLink(config.links.back(), key, value);
+		if (!valid)
+			throw std::runtime_error(where.str() + "invalid " + key + " \"" + value + "\"");
+	}
+	for (size_t i = 0; i < config.listeners.size(); ++i)
+	{
+		if (config.listeners[i].port == 0)
+			throw std::runtime_error(path + ": listener " + config.listeners[i].address + " has no port");
+	}
+	for (size_t i = 0; i < config.links.size(); ++i)
+	{
+		LinkSpec const& link = config.links[i];
+		if (link.name.empty() || link.port == 0 || link.password.empty())
+			throw std::runtime_error(path + ": link " + (link.name.empty() ? link.address : link.name)
+				+ " needs a name, port and password");
+	}
+	return config;
+}
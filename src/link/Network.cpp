@@ -0,0 +1,1010 @@
+#include "Network.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "Command.hpp"
+#include "Reactor.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+Network::Spec const Network::specs[] = {
+	{ "PRIVMSG", &Network::privmsg, 2, true },
+	{ "NOTICE",  &Network::privmsg, 2, true },
+	{ "JOIN",    &Network::join,    1, true },
+	{ "PART",    &Network::part,    1, true },
+	{ "QUIT",    &Network::quit,    0, true },
+	{ "NICK",    &Network::nick,    1, false },
+	{ "NJOIN",   &Network::njoin,   2, false },
+	{ "MODE",    &Network::mode,    2, false },
+	{ "TOPIC",   &Network::topic,   2, false },
+	{ "KICK",    &Network::kick,    2, false },
+	{ "INVITE",  &Network::invite,  2, true },
+	{ "KILL",    &Network::kill,    2, false },
+	{ "SERVER",  &Network::server,  3, false },
+	{ "SQUIT",   &Network::squit,   1, false },
+	{ "PING",    &Network::ping,    1, false },
+	{ "PONG",    &Network::pong,    0, false },
+	{ "ERROR",   &Network::error,   0, false }
+};
+
+size_t const Network::specCount = sizeof(Network::specs) / sizeof(Network::specs[0]);
+
+namespace
+{
+	/* Burst output is queued on the link in chunks of about this size. */
+	size_t const BURST_CHUNK = 16384;
+
+	/* Longest NJOIN member list, well under the 512 byte line limit. */
+	size_t const NJOIN_LIST_MAX = 400;
+
+	std::vector<std::string> splitList(std::string const& list)
+	{
+		std::vector<std::string> items;
+		std::string::size_type start = 0;
+		std::string::size_type comma;
+
+		while ((comma = list.find(',', start)) != std::string::npos)
+		{
+			items.push_back(list.substr(start, comma - start));
+			start = comma + 1;
+		}
+		items.push_back(list.substr(start));
+		return items;
+	}
+
+	bool isChannelName(std::string const& name)
+	{
+		return name.size() > 1 && (name[0] == '#' || name[0] == '&');
+	}
+
+	size_t parseHops(std::string const& text)
+	{
+		long hops = std::strtol(text.c_str(), NULL, 10);
+		return hops > 0 ? static_cast<size_t>(hops) : 1;
+	}
+
+	std::string toString(size_t value)
+	{
+		std::stringstream ss;
+		ss << value;
+		return ss.str();
+	}
+
+	struct UserCollector
+	{
+		std::vector<ClientRef> users;
+
+		void operator()(Client* client)
+		{
+			client->retain();
+			users.push_back(ClientRef(client));
+		}
+	};
+
+	struct ByHops
+	{
+		template <typename T>
+		bool operator()(T const& a, T const& b) const
+		{
+			return a.hops < b.hops;
+		}
+	};
+}
+
+Network::Network(Server& server) : _server(server), _description(SERVER_DESCRIPTION)
+{
+	pthread_mutex_init(&_lock, NULL);
+}
+
+/**
+ * @brief Drops the references still held on links and remote users.
+ * Only runs at exit, after every reactor stopped.
+ */
+Network::~Network()
+{
+	for (std::set<Client*>::iterator it = _remote.begin(); it != _remote.end(); ++it)
+		(*it)->release();
+	for (size_t i = 0; i < _peers.size(); ++i)
+		_peers[i]->release();
+	pthread_mutex_destroy(&_lock);
+}
+
+/**
+ * @brief Sets this server's description and the links it accepts.
+ * Called once at startup before any reactor runs.
+ */
+void Network::configure(std::string const& description, std::vector<LinkSpec> const& links)
+{
+	if (!description.empty())
+		_description = description;
+	_links = links;
+}
+
+bool Network::autoconnects() const
+{
+	for (size_t i = 0; i < _links.size(); ++i)
+	{
+		if (_links[i].autoconnect)
+			return true;
+	}
+	return false;
+}
+
+std::string const& Network::description() const
+{
+	return _description;
+}
+
+LinkSpec const* Network::findLink(std::string const& name) const
+{
+	std::string folded = ircFold(name);
+	for (size_t i = 0; i < _links.size(); ++i)
+	{
+		if (ircFold(_links[i].name) == folded)
+			return &_links[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief PASS and SERVER lines that register this server on a link.
+ */
+std::string Network::greeting(LinkSpec const& link) const
+{
+	return "PASS " + link.password + " 0210 IRC|\r\nSERVER " + Command::serverName()
+		+ " 1 :" + _description + "\r\n";
+}
+
+/**
+ * @brief Opens a connection to every autoconnect link that is neither
+ * linked nor already being connected. The connection is non-blocking;
+ * the greeting waits in its queue until the socket is writable, and a
+ * refused connection is dropped like any client, to be retried by the
+ * next call.
+ */
+void Network::connectLinks(Reactor& reactor)
+{
+	for (size_t i = 0; i < _links.size(); ++i)
+	{
+		LinkSpec const& spec = _links[i];
+		std::string folded = ircFold(spec.name);
+		if (!spec.autoconnect)
+			continue;
+		pthread_mutex_lock(&_lock);
+		bool busy = _servers.count(folded) || _connecting.count(folded);
+		if (!busy)
+			_connecting.insert(folded);
+		pthread_mutex_unlock(&_lock);
+		if (busy)
+			continue;
+
+		int fd = -1;
+		try
+		{
+			SockAddressInitializer address(spec.address, spec.port);
+			fd = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd < 0)
+				throw std::runtime_error(std::string("socket: ") + strerror(errno));
+			if (connect(fd, address.getAddress(), address.getLength()) < 0 && errno != EINPROGRESS)
+				throw std::runtime_error(std::string("connect: ") + strerror(errno));
+		}
+		catch (std::exception const& e)
+		{
+			if (fd >= 0)
+				close(fd);
+			pthread_mutex_lock(&_lock);
+			_connecting.erase(folded);
+			pthread_mutex_unlock(&_lock);
+			Logger::log(LOG_WARN, "link.connect_failed", "name=%s address=%s port=%d error=\"%s\"",
+				spec.name.c_str(), spec.address.c_str(), spec.port, e.what());
+			continue;
+		}
+		Client* link = new Client(fd, &reactor);
+		link->isLink = true;
+		link->server = spec.name;
+		link->hostname = spec.address;
+		link->admissionKey = AdmissionTable::keyOf(spec.address);
+		_server.trackConnection(link->admissionKey);
+		Logger::log(LOG_INFO, "link.connecting", "fd=%d name=%s address=%s port=%d",
+			fd, spec.name.c_str(), spec.address.c_str(), spec.port);
+		reactor.adopt(link, greeting(spec));
+	}
+}
+
+/**
+ * @brief SERVER from a connection that has not registered: accepts it
+ * as a link if it names a configured [link] whose password it sent
+ * with PASS, answering with our own greeting when it connected to us.
+ *
+ * @throws std::runtime_error if it is not accepted; the reactor drops
+ * the connection.
+ */
+void Network::accept(Message const& msg, Client* client)
+{
+	std::string name = msg.param(0);
+	LinkSpec const* spec = findLink(name);
+	std::string reason;
+
+	if (!spec || client->password != spec->password)
+		reason = "No such link or bad password";
+	else if (client->isLink && ircFold(client->server) != ircFold(name))
+		reason = "Unexpected server name";
+	else if (ircFold(name) == ircFold(Command::serverName()))
+		reason = "Server name is mine";
+	if (reason.empty())
+	{
+		bool inbound = !client->isLink;
+		client->isLink = true;
+		client->server = spec->name;
+		client->password.clear();
+		if (inbound)
+			client->sendMessage(greeting(*spec));
+		if (!establish(client, msg.param(msg.paramCount - 1)))
+			reason = "Server exists";
+	}
+	if (reason.empty())
+		return;
+	Logger::log(LOG_WARN, "link.refused", "fd=%d name=%s reason=\"%s\"",
+		client->getFd(), name.c_str(), reason.c_str());
+	client->sendMessage("ERROR :Closing Link: " + client->hostname + " (" + reason + ")\r\n");
+	throw std::runtime_error(reason);
+}
+
+/**
+ * @brief Records a registered link, tells the rest of the network and
+ * sends it the burst.
+ *
+ * @return false if a server of that name is already linked.
+ */
+bool Network::establish(Client* link, std::string const& description)
+{
+	std::string folded = ircFold(link->server);
+
+	pthread_mutex_lock(&_lock);
+	if (_servers.count(folded))
+	{
+		pthread_mutex_unlock(&_lock);
+		return false;
+	}
+	Peer peer;
+	peer.name = link->server;
+	peer.uplink = Command::serverName();
+	peer.description = description;
+	peer.hops = 1;
+	peer.route = link;
+	_servers[folded] = peer;
+	_peers.push_back(link);
+	link->retain();
+	_connecting.erase(folded);
+	link->registered = true;
+	pthread_mutex_unlock(&_lock);
+
+	Metrics::add(M_LINKS);
+	Logger::log(LOG_INFO, "link.established", "fd=%d name=%s",
+		link->getFd(), link->server.c_str());
+	propagate(SharedBuffer(":" + Command::serverName() + " SERVER " + link->server + " 2 :"
+		+ description + "\r\n"), link);
+	burst(link);
+	return true;
+}
+
+/**
+ * @brief NICK line introducing a user, with its distance from the
+ * server the line is sent to.
+ */
+std::string Network::introduction(Client* user)
+{
+	size_t hops = 1;
+	std::string server = Command::serverName();
+	if (user->getRoute())
+	{
+		server = user->server;
+		hops = 2;
+		pthread_mutex_lock(&_lock);
+		std::map<std::string, Peer>::iterator it = _servers.find(ircFold(server));
+		if (it != _servers.end())
+			hops = it->second.hops + 1;
+		pthread_mutex_unlock(&_lock);
+	}
+	std::stringstream ss;
+	ss << "NICK " << user->getNickname() << " " << hops << " " << user->username << " "
+		<< user->hostname << " " << server << " + :" << user->realname << "\r\n";
+	return ss.str();
+}
+
+/**
+ * @brief Sends a new link everything not reached through it: servers
+ * nearest first so each uplink is known before what hangs off it, then
+ * users, then channel members, modes and topics.
+ */
+void Network::burst(Client* link)
+{
+	std::string out;
+	std::vector<Peer> known;
+
+	pthread_mutex_lock(&_lock);
+	for (std::map<std::string, Peer>::iterator it = _servers.begin(); it != _servers.end(); ++it)
+	{
+		if (it->second.route != link)
+			known.push_back(it->second);
+	}
+	pthread_mutex_unlock(&_lock);
+	std::stable_sort(known.begin(), known.end(), ByHops());
+	for (size_t i = 0; i < known.size(); ++i)
+		out += ":" + known[i].uplink + " SERVER " + known[i].name + " "
+			+ toString(known[i].hops + 1) + " :" + known[i].description + "\r\n";
+
+	UserCollector collector;
+	_server.collectUsers(collector);
+	for (size_t i = 0; i < collector.users.size(); ++i)
+	{
+		Client* user = collector.users[i].get();
+		if (!user->registered || user->isLink || user->getRoute() == link)
+			continue;
+		out += introduction(user);
+		if (out.size() >= BURST_CHUNK)
+		{
+			link->sendMessage(out);
+			out.clear();
+		}
+	}
+
+	std::vector<Channel*> channels;
+	_server.collectChannels(channels);
+	std::string const prefix = ":" + Command::serverName() + " ";
+	for (size_t i = 0; i < channels.size(); ++i)
+	{
+		Channel* channel = channels[i];
+		MemberSnapshot members = channel->getMembers();
+		std::string list;
+		for (MemberSnapshot::const_iterator it = members.begin(); it != members.end(); ++it)
+		{
+			if ((*it)->getRoute() == link)
+				continue;
+			if (list.size() > NJOIN_LIST_MAX)
+			{
+				out += "NJOIN " + channel->name + " :" + list + "\r\n";
+				list.clear();
+			}
+			if (!list.empty())
+				list += ",";
+			if (channel->isOperator(*it))
+				list += "@";
+			list += (*it)->getNickname();
+		}
+		if (list.empty())
+			continue;
+		out += "NJOIN " + channel->name + " :" + list + "\r\n";
+		std::string modes = channel->modeString();
+		if (modes != "+")
+			out += prefix + "MODE " + channel->name + " " + modes + "\r\n";
+		std::string topic = channel->getTopic();
+		if (!topic.empty())
+			out += prefix + "TOPIC " + channel->name + " :" + topic + "\r\n";
+		if (out.size() >= BURST_CHUNK)
+		{
+			link->sendMessage(out);
+			out.clear();
+		}
+	}
+	if (!out.empty())
+		link->sendMessage(out);
+	Logger::log(LOG_INFO, "link.burst", "name=%s servers=%lu users=%lu channels=%lu",
+		link->server.c_str(), static_cast<unsigned long>(known.size()),
+		static_cast<unsigned long>(collector.users.size()),
+		static_cast<unsigned long>(channels.size()));
+}
+
+/**
+ * @brief Announces a user that just registered here to every link.
+ */
+void Network::introduce(Client* user)
+{
+	propagate(SharedBuffer(introduction(user)), NULL);
+}
+
+/**
+ * @brief Queues a line on every established link but one.
+ */
+void Network::propagate(SharedBuffer const& line, Client* except)
+{
+	size_t sent = 0;
+
+	pthread_mutex_lock(&_lock);
+	for (size_t i = 0; i < _peers.size(); ++i)
+	{
+		if (_peers[i] == except)
+			continue;
+		_peers[i]->sendMessage(line);
+		++sent;
+	}
+	pthread_mutex_unlock(&_lock);
+	if (sent)
+		Metrics::add(M_LINK_DELIVERIES, static_cast<int64_t>(sent));
+}
+
+/**
+ * @brief Channel state change (JOIN, PART, KICK, MODE, TOPIC): shown to
+ * the local members and passed on to every link, members or not, so
+ * every server keeps the whole membership.
+ */
+void Network::announce(Channel* channel, SharedBuffer const& line, Client* except)
+{
+	channel->broadcast(line, NULL, false);
+	propagate(line, except);
+}
+
+/**
+ * @brief Disconnects a user wherever it lives: a local one is told
+ * and closed by its reactor, a remote one is killed by its own server.
+ */
+void Network::killUser(Client* victim, std::string const& source, std::string const& reason)
+{
+	if (Client* route = victim->getRoute())
+	{
+		route->sendMessage(":" + source + " KILL " + victim->getNickname() + " :" + reason + "\r\n");
+		return;
+	}
+	std::string text = "Killed (" + source + " (" + reason + "))";
+	victim->sendMessage("ERROR :Closing Link: " + victim->hostname + " (" + text + ")\r\n");
+	victim->disconnect(text);
+}
+
+/**
+ * @brief LINKS replies: this server, then every known one.
+ */
+void Network::list(std::vector<std::string>& lines)
+{
+	std::string const& me = Command::serverName();
+	lines.push_back(me + " " + me + " :0 " + _description);
+	pthread_mutex_lock(&_lock);
+	for (std::map<std::string, Peer>::iterator it = _servers.begin(); it != _servers.end(); ++it)
+		lines.push_back(it->second.name + " " + it->second.uplink + " :"
+			+ toString(it->second.hops) + " " + it->second.description);
+	pthread_mutex_unlock(&_lock);
+}
+
+/**
+ * @brief Forgets a remote user: its channels see it quit, its nick is
+ * freed and the reference taken when it was introduced is dropped.
+ */
+void Network::remove(Client* user, std::string const& reason)
+{
+	pthread_mutex_lock(&_lock);
+	bool known = _remote.erase(user) > 0;
+	pthread_mutex_unlock(&_lock);
+	if (!known)
+		return;
+	_server.leaveChannels(user, reason);
+	_server.releaseNick(user);
+	user->detach();
+	user->release();
+	Metrics::add(M_REMOTE_USERS, -1);
+}
+
+/**
+ * @brief Removes the remote users reached through link whose server is
+ * in lost, or all of them if lost is empty.
+ */
+void Network::dropRoute(Client* link, std::set<std::string> const& lost, std::string const& reason)
+{
+	std::vector<Client*> gone;
+
+	pthread_mutex_lock(&_lock);
+	for (std::set<Client*>::iterator it = _remote.begin(); it != _remote.end(); ++it)
+	{
+		if ((*it)->getRoute() == link && (lost.empty() || lost.count(ircFold((*it)->server))))
+		{
+			(*it)->retain();
+			gone.push_back(*it);
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+	for (size_t i = 0; i < gone.size(); ++i)
+	{
+		remove(gone[i], reason);
+		gone[i]->release();
+	}
+}
+
+/**
+ * @brief A link went away: everything behind it is removed and the
+ * rest of the network is told with SQUIT. A link that never registered
+ * only frees its name for the next connection attempt.
+ */
+void Network::split(Client* link, std::string const& reason)
+{
+	std::string folded = ircFold(link->server);
+
+	pthread_mutex_lock(&_lock);
+	_connecting.erase(folded);
+	std::vector<Client*>::iterator peer = std::find(_peers.begin(), _peers.end(), link);
+	bool established = peer != _peers.end();
+	if (established)
+	{
+		_peers.erase(peer);
+		std::map<std::string, Peer>::iterator it = _servers.begin();
+		while (it != _servers.end())
+		{
+			if (it->second.route == link)
+				_servers.erase(it++);
+			else
+				++it;
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+	if (!established)
+	{
+		Logger::log(LOG_INFO, "link.failed", "name=%s reason=\"%s\"",
+			link->server.c_str(), reason.c_str());
+		return;
+	}
+
+	dropRoute(link, std::set<std::string>(), Command::serverName() + " " + link->server);
+	propagate(SharedBuffer(":" + Command::serverName() + " SQUIT " + link->server
+		+ " :" + reason + "\r\n"), NULL);
+	Metrics::add(M_LINKS, -1);
+	Metrics::add(M_NETSPLITS);
+	Logger::log(LOG_WARN, "link.split", "name=%s reason=\"%s\"",
+		link->server.c_str(), reason.c_str());
+	link->release();
+}
+
+/**
+ * @brief The line as received, from its verb on, behind the prefix of
+ * its source: the user's full prefix, or the server that sent it.
+ */
+SharedBuffer Network::relay(Message const& msg, Client* link, Client* source) const
+{
+	std::string origin;
+	if (source)
+		origin = source->prefix();
+	else if (msg.prefix.length)
+		origin = msg.str(msg.prefix);
+	else
+		origin = link->server;
+	char const* verb = msg.data(msg.verb);
+	char const* end = verb + msg.verb.length;
+	if (msg.paramCount)
+	{
+		Token const& last = msg.params[msg.paramCount - 1];
+		end = msg.data(last) + last.length;
+	}
+	size_t length = static_cast<size_t>(end - verb);
+	SharedBuffer line(1 + origin.size() + 1 + length + 2);
+	line.append(":", 1).append(origin).append(" ", 1).append(verb, length).append("\r\n", 2);
+	return line;
+}
+
+/**
+ * @brief Runs one line received on a registered link.
+ *
+ * A nick!user@host prefix has to name a user reached through this
+ * link, or the line is dropped; any other prefix is a server.
+ */
+void Network::handle(Message const& msg, Client* link)
+{
+	ClientRef holder;
+	Client* source = NULL;
+	if (msg.prefix.length)
+	{
+		std::string prefix = msg.str(msg.prefix);
+		std::string::size_type bang = prefix.find('!');
+		holder = _server.findClient(prefix.substr(0, bang));
+		source = holder.get();
+		if (source && source->getRoute() != link)
+		{
+			source = NULL;
+			if (bang != std::string::npos)
+			{
+				Logger::log(LOG_DEBUG, "link.wrong_direction", "name=%s source=%s",
+					link->server.c_str(), prefix.c_str());
+				return;
+			}
+		}
+	}
+
+	char const* verb = msg.data(msg.verb);
+	size_t length = msg.verb.length;
+	if (length == 3 && std::isdigit(static_cast<unsigned char>(verb[0]))
+		&& std::isdigit(static_cast<unsigned char>(verb[1]))
+		&& std::isdigit(static_cast<unsigned char>(verb[2])))
+	{
+		numeric(msg, link, source);
+		return;
+	}
+	for (size_t i = 0; i < specCount; ++i)
+	{
+		Spec const& spec = specs[i];
+		if (std::strlen(spec.name) != length || strncasecmp(spec.name, verb, length) != 0)
+			continue;
+		if (msg.paramCount < spec.minParams || (spec.needsUser && !source))
+		{
+			Logger::log(LOG_DEBUG, "link.ignored", "name=%s verb=%s",
+				link->server.c_str(), spec.name);
+			return;
+		}
+		(this->*spec.handler)(msg, link, source);
+		return;
+	}
+	Logger::log(LOG_DEBUG, "link.unknown", "name=%s verb=%.*s",
+		link->server.c_str(), static_cast<int>(length), verb);
+}
+
+void Network::privmsg(Message const& msg, Client* link, Client* source)
+{
+	std::string target = msg.param(0);
+	SharedBuffer line = relay(msg, link, source);
+	if (isChannelName(target))
+	{
+		Channel* channel = _server.findChannel(target);
+		if (channel)
+		{
+			HistoryStamp stamp;
+			bool stamped = channel->history.append(line.data(), line.size(), stamp);
+			channel->broadcast(line, source, true, stamped ? &stamp : NULL);
+		}
+		return;
+	}
+	ClientRef user = _server.findClient(target);
+	if (user.get() && user->getRoute() != link)
+		user->sendMessage(line);
+}
+
+/**
+ * @brief Both kinds of NICK: a user introduction, with seven
+ * parameters, or a nick change by a known user.
+ */
+void Network::nick(Message const& msg, Client* link, Client* source)
+{
+	std::string nickname = msg.param(0);
+	if (msg.paramCount >= 7)
+	{
+		ClientRef holder = _server.findClient(nickname);
+		if (holder.get())
+		{
+			if (holder->getRoute() != link)
+				collide(link, nickname, holder.get());
+			return;
+		}
+		Client* user = new Client(link);
+		user->username = msg.param(2);
+		user->hostname = msg.param(3);
+		user->server = msg.param(4);
+		user->realname = msg.param(6);
+		if (!_server.claimNick(user, nickname))
+		{
+			user->release();
+			holder = _server.findClient(nickname);
+			collide(link, nickname, holder.get());
+			return;
+		}
+		user->setNickname(nickname);
+		pthread_mutex_lock(&_lock);
+		_remote.insert(user);
+		pthread_mutex_unlock(&_lock);
+		Metrics::add(M_REMOTE_USERS);
+		propagate(SharedBuffer(introduction(user)), link);
+		return;
+	}
+	if (!source)
+		return;
+	if (ircFold(nickname) != ircFold(source->getNickname()) && !_server.claimNick(source, nickname))
+	{
+		ClientRef holder = _server.findClient(nickname);
+		collide(link, nickname, holder.get());
+		remove(source, "Nick collision");
+		return;
+	}
+	SharedBuffer line = relay(msg, link, source);
+	_server.notifyPeers(source, line);
+	propagate(line, link);
+	source->setNickname(nickname);
+}
+
+/**
+ * @brief Two users claimed one nick: both are killed, the one behind
+ * link by its own server.
+ */
+void Network::collide(Client* link, std::string const& nickname, Client* holder)
+{
+	std::string const& me = Command::serverName();
+	Logger::log(LOG_WARN, "link.collision", "name=%s nick=%s", link->server.c_str(), nickname.c_str());
+	link->sendMessage(":" + me + " KILL " + nickname + " :Nick collision\r\n");
+	if (holder)
+		killUser(holder, me, "Nick collision");
+}
+
+void Network::quit(Message const& msg, Client* link, Client* source)
+{
+	propagate(relay(msg, link, source), link);
+	remove(source, msg.paramCount ? msg.param(0) : source->getNickname());
+}
+
+void Network::join(Message const& msg, Client* link, Client* source)
+{
+	if (msg.equals(msg.params[0], "0"))
+	{
+		std::vector<Channel*> joined = source->getChannels();
+		for (std::vector<Channel*>::iterator it = joined.begin(); it != joined.end(); ++it)
+		{
+			announce(*it, SharedBuffer(":" + source->prefix() + " PART " + (*it)->name
+				+ " :" + source->getNickname() + "\r\n"), link);
+			_server.leaveChannel(*it, source);
+		}
+		return;
+	}
+	std::vector<std::string> names = splitList(msg.param(0));
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		if (!isChannelName(names[i]))
+			continue;
+		Channel* channel = _server.joinChannel(names[i]);
+		if (channel->isMember(source))
+			continue;
+		while (!channel->addMember(source, channel->size() == 0))
+			channel = _server.joinChannel(names[i]);
+		announce(channel, SharedBuffer(":" + source->prefix() + " JOIN " + channel->name + "\r\n"), link);
+	}
+}
+
+/**
+ * @brief NJOIN: channel members from a burst, operators marked with @.
+ */
+void Network::njoin(Message const& msg, Client* link, Client* source)
+{
+	(void)source;
+	std::string name = msg.param(0);
+	if (!isChannelName(name))
+		return;
+	Channel* channel = _server.joinChannel(name);
+	std::string origin = msg.prefix.length ? msg.str(msg.prefix) : link->server;
+	std::vector<std::string> members = splitList(msg.param(1));
+	for (size_t i = 0; i < members.size(); ++i)
+	{
+		std::string nickname = members[i];
+		std::string::size_type start = nickname.find_first_not_of("@+");
+		if (start == std::string::npos)
+			continue;
+		bool chanop = nickname.find('@') < start;
+		nickname = nickname.substr(start);
+		ClientRef member = _server.findClient(nickname);
+		if (!member.get() || member->getRoute() != link || channel->isMember(member.get()))
+			continue;
+		while (!channel->addMember(member.get(), chanop))
+			channel = _server.joinChannel(name);
+		channel->broadcast(SharedBuffer(":" + member->prefix() + " JOIN " + channel->name + "\r\n"),
+			member.get(), false);
+		if (chanop)
+			channel->broadcast(SharedBuffer(":" + origin + " MODE " + channel->name + " +o "
+				+ member->getNickname() + "\r\n"), member.get(), false);
+	}
+	propagate(relay(msg, link, NULL), link);
+}
+
+void Network::part(Message const& msg, Client* link, Client* source)
+{
+	std::vector<std::string> names = splitList(msg.param(0));
+	std::string reason = msg.paramCount > 1 ? msg.param(1) : source->getNickname();
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		Channel* channel = _server.findChannel(names[i]);
+		if (!channel || !channel->isMember(source))
+			continue;
+		announce(channel, SharedBuffer(":" + source->prefix() + " PART " + channel->name
+			+ " :" + reason + "\r\n"), link);
+		_server.leaveChannel(channel, source);
+	}
+}
+
+void Network::kick(Message const& msg, Client* link, Client* source)
+{
+	Channel* channel = _server.findChannel(msg.param(0));
+	if (!channel)
+		return;
+	ClientRef victim = channel->findMember(msg.param(1));
+	if (!victim.get())
+		return;
+	announce(channel, relay(msg, link, source), link);
+	_server.leaveChannel(channel, victim.get());
+}
+
+/**
+ * @brief MODE on a channel, applied as the sending server already
+ * checked it. User modes are not propagated.
+ */
+void Network::mode(Message const& msg, Client* link, Client* source)
+{
+	Channel* channel = _server.findChannel(msg.param(0));
+	if (!channel)
+		return;
+	applyModes(channel, msg);
+	announce(channel, relay(msg, link, source), link);
+}
+
+void Network::applyModes(Channel* channel, Message const& msg)
+{
+	std::string modes = msg.param(1);
+	size_t argIndex = 2;
+	bool enable = true;
+	for (size_t i = 0; i < modes.size(); ++i)
+	{
+		char c = modes[i];
+		if (c == '+' || c == '-')
+		{
+			enable = (c == '+');
+			continue;
+		}
+		std::string arg;
+		if (c == 'o' || (enable && (c == 'k' || c == 'l')))
+		{
+			if (argIndex >= msg.paramCount)
+				break;
+			arg = msg.param(argIndex++);
+		}
+		ClientRef member = c == 'o' ? channel->findMember(arg) : ClientRef();
+		if (c == 'o' && !member.get())
+			continue;
+		channel->setMode(c, enable, arg, member.get());
+	}
+}
+
+void Network::topic(Message const& msg, Client* link, Client* source)
+{
+	Channel* channel = _server.findChannel(msg.param(0));
+	if (!channel)
+		return;
+	channel->setTopic(msg.param(1));
+	announce(channel, relay(msg, link, source), link);
+}
+
+void Network::invite(Message const& msg, Client* link, Client* source)
+{
+	ClientRef target = _server.findClient(msg.param(0));
+	if (!target.get() || target->getRoute() == link)
+		return;
+	if (!target->getRoute())
+	{
+		Channel* channel = _server.findChannel(msg.param(1));
+		if (channel)
+			channel->invite(target->getNickname());
+	}
+	target->sendMessage(relay(msg, link, source));
+}
+
+void Network::kill(Message const& msg, Client* link, Client* source)
+{
+	ClientRef victim = _server.findClient(msg.param(0));
+	if (!victim.get() || victim->getRoute() == link)
+		return;
+	std::string killer = source ? source->getNickname()
+		: msg.prefix.length ? msg.str(msg.prefix) : link->server;
+	killUser(victim.get(), killer, msg.param(1));
+}
+
+/**
+ * @brief A server linked somewhere behind link.
+ *
+ * @throws std::runtime_error if the name is already known, which means
+ * the network has a loop; dropping this link breaks it.
+ */
+void Network::server(Message const& msg, Client* link, Client* source)
+{
+	(void)source;
+	Peer peer;
+	peer.name = msg.param(0);
+	peer.uplink = msg.prefix.length ? msg.str(msg.prefix) : link->server;
+	peer.description = msg.param(msg.paramCount - 1);
+	peer.hops = parseHops(msg.param(1));
+	peer.route = link;
+	std::string folded = ircFold(peer.name);
+
+	pthread_mutex_lock(&_lock);
+	bool exists = _servers.count(folded) || folded == ircFold(Command::serverName());
+	if (!exists)
+		_servers[folded] = peer;
+	pthread_mutex_unlock(&_lock);
+	if (exists)
+	{
+		link->sendMessage("ERROR :Server " + peer.name + " already exists\r\n");
+		throw std::runtime_error("Server " + peer.name + " already exists");
+	}
+	Logger::log(LOG_INFO, "link.server", "name=%s uplink=%s hops=%lu",
+		peer.name.c_str(), peer.uplink.c_str(), static_cast<unsigned long>(peer.hops));
+	propagate(SharedBuffer(":" + peer.uplink + " SERVER " + peer.name + " "
+		+ toString(peer.hops + 1) + " :" + peer.description + "\r\n"), link);
+}
+
+/**
+ * @brief A server behind link is gone, and with it every server linked
+ * behind it and all their users.
+ *
+ * @throws std::runtime_error if the SQUIT names this link's peer or this
+ * server: the peer is closing the link itself.
+ */
+void Network::squit(Message const& msg, Client* link, Client* source)
+{
+	(void)source;
+	std::string name = msg.param(0);
+	std::string reason = msg.paramCount > 1 ? msg.param(1) : name;
+	std::string folded = ircFold(name);
+	if (folded == ircFold(link->server) || folded == ircFold(Command::serverName()))
+		throw std::runtime_error(reason);
+
+	std::set<std::string> lost;
+	std::string uplink;
+	pthread_mutex_lock(&_lock);
+	std::map<std::string, Peer>::iterator found = _servers.find(folded);
+	if (found != _servers.end() && found->second.route == link)
+	{
+		uplink = found->second.uplink;
+		lost.insert(folded);
+		bool grew = true;
+		while (grew)
+		{
+			grew = false;
+			for (std::map<std::string, Peer>::iterator it = _servers.begin(); it != _servers.end(); ++it)
+			{
+				if (!lost.count(it->first) && lost.count(ircFold(it->second.uplink)))
+				{
+					lost.insert(it->first);
+					grew = true;
+				}
+			}
+		}
+		for (std::set<std::string>::iterator it = lost.begin(); it != lost.end(); ++it)
+			_servers.erase(*it);
+	}
+	pthread_mutex_unlock(&_lock);
+	if (lost.empty())
+		return;
+	Logger::log(LOG_WARN, "link.squit", "name=%s via=%s servers=%lu reason=\"%s\"",
+		name.c_str(), link->server.c_str(), static_cast<unsigned long>(lost.size()), reason.c_str());
+	dropRoute(link, lost, uplink + " " + name);
+	propagate(relay(msg, link, NULL), link);
+}
+
+void Network::ping(Message const& msg, Client* link, Client* source)
+{
+	(void)source;
+	std::string const& me = Command::serverName();
+	link->sendMessage(":" + me + " PONG " + me + " :" + msg.param(0) + "\r\n");
+}
+
+void Network::pong(Message const& msg, Client* link, Client* source)
+{
+	(void)msg;
+	(void)link;
+	(void)source;
+}
+
+/**
+ * @throws std::runtime_error always; the peer is closing the link.
+ */
+void Network::error(Message const& msg, Client* link, Client* source)
+{
+	(void)link;
+	(void)source;
+	throw std::runtime_error("ERROR " + (msg.paramCount ? msg.param(0) : std::string("from link")));
+}
+
+/**
+ * @brief A numeric reply for one of our users, passed on toward it.
+ */
+void Network::numeric(Message const& msg, Client* link, Client* source)
+{
+	if (msg.paramCount == 0)
+		return;
+	ClientRef target = _server.findClient(msg.param(0));
+	if (target.get() && target->getRoute() != link)
+		target->sendMessage(relay(msg, link, source));
+}
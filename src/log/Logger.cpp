@@ -0,0 +1,231 @@
+#include "Logger.hpp"
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+Logger::Record Logger::_ring[LOG_RING_SIZE];
+volatile size_t Logger::_enqueuePos = 0;
+size_t Logger::_dequeuePos = 0;
+volatile size_t Logger::_dropped = 0;
+volatile int Logger::_running = 0;
+LogLevel Logger::_threshold = DEBUG ? LOG_DEBUG : LOG_INFO;
+int Logger::_fd = STDERR_FILENO;
+bool Logger::_color = false;
+pthread_t Logger::_thread;
+
+namespace
+{
+	char const* const levelName[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+	char const* const levelColor[] = { "\033[90m", "\033[32m", "\033[33m", "\033[1;31m" };
+
+	/* Timestamp + level + event + text + color codes + newline. */
+	size_t const RECORD_MAX = 64 + LOG_TEXT_MAX;
+
+	void writeAll(int fd, char const* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t n = write(fd, data, size);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+			data += n;
+			size -= static_cast<size_t>(n);
+		}
+	}
+}
+
+/**
+ * @brief Starts the drain thread writing to fd. Records below
+ * threshold are discarded by log() before any formatting.
+ */
+void Logger::start(int fd, LogLevel threshold)
+{
+	if (_running)
+		return;
+	for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+		_ring[i].sequence = i;
+	_enqueuePos = 0;
+	_dequeuePos = 0;
+	_fd = fd;
+	_threshold = threshold;
+	_color = isatty(fd);
+	_running = 1;
+	__sync_synchronize();
+	if (pthread_create(&_thread, NULL, &Logger::drainLoop, NULL) != 0)
+		_running = 0;
+}
+
+/**
+ * @brief Stops the drain thread and flushes whatever is still queued.
+ */
+void Logger::stop()
+{
+	if (!__sync_bool_compare_and_swap(&_running, 1, 0))
+		return;
+	pthread_join(_thread, NULL);
+	while (drain() > 0)
+		;
+}
+
+bool Logger::enabled(LogLevel level)
+{
+	return level >= _threshold;
+}
+
+/**
+ * @brief Queues one record. Before start() or after stop() the record
+ * is written synchronously instead.
+ *
+ * @param event Static dotted name, e.g. "client.connect". Only the
+ * pointer is stored, so it must outlive the record.
+ * @param fmt printf format for the key=value fields.
+ */
+void Logger::log(LogLevel level, char const* event, char const* fmt, ...)
+{
+	if (level < _threshold)
+		return;
+
+	Record local;
+	Record* cell = &local;
+	size_t pos = 0;
+	if (_running)
+	{
+		pos = _enqueuePos;
+		while (true)
+		{
+			cell = &_ring[pos & (LOG_RING_SIZE - 1)];
+			size_t sequence = cell->sequence;
+			__sync_synchronize();
+			long diff = static_cast<long>(sequence) - static_cast<long>(pos);
+			if (diff == 0)
+			{
+				if (__sync_bool_compare_and_swap(&_enqueuePos, pos, pos + 1))
+					break;
+				pos = _enqueuePos;
+			}
+			else if (diff < 0)
+			{
+				__sync_add_and_fetch(&_dropped, 1);
+				return;
+			}
+			else
+				pos = _enqueuePos;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &cell->when);
+	cell->level = level;
+	cell->event = event;
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(cell->text, LOG_TEXT_MAX, fmt, args);
+	va_end(args);
+	if (n < 0)
+		n = 0;
+	cell->length = static_cast<unsigned short>(
+		static_cast<size_t>(n) < LOG_TEXT_MAX ? static_cast<size_t>(n) : LOG_TEXT_MAX - 1);
+
+	if (cell == &local)
+	{
+		char line[RECORD_MAX];
+		writeAll(_fd, line, render(local, line, sizeof(line)));
+		return;
+	}
+	__sync_synchronize();
+	cell->sequence = pos + 1;
+}
+
+void* Logger::drainLoop(void* arg)
+{
+	(void)arg;
+	struct timespec idle = { 0, 2000000 };
+
+	while (_running)
+	{
+		if (drain() == 0)
+			nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Renders every ready record into one buffer and writes it out.
+ * Only ever called by one thread at a time.
+ *
+ * @return The number of records written.
+ */
+size_t Logger::drain()
+{
+	static char batch[LOG_BATCH_BYTES];
+	size_t used = 0;
+	size_t count = 0;
+
+	while (used + RECORD_MAX <= sizeof(batch))
+	{
+		Record& cell = _ring[_dequeuePos & (LOG_RING_SIZE - 1)];
+		size_t sequence = cell.sequence;
+		__sync_synchronize();
+		if (sequence != _dequeuePos + 1)
+			break;
+		used += render(cell, batch + used, sizeof(batch) - used);
+		__sync_synchronize();
+		cell.sequence = _dequeuePos + LOG_RING_SIZE;
+		++_dequeuePos;
+		++count;
+	}
+
+	size_t dropped = __sync_lock_test_and_set(&_dropped, 0);
+	if (dropped > 0)
+	{
+		Record note;
+		clock_gettime(CLOCK_REALTIME, &note.when);
+		note.level = LOG_WARN;
+		note.event = "log.dropped";
+		note.length = static_cast<unsigned short>(
+			snprintf(note.text, LOG_TEXT_MAX, "count=%lu", static_cast<unsigned long>(dropped)));
+		if (used + RECORD_MAX > sizeof(batch))
+		{
+			writeAll(_fd, batch, used);
+			used = 0;
+		}
+		used += render(note, batch + used, sizeof(batch) - used);
+	}
+	if (used > 0)
+		writeAll(_fd, batch, used);
+	return count;
+}
+
+/**
+ * @brief Formats one record as a single line.
+ *
+ * @return The number of bytes written to out.
+ */
+size_t Logger::render(Record const& record, char* out, size_t room)
+{
+	struct tm utc;
+	time_t seconds = record.when.tv_sec;
+	gmtime_r(&seconds, &utc);
+
+	int level = record.level;
+	int n = snprintf(out, room, "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ %s%s%s %s ",
+		utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+		utc.tm_hour, utc.tm_min, utc.tm_sec, record.when.tv_nsec / 1000000,
+		_color ? levelColor[level] : "", levelName[level], _color ? "\033[0m" : "",
+		record.event);
+	if (n < 0)
+		return 0;
+	size_t used = static_cast<size_t>(n) < room ? static_cast<size_t>(n) : room - 1;
+	if (used + record.length + 1 < room)
+	{
+		std::memcpy(out + used, record.text, record.length);
+		used += record.length;
+	}
+	out[used++] = '\n';
+	return used;
+}
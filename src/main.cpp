@@ -1,13 +1,77 @@
 #include <iostream>
 #include "Client.hpp"
 #include "Server.hpp"
+#include "Logger.hpp"
+#include "ChannelSnapshot.hpp"
+#include "ChannelHistory.hpp"
 #include <string>
+#include <cstring>
+#include <unistd.h>
+
+static void usage(char const* name)
+{
+	std::cerr << "Usage: " << name << " <port> <password> [--reactors N] [--oper-password P]"
+		<< " [--log-level debug|info|warn|error] [--admin-socket PATH]"
+		<< " [--flood-rate CMDS_PER_SEC] [--flood-burst CMDS] [--sendq BYTES]"
+		<< " [--snapshot PATH] [--snapshot-interval S] [--io epoll|uring]"
+		<< " [--max-clients N] [--max-per-ip N] [--config FILE] [--history-budget BYTES]"
+		<< std::endl;
+	std::cerr << "A --config file with [listener] sections replaces the listener on <port>;"
+		<< " its [server] and [link] sections join this server to others." << std::endl;
+	std::cerr << "Send SIGUSR2 (or UPGRADE as an operator) to hand every connection to a"
+		<< " freshly started copy of the binary." << std::endl;
+}
+
+static bool parseLevel(char const* name, LogLevel& level)
+{
+	char const* const names[] = { "debug", "info", "warn", "error" };
+	for (int i = 0; i < 4; ++i)
+	{
+		if (std::strcmp(name, names[i]) == 0)
+		{
+			level = static_cast<LogLevel>(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parseCount(char const* text, unsigned& value)
+{
+	std::stringstream ss(text);
+	return (ss >> value) && ss.eof();
+}
+
+/**
+ * @brief Common startup of a fresh server and of one taking over from
+ * a previous process, which is only told to exit once everything,
+ * admin socket included, is in place.
+ */
+static void serve(Server& server, int argc, char* argv[], ServerConfig const& config,
+	std::string const& operPassword, std::string const& adminSocket, std::string const& snapshot,
+	unsigned snapshotInterval, unsigned maxClients, unsigned maxPerIp, int upgradeSocket)
+{
+	server.enableLinks(config);
+	server.setOperPassword(operPassword);
+	server.setConnectionLimits(maxClients, maxPerIp);
+	server.setArguments(argc, argv);
+	if (!snapshot.empty())
+		server.enableSnapshots(snapshot, snapshotInterval, upgradeSocket < 0);
+	if (!adminSocket.empty())
+		server.openAdminSocket(adminSocket);
+	if (upgradeSocket >= 0)
+	{
+		Handoff::acknowledge(upgradeSocket);
+		close(upgradeSocket);
+	}
+	server.run();
+}
 
 int main(int argc, char* argv[])
 {
-	if (argc != 3)
+	if (argc < 3)
 	{
-		std::cerr << "Usage: " << argv[0] << " <port> <password>" << std::endl;
+		usage(argv[0]);
 		return 1;
 	}
 
@@ -19,8 +83,105 @@ int main(int argc, char* argv[])
 			throw std::invalid_argument("Invalid port number");
 		std::string password(argv[2]);
 
-		Server server(port, password);
-		server.run();
+		size_t reactors = 1;
+		std::string operPassword;
+		std::string adminSocket;
+		std::string snapshot;
+		std::string config;
+		unsigned snapshotInterval = SNAPSHOT_INTERVAL;
+		unsigned floodRate = FLOOD_RATE;
+		unsigned floodBurst = FLOOD_BURST;
+		unsigned sendQ = MAX_SENDQ;
+		unsigned maxClients = MAX_CLIENTS;
+		unsigned maxPerIp = MAX_CLIENTS_PER_IP;
+		unsigned historyBudget = HISTORY_BUDGET;
+		unsigned upgradeFD = 0;
+		bool upgrading = false;
+		LogLevel logLevel = DEBUG ? LOG_DEBUG : LOG_INFO;
+		for (int i = 3; i < argc; ++i)
+		{
+			if (std::strcmp(argv[i], "--reactors") == 0 && i + 1 < argc)
+			{
+				std::stringstream rs(argv[++i]);
+				if (!(rs >> reactors) || !(rs.eof()) || reactors == 0 || reactors > 1024)
+				{
+					std::cerr << "Invalid reactor count: " << argv[i] << std::endl;
+					return 1;
+				}
+			}
+			else if (std::strcmp(argv[i], "--oper-password") == 0 && i + 1 < argc)
+				operPassword = argv[++i];
+			else if (std::strcmp(argv[i], "--log-level") == 0 && i + 1 < argc
+				&& parseLevel(argv[i + 1], logLevel))
+				++i;
+			else if (std::strcmp(argv[i], "--admin-socket") == 0 && i + 1 < argc)
+				adminSocket = argv[++i];
+			else if (std::strcmp(argv[i], "--flood-rate") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], floodRate))
+				++i;
+			else if (std::strcmp(argv[i], "--flood-burst") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], floodBurst))
+				++i;
+			else if (std::strcmp(argv[i], "--sendq") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], sendQ) && sendQ >= IRC_LINE_MAX)
+				++i;
+			else if (std::strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], maxClients))
+				++i;
+			else if (std::strcmp(argv[i], "--max-per-ip") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], maxPerIp))
+				++i;
+			else if (std::strcmp(argv[i], "--history-budget") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], historyBudget))
+				++i;
+			else if (std::strcmp(argv[i], "--io") == 0 && i + 1 < argc
+				&& (std::strcmp(argv[i + 1], "epoll") == 0 || std::strcmp(argv[i + 1], "uring") == 0))
+				Reactor::useRing(std::strcmp(argv[++i], "uring") == 0);
+			else if (std::strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+				config = argv[++i];
+			else if (std::strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+				snapshot = argv[++i];
+			else if (std::strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], snapshotInterval))
+				++i;
+			else if (std::strcmp(argv[i], "--upgrade-fd") == 0 && i + 1 < argc
+				&& parseCount(argv[i + 1], upgradeFD))
+			{
+				upgrading = true;
+				++i;
+			}
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+		}
+
+		FloodBucket::configure(floodRate, floodBurst);
+		Client::setSendQLimit(sendQ);
+		ChannelHistory::setBudget(historyBudget);
+		Logger::start(STDERR_FILENO, logLevel);
+		ServerConfig serverConfig;
+		if (!config.empty())
+			serverConfig = ServerConfig::load(config);
+		if (upgrading)
+		{
+			int socket = static_cast<int>(upgradeFD);
+			Handoff handoff;
+			handoff.receive(socket);
+			Server server(password, handoff);
+			serve(server, argc, argv, serverConfig, operPassword, adminSocket, snapshot,
+				snapshotInterval, maxClients, maxPerIp, socket);
+		}
+		else
+		{
+			std::vector<ListenerSpec> listeners = serverConfig.listeners;
+			if (listeners.empty())
+				listeners.push_back(ListenerSpec(port));
+			Server server(listeners, password, reactors);
+			serve(server, argc, argv, serverConfig, operPassword, adminSocket, snapshot,
+				snapshotInterval, maxClients, maxPerIp, -1);
+		}
 	} catch (const std::invalid_argument& e)
 	{
 		std::cerr << "Invalid port number: " << argv[1] << std::endl;
@@ -29,5 +190,10 @@ int main(int argc, char* argv[])
 	{
 		std::cerr << "Port number out of range: " << argv[1] << std::endl;
 		return 1;
+	} catch (const std::exception& e)
+	{
+		Logger::stop();
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
 	}
-}
\ No newline at end of file
+}
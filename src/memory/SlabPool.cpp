@@ -0,0 +1,329 @@
+#include "SlabPool.hpp"
+#include <cstdlib>
+#include <new>
+
+SlabPool* SlabPool::_pools = NULL;
+size_t SlabPool::_poolCount = 0;
+pthread_mutex_t SlabPool::_poolsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+namespace
+{
+	/* One thread's free list for one pool; allocations counts the ones
+	 * not yet added to the pool's total, which happens once per batch.
+	 * count is also read by other threads, for stats. */
+	struct ThreadCache
+	{
+		void* free;
+		size_t count;
+		size_t allocations;
+	};
+
+	/* Every cache of one thread, listed from its first use of a pool
+	 * until it exits. */
+	struct ThreadCaches
+	{
+		ThreadCache pools[SLAB_MAX_POOLS];
+		ThreadCaches* next;
+		bool listed;
+	};
+
+	__thread ThreadCaches threadCaches;
+	ThreadCaches* threads = NULL;	// guarded by SlabPool::_poolsMutex
+	pthread_key_t exitKey;
+	pthread_once_t exitKeyOnce = PTHREAD_ONCE_INIT;
+}
+
+SlabPool::SlabPool(char const* name, size_t objectSize, size_t perSlab) :
+	_name(name), _objectSize(objectSize), _perSlab(perSlab ? perSlab : 1),
+	_free(NULL), _inUse(0), _peak(0), _allocations(0), _recycled(0)
+{
+	size_t size = objectSize < sizeof(Slot) ? sizeof(Slot) : objectSize;
+	_slotSize = (size + SLAB_ALIGN - 1) & ~static_cast<size_t>(SLAB_ALIGN - 1);
+	_batch = _perSlab < SLAB_CACHE_BATCH ? _perSlab : SLAB_CACHE_BATCH;
+	pthread_spin_init(&_lock, PTHREAD_PROCESS_PRIVATE);
+
+	pthread_mutex_lock(&_poolsMutex);
+	_cacheIndex = _poolCount < SLAB_MAX_POOLS ? _poolCount++ : SLAB_MAX_POOLS;
+	_nextPool = _pools;
+	_pools = this;
+	pthread_mutex_unlock(&_poolsMutex);
+}
+
+/**
+ * @brief Unregisters the pool. Slabs are only returned to the system
+ * when nothing is still allocated from them: at exit, detached reactor
+ * threads may still hold objects.
+ */
+SlabPool::~SlabPool()
+{
+	flushCache();
+	pthread_mutex_lock(&_poolsMutex);
+	for (SlabPool** link = &_pools; *link; link = &(*link)->_nextPool)
+	{
+		if (*link == this)
+		{
+			*link = _nextPool;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&_poolsMutex);
+	if (_inUse == 0)
+	{
+		for (size_t i = 0; i < _slabs.size(); ++i)
+			std::free(_slabs[i]);
+		pthread_spin_destroy(&_lock);
+	}
+}
+
+/**
+ * @brief Carves a new slab into slots and threads them onto the free
+ * list. Called with _lock held.
+ */
+void SlabPool::grow()
+{
+	char* slab = static_cast<char*>(std::malloc(_slotSize * _perSlab));
+	if (!slab)
+		throw std::bad_alloc();
+	_slabs.push_back(slab);
+	for (size_t i = _perSlab; i-- > 0; )
+	{
+		Slot* slot = reinterpret_cast<Slot*>(slab + i * _slotSize);
+		slot->next = _free;
+		_free = slot;
+	}
+}
+
+/**
+ * @brief Moves count slots from the shared free list onto list, carving
+ * slabs as needed.
+ *
+ * @throws std::bad_alloc if a new slab cannot be allocated.
+ */
+void SlabPool::take(Slot*& list, size_t count)
+{
+	pthread_spin_lock(&_lock);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (_free)
+			++_recycled;
+		else
+		{
+			try
+			{
+				grow();
+			}
+			catch (...)
+			{
+				for (; i > 0; --i)
+				{
+					Slot* slot = list;
+					list = slot->next;
+					slot->next = _free;
+					_free = slot;
+				}
+				pthread_spin_unlock(&_lock);
+				throw;
+			}
+		}
+		Slot* slot = _free;
+		_free = slot->next;
+		slot->next = list;
+		list = slot;
+	}
+	_inUse += count;
+	if (_inUse > _peak)
+		_peak = _inUse;
+	pthread_spin_unlock(&_lock);
+}
+
+/**
+ * @brief Puts count slots chained from list back on the shared free
+ * list. The chain is walked before the lock is taken.
+ */
+void SlabPool::give(Slot* list, size_t count)
+{
+	Slot* last = list;
+	for (size_t i = 1; i < count; ++i)
+		last = last->next;
+	pthread_spin_lock(&_lock);
+	last->next = _free;
+	_free = list;
+	_inUse -= count;
+	pthread_spin_unlock(&_lock);
+}
+
+/**
+ * @brief Gives the calling thread's whole cache back.
+ */
+void SlabPool::flushCache()
+{
+	if (_cacheIndex == SLAB_MAX_POOLS)
+		return;
+	ThreadCache& cache = threadCaches.pools[_cacheIndex];
+	if (cache.count)
+		give(static_cast<Slot*>(cache.free), cache.count);
+	__sync_add_and_fetch(&_allocations, cache.allocations);
+	cache.free = NULL;
+	__atomic_store_n(&cache.count, 0, __ATOMIC_RELAXED);
+	cache.allocations = 0;
+}
+
+/**
+ * @brief Lists the calling thread's caches, and has them flushed when
+ * it exits. Called the first time the thread fills one.
+ */
+void SlabPool::listThread()
+{
+	pthread_once(&exitKeyOnce, &SlabPool::createExitKey);
+	pthread_mutex_lock(&_poolsMutex);
+	threadCaches.next = threads;
+	threads = &threadCaches;
+	threadCaches.listed = true;
+	pthread_mutex_unlock(&_poolsMutex);
+	pthread_setspecific(exitKey, &threadCaches);
+}
+
+void SlabPool::createExitKey()
+{
+	pthread_key_create(&exitKey, &SlabPool::flushThread);
+}
+
+/**
+ * @brief Destructor of the thread-specific key, run by an exiting
+ * thread: gives every pool its cache back and unlists them.
+ */
+void SlabPool::flushThread(void* caches)
+{
+	pthread_mutex_lock(&_poolsMutex);
+	for (SlabPool* pool = _pools; pool; pool = pool->_nextPool)
+		pool->flushCache();
+	for (ThreadCaches** link = &threads; *link; link = &(*link)->next)
+	{
+		if (*link == caches)
+		{
+			*link = threadCaches.next;
+			break;
+		}
+	}
+	threadCaches.listed = false;
+	pthread_mutex_unlock(&_poolsMutex);
+}
+
+/**
+ * @brief Slots in the caches of every listed thread. _poolsMutex is
+ * held; the counts are read as their threads change them.
+ */
+size_t SlabPool::cachedSlots() const
+{
+	size_t cached = 0;
+	if (_cacheIndex == SLAB_MAX_POOLS)
+		return 0;
+	for (ThreadCaches* thread = threads; thread; thread = thread->next)
+		cached += __atomic_load_n(&thread->pools[_cacheIndex].count, __ATOMIC_RELAXED);
+	return cached;
+}
+
+/**
+ * @brief Returns one uninitialised slot of objectSize() bytes, from the
+ * calling thread's cache when it has one.
+ *
+ * @throws std::bad_alloc if a new slab cannot be allocated.
+ */
+void* SlabPool::allocate()
+{
+	if (_cacheIndex == SLAB_MAX_POOLS)
+	{
+		Slot* slot = NULL;
+		take(slot, 1);
+		__sync_add_and_fetch(&_allocations, 1);
+		return slot;
+	}
+	ThreadCache& cache = threadCaches.pools[_cacheIndex];
+	if (!cache.free)
+	{
+		if (!threadCaches.listed)
+			listThread();
+		Slot* list = NULL;
+		take(list, _batch);
+		cache.free = list;
+		__atomic_store_n(&cache.count, _batch, __ATOMIC_RELAXED);
+	}
+	Slot* slot = static_cast<Slot*>(cache.free);
+	cache.free = slot->next;
+	__atomic_store_n(&cache.count, cache.count - 1, __ATOMIC_RELAXED);
+	if (++cache.allocations == _batch)
+	{
+		__sync_add_and_fetch(&_allocations, cache.allocations);
+		cache.allocations = 0;
+	}
+	return slot;
+}
+
+/**
+ * @brief Returns a slot to the calling thread's cache, handing a batch
+ * to the shared list once the cache holds two.
+ */
+void SlabPool::deallocate(void* ptr)
+{
+	if (!ptr)
+		return;
+	Slot* slot = static_cast<Slot*>(ptr);
+	if (_cacheIndex == SLAB_MAX_POOLS)
+	{
+		slot->next = NULL;
+		give(slot, 1);
+		return;
+	}
+	ThreadCache& cache = threadCaches.pools[_cacheIndex];
+	if (!cache.free && !threadCaches.listed)
+		listThread();
+	slot->next = static_cast<Slot*>(cache.free);
+	cache.free = slot;
+	__atomic_store_n(&cache.count, cache.count + 1, __ATOMIC_RELAXED);
+	if (cache.count < 2 * _batch)
+		return;
+	Slot* batch = static_cast<Slot*>(cache.free);
+	Slot* last = batch;
+	for (size_t i = 1; i < _batch; ++i)
+		last = last->next;
+	cache.free = last->next;
+	__atomic_store_n(&cache.count, cache.count - _batch, __ATOMIC_RELAXED);
+	give(batch, _batch);
+}
+
+size_t SlabPool::objectSize() const
+{
+	return _objectSize;
+}
+
+/**
+ * @brief Called by collect(), with _poolsMutex held. A slot counts as
+ * in use once it has left both the shared list and the thread caches.
+ */
+PoolStats SlabPool::stats()
+{
+	PoolStats s;
+	s.cached = cachedSlots();
+	pthread_spin_lock(&_lock);
+	s.name = _name;
+	s.objectSize = _objectSize;
+	s.slabs = _slabs.size();
+	s.capacity = _slabs.size() * _perSlab;
+	s.inUse = _inUse > s.cached ? _inUse - s.cached : 0;
+	s.peak = _peak;
+	s.allocations = __atomic_load_n(&_allocations, __ATOMIC_RELAXED);
+	s.recycled = _recycled;
+	pthread_spin_unlock(&_lock);
+	return s;
+}
+
+/**
+ * @brief Appends the stats of every live pool to out.
+ */
+void SlabPool::collect(std::vector<PoolStats>& out)
+{
+	pthread_mutex_lock(&_poolsMutex);
+	for (SlabPool* pool = _pools; pool; pool = pool->_nextPool)
+		out.push_back(pool->stats());
+	pthread_mutex_unlock(&_poolsMutex);
+}
@@ -0,0 +1,99 @@
+#include "Histogram.hpp"
+
+Histogram::Histogram()
+{
+	clear();
+}
+
+/**
+ * @brief Maps a value to its bucket: the value itself below 16, else
+ * its octave and the next three bits under its most significant one.
+ */
+size_t Histogram::bucketOf(uint64_t value)
+{
+	if (value < 2 * HISTO_SUB)
+		return static_cast<size_t>(value);
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - HISTO_SUB_BITS;
+	size_t mantissa = static_cast<size_t>(value >> shift) - HISTO_SUB;
+	return 2 * HISTO_SUB + static_cast<size_t>(msb - HISTO_SUB_BITS - 1) * HISTO_SUB + mantissa;
+}
+
+/**
+ * @brief Largest value that falls into bucket.
+ */
+uint64_t Histogram::upperBound(size_t bucket)
+{
+	if (bucket < 2 * HISTO_SUB)
+		return bucket;
+	size_t octave = (bucket - 2 * HISTO_SUB) / HISTO_SUB;
+	uint64_t mantissa = HISTO_SUB + (bucket - 2 * HISTO_SUB) % HISTO_SUB;
+	int shift = static_cast<int>(octave) + 1;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+	++_counts[bucketOf(value)];
+	++_total;
+	_sum += value;
+	if (value > _max)
+		_max = value;
+}
+
+void Histogram::merge(Histogram const& other)
+{
+	for (size_t i = 0; i < HISTO_BUCKETS; ++i)
+		_counts[i] += other._counts[i];
+	_total += other._total;
+	_sum += other._sum;
+	if (other._max > _max)
+		_max = other._max;
+}
+
+void Histogram::clear()
+{
+	for (size_t i = 0; i < HISTO_BUCKETS; ++i)
+		_counts[i] = 0;
+	_total = 0;
+	_sum = 0;
+	_max = 0;
+}
+
+uint64_t Histogram::count() const
+{
+	return _total;
+}
+
+uint64_t Histogram::sum() const
+{
+	return _sum;
+}
+
+uint64_t Histogram::max() const
+{
+	return _max;
+}
+
+/**
+ * @brief Smallest bucket bound below which a fraction q of the values
+ * lie, capped at the largest value actually seen.
+ *
+ * @param q Quantile in [0, 1], e.g. 0.99.
+ */
+uint64_t Histogram::quantile(double q) const
+{
+	if (_total == 0)
+		return 0;
+	uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(_total) + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HISTO_BUCKETS; ++i)
+	{
+		seen += _counts[i];
+		if (seen >= rank)
+			return upperBound(i) < _max ? upperBound(i) : _max;
+	}
+	return _max;
+}
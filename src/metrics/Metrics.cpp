@@ -0,0 +1,232 @@
+#include "Metrics.hpp"
+#include "Server.hpp"
+#include "Command.hpp"
+#include "SlabPool.hpp"
+#include <sstream>
+#include <time.h>
+
+std::vector<MetricsShard*> Metrics::_shards;
+pthread_mutex_t Metrics::_shardsMutex = PTHREAD_MUTEX_INITIALIZER;
+MetricsShard Metrics::_fallback;
+
+namespace
+{
+	__thread MetricsShard* threadShard = NULL;
+
+	struct Describe
+	{
+		char const* name;
+		char const* type;
+		char const* help;
+	};
+
+	Describe const counterInfo[M_COUNTER_COUNT] = {
+		{ "connections_accepted_total", "counter", "Connections accepted" },
+		{ "connections_closed_total", "counter", "Connections torn down" },
+		{ "connections_rejected_total", "counter", "Connections refused by the global or per-address limit" },
+		{ "loop_wakeups_total", "counter", "Event loop returns from epoll_wait" },
+		{ "read_calls_total", "counter", "Client read passes" },
+		{ "bytes_in_total", "counter", "Bytes received from clients" },
+		{ "lines_in_total", "counter", "Framed lines dispatched" },
+		{ "lines_out_total", "counter", "Lines queued to clients" },
+		{ "bytes_out_total", "counter", "Bytes written to clients" },
+		{ "sendq_bytes", "gauge", "Bytes waiting in all send queues" },
+		{ "sendq_congested", "gauge", "Clients above the SendQ high watermark" },
+		{ "sendq_high_water_total", "counter", "Times a client crossed the SendQ high watermark" },
+		{ "sendq_evictions_total", "counter", "Clients disconnected for Excess SendQ" },
+		{ "broadcasts_total", "counter", "Channel broadcasts" },
+		{ "fanout_deliveries_total", "counter", "Lines queued by channel broadcasts" },
+		{ "deferred_turns_total", "counter", "Client turns ended by flood control, SendQ or the dispatch quantum" },
+		{ "timeouts_total", "counter", "Clients dropped for registration or ping timeout" },
+		{ "ring_enters_total", "counter", "io_uring_enter calls of io_uring reactors" },
+		{ "ring_completions_total", "counter", "Completions reaped by io_uring reactors" },
+		{ "server_links", "gauge", "Established links to other servers" },
+		{ "remote_users", "gauge", "Users known through server links" },
+		{ "link_deliveries_total", "counter", "Lines queued on server links" },
+		{ "netsplits_total", "counter", "Server links lost" },
+		{ "history_bytes", "gauge", "Bytes of channel history arenas" },
+		{ "history_evictions_total", "counter", "Channel histories evicted by the memory budget" },
+		{ "history_replayed_total", "counter", "Lines sent by CHATHISTORY" }
+	};
+
+	Describe const histogramInfo[H_HISTOGRAM_COUNT] = {
+		{ "loop_busy_ns", "summary", "Time spent handling one epoll_wait batch" },
+		{ "read_ns", "summary", "Time spent in one client read pass" },
+		{ "command_ns", "summary", "Time spent parsing and running one command" },
+		{ "broadcast_ns", "summary", "Time spent fanning out one channel line" },
+		{ "broadcast_fanout", "summary", "Recipients per channel broadcast" }
+	};
+
+	double const quantiles[] = { 0.5, 0.99, 0.999 };
+	char const* const quantileLabel[] = { "0.5", "0.99", "0.999" };
+}
+
+MetricsShard::MetricsShard()
+{
+	for (size_t i = 0; i < M_COUNTER_COUNT; ++i)
+		counters[i] = 0;
+	for (size_t i = 0; i < METRICS_VERBS; ++i)
+		verbs[i] = 0;
+}
+
+/**
+ * @brief Gives the calling thread a shard of its own. Shards are never
+ * freed: a reader may be merging one while its thread exits.
+ */
+void Metrics::attachThread()
+{
+	if (threadShard)
+		return;
+	MetricsShard* shard = new MetricsShard();
+	pthread_mutex_lock(&_shardsMutex);
+	_shards.push_back(shard);
+	pthread_mutex_unlock(&_shardsMutex);
+	threadShard = shard;
+}
+
+MetricsShard& Metrics::local()
+{
+	return threadShard ? *threadShard : _fallback;
+}
+
+/**
+ * @brief Monotonic nanoseconds; served from the vDSO, no system call.
+ */
+uint64_t Metrics::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * static_cast<uint64_t>(1000000000) + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+void Metrics::add(MetricCounter counter, int64_t delta)
+{
+	local().counters[counter] += delta;
+}
+
+void Metrics::countVerb(size_t index)
+{
+	if (index < METRICS_VERBS)
+		++local().verbs[index];
+}
+
+void Metrics::record(MetricHistogram histogram, uint64_t value)
+{
+	local().histograms[histogram].record(value);
+}
+
+/**
+ * @brief Sums every shard into out, which should start empty.
+ */
+void Metrics::merge(MetricsShard& out)
+{
+	pthread_mutex_lock(&_shardsMutex);
+	std::vector<MetricsShard*> shards(_shards);
+	pthread_mutex_unlock(&_shardsMutex);
+	shards.push_back(&_fallback);
+
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		for (size_t i = 0; i < M_COUNTER_COUNT; ++i)
+			out.counters[i] += shards[s]->counters[i];
+		for (size_t i = 0; i < METRICS_VERBS; ++i)
+			out.verbs[i] += shards[s]->verbs[i];
+		for (size_t i = 0; i < H_HISTOGRAM_COUNT; ++i)
+			out.histograms[i].merge(shards[s]->histograms[i]);
+	}
+}
+
+/**
+ * @brief Renders everything in the Prometheus text exposition format.
+ */
+std::string Metrics::prometheus(Server& server)
+{
+	MetricsShard* total = new MetricsShard();
+	merge(*total);
+	std::ostringstream os;
+
+	for (size_t i = 0; i < M_COUNTER_COUNT; ++i)
+	{
+		os << "# HELP ircserv_" << counterInfo[i].name << " " << counterInfo[i].help << "\n"
+			<< "# TYPE ircserv_" << counterInfo[i].name << " " << counterInfo[i].type << "\n"
+			<< "ircserv_" << counterInfo[i].name << " " << total->counters[i] << "\n";
+	}
+
+	os << "# HELP ircserv_commands_total Commands dispatched, by verb\n"
+		<< "# TYPE ircserv_commands_total counter\n";
+	for (size_t i = 0; i <= Command::verbCount() && i < METRICS_VERBS; ++i)
+	{
+		char const* verb = i < Command::verbCount() ? Command::verbName(i) : "unknown";
+		os << "ircserv_commands_total{verb=\"" << verb << "\"} " << total->verbs[i] << "\n";
+	}
+
+	for (size_t i = 0; i < H_HISTOGRAM_COUNT; ++i)
+	{
+		Histogram const& h = total->histograms[i];
+		std::string name = std::string("ircserv_") + histogramInfo[i].name;
+		os << "# HELP " << name << " " << histogramInfo[i].help << "\n"
+			<< "# TYPE " << name << " " << histogramInfo[i].type << "\n";
+		for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q)
+			os << name << "{quantile=\"" << quantileLabel[q] << "\"} " << h.quantile(quantiles[q]) << "\n";
+		os << name << "_sum " << h.sum() << "\n"
+			<< name << "_count " << h.count() << "\n";
+	}
+
+	os << "# TYPE ircserv_clients gauge\n"
+		<< "ircserv_clients " << total->counters[M_CONNECTIONS_ACCEPTED] - total->counters[M_CONNECTIONS_CLOSED] << "\n"
+		<< "# TYPE ircserv_nicks gauge\n"
+		<< "ircserv_nicks " << server.nickCount() << "\n"
+		<< "# TYPE ircserv_channels gauge\n"
+		<< "ircserv_channels " << server.channelCount() << "\n";
+
+	std::vector<PoolStats> pools;
+	SlabPool::collect(pools);
+	os << "# TYPE ircserv_pool_in_use gauge\n";
+	for (size_t i = 0; i < pools.size(); ++i)
+		os << "ircserv_pool_in_use{pool=\"" << pools[i].name << "\"} " << pools[i].inUse << "\n";
+	os << "# TYPE ircserv_pool_cached gauge\n";
+	for (size_t i = 0; i < pools.size(); ++i)
+		os << "ircserv_pool_cached{pool=\"" << pools[i].name << "\"} " << pools[i].cached << "\n";
+	os << "# TYPE ircserv_pool_capacity gauge\n";
+	for (size_t i = 0; i < pools.size(); ++i)
+		os << "ircserv_pool_capacity{pool=\"" << pools[i].name << "\"} " << pools[i].capacity << "\n";
+
+	delete total;
+	return os.str();
+}
+
+/**
+ * @brief One line per metric for the STATS m reply: counters as
+ * "name value", histograms as "name p50=.. p99=.. p999=.. max=.. n=..".
+ */
+void Metrics::statsLines(std::vector<std::string>& out)
+{
+	MetricsShard* total = new MetricsShard();
+	merge(*total);
+
+	for (size_t i = 0; i < M_COUNTER_COUNT; ++i)
+	{
+		std::ostringstream line;
+		line << counterInfo[i].name << " " << total->counters[i];
+		out.push_back(line.str());
+	}
+	for (size_t i = 0; i < H_HISTOGRAM_COUNT; ++i)
+	{
+		Histogram const& h = total->histograms[i];
+		std::ostringstream line;
+		line << histogramInfo[i].name << " p50=" << h.quantile(0.5) << " p99=" << h.quantile(0.99)
+			<< " p999=" << h.quantile(0.999) << " max=" << h.max() << " n=" << h.count();
+		out.push_back(line.str());
+	}
+	delete total;
+}
+
+MetricTimer::MetricTimer(MetricHistogram histogram) :
+	_histogram(histogram), _start(Metrics::now())
+{
+}
+
+MetricTimer::~MetricTimer()
+{
+	Metrics::record(_histogram, Metrics::now() - _start);
+}
@@ -0,0 +1,1184 @@
+#include "Reactor.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Command.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+bool Reactor::_useRing = false;
+
+namespace
+{
+	uint64_t const NS_PER_SECOND = static_cast<uint64_t>(1000000000);
+
+	/* What a ring completion is for, in the top byte of its user_data;
+	 * the rest is the Client it concerns, if any. */
+	enum RingOp
+	{
+		RING_ACCEPT = 1,
+		RING_POLL,
+		RING_RECV,
+		RING_SEND,
+		RING_CANCEL
+	};
+
+	uint64_t const RING_TARGET_MASK = (static_cast<uint64_t>(1) << 56) - 1;
+
+	uint64_t ringTag(int op, Client* client)
+	{
+		return static_cast<uint64_t>(op) << 56 | reinterpret_cast<uintptr_t>(client);
+	}
+
+	uint64_t acceptTag(size_t listener)
+	{
+		return static_cast<uint64_t>(RING_ACCEPT) << 56 | listener;
+	}
+
+	/* Numeric host of a peer for its prefix. IPv4-mapped addresses of
+	 * dual-stack listeners read as IPv4, and IPv6 ones get a leading
+	 * 0 when they start with ':', which would end an IRC prefix. */
+	std::string peerHost(struct sockaddr_storage const& address)
+	{
+		char ip[INET6_ADDRSTRLEN] = "*";
+		if (address.ss_family == AF_INET)
+			inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in const*>(&address)->sin_addr, ip, sizeof(ip));
+		else if (address.ss_family == AF_INET6)
+		{
+			struct in6_addr const& v6 = reinterpret_cast<struct sockaddr_in6 const*>(&address)->sin6_addr;
+			if (IN6_IS_ADDR_V4MAPPED(&v6))
+				inet_ntop(AF_INET, &v6.s6_addr[12], ip, sizeof(ip));
+			else
+				inet_ntop(AF_INET6, &v6, ip, sizeof(ip));
+		}
+		return ip[0] == ':' ? std::string("0") + ip : std::string(ip);
+	}
+}
+
+Reactor::Reactor(Server& server, size_t id, std::vector<int> const& listenFDs)
+	: _server(server), _id(id), _epollFD(-1), _listenFDs(listenFDs), _adminFD(-1), _signalFD(-1), _wakeFD(-1), _thread(), _events(MAX_EVENTS),
+	_timers(Metrics::now()), _snapshotInterval(0), _linkRetry(0), _ring(NULL), _acceptArmed(listenFDs.size(), false), _acceptsArmed(0),
+	_backlogged(listenFDs.size(), false), _acceptBacklog(false), _multishotRecv(true), _quiescing(false), _inFlight(0), _loopThread(pthread_self()), _epoch(0), _sendWake(false)
+{
+	_epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (_epollFD < 0)
+		throw std::runtime_error("epoll_create1 failed: " + std::string(strerror(errno)));
+	_wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakeFD < 0)
+	{
+		close(_epollFD);
+		throw std::runtime_error("eventfd failed: " + std::string(strerror(errno)));
+	}
+	pthread_mutex_init(&_sendLock, NULL);
+	add(_wakeFD, EPOLLIN);
+	if (_useRing)
+	{
+		try
+		{
+			_ring = new IoRing(RING_ENTRIES);
+		}
+		catch (const std::exception& e)
+		{
+			Logger::log(LOG_WARN, "reactor.ring_unavailable", "reactor=%lu error=\"%s\" fallback=epoll",
+				static_cast<unsigned long>(_id), e.what());
+		}
+	}
+	if (_ring)
+	{
+		armPoll();
+		armAccepts();
+	}
+	else
+	{
+		for (size_t i = 0; i < _listenFDs.size(); ++i)
+			add(_listenFDs[i], EPOLLIN | EPOLLET);
+	}
+}
+
+Reactor::~Reactor()
+{
+	for (ClientsIte it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		it->second->detach();
+		close(it->first);
+		it->second->release();
+	}
+	for (size_t i = 0; i < _deferred.size(); ++i)
+		_deferred[i]->release();
+	delete _ring;
+	pthread_mutex_destroy(&_sendLock);
+	for (size_t i = 0; i < _listenFDs.size(); ++i)
+		close(_listenFDs[i]);
+	if (_adminFD >= 0)
+		close(_adminFD);
+	if (_wakeFD >= 0)
+		close(_wakeFD);
+	if (_epollFD >= 0)
+		close(_epollFD);
+}
+
+void Reactor::control(int op, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(_epollFD, op, fd, &ev) < 0)
+		throw std::runtime_error("epoll_ctl failed: " + std::string(strerror(errno)));
+}
+
+void Reactor::add(int fd, uint32_t events)
+{
+	control(EPOLL_CTL_ADD, fd, events);
+}
+
+void Reactor::modify(int fd, uint32_t events)
+{
+	control(EPOLL_CTL_MOD, fd, events);
+}
+
+/**
+ * @brief Unregisters a descriptor. Errors are ignored because the fd
+ * may already have been closed, which removes it from the set anyway.
+ */
+void Reactor::remove(int fd)
+{
+	epoll_ctl(_epollFD, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * @brief Blocks until at least one descriptor is ready.
+ *
+ * @param timeout Milliseconds to wait, -1 to wait forever.
+ * @return Number of ready events, 0 on timeout or signal interruption.
+ */
+int Reactor::wait(int timeout)
+{
+	int n = epoll_wait(_epollFD, &_events[0], static_cast<int>(_events.size()), timeout);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+		throw std::runtime_error("epoll_wait failed: " + std::string(strerror(errno)));
+	}
+	return n;
+}
+
+struct epoll_event const& Reactor::event(int i) const
+{
+	return _events[static_cast<size_t>(i)];
+}
+
+size_t Reactor::getId() const
+{
+	return _id;
+}
+
+/**
+ * @brief Counts loop iterations twice: odd while one runs, even while
+ * the reactor waits for events and holds no channel pointer. Any other
+ * thread may read it.
+ */
+uint64_t Reactor::getEpoch() const
+{
+	return __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Accepts up to ACCEPT_BUDGET pending connections on one of
+ * this reactor's listeners.
+ *
+ * Listeners are registered edge-triggered, so no further notification
+ * arrives for connections still queued: if the budget runs out first,
+ * _acceptBacklog brings run() back here on its next iteration without
+ * sleeping. accept4() hands out sockets already non-blocking and
+ * close-on-exec.
+ */
+void Reactor::handleNewConnection(size_t listener)
+{
+	_backlogged[listener] = false;
+	for (size_t accepted = 0; accepted < ACCEPT_BUDGET; )
+	{
+		struct sockaddr_storage clientAddress;
+		socklen_t clientLength = sizeof(clientAddress);
+		int clientFD = accept4(_listenFDs[listener], (struct sockaddr*)&clientAddress, &clientLength,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (clientFD < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			Logger::log(LOG_ERROR, "accept.failed", "reactor=%lu error=\"%s\"",
+				static_cast<unsigned long>(_id), strerror(errno));
+			return;
+		}
+		addClient(clientFD, clientAddress);
+		++accepted;
+	}
+	_backlogged[listener] = true;
+	_acceptBacklog = true;
+}
+
+/**
+ * @brief Charges a new connection to the AdmissionTable, or refuses it
+ * with one best-effort ERROR line and closes it.
+ */
+bool Reactor::admit(int clientFD, uint64_t key, std::string const& host)
+{
+	AdmissionTable::Verdict verdict = _server.admitConnection(key);
+	if (verdict == AdmissionTable::ADMIT)
+		return true;
+	char const* reason = verdict == AdmissionTable::REJECT_HOST
+		? "Too many connections from your host" : "Server full";
+	std::string error = "ERROR :Closing Link: " + host + " (" + reason + ")\r\n";
+	ssize_t sent = send(clientFD, error.data(), error.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	(void)sent;
+	close(clientFD);
+	Metrics::add(M_CONNECTIONS_REJECTED);
+	Logger::log(LOG_DEBUG, "client.rejected", "reactor=%lu host=%s reason=\"%s\"",
+		static_cast<unsigned long>(_id), host.c_str(), reason);
+	return false;
+}
+
+/**
+ * @brief Sets up a freshly accepted, non-blocking connection and starts
+ * its registration deadline.
+ */
+void Reactor::addClient(int clientFD, struct sockaddr_storage const& address)
+{
+	uint64_t key = AdmissionTable::keyOf(reinterpret_cast<struct sockaddr const*>(&address));
+	std::string host = peerHost(address);
+	if (!admit(clientFD, key, host))
+		return;
+	try
+	{
+		if (!_ring)
+			add(clientFD, EPOLLIN | EPOLLRDHUP | EPOLLET);
+	}
+	catch (const std::exception& e)
+	{
+		Logger::log(LOG_WARN, "client.setup_failed", "fd=%d error=\"%s\"", clientFD, e.what());
+		_server.releaseConnection(key);
+		close(clientFD);
+		return;
+	}
+	Client* client = new Client(clientFD, this);
+	client->admissionKey = key;
+	client->hostname = host;
+	client->lastActivity = Metrics::now();
+	arm(client->liveness, TIMER_REGISTRATION, client->lastActivity,
+		static_cast<uint64_t>(REGISTRATION_TIMEOUT) * NS_PER_SECOND);
+	_clients.insert(std::make_pair(clientFD, client));
+	Metrics::add(M_CONNECTIONS_ACCEPTED);
+	Logger::log(LOG_INFO, "client.connect", "fd=%d reactor=%lu host=%s",
+		clientFD, static_cast<unsigned long>(_id), client->hostname.c_str());
+	if (_ring && !_quiescing)
+		armReceive(client);
+}
+
+/**
+ * @brief Registers the admin socket listener with this reactor, which
+ * takes ownership of the descriptor.
+ */
+void Reactor::setAdminListener(int fd)
+{
+	add(fd, EPOLLIN | EPOLLET);
+	_adminFD = fd;
+}
+
+/**
+ * @brief Watches the read end of the server's signal self-pipe.
+ */
+void Reactor::setSignalListener(int fd)
+{
+	add(fd, EPOLLIN);
+	_signalFD = fd;
+}
+
+/**
+ * @brief Writes the channel snapshot every `seconds`. Must be called
+ * before the reactor runs, or from its own thread.
+ */
+void Reactor::setSnapshotInterval(unsigned seconds)
+{
+	_snapshotInterval = static_cast<uint64_t>(seconds) * NS_PER_SECOND;
+	arm(_snapshotTimer, TIMER_SNAPSHOT, Metrics::now(), _snapshotInterval);
+}
+
+/**
+ * @brief Connects the autoconnect server links now and again every
+ * `seconds`, skipping those that are up. Same threading rule as
+ * setSnapshotInterval().
+ */
+void Reactor::setLinkRetry(unsigned seconds)
+{
+	_linkRetry = static_cast<uint64_t>(seconds) * NS_PER_SECOND;
+	arm(_linkTimer, TIMER_LINK, Metrics::now(), 0);
+}
+
+void Reactor::handleSignal()
+{
+	char byte;
+	if (read(_signalFD, &byte, 1) == 1)
+		_server.handleSignal(static_cast<unsigned char>(byte));
+}
+
+/**
+ * @brief Interrupts this reactor's epoll_wait from another thread.
+ */
+void Reactor::wake()
+{
+	uint64_t one = 1;
+	ssize_t written = write(_wakeFD, &one, sizeof(one));
+	(void)written;
+}
+
+/**
+ * @brief Parks this thread if the server is quiescing for an upgrade.
+ * Also how other threads get output into a ring reactor's next batch.
+ */
+void Reactor::handleWake()
+{
+	uint64_t count;
+	ssize_t got = read(_wakeFD, &count, sizeof(count));
+	(void)got;
+	if (_server.isPausing())
+		quiesce();
+	_server.checkpoint();
+	resume();
+}
+
+/**
+ * @brief Takes over a client handed over by a hot upgrade, before the
+ * loop starts: its socket is registered (epoll or the first receive
+ * reports whatever arrived meanwhile), output the old process had not written is queued again,
+ * and complete lines it had not run get a turn straight away.
+ */
+void Reactor::adopt(Client* client, std::string const& output)
+{
+	if (_ring)
+		armReceive(client);
+	else
+		add(client->getFd(), EPOLLIN | EPOLLRDHUP | EPOLLET);
+	_clients.insert(std::make_pair(client->getFd(), client));
+	Metrics::add(M_CONNECTIONS_ACCEPTED);
+	client->lastActivity = Metrics::now();
+	if (client->registered)
+		arm(client->liveness, TIMER_IDLE, client->lastActivity,
+			static_cast<uint64_t>(PING_INTERVAL) * NS_PER_SECOND);
+	else
+		arm(client->liveness, TIMER_REGISTRATION, client->lastActivity,
+			static_cast<uint64_t>(REGISTRATION_TIMEOUT) * NS_PER_SECOND);
+	if (!output.empty())
+		client->sendMessage(output);
+	if (client->hasBufferedLine())
+		enqueue(client);
+}
+
+std::map<int, Client*> const& Reactor::getClients() const
+{
+	return _clients;
+}
+
+std::vector<int> const& Reactor::getListenFds() const
+{
+	return _listenFDs;
+}
+
+/**
+ * @brief Answers each pending admin connection with one metrics dump.
+ *
+ * The reply is a few kilobytes and the socket is local, so it goes out
+ * with a single non-blocking write; a reader too slow to take it just
+ * gets a truncated dump.
+ */
+void Reactor::handleAdmin()
+{
+	while (true)
+	{
+		int fd = accept4(_adminFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		std::string body = Metrics::prometheus(_server);
+		ssize_t written = send(fd, body.data(), body.size(), MSG_NOSIGNAL);
+		(void)written;
+		close(fd);
+	}
+}
+
+/**
+ * @brief Services a readiness notification for one client.
+ *
+ * @param clientFD Descriptor reported by epoll.
+ * @param events epoll event mask for this descriptor.
+ */
+void Reactor::handleClient(int clientFD, uint32_t events)
+{
+	ClientsIte it = _clients.find(clientFD);
+	if (it != _clients.end())
+		serve(it->second, events);
+}
+
+/**
+ * @brief Flushes the outbound queue when writable, reads everything the
+ * socket has buffered, runs the client's share of commands and drops
+ * it once the peer has closed or errored.
+ *
+ * A client with a backlog only has its socket drained here; its
+ * commands run when its turn comes. One waiting for its SendQ to drain
+ * gets that turn as soon as a flush brings it under the low watermark.
+ *
+ * @param events epoll event mask, 0 for a deferred turn.
+ */
+void Reactor::serve(Client* client, uint32_t events)
+{
+	try
+	{
+		if (events & EPOLLOUT)
+		{
+			client->flush();
+			if (client->backlog == BACKLOG_SENDQ && !client->isCongested())
+				enqueue(client);
+		}
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		{
+			if (!client->handleRead())
+				throw std::runtime_error("Client disconnected");
+			client->lastActivity = Metrics::now();
+		}
+		if (client->backlog == BACKLOG_NONE)
+			park(client, runCommands(client));
+		if (_ring && !_quiescing && !client->receiving && !client->hasPendingInput())
+			armReceive(client);
+	}
+	catch (const std::exception& e)
+	{
+		drop(client, e.what());
+	}
+}
+
+/**
+ * @brief Removes a client whose connection ended, logging the QUIT or
+ * error reason it recorded, if any, rather than `reason`.
+ */
+void Reactor::drop(Client* client, std::string const& reason)
+{
+	std::string quitReason = client->getQuitReason();
+	if (quitReason.empty())
+		quitReason = reason;
+	Logger::log(LOG_INFO, "client.disconnect", "fd=%d nick=%s reason=\"%s\"",
+		client->getFd(), client->getNickname().c_str(), quitReason.c_str());
+	removeClient(client->getFd(), quitReason);
+}
+
+/**
+ * @brief True if `client` is still connected to this reactor, rather
+ * than removed with its fd possibly reused.
+ */
+bool Reactor::owns(Client* client) const
+{
+	std::map<int, Client*>::const_iterator it = _clients.find(client->getFd());
+	return it != _clients.end() && it->second == client;
+}
+
+/**
+ * @brief Dispatches buffered lines, refilling the ring from the socket
+ * whenever it was left full, until the input runs dry or the client
+ * has to wait.
+ *
+ * @return Why complete lines are still waiting, BACKLOG_NONE if none
+ * are.
+ * @throws std::runtime_error if the peer closed the connection.
+ */
+Reactor::Backlog Reactor::runCommands(Client* client)
+{
+	uint64_t now = Metrics::now();
+	bool congested = client->isCongested();
+	size_t quantum = DISPATCH_QUANTUM;
+	LineView line;
+
+	while (true)
+	{
+		if (client->hasBufferedLine())
+		{
+			if (congested)
+				return BACKLOG_SENDQ;
+			if (!client->isLink && !client->flood.ready(now))
+				return BACKLOG_FLOOD;
+			if (quantum == 0)
+				return BACKLOG_QUEUED;
+		}
+		InputRing::Status status = client->nextCommand(line);
+		if (status == InputRing::LINE_NONE)
+		{
+			if (!client->hasPendingInput())
+				return BACKLOG_NONE;
+			if (!client->handleRead())
+				throw std::runtime_error("Client disconnected");
+			continue;
+		}
+		if (!client->isLink)
+			client->flood.charge(now);
+		if (quantum > 0)
+			--quantum;
+		if (status == InputRing::LINE_TOO_LONG)
+		{
+			Command::reply(client, "417", ":Input line was too long");
+			continue;
+		}
+		Logger::log(LOG_DEBUG, "client.command", "fd=%d line=\"%.*s\"",
+			client->getFd(), static_cast<int>(line.size), line.data);
+		Command::handleCommand(line, client, _server);
+	}
+}
+
+/**
+ * @brief Puts a client whose input outlasted its turn where it will be
+ * picked up again: the back of the round-robin queue, a flood timer
+ * set to when its budget allows the next command, or nowhere until a
+ * flush drains its SendQ.
+ */
+void Reactor::park(Client* client, Backlog backlog)
+{
+	if (backlog == BACKLOG_NONE)
+		return;
+	Metrics::add(M_DEFERRED_TURNS);
+	if (backlog == BACKLOG_QUEUED)
+		enqueue(client);
+	else
+	{
+		client->backlog = backlog;
+		if (backlog == BACKLOG_FLOOD)
+		{
+			uint64_t now = Metrics::now();
+			arm(client->floodWakeup, TIMER_FLOOD, now, client->flood.delay(now));
+		}
+	}
+}
+
+void Reactor::enqueue(Client* client)
+{
+	client->backlog = BACKLOG_QUEUED;
+	client->retain();
+	_deferred.push_back(client);
+}
+
+/**
+ * @brief Gives every client that was queued at the start of this pass
+ * one more turn, in arrival order. Those removed meanwhile are skipped.
+ */
+void Reactor::serviceDeferred()
+{
+	for (size_t n = _deferred.size(); n > 0; --n)
+	{
+		Client* client = _deferred.front();
+		_deferred.pop_front();
+		if (owns(client))
+		{
+			client->backlog = BACKLOG_NONE;
+			serve(client, 0);
+		}
+		client->release();
+	}
+}
+
+void Reactor::arm(Timer& timer, int kind, uint64_t now, uint64_t delayNs)
+{
+	timer.kind = kind;
+	_timers.arm(timer, now, delayNs);
+}
+
+/**
+ * @brief Runs every timer that came due since the last pass.
+ *
+ * Owners are retained for the whole batch: a timeout may remove its
+ * client while another of that client's timers is still in the batch.
+ */
+void Reactor::expireTimers()
+{
+	uint64_t now = Metrics::now();
+	_expired.clear();
+	_timers.advance(now, _expired);
+	for (size_t i = 0; i < _expired.size(); ++i)
+	{
+		if (_expired[i]->owner)
+			static_cast<Client*>(_expired[i]->owner)->retain();
+	}
+	for (size_t i = 0; i < _expired.size(); ++i)
+	{
+		Client* client = static_cast<Client*>(_expired[i]->owner);
+		if (!client)
+		{
+			onReactorTimer(_expired[i]->kind, now);
+			continue;
+		}
+		if (owns(client))
+			onTimer(client, _expired[i]->kind, now);
+	}
+	for (size_t i = 0; i < _expired.size(); ++i)
+	{
+		if (_expired[i]->owner)
+			static_cast<Client*>(_expired[i]->owner)->release();
+	}
+}
+
+/**
+ * @brief Client liveness and flood wakeups.
+ *
+ * The liveness timer goes registration deadline -> idle probe -> PONG
+ * deadline -> idle probe ... Input never touches the wheel: it only
+ * stamps lastActivity, and an idle probe that finds recent traffic
+ * just re-arms for the remainder. Any line answers a PING.
+ */
+void Reactor::onTimer(Client* client, int kind, uint64_t now)
+{
+	uint64_t idle = now - client->lastActivity;
+	uint64_t interval = static_cast<uint64_t>(PING_INTERVAL) * NS_PER_SECOND;
+	uint64_t grace = static_cast<uint64_t>(PING_TIMEOUT) * NS_PER_SECOND;
+
+	switch (kind)
+	{
+		case TIMER_REGISTRATION:
+			if (!client->registered)
+				timeOut(client, "Registration timeout");
+			else
+				arm(client->liveness, TIMER_IDLE, now, idle < interval ? interval - idle : 0);
+			break;
+		case TIMER_IDLE:
+			if (idle < interval)
+				arm(client->liveness, TIMER_IDLE, now, interval - idle);
+			else
+			{
+				client->sendMessage("PING :" + Command::serverName() + "\r\n");
+				arm(client->liveness, TIMER_PONG, now, grace);
+			}
+			break;
+		case TIMER_PONG:
+			if (idle >= grace)
+				timeOut(client, "Ping timeout");
+			else
+				arm(client->liveness, TIMER_IDLE, now, idle < interval ? interval - idle : 0);
+			break;
+		case TIMER_FLOOD:
+			if (client->backlog == BACKLOG_FLOOD)
+				enqueue(client);
+			break;
+	}
+}
+
+/**
+ * @brief Timers of the reactor itself.
+ */
+void Reactor::onReactorTimer(int kind, uint64_t now)
+{
+	if (kind == TIMER_SNAPSHOT)
+	{
+		_server.writeSnapshot();
+		arm(_snapshotTimer, TIMER_SNAPSHOT, now, _snapshotInterval);
+	}
+	else if (kind == TIMER_ACCEPT && !_quiescing)
+		armAccepts();
+	else if (kind == TIMER_LINK)
+	{
+		_server.getNetwork().connectLinks(*this);
+		arm(_linkTimer, TIMER_LINK, now, _linkRetry);
+	}
+}
+
+/**
+ * @brief Drops a client that missed a deadline, telling it why first.
+ */
+void Reactor::timeOut(Client* client, std::string const& reason)
+{
+	int clientFD = client->getFd();
+	client->sendMessage("ERROR :Closing Link: " + client->hostname + " (" + reason + ")\r\n");
+	Metrics::add(M_TIMEOUTS);
+	Logger::log(LOG_INFO, "client.disconnect", "fd=%d nick=%s reason=\"%s\"",
+		clientFD, client->getNickname().c_str(), reason.c_str());
+	removeClient(clientFD, reason);
+}
+
+/**
+ * @brief epoll timeout: 0 while clients are queued for a turn,
+ * otherwise until the next tick with a timer due.
+ */
+int Reactor::nextTimeout() const
+{
+	if (!_deferred.empty() || _acceptBacklog)
+		return 0;
+	return _timers.timeout(Metrics::now());
+}
+
+void Reactor::removeClient(int clientFD, std::string const& reason)
+{
+	ClientsIte it = _clients.find(clientFD);
+	if (it == _clients.end())
+		return;
+	// Detach before closing so a broadcaster still holding a snapshot
+	// with this client can never write to the fd once it is reused.
+	if (it->second->isLink)
+		_server.getNetwork().split(it->second, reason);
+	else
+		_server.leaveChannels(it->second, reason);
+	_server.releaseNick(it->second);
+	_server.releaseConnection(it->second->admissionKey);
+	_timers.cancel(it->second->liveness);
+	_timers.cancel(it->second->floodWakeup);
+	if (_ring)
+	{
+		// Queued lines such as a closing ERROR go out before the
+		// connection does; pending ring operations would otherwise
+		// keep the socket open after close().
+		it->second->flush();
+		if (it->second->receiving)
+			cancel(ringTag(RING_RECV, it->second));
+		cancel(ringTag(RING_SEND, it->second));
+	}
+	it->second->detach();
+	remove(clientFD);
+	close(clientFD);
+	it->second->release();
+	_clients.erase(it);
+	Metrics::add(M_CONNECTIONS_CLOSED);
+}
+
+void Reactor::handleEvent(struct epoll_event const& ev)
+{
+	for (size_t i = 0; i < _listenFDs.size(); ++i)
+	{
+		if (ev.data.fd == _listenFDs[i])
+		{
+			handleNewConnection(i);
+			return;
+		}
+	}
+	if (ev.data.fd == _adminFD)
+		handleAdmin();
+	else if (ev.data.fd == _signalFD)
+		handleSignal();
+	else if (ev.data.fd == _wakeFD)
+		handleWake();
+	else
+		handleClient(ev.data.fd, ev.events);
+}
+
+void Reactor::run()
+{
+	Metrics::attachThread();
+	_loopThread = pthread_self();
+	while (true)
+	{
+		try
+		{
+			int ready = 0;
+			if (_ring)
+				enterRing(nextTimeout());
+			else
+				ready = wait(nextTimeout());
+			__sync_add_and_fetch(&_epoch, 1);
+			Metrics::add(M_LOOP_WAKEUPS);
+			MetricTimer busy(H_LOOP_BUSY_NS);
+			expireTimers();
+			serviceDeferred();
+			if (_acceptBacklog)
+			{
+				_acceptBacklog = false;
+				for (size_t i = 0; i < _listenFDs.size(); ++i)
+				{
+					if (_backlogged[i])
+						handleNewConnection(i);
+				}
+			}
+			if (_ring && reapRing())
+				ready = wait(0);
+			for (int i = 0; i < ready; ++i)
+				handleEvent(event(i));
+		}
+		catch (const std::exception& e)
+		{
+			Logger::log(LOG_ERROR, "reactor.error", "reactor=%lu error=\"%s\"",
+				static_cast<unsigned long>(_id), e.what());
+		}
+		if (_epoch & 1)
+			__sync_add_and_fetch(&_epoch, 1);
+		_server.reclaimChannels();
+	}
+}
+
+void* Reactor::start(void* arg)
+{
+	static_cast<Reactor*>(arg)->run();
+	return NULL;
+}
+
+/**
+ * @brief Runs the event loop on a dedicated, detached thread.
+ */
+void Reactor::spawn()
+{
+	if (pthread_create(&_thread, NULL, Reactor::start, this) != 0)
+		throw std::runtime_error("Can't start reactor thread");
+	pthread_detach(_thread);
+}
+
+void Reactor::broadcast(std::string const& text)
+{
+	SharedBuffer message(text);
+	for (ClientsIte it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		it->second->sendMessage(message);
+		if (_ring)
+			it->second->flush();
+	}
+}
+
+/**
+ * @brief Selects the io_uring backend for every reactor created after
+ * this call.
+ */
+void Reactor::useRing(bool enable)
+{
+	_useRing = enable;
+}
+
+bool Reactor::usesRing() const
+{
+	return _ring != NULL;
+}
+
+/**
+ * @brief Puts a client with new output into the next batch of sends;
+ * safe from any thread. Only a reactor sleeping in io_uring_enter
+ * needs waking, and only once per batch.
+ */
+void Reactor::scheduleSend(Client* client)
+{
+	client->retain();
+	pthread_mutex_lock(&_sendLock);
+	_sendRequests.push_back(client);
+	bool remote = !_sendWake && !pthread_equal(pthread_self(), _loopThread);
+	if (remote)
+		_sendWake = true;
+	pthread_mutex_unlock(&_sendLock);
+	if (remote)
+		wake();
+}
+
+void Reactor::armAccept(size_t listener)
+{
+	struct io_uring_sqe* sqe = _ring->prepare(IORING_OP_ACCEPT, _listenFDs[listener], acceptTag(listener));
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	_acceptArmed[listener] = true;
+	++_acceptsArmed;
+}
+
+/**
+ * @brief Arms every listener whose multishot accept is not running.
+ */
+void Reactor::armAccepts()
+{
+	for (size_t i = 0; i < _listenFDs.size(); ++i)
+	{
+		if (!_acceptArmed[i])
+			armAccept(i);
+	}
+}
+
+/**
+ * @brief Watches the epoll set, which holds the admin socket, the
+ * signal pipe and the wake eventfd.
+ */
+void Reactor::armPoll()
+{
+	struct io_uring_sqe* sqe = _ring->prepare(IORING_OP_POLL_ADD, _epollFD, ringTag(RING_POLL, NULL));
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/**
+ * @brief Arms a receive into a buffer of the provided ring; multishot
+ * unless the kernel turned that down once. Holds a reference on the
+ * client until its last completion.
+ */
+void Reactor::armReceive(Client* client)
+{
+	struct io_uring_sqe* sqe = _ring->prepare(IORING_OP_RECV, client->getFd(), ringTag(RING_RECV, client));
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	if (_multishotRecv)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	client->retain();
+	client->receiving = true;
+	++_inFlight;
+}
+
+/**
+ * @brief Cancels the operation submitted with `userData`. Matching on
+ * the tag rather than the fd stays correct once the fd is closed and
+ * reused.
+ */
+void Reactor::cancel(uint64_t userData)
+{
+	struct io_uring_sqe* sqe = _ring->prepare(IORING_OP_ASYNC_CANCEL, -1, ringTag(RING_CANCEL, NULL));
+	sqe->addr = userData;
+}
+
+/**
+ * @brief Prepares one sendmsg for a client whose reference the caller
+ * hands over; released at once if there is nothing left to send.
+ */
+void Reactor::submitSend(Client* client)
+{
+	struct msghdr* message = client->prepareSend();
+	if (!message)
+	{
+		client->release();
+		return;
+	}
+	struct io_uring_sqe* sqe = _ring->prepare(IORING_OP_SENDMSG, client->getFd(), ringTag(RING_SEND, client));
+	sqe->addr = reinterpret_cast<uintptr_t>(message);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	++_inFlight;
+}
+
+/**
+ * @brief Turns every send scheduled since the last batch into a ring
+ * submission.
+ */
+void Reactor::submitSends()
+{
+	pthread_mutex_lock(&_sendLock);
+	_sending.swap(_sendRequests);
+	_sendWake = false;
+	pthread_mutex_unlock(&_sendLock);
+	for (size_t i = 0; i < _sending.size(); ++i)
+		submitSend(_sending[i]);
+	_sending.clear();
+}
+
+/**
+ * @brief The ring backend's wait(): submits the batch of sends and
+ * everything else prepared, then waits for a completion, all in one
+ * io_uring_enter.
+ */
+void Reactor::enterRing(int timeout)
+{
+	submitSends();
+	Metrics::add(M_RING_ENTERS);
+	_ring->enter(timeout);
+}
+
+/**
+ * @brief Handles every completion posted so far.
+ *
+ * @return true if the epoll set has events to collect.
+ */
+bool Reactor::reapRing()
+{
+	bool polled = false;
+	struct io_uring_cqe cqe;
+	while (_ring->next(cqe))
+	{
+		Metrics::add(M_RING_COMPLETIONS);
+		Client* client = reinterpret_cast<Client*>(static_cast<uintptr_t>(cqe.user_data & RING_TARGET_MASK));
+		switch (cqe.user_data >> 56)
+		{
+			case RING_ACCEPT:
+				onAccept(static_cast<size_t>(cqe.user_data & RING_TARGET_MASK), cqe);
+				break;
+			case RING_POLL:
+				polled = true;
+				if (!(cqe.flags & IORING_CQE_F_MORE))
+					armPoll();
+				break;
+			case RING_RECV:
+				onReceive(client, cqe);
+				break;
+			case RING_SEND:
+				onSent(client, cqe.res);
+				break;
+			default:
+				break;
+		}
+	}
+	return polled;
+}
+
+/**
+ * @brief One connection from the multishot accept. A failed accept
+ * ends the multishot; it is armed again after ACCEPT_RETRY_MS so a
+ * persistent error such as EMFILE does not spin the loop.
+ */
+void Reactor::onAccept(size_t listener, struct io_uring_cqe const& cqe)
+{
+	if (cqe.res >= 0)
+	{
+		struct sockaddr_storage address;
+		socklen_t length = sizeof(address);
+		std::memset(&address, 0, sizeof(address));
+		getpeername(cqe.res, reinterpret_cast<struct sockaddr*>(&address), &length);
+		addClient(cqe.res, address);
+	}
+	else if (cqe.res != -ECANCELED)
+		Logger::log(LOG_ERROR, "accept.failed", "reactor=%lu error=\"%s\"",
+			static_cast<unsigned long>(_id), strerror(-cqe.res));
+	if (cqe.flags & IORING_CQE_F_MORE)
+		return;
+	_acceptArmed[listener] = false;
+	--_acceptsArmed;
+	if (_quiescing)
+		return;
+	if (cqe.res < 0)
+		arm(_acceptTimer, TIMER_ACCEPT, Metrics::now(), static_cast<uint64_t>(ACCEPT_RETRY_MS) * static_cast<uint64_t>(1000000));
+	else
+		armAccept(listener);
+}
+
+/**
+ * @brief Data, end of stream or an error from a client's receive.
+ *
+ * The buffer goes back to the ring as soon as its bytes are copied into
+ * the client's input. A client that cannot take a whole buffer has its
+ * receive cancelled, so unread input waits in the socket as it does
+ * with epoll, and is armed again once serve() has drained it. Running
+ * out of provided buffers only ends the multishot; it is armed again
+ * the same way.
+ */
+void Reactor::onReceive(Client* client, struct io_uring_cqe const& cqe)
+{
+	bool live = owns(client);
+	if (cqe.flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		if (live && cqe.res > 0)
+		{
+			Metrics::add(M_READ_CALLS);
+			Metrics::add(M_BYTES_IN, cqe.res);
+			client->receive(_ring->buffer(id), static_cast<size_t>(cqe.res));
+		}
+		_ring->recycle(id);
+	}
+	bool last = !(cqe.flags & IORING_CQE_F_MORE);
+	if (last)
+	{
+		client->receiving = false;
+		--_inFlight;
+	}
+	if (live && !_quiescing)
+	{
+		if (cqe.res == -EINVAL && _multishotRecv)
+		{
+			_multishotRecv = false;
+			Logger::log(LOG_WARN, "reactor.multishot_unsupported", "reactor=%lu",
+				static_cast<unsigned long>(_id));
+		}
+		if (cqe.res == 0)
+			drop(client, "Client disconnected");
+		else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED && cqe.res != -EINVAL)
+			drop(client, "Error on recv: " + std::string(strerror(-cqe.res)));
+		else
+		{
+			if (cqe.res > 0)
+				client->lastActivity = Metrics::now();
+			serve(client, 0);
+			if (client->receiving && client->hasPendingInput() && owns(client))
+				cancel(ringTag(RING_RECV, client));
+		}
+	}
+	if (last)
+		client->release();
+}
+
+/**
+ * @brief A finished sendmsg: the next one for the same client goes
+ * into the current batch if more output is queued, and a client
+ * waiting on its SendQ gets its turn back below the low watermark.
+ */
+void Reactor::onSent(Client* client, int result)
+{
+	--_inFlight;
+	bool more = client->completeSend(result);
+	if (owns(client) && !_quiescing && client->backlog == BACKLOG_SENDQ && !client->isCongested())
+		enqueue(client);
+	if (!more)
+		client->release();
+	else if (_quiescing)
+	{
+		pthread_mutex_lock(&_sendLock);
+		_sendRequests.push_back(client);
+		pthread_mutex_unlock(&_sendLock);
+	}
+	else
+		submitSend(client);
+}
+
+/**
+ * @brief Ring backend, before a hot upgrade captures state: cancels
+ * the accept and every client operation and reaps until none is in
+ * flight. Afterwards all received bytes sit in input rings and every
+ * queue holds exactly what the kernel has not written.
+ */
+void Reactor::quiesce()
+{
+	if (!_ring || _quiescing)
+		return;
+	_quiescing = true;
+	for (size_t i = 0; i < _listenFDs.size(); ++i)
+	{
+		if (_acceptArmed[i])
+			cancel(acceptTag(i));
+	}
+	for (ClientsIte it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		if (it->second->receiving)
+			cancel(ringTag(RING_RECV, it->second));
+		cancel(ringTag(RING_SEND, it->second));
+	}
+	while (_inFlight > 0 || _acceptsArmed > 0)
+	{
+		_ring->enter(TIMER_TICK_MS);
+		reapRing();
+	}
+}
+
+/**
+ * @brief Undoes quiesce() when the upgrade did not happen: the accept
+ * and receives are armed again, held sends go into the next batch and
+ * input that arrived meanwhile gets its turn.
+ */
+void Reactor::resume()
+{
+	if (!_quiescing)
+		return;
+	_quiescing = false;
+	armAccepts();
+	std::vector<Client*> clients;
+	for (ClientsIte it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		it->second->retain();
+		clients.push_back(it->second);
+	}
+	for (size_t i = 0; i < clients.size(); ++i)
+	{
+		if (owns(clients[i]))
+			serve(clients[i], 0);
+		clients[i]->release();
+	}
+}
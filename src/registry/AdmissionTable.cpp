@@ -0,0 +1,206 @@
+#include "AdmissionTable.hpp"
+#include <cstring>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace
+{
+	/* 2^64 divided by the golden ratio, for Fibonacci hashing. */
+	uint64_t const GOLDEN_RATIO = static_cast<uint64_t>(0x9E3779B9) << 32 | 0x7F4A7C15;
+
+	/* The ::ffff:0:0/96 prefix of IPv4-mapped addresses, as a key. */
+	uint64_t const V4_MAPPED = static_cast<uint64_t>(0xffff) << 32;
+}
+
+AdmissionTable::AdmissionTable()
+	: _total(0), _maxTotal(MAX_CLIENTS), _maxPerAddress(MAX_CLIENTS_PER_IP)
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+	{
+		pthread_mutex_init(&_shards[i].lock, NULL);
+		std::memset(_shards[i].slots, 0, sizeof(_shards[i].slots));
+	}
+}
+
+AdmissionTable::~AdmissionTable()
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+		pthread_mutex_destroy(&_shards[i].lock);
+}
+
+/**
+ * @brief Sets both limits, 0 meaning unlimited. Called once at startup
+ * before any reactor accepts.
+ */
+void AdmissionTable::configure(size_t maxTotal, size_t maxPerAddress)
+{
+	_maxTotal = maxTotal;
+	_maxPerAddress = maxPerAddress;
+}
+
+uint32_t AdmissionTable::hash(uint64_t key)
+{
+	return static_cast<uint32_t>((key * GOLDEN_RATIO) >> 32);
+}
+
+/**
+ * @brief Admission key of a peer: an IPv6 address's /64 prefix, or an
+ * IPv4 address tagged like its IPv4-mapped form (::ffff:a.b.c.d),
+ * which no routable /64 can collide with.
+ */
+uint64_t AdmissionTable::keyOf(struct sockaddr const* address)
+{
+	if (address->sa_family == AF_INET)
+		return V4_MAPPED
+			| ntohl(reinterpret_cast<struct sockaddr_in const*>(address)->sin_addr.s_addr);
+	if (address->sa_family != AF_INET6)
+		return 0;
+	struct in6_addr const& v6 = reinterpret_cast<struct sockaddr_in6 const*>(address)->sin6_addr;
+	unsigned char const* bytes = v6.s6_addr;
+	if (IN6_IS_ADDR_V4MAPPED(&v6))
+		return V4_MAPPED | static_cast<uint64_t>(bytes[12]) << 24
+			| static_cast<uint64_t>(bytes[13]) << 16 | static_cast<uint64_t>(bytes[14]) << 8 | bytes[15];
+	uint64_t key = 0;
+	for (int i = 0; i < 8; ++i)
+		key = key << 8 | bytes[i];
+	return key;
+}
+
+/**
+ * @brief Same key from a client's numeric hostname, for connections
+ * inherited without their socket address.
+ */
+uint64_t AdmissionTable::keyOf(std::string const& host)
+{
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+	std::memset(&v4, 0, sizeof(v4));
+	std::memset(&v6, 0, sizeof(v6));
+	if (inet_pton(AF_INET, host.c_str(), &v4.sin_addr) == 1)
+	{
+		v4.sin_family = AF_INET;
+		return keyOf(reinterpret_cast<struct sockaddr const*>(&v4));
+	}
+	if (inet_pton(AF_INET6, host.c_str(), &v6.sin6_addr) == 1)
+	{
+		v6.sin6_family = AF_INET6;
+		return keyOf(reinterpret_cast<struct sockaddr const*>(&v6));
+	}
+	return 0;
+}
+
+/**
+ * @brief Counts one more connection from a source in its shard.
+ *
+ * @param force Count it even above the per-address limit.
+ */
+AdmissionTable::Verdict AdmissionTable::charge(uint64_t key, bool force)
+{
+	uint32_t h = hash(key);
+	Shard& shard = _shards[(h >> 24) & (REGISTRY_SHARDS - 1)];
+	Verdict verdict = REJECT_FULL;
+
+	pthread_mutex_lock(&shard.lock);
+	for (size_t probe = 0; probe < ADMISSION_SLOTS; ++probe)
+	{
+		Slot& slot = shard.slots[(h + probe) & (ADMISSION_SLOTS - 1)];
+		if (slot.count == 0)
+		{
+			slot.key = key;
+			slot.count = 1;
+			verdict = ADMIT;
+			break;
+		}
+		if (slot.key == key)
+		{
+			verdict = force || !_maxPerAddress || slot.count < _maxPerAddress ? ADMIT : REJECT_HOST;
+			if (verdict == ADMIT)
+				++slot.count;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard.lock);
+	return verdict;
+}
+
+/**
+ * @brief Uncounts one connection from a source, freeing its slot at
+ * zero. Later entries of the probe run are shifted back into the hole
+ * so lookups never need tombstones.
+ */
+void AdmissionTable::discharge(uint64_t key)
+{
+	uint32_t h = hash(key);
+	Shard& shard = _shards[(h >> 24) & (REGISTRY_SHARDS - 1)];
+	size_t const mask = ADMISSION_SLOTS - 1;
+
+	pthread_mutex_lock(&shard.lock);
+	for (size_t probe = 0; probe < ADMISSION_SLOTS; ++probe)
+	{
+		size_t hole = (h + probe) & mask;
+		Slot& slot = shard.slots[hole];
+		if (slot.count == 0)
+			break;
+		if (slot.key != key)
+			continue;
+		if (--slot.count == 0)
+		{
+			for (size_t next = (hole + 1) & mask; shard.slots[next].count; next = (next + 1) & mask)
+			{
+				size_t home = hash(shard.slots[next].key) & mask;
+				if (((next - home) & mask) >= ((next - hole) & mask))
+				{
+					shard.slots[hole] = shard.slots[next];
+					hole = next;
+				}
+			}
+			shard.slots[hole].count = 0;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&shard.lock);
+}
+
+/**
+ * @brief Decides whether a freshly accepted connection may stay, and
+ * counts it if so.
+ *
+ * @param key The peer's keyOf().
+ */
+AdmissionTable::Verdict AdmissionTable::admit(uint64_t key)
+{
+	size_t total = __sync_add_and_fetch(&_total, 1);
+	if (_maxTotal && total > _maxTotal)
+	{
+		__sync_sub_and_fetch(&_total, 1);
+		return REJECT_FULL;
+	}
+	Verdict verdict = charge(key, false);
+	if (verdict != ADMIT)
+		__sync_sub_and_fetch(&_total, 1);
+	return verdict;
+}
+
+/**
+ * @brief Counts a connection that is kept regardless of the limits,
+ * such as one inherited from a hot upgrade.
+ */
+void AdmissionTable::track(uint64_t key)
+{
+	__sync_add_and_fetch(&_total, 1);
+	charge(key, true);
+}
+
+/**
+ * @brief Uncounts a connection previously admitted or tracked.
+ */
+void AdmissionTable::release(uint64_t key)
+{
+	__sync_sub_and_fetch(&_total, 1);
+	discharge(key);
+}
+
+size_t AdmissionTable::size() const
+{
+	return __atomic_load_n(&_total, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,113 @@
+#include "ChannelRegistry.hpp"
+#include "Channel.hpp"
+
+namespace
+{
+	struct DeleteChannel
+	{
+		void operator()(Channel* channel) const
+		{
+			delete channel;
+		}
+	};
+}
+
+ChannelRegistry::ChannelRegistry()
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+		pthread_rwlock_init(&_shards[i].lock, NULL);
+}
+
+ChannelRegistry::~ChannelRegistry()
+{
+	DeleteChannel destroy;
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+	{
+		_shards[i].table.forEach(destroy);
+		pthread_rwlock_destroy(&_shards[i].lock);
+	}
+}
+
+ChannelRegistry::Shard& ChannelRegistry::shardFor(uint32_t hash)
+{
+	return _shards[(hash >> 24) & (REGISTRY_SHARDS - 1)];
+}
+
+/**
+ * @brief Looks a channel up by name, ignoring case.
+ *
+ * @return The channel, or NULL if it does not exist.
+ */
+Channel* ChannelRegistry::find(std::string const& name)
+{
+	std::string folded = ircFold(name);
+	uint32_t hash = FoldedTable<Channel*>::hash(folded);
+	Shard& shard = shardFor(hash);
+
+	pthread_rwlock_rdlock(&shard.lock);
+	Channel** found = shard.table.find(folded, hash);
+	Channel* channel = found ? *found : NULL;
+	pthread_rwlock_unlock(&shard.lock);
+	return channel;
+}
+
+/**
+ * @brief Looks a channel up, creating it under the given spelling if
+ * it does not exist. The name is folded and hashed once; the write lock
+ * is only taken on a miss.
+ */
+Channel* ChannelRegistry::findOrCreate(std::string const& name)
+{
+	std::string folded = ircFold(name);
+	uint32_t hash = FoldedTable<Channel*>::hash(folded);
+	Shard& shard = shardFor(hash);
+
+	pthread_rwlock_rdlock(&shard.lock);
+	Channel** found = shard.table.find(folded, hash);
+	Channel* channel = found ? *found : NULL;
+	pthread_rwlock_unlock(&shard.lock);
+	if (channel)
+		return channel;
+
+	pthread_rwlock_wrlock(&shard.lock);
+	found = shard.table.find(folded, hash);
+	if (found)
+		channel = *found;
+	else
+		channel = *shard.table.insert(folded, hash, new Channel(name));
+	pthread_rwlock_unlock(&shard.lock);
+	return channel;
+}
+
+/**
+ * @brief Takes a channel out if it is still empty, closing it under the
+ * shard's write lock so no lookup can hand it out for a join afterwards.
+ *
+ * @return true if the channel was removed; the caller owns it now.
+ */
+bool ChannelRegistry::remove(Channel* channel)
+{
+	std::string folded = ircFold(channel->name);
+	uint32_t hash = FoldedTable<Channel*>::hash(folded);
+	Shard& shard = shardFor(hash);
+
+	pthread_rwlock_wrlock(&shard.lock);
+	Channel** found = shard.table.find(folded, hash);
+	bool removed = found && *found == channel && channel->close();
+	if (removed)
+		shard.table.erase(folded, hash);
+	pthread_rwlock_unlock(&shard.lock);
+	return removed;
+}
+
+size_t ChannelRegistry::size()
+{
+	size_t total = 0;
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+	{
+		pthread_rwlock_rdlock(&_shards[i].lock);
+		total += _shards[i].table.size();
+		pthread_rwlock_unlock(&_shards[i].lock);
+	}
+	return total;
+}
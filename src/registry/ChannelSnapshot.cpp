@@ -0,0 +1,206 @@
+#include "ChannelSnapshot.hpp"
+#include "ChannelRegistry.hpp"
+#include "Channel.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "IRCSNAP1"
+
+namespace
+{
+	struct ChannelCollector
+	{
+		std::vector<Channel*> channels;
+
+		void operator()(Channel* channel)
+		{
+			channels.push_back(channel);
+		}
+	};
+
+	uint32_t checksum(char const* data, size_t size)
+	{
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash ^= static_cast<unsigned char>(data[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	void place(std::string& pool, std::string const& value, uint32_t& offset, uint32_t& length)
+	{
+		offset = static_cast<uint32_t>(pool.size());
+		length = static_cast<uint32_t>(value.size());
+		pool.append(value);
+	}
+
+	void writeAll(int fd, char const* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t written = ::write(fd, data, size);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error(strerror(errno));
+			}
+			data += written;
+			size -= static_cast<size_t>(written);
+		}
+	}
+}
+
+/**
+ * @brief Copies every channel's name, topic, key, limit and modes into
+ * a file image. Only each channel's own mutex is held, one at a time.
+ *
+ * @param count Set to the number of channels captured.
+ */
+std::string ChannelSnapshot::capture(ChannelRegistry& registry, size_t& count)
+{
+	ChannelCollector collector;
+	registry.forEach(collector);
+
+	std::vector<Record> records(collector.channels.size());
+	std::string pool;
+	for (size_t i = 0; i < collector.channels.size(); ++i)
+	{
+		Channel* channel = collector.channels[i];
+		Record& record = records[i];
+		pthread_mutex_lock(&channel->mutex);
+		place(pool, channel->name, record.nameOffset, record.nameLength);
+		place(pool, channel->topic, record.topicOffset, record.topicLength);
+		place(pool, channel->key, record.keyOffset, record.keyLength);
+		record.limit = static_cast<uint32_t>(channel->limit);
+		record.flags = (channel->inviteOnly ? INVITE_ONLY : 0)
+			| (channel->topicRestricted ? TOPIC_RESTRICTED : 0);
+		pthread_mutex_unlock(&channel->mutex);
+	}
+
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.count = static_cast<uint32_t>(records.size());
+	header.poolSize = pool.size();
+	header.written = static_cast<uint64_t>(std::time(NULL));
+	std::string body(reinterpret_cast<char const*>(records.empty() ? NULL : &records[0]),
+		records.size() * sizeof(Record));
+	body.append(pool);
+	header.checksum = checksum(body.data(), body.size());
+	count = records.size();
+	return std::string(reinterpret_cast<char const*>(&header), sizeof(header)) + body;
+}
+
+/**
+ * @brief Puts an image from capture() on disk under path.
+ *
+ * @throws std::runtime_error if the file cannot be written; a previous
+ * snapshot is left in place.
+ */
+void ChannelSnapshot::store(std::string const& path, std::string const& image)
+{
+	std::string temporary = path + ".tmp";
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		throw std::runtime_error(temporary + ": " + strerror(errno));
+	try
+	{
+		writeAll(fd, image.data(), image.size());
+		if (fdatasync(fd) < 0)
+			throw std::runtime_error(strerror(errno));
+	}
+	catch (std::exception const& e)
+	{
+		close(fd);
+		unlink(temporary.c_str());
+		throw std::runtime_error(temporary + ": " + e.what());
+	}
+	close(fd);
+	if (rename(temporary.c_str(), path.c_str()) < 0)
+	{
+		std::string reason(strerror(errno));
+		unlink(temporary.c_str());
+		throw std::runtime_error(path + ": " + reason);
+	}
+}
+
+/**
+ * @brief Maps a snapshot and recreates its channels, empty. See
+ * Channel::join for how the first member gets into a +i one.
+ *
+ * @return Number of channels loaded; 0 if the file is missing.
+ * @throws std::runtime_error if the file exists but is not a valid
+ * snapshot.
+ */
+size_t ChannelSnapshot::load(std::string const& path, ChannelRegistry& registry)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return 0;
+		throw std::runtime_error(path + ": " + strerror(errno));
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(Header))
+	{
+		close(fd);
+		throw std::runtime_error(path + ": not a channel snapshot");
+	}
+	size_t size = static_cast<size_t>(info.st_size);
+	void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		throw std::runtime_error(path + ": " + strerror(errno));
+
+	char const* base = static_cast<char const*>(mapping);
+	Header const* header = reinterpret_cast<Header const*>(base);
+	Record const* records = reinterpret_cast<Record const*>(base + sizeof(Header));
+	size_t recordBytes = static_cast<size_t>(header->count) * sizeof(Record);
+	bool valid = std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+		&& size - sizeof(Header) >= recordBytes
+		&& size - sizeof(Header) - recordBytes == header->poolSize
+		&& checksum(base + sizeof(Header), size - sizeof(Header)) == header->checksum;
+	char const* pool = base + sizeof(Header) + recordBytes;
+	for (uint32_t i = 0; valid && i < header->count; ++i)
+	{
+		Record const& record = records[i];
+		valid = record.nameLength > 0
+			&& record.nameOffset + static_cast<uint64_t>(record.nameLength) <= header->poolSize
+			&& record.topicOffset + static_cast<uint64_t>(record.topicLength) <= header->poolSize
+			&& record.keyOffset + static_cast<uint64_t>(record.keyLength) <= header->poolSize;
+	}
+	if (!valid)
+	{
+		munmap(mapping, size);
+		throw std::runtime_error(path + ": not a channel snapshot");
+	}
+
+	madvise(mapping, size, MADV_SEQUENTIAL);
+	for (uint32_t i = 0; i < header->count; ++i)
+	{
+		Record const& record = records[i];
+		Channel* channel = registry.findOrCreate(std::string(pool + record.nameOffset, record.nameLength));
+		pthread_mutex_lock(&channel->mutex);
+		channel->topic.assign(pool + record.topicOffset, record.topicLength);
+		channel->key.assign(pool + record.keyOffset, record.keyLength);
+		channel->limit = record.limit;
+		channel->inviteOnly = record.flags & INVITE_ONLY;
+		channel->topicRestricted = record.flags & TOPIC_RESTRICTED;
+		pthread_mutex_unlock(&channel->mutex);
+	}
+	size_t count = header->count;
+	munmap(mapping, size);
+	return count;
+}
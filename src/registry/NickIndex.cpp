@@ -0,0 +1,109 @@
+#include "NickIndex.hpp"
+#include "Client.hpp"
+#include <algorithm>
+
+NickIndex::NickIndex()
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+		pthread_rwlock_init(&_shards[i].lock, NULL);
+}
+
+NickIndex::~NickIndex()
+{
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+		pthread_rwlock_destroy(&_shards[i].lock);
+}
+
+size_t NickIndex::shardOf(uint32_t hash) const
+{
+	return (hash >> 24) & (REGISTRY_SHARDS - 1);
+}
+
+/**
+ * @brief Atomically moves client from previous to nickname.
+ *
+ * @param previous Current nick, empty if the client has none yet.
+ * @return false if nickname belongs to another client.
+ */
+bool NickIndex::claim(Client* client, std::string const& previous, std::string const& nickname)
+{
+	std::string folded = ircFold(nickname);
+	std::string oldFolded = ircFold(previous);
+	uint32_t hash = FoldedTable<Client*>::hash(folded);
+	uint32_t oldHash = FoldedTable<Client*>::hash(oldFolded);
+	size_t first = shardOf(hash);
+	size_t second = previous.empty() ? first : shardOf(oldHash);
+
+	if (first > second)
+		std::swap(first, second);
+	pthread_rwlock_wrlock(&_shards[first].lock);
+	if (second != first)
+		pthread_rwlock_wrlock(&_shards[second].lock);
+
+	bool ok = true;
+	FoldedTable<Client*>& table = _shards[shardOf(hash)].table;
+	Client** owner = table.find(folded, hash);
+	if (owner && *owner != client)
+		ok = false;
+	else if (!owner)
+	{
+		table.insert(folded, hash, client);
+		if (!previous.empty())
+			_shards[shardOf(oldHash)].table.erase(oldFolded, oldHash);
+	}
+
+	if (second != first)
+		pthread_rwlock_unlock(&_shards[second].lock);
+	pthread_rwlock_unlock(&_shards[first].lock);
+	return ok;
+}
+
+/**
+ * @brief Drops a nick on disconnect, only if it still maps to client.
+ */
+void NickIndex::release(Client* client, std::string const& nickname)
+{
+	if (nickname.empty())
+		return;
+	std::string folded = ircFold(nickname);
+	uint32_t hash = FoldedTable<Client*>::hash(folded);
+	Shard& shard = _shards[shardOf(hash)];
+
+	pthread_rwlock_wrlock(&shard.lock);
+	Client** owner = shard.table.find(folded, hash);
+	if (owner && *owner == client)
+		shard.table.erase(folded, hash);
+	pthread_rwlock_unlock(&shard.lock);
+}
+
+/**
+ * @brief One hashed lookup, ignoring case.
+ *
+ * @return The client with a reference taken for the caller, or NULL.
+ */
+Client* NickIndex::find(std::string const& nickname)
+{
+	std::string folded = ircFold(nickname);
+	uint32_t hash = FoldedTable<Client*>::hash(folded);
+	Shard& shard = _shards[shardOf(hash)];
+
+	pthread_rwlock_rdlock(&shard.lock);
+	Client** owner = shard.table.find(folded, hash);
+	Client* client = owner ? *owner : NULL;
+	if (client)
+		client->retain();
+	pthread_rwlock_unlock(&shard.lock);
+	return client;
+}
+
+size_t NickIndex::size()
+{
+	size_t total = 0;
+	for (size_t i = 0; i < REGISTRY_SHARDS; ++i)
+	{
+		pthread_rwlock_rdlock(&_shards[i].lock);
+		total += _shards[i].table.size();
+		pthread_rwlock_unlock(&_shards[i].lock);
+	}
+	return total;
+}
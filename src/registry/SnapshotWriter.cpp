@@ -0,0 +1,114 @@
+#include "SnapshotWriter.hpp"
+#include "ChannelSnapshot.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include <stdexcept>
+
+namespace
+{
+	void storeImage(std::string const& path, std::string const& image, size_t count)
+	{
+		uint64_t start = Metrics::now();
+		try
+		{
+			ChannelSnapshot::store(path, image);
+			Logger::log(LOG_DEBUG, "snapshot.written", "path=%s channels=%lu us=%lu", path.c_str(),
+				static_cast<unsigned long>(count),
+				static_cast<unsigned long>((Metrics::now() - start) / 1000));
+		}
+		catch (std::exception const& e)
+		{
+			Logger::log(LOG_WARN, "snapshot.write_failed", "error=\"%s\"", e.what());
+		}
+	}
+}
+
+SnapshotWriter::SnapshotWriter() : _count(0), _pending(false), _running(false)
+{
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_wake, NULL);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	stop();
+	pthread_cond_destroy(&_wake);
+	pthread_mutex_destroy(&_lock);
+}
+
+/**
+ * @brief Starts the thread writing to path.
+ *
+ * @throws std::runtime_error if the thread cannot be created.
+ */
+void SnapshotWriter::start(std::string const& path)
+{
+	if (_running)
+		return;
+	_path = path;
+	_running = true;
+	if (pthread_create(&_thread, NULL, &SnapshotWriter::writeLoop, this) != 0)
+	{
+		_running = false;
+		throw std::runtime_error("Failed to start the snapshot writer");
+	}
+}
+
+/**
+ * @brief Queues an image for writing, taking its contents. Without a
+ * running thread the image is written right away.
+ */
+void SnapshotWriter::submit(std::string& image, size_t count)
+{
+	pthread_mutex_lock(&_lock);
+	if (_running)
+	{
+		_image.swap(image);
+		_count = count;
+		_pending = true;
+		pthread_cond_signal(&_wake);
+		pthread_mutex_unlock(&_lock);
+		return;
+	}
+	pthread_mutex_unlock(&_lock);
+	storeImage(_path, image, count);
+}
+
+/**
+ * @brief Writes the pending image, if any, and joins the thread.
+ */
+void SnapshotWriter::stop()
+{
+	pthread_mutex_lock(&_lock);
+	bool running = _running;
+	_running = false;
+	pthread_cond_signal(&_wake);
+	pthread_mutex_unlock(&_lock);
+	if (running)
+		pthread_join(_thread, NULL);
+}
+
+void* SnapshotWriter::writeLoop(void* arg)
+{
+	SnapshotWriter* writer = static_cast<SnapshotWriter*>(arg);
+	std::string image;
+
+	pthread_mutex_lock(&writer->_lock);
+	while (true)
+	{
+		while (writer->_running && !writer->_pending)
+			pthread_cond_wait(&writer->_wake, &writer->_lock);
+		if (!writer->_pending)
+			break;
+		image.swap(writer->_image);
+		size_t count = writer->_count;
+		writer->_pending = false;
+		pthread_mutex_unlock(&writer->_lock);
+
+		storeImage(writer->_path, image, count);
+		image.clear();
+		pthread_mutex_lock(&writer->_lock);
+	}
+	pthread_mutex_unlock(&writer->_lock);
+	return NULL;
+}
@@ -0,0 +1,262 @@
+#include "IoRing.hpp"
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace
+{
+	std::string failure(char const* what)
+	{
+		return std::string(what) + ": " + strerror(errno);
+	}
+
+	int ringEnter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t argSize)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argSize));
+	}
+
+	int ringRegister(int fd, unsigned opcode, void* arg, unsigned count)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+	}
+}
+
+IoRing::IoRing(unsigned entries)
+	: _fd(-1), _ringMap(MAP_FAILED), _ringSize(0), _sqes(NULL), _sqesSize(0), _sqHead(NULL),
+	_sqTail(NULL), _sqArray(NULL), _sqMask(0), _sqEntries(0), _cqHead(NULL), _cqTail(NULL),
+	_cqMask(0), _cqes(NULL), _prepared(0), _buffers(NULL), _buffersSize(0), _bufferData(NULL),
+	_bufferTail(0)
+{
+	try
+	{
+		setupRings(entries);
+		requireOps();
+		setupBuffers();
+	}
+	catch (...)
+	{
+		release();
+		throw;
+	}
+}
+
+IoRing::~IoRing()
+{
+	release();
+}
+
+void IoRing::release()
+{
+	if (_fd >= 0)
+		close(_fd);
+	if (_sqes)
+		munmap(_sqes, _sqesSize);
+	if (_ringMap != MAP_FAILED)
+		munmap(_ringMap, _ringSize);
+	if (_buffers)
+		munmap(_buffers, _buffersSize);
+	_fd = -1;
+	_sqes = NULL;
+	_ringMap = MAP_FAILED;
+	_buffers = NULL;
+}
+
+/**
+ * @brief Creates the ring and maps the shared queues.
+ */
+void IoRing::setupRings(unsigned entries)
+{
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = entries * 4;
+	_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	if (_fd < 0)
+		throw std::runtime_error(failure("io_uring_setup"));
+	unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG
+		| IORING_FEAT_FAST_POLL;
+	if ((params.features & needed) != needed)
+		throw std::runtime_error("io_uring lacks single mmap, nodrop, ext_arg or fast poll");
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	_ringSize = sqSize > cqSize ? sqSize : cqSize;
+	_ringMap = mmap(NULL, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		_fd, IORING_OFF_SQ_RING);
+	if (_ringMap == MAP_FAILED)
+		throw std::runtime_error(failure("io_uring ring mmap"));
+	_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		throw std::runtime_error(failure("io_uring sqe mmap"));
+	_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+	char* base = static_cast<char*>(_ringMap);
+	_sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+	_sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+	_sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+	_sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+	_sqEntries = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_entries);
+	_cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+	_cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+	_cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+	_cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+}
+
+/**
+ * @brief Checks that every opcode the reactor submits is supported.
+ */
+void IoRing::requireOps() const
+{
+	static uint8_t const ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+		IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+	union
+	{
+		struct io_uring_probe probe;
+		char storage[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+	} buffer;
+	std::memset(&buffer, 0, sizeof(buffer));
+	if (ringRegister(_fd, IORING_REGISTER_PROBE, &buffer.probe, 256) < 0)
+		throw std::runtime_error(failure("io_uring probe"));
+	for (size_t i = 0; i < sizeof(ops); ++i)
+	{
+		if (ops[i] > buffer.probe.last_op || !(buffer.probe.ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			throw std::runtime_error("io_uring lacks a required opcode");
+	}
+}
+
+/**
+ * @brief Maps the buffer ring and its RING_BUFFERS buffers in one
+ * region, registers it as group 0 and hands every buffer to the kernel.
+ */
+void IoRing::setupBuffers()
+{
+	size_t ringBytes = RING_BUFFERS * sizeof(struct io_uring_buf);
+	long page = sysconf(_SC_PAGESIZE);
+	ringBytes = (ringBytes + static_cast<size_t>(page) - 1) & ~(static_cast<size_t>(page) - 1);
+	_buffersSize = ringBytes + static_cast<size_t>(RING_BUFFERS) * RING_BUFFER_SIZE;
+	void* region = mmap(NULL, _buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+		throw std::runtime_error(failure("io_uring buffer mmap"));
+	_buffers = static_cast<struct io_uring_buf*>(region);
+	_bufferData = static_cast<char*>(region) + ringBytes;
+
+	struct io_uring_buf_reg reg;
+	std::memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uintptr_t>(_buffers);
+	reg.ring_entries = RING_BUFFERS;
+	reg.bgid = 0;
+	if (ringRegister(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		throw std::runtime_error(failure("io_uring buffer ring"));
+	for (unsigned id = 0; id < RING_BUFFERS; ++id)
+		recycle(id);
+}
+
+/**
+ * @brief Claims the next submission slot, submitting what is already
+ * prepared if the queue is full.
+ *
+ * The slot is published at once but the kernel only reads it during
+ * the next enter(), so the caller fills the remaining fields before
+ * calling anything else on the ring.
+ */
+struct io_uring_sqe* IoRing::prepare(uint8_t opcode, int fd, uint64_t userData)
+{
+	unsigned tail = *_sqTail;
+	if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+	{
+		submit(0, NULL, 0);
+		if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+			throw std::runtime_error("io_uring submission queue full");
+	}
+	unsigned index = tail & _sqMask;
+	struct io_uring_sqe* sqe = &_sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = userData;
+	_sqArray[index] = index;
+	__atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+	++_prepared;
+	return sqe;
+}
+
+int IoRing::submit(unsigned wait, void* arg, size_t argSize)
+{
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	if (arg)
+		flags |= IORING_ENTER_EXT_ARG;
+	int submitted = ringEnter(_fd, _prepared, wait, flags, arg, argSize);
+	if (submitted < 0)
+	{
+		if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN)
+			return 0;
+		throw std::runtime_error(failure("io_uring_enter"));
+	}
+	_prepared -= static_cast<unsigned>(submitted);
+	return submitted;
+}
+
+/**
+ * @brief Submits everything prepared and waits for one completion.
+ *
+ * @param timeoutMs Milliseconds to wait, -1 to wait forever.
+ * @return Number of entries submitted.
+ */
+int IoRing::enter(int timeoutMs)
+{
+	if (timeoutMs < 0)
+		return submit(1, NULL, 0);
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = static_cast<long>(timeoutMs % 1000) * 1000000;
+	struct io_uring_getevents_arg arg;
+	std::memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uintptr_t>(&ts);
+	return submit(1, &arg, sizeof(arg));
+}
+
+/**
+ * @brief Pops the oldest completion, if any.
+ */
+bool IoRing::next(struct io_uring_cqe& cqe)
+{
+	unsigned head = *_cqHead;
+	if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+		return false;
+	cqe = _cqes[head & _cqMask];
+	__atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * @brief Data of the provided buffer a receive completion names in
+ * its flags.
+ */
+char const* IoRing::buffer(unsigned id) const
+{
+	return _bufferData + static_cast<size_t>(id) * RING_BUFFER_SIZE;
+}
+
+/**
+ * @brief Gives a consumed buffer back to the kernel.
+ *
+ * The ring is addressed as an array of io_uring_buf with the tail in
+ * the first entry's resv field: io_uring_buf_ring's flexible array
+ * sits behind an empty struct, which has size 1 in C++ and would shift
+ * every entry.
+ */
+void IoRing::recycle(unsigned id)
+{
+	struct io_uring_buf* entry = _buffers + (_bufferTail & (RING_BUFFERS - 1));
+	entry->addr = reinterpret_cast<uintptr_t>(_bufferData + static_cast<size_t>(id) * RING_BUFFER_SIZE);
+	entry->len = RING_BUFFER_SIZE;
+	entry->bid = static_cast<unsigned short>(id);
+	++_bufferTail;
+	__atomic_store_n(&_buffers->resv, _bufferTail, __ATOMIC_RELEASE);
+}
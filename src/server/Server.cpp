@@ -2,6 +2,9 @@
 #include "Command.hpp"
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "Logger.hpp"
+#include "ChannelSnapshot.hpp"
+#include "Metrics.hpp"
 #include <iostream>
 #include <unistd.h>
 #include <fcntl.h>
@@ -9,94 +12,192 @@
 #include <cstdio>
 #include <sys/socket.h>
 #include <arpa/inet.h>  // inet_ntoa
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <sys/un.h>
 #include <utility>
 #include <stdexcept>
 #include <csignal>
 #include <fstream>
+#include <set>
+#include <sys/wait.h>
 
 Server* Server::instance = NULL;
 
-Server::Server(int& port, const std::string& password) : password(password)
+void Server::init()
 {
 	instance = this;
+	signalPipe[0] = -1;
+	signalPipe[1] = -1;
+	pthread_mutex_init(&pauseMutex, NULL);
+	pthread_cond_init(&pauseCond, NULL);
+	pausing = false;
+	paused = 0;
+	retiredCount = 0;
+	pthread_mutex_init(&retireMutex, NULL);
+}
+
+/**
+ * @brief Starts fresh: every reactor gets its own socket for each
+ * listener, so with several reactors each listener is a group of
+ * SO_REUSEPORT sockets the kernel balances.
+ */
+Server::Server(std::vector<ListenerSpec> const& listeners, const std::string& password, size_t reactorCount)
+	: password(password), network(*this)
+{
+	init();
 	try
 	{
-		serverFD = socket(AF_INET, SOCK_STREAM, 0);
-		if (serverFD <= 0)
-		{
-			throw std::runtime_error("Can't create socket");
-		}
-		/**
-		 class stores the port and password and uses them during
-		 initialization and operation. The welcome message is
-		 displayed when the server starts listening on the specified
-		 IP address and port. The `SO_REUSEADDR` option is used to
-		 allow the server to bind to the port even if it is in the
-		 `TIME_WAIT` state. Additionally, signal handlers are set up
-		 to handle interruptions and close the server socket
-		 gracefully.
-		 * 
-		 */
-		int opt = 1;
-		// | SO_REUSEPORT
-		//if (bind(listeningSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
-		if (setsockopt(serverFD, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+		if (reactorCount == 0)
+			reactorCount = 1;
+		for (size_t i = 0; i < reactorCount; ++i)
 		{
-			throw std::runtime_error("setsockopt(SO_REUSEADDR) failed");
+			std::vector<int> listenFDs;
+			try
+			{
+				for (size_t l = 0; l < listeners.size(); ++l)
+					listenFDs.push_back(createListener(listeners[l], reactorCount > 1));
+				reactors.push_back(new Reactor(*this, i, listenFDs));
+			}
+			catch (...)
+			{
+				for (size_t l = 0; l < listenFDs.size(); ++l)
+					close(listenFDs[l]);
+				throw;
+			}
 		}
+		setupSignalHandlers();
+	}
+	catch (const std::exception& e)
+	{
+		Logger::log(LOG_ERROR, "server.init_failed", "error=\"%s\"", e.what());
+		Logger::stop();
+		exit(1);
+	}
+}
 
-		SockAddressInitializer initializer(port);
-		struct sockaddr_in serverAddress = initializer.getAddress();
-
-		if (bind(serverFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1)
+/**
+ * @brief Takes over from a previous process during a hot upgrade: one
+ * reactor per inherited set of listeners, then every client and
+ * channel.
+ */
+Server::Server(std::string const& password, Handoff& handoff)
+	: password(password), network(*this)
+{
+	init();
+	try
+	{
+		uint32_t count = handoff.getU32();
+		uint32_t perReactor = handoff.getU32();
+		for (uint32_t i = 0; i < count; ++i)
 		{
-			throw std::runtime_error("Can't bind to IP/port");
+			std::vector<int> listenFDs;
+			for (uint32_t l = 0; l < perReactor; ++l)
+				listenFDs.push_back(handoff.fd(handoff.getU32()));
+			reactors.push_back(new Reactor(*this, i, listenFDs));
 		}
+		if (reactors.empty())
+			throw std::runtime_error("Handoff without listeners");
+		setupSignalHandlers();
+		restore(handoff);
+	}
+	catch (const std::exception& e)
+	{
+		Logger::log(LOG_ERROR, "server.init_failed", "error=\"%s\"", e.what());
+		Logger::stop();
+		exit(1);
+	}
+}
 
-		char ip[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &serverAddress.sin_addr, ip, INET_ADDRSTRLEN);
-		if (listen(serverFD, SOMAXCONN) == -1)
-		{
-			std::stringstream ss;
+namespace
+{
+	void setOption(int fd, int level, int name, int value, char const* label)
+	{
+		if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+			throw std::runtime_error("setsockopt(" + std::string(label) + ") failed: " + strerror(errno));
+	}
+}
 
-			ss << "Server " << ip << ":" << port << " can't listen" << std::endl;
-			throw std::runtime_error(ss.str());
+/**
+ * @brief Creates a non-blocking listening socket for one listener and
+ * applies its socket options, which accepted connections inherit.
+ *
+ * @param spec Address, port and options to apply.
+ * @param reusePort Set SO_REUSEPORT so several reactors can bind the
+ * same port and let the kernel balance connections between them.
+ * @return The listening descriptor.
+ */
+int Server::createListener(ListenerSpec const& spec, bool reusePort)
+{
+	SockAddressInitializer initializer(spec.address, spec.port);
+	int serverFD = socket(initializer.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (serverFD < 0)
+		throw std::runtime_error("Can't create socket for " + spec.describe() + ": " + strerror(errno));
+	try
+	{
+		// SO_REUSEADDR lets a restarted server bind while old
+		// connections on the port are still in TIME_WAIT.
+		setOption(serverFD, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+		if (reusePort)
+			setOption(serverFD, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+		if (initializer.family() == AF_INET6 && spec.v6Only >= 0)
+			setOption(serverFD, IPPROTO_IPV6, IPV6_V6ONLY, spec.v6Only, "IPV6_V6ONLY");
+		if (spec.noDelay)
+			setOption(serverFD, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+		// Buffer sizes must be set before listen() to size the TCP
+		// window scale of accepted connections.
+		if (spec.sendBuffer)
+			setOption(serverFD, SOL_SOCKET, SO_SNDBUF, spec.sendBuffer, "SO_SNDBUF");
+		if (spec.receiveBuffer)
+			setOption(serverFD, SOL_SOCKET, SO_RCVBUF, spec.receiveBuffer, "SO_RCVBUF");
+		if (spec.keepIdle)
+		{
+			setOption(serverFD, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+			setOption(serverFD, IPPROTO_TCP, TCP_KEEPIDLE, spec.keepIdle, "TCP_KEEPIDLE");
+			if (spec.keepInterval)
+				setOption(serverFD, IPPROTO_TCP, TCP_KEEPINTVL, spec.keepInterval, "TCP_KEEPINTVL");
+			if (spec.keepCount)
+				setOption(serverFD, IPPROTO_TCP, TCP_KEEPCNT, spec.keepCount, "TCP_KEEPCNT");
 		}
-		std::cout << "Server listening on " << ip << ":" << port << "\n";
-
-		setNonBlocking(serverFD);
+		if (spec.userTimeout)
+			setOption(serverFD, IPPROTO_TCP, TCP_USER_TIMEOUT, spec.userTimeout, "TCP_USER_TIMEOUT");
+		if (spec.deferAccept)
+			setOption(serverFD, IPPROTO_TCP, TCP_DEFER_ACCEPT, spec.deferAccept, "TCP_DEFER_ACCEPT");
 
-		struct pollfd serverP_FDs = {serverFD, POLLIN, 0};
-		pollFDs.push_back(serverP_FDs);
-
-		pthread_mutex_init(&clientsMutex, NULL);
-		pthread_mutex_init(&channelsMutex, NULL);
-		setupSignalHandlers();
+		if (bind(serverFD, initializer.getAddress(), initializer.getLength()) == -1)
+			throw std::runtime_error("Can't bind to " + spec.describe() + ": " + strerror(errno));
+		if (listen(serverFD, spec.backlog) == -1)
+			throw std::runtime_error("Server " + spec.describe() + " can't listen: " + strerror(errno));
+		Logger::log(LOG_INFO, "server.listen", "addr=%s port=%d backlog=%d nodelay=%d defer_accept=%d",
+			spec.address.c_str(), spec.port, spec.backlog, spec.noDelay ? 1 : 0, spec.deferAccept);
 	}
-	catch (const std::exception& e)
+	catch (...)
 	{
-		std::cerr << "Error initializing server: " << e.what() << std::endl;
-		exit(1);
+		close(serverFD);
+		throw;
 	}
+	return serverFD;
 }
 
 Server::~Server()
 {
-	pthread_mutex_destroy(&clientsMutex);
-	pthread_mutex_destroy(&channelsMutex);
-	close(serverFD);
-
-	for (ClientsIte it = clients.begin(); it != clients.end(); ++it)
+	for (size_t i = 0; i < reactors.size(); ++i)
 	{
-		delete it->second;
+		delete reactors[i];
 	}
+	for (size_t i = 0; i < retired.size(); ++i)
+		delete retired[i].channel;
 
-	for (ChannelIte it = channels.begin(); it != channels.end(); ++it)
+	if (!adminPath.empty())
+		unlink(adminPath.c_str());
+	for (int i = 0; i < 2; ++i)
 	{
-		delete it->second;
+		if (signalPipe[i] >= 0)
+			close(signalPipe[i]);
 	}
-	removeLockFile();
+	pthread_cond_destroy(&pauseCond);
+	pthread_mutex_destroy(&pauseMutex);
+	pthread_mutex_destroy(&retireMutex);
 }
 
 void Server::setNonBlocking(int fd)
@@ -112,152 +213,811 @@ void Server::setNonBlocking(int fd)
 	}
 }
 
-void Server::handleNewConnection()
+/**
+ * @brief Starts every reactor but the first on its own thread and runs
+ * the first one on the calling thread. Never returns.
+ */
+void Server::run()
 {
-	try
+	for (size_t i = 1; i < reactors.size(); ++i)
+	{
+		reactors[i]->spawn();
+	}
+	reactors[0]->run();
+}
+
+/**
+ * @brief Routes SIGINT/SIGTERM through a self-pipe watched by the first
+ * reactor, so shutdown runs on a reactor thread and never inside a
+ * handler that may have interrupted a thread holding a lock.
+ */
+void Server::setupSignalHandlers()
+{
+	if (pipe2(signalPipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		throw std::runtime_error("Failed to create signal pipe: " + std::string(strerror(errno)));
+	reactors[0]->setSignalListener(signalPipe[0]);
+	signal(SIGINT, Server::signalHandler);
+	signal(SIGTERM, Server::signalHandler);
+	signal(SIGUSR2, Server::signalHandler);
+	// Writes to a peer that already closed must fail with EPIPE rather
+	// than kill the process.
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * @brief Only does what is async-signal-safe: hands the signal number
+ * to the first reactor through the self-pipe.
+ */
+void Server::signalHandler(int signum)
+{
+	char byte = static_cast<char>(signum);
+	ssize_t written = write(instance->signalPipe[1], &byte, 1);
+	(void)written;
+}
+
+/**
+ * @brief Tells every client the server is going away and exits. Runs on
+ * the first reactor's thread, which parks the others first, as an
+ * upgrade does: their clients can then be walked without racing their
+ * own accepts and disconnects, and exit() finds no loop mid-iteration.
+ * With io_uring nothing is in flight afterwards, so the goodbye is
+ * written straight from this thread.
+ */
+void Server::shutdown(int signum)
+{
+	Logger::log(LOG_INFO, "server.shutdown", "signal=%d", signum);
+	pauseReactors();
+	reactors[0]->quiesce();
+
+	for (size_t i = 0; i < reactors.size(); ++i)
 	{
-		struct sockaddr_in clientAddress;
-		socklen_t clientLength = sizeof(clientAddress);
-		int clientFD = accept(serverFD, (struct sockaddr*)&clientAddress, &clientLength);
-		if (clientFD < 0)
+		reactors[i]->broadcast("Server is shutting down.\n");
+	}
+
+	writeSnapshot();
+	snapshots.stop();
+	if (!adminPath.empty())
+		unlink(adminPath.c_str());
+	Logger::stop();
+	exit(signum);
+}
+
+/**
+ * @brief Signals forwarded by the self-pipe: SIGUSR2 upgrades, anything
+ * else shuts down.
+ */
+void Server::handleSignal(int signum)
+{
+	if (signum == SIGUSR2)
+		upgrade();
+	else
+		shutdown(signum);
+}
+
+/**
+ * @brief Recreates the channels of the last snapshot, when `load` is
+ * set, then writes a new one every `interval` seconds.
+ *
+ * Loading happens before any reactor runs. A process taking over in a
+ * hot upgrade already got the channels through the handoff and only
+ * resumes writing.
+ */
+void Server::enableSnapshots(std::string const& path, unsigned interval, bool load)
+{
+	snapshotPath = path;
+	if (load)
+	{
+		uint64_t start = Metrics::now();
+		try
+		{
+			size_t count = ChannelSnapshot::load(path, channels);
+			Logger::log(LOG_INFO, "snapshot.loaded", "path=%s channels=%lu us=%lu", path.c_str(),
+				static_cast<unsigned long>(count),
+				static_cast<unsigned long>((Metrics::now() - start) / 1000));
+		}
+		catch (std::exception const& e)
 		{
-			throw std::runtime_error("Failed to accept new connection: " + std::string(strerror(errno)));
+			Logger::log(LOG_WARN, "snapshot.load_failed", "error=\"%s\"", e.what());
 		}
-		setNonBlocking(clientFD);
-		struct pollfd pfd = {clientFD, POLLIN, 0};
-		pollFDs.push_back(pfd);
+	}
+	snapshots.start(path);
+	if (interval > 0)
+		reactors[0]->setSnapshotInterval(interval);
+}
+
+/**
+ * @brief Captures the channel snapshot, if enabled, and hands it to the
+ * writer thread. A failed write is logged there and the previous
+ * snapshot stays in place.
+ */
+void Server::writeSnapshot()
+{
+	if (snapshotPath.empty())
+		return;
+	size_t count;
+	std::string image = ChannelSnapshot::capture(channels, count);
+	snapshots.submit(image, count);
+}
+
+/**
+ * @brief Names this server and sets up its links from the config. The
+ * first reactor connects the autoconnect ones as soon as it runs.
+ */
+void Server::enableLinks(ServerConfig const& config)
+{
+	if (!config.name.empty())
+		Command::setServerName(config.name);
+	network.configure(config.description, config.links);
+	if (network.autoconnects())
+		reactors[0]->setLinkRetry(LINK_RETRY);
+}
 
-		pthread_mutex_lock(&clientsMutex);
-		clients.insert(std::make_pair(clientFD, new Client(clientFD)));
-		pthread_mutex_unlock(&clientsMutex);
+Network& Server::getNetwork()
+{
+	return network;
+}
 
-		std::cout << "New client connected: " << clientFD << std::endl;
+Server* Server::getInstance()
+{
+	return instance;
+}
 
-		ClientHandler* handler = new ClientHandler(this, clientFD);
-		pthread_t thread;
-		pthread_create(&thread, NULL, ClientHandler::start, handler);
-		pthread_detach(thread);
+/**
+ * @brief Remembers how this process was started so an upgrade can
+ * start the binary at the same path with the same options. The path is
+ * resolved now, while it still names the running binary.
+ */
+void Server::setArguments(int argc, char* argv[])
+{
+	char path[4096];
+	ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	executable = length > 0 ? std::string(path, static_cast<size_t>(length)) : std::string(argv[0]);
+	arguments.clear();
+	for (int i = 0; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--upgrade-fd") == 0 && i + 1 < argc)
+			++i;
+		else
+			arguments.push_back(argv[i]);
 	}
-	catch (const std::exception& e)
+}
+
+/**
+ * @brief Asks the first reactor to upgrade; safe from any thread.
+ */
+void Server::requestUpgrade()
+{
+	char byte = static_cast<char>(SIGUSR2);
+	ssize_t written = write(signalPipe[1], &byte, 1);
+	(void)written;
+}
+
+/**
+ * @brief Called by every reactor when woken: parks the thread for as
+ * long as an upgrade is in progress.
+ */
+void Server::checkpoint()
+{
+	pthread_mutex_lock(&pauseMutex);
+	if (pausing)
 	{
-		std::cerr << "Error handling new connection: " << e.what() << std::endl;
+		++paused;
+		pthread_cond_broadcast(&pauseCond);
+		while (pausing)
+			pthread_cond_wait(&pauseCond, &pauseMutex);
+		--paused;
 	}
+	pthread_mutex_unlock(&pauseMutex);
 }
 
-void Server::handleClient(int clientFD)
+/**
+ * @brief True while an upgrade is stopping the reactors.
+ */
+bool Server::isPausing()
 {
-	try
+	pthread_mutex_lock(&pauseMutex);
+	bool result = pausing;
+	pthread_mutex_unlock(&pauseMutex);
+	return result;
+}
+
+/**
+ * @brief Stops every reactor but the calling first one at the top of
+ * its loop, where it holds no lock and no half-handled client.
+ */
+void Server::pauseReactors()
+{
+	pthread_mutex_lock(&pauseMutex);
+	pausing = true;
+	pthread_mutex_unlock(&pauseMutex);
+	for (size_t i = 1; i < reactors.size(); ++i)
+		reactors[i]->wake();
+	pthread_mutex_lock(&pauseMutex);
+	while (paused < reactors.size() - 1)
+		pthread_cond_wait(&pauseCond, &pauseMutex);
+	pthread_mutex_unlock(&pauseMutex);
+}
+
+void Server::resumeReactors()
+{
+	pthread_mutex_lock(&pauseMutex);
+	pausing = false;
+	pthread_cond_broadcast(&pauseCond);
+	pthread_mutex_unlock(&pauseMutex);
+}
+
+namespace
+{
+	struct ChannelCollector
 	{
-		while (true)
+		std::vector<Channel*> channels;
+
+		void operator()(Channel* channel)
 		{
-			pthread_mutex_lock(&clientsMutex);
-			std::map<int, Client*>::iterator it = clients.find(clientFD);
-			if (it != clients.end())
-			{
-				try {
-					it->second->handleRead();
-				} catch (const std::runtime_error& e)
-				{
-					std::cerr << "Client " << clientFD << " error: " << e.what() << std::endl;
-					pthread_mutex_unlock(&clientsMutex);
-					throw; // Re-throw to handle cleanup outside the loop
-				}
-			}
-			pthread_mutex_unlock(&clientsMutex);
+			channels.push_back(channel);
 		}
+	};
+
+	enum
+	{
+		CLIENT_PASS = 1,
+		CLIENT_REGISTERED = 2,
+		CLIENT_OPERATOR = 4,
+		CLIENT_MESSAGE_TAGS = 8,
+		CLIENT_SERVER_TIME = 16,
+		CHANNEL_INVITE_ONLY = 1,
+		CHANNEL_TOPIC_RESTRICTED = 2
+	};
+}
+
+/**
+ * @brief Serializes listeners, clients and channels. Every reactor must
+ * be paused.
+ *
+ * Clients are numbered in the order written and channels refer to
+ * their members and operators by those numbers. Each client carries
+ * the input it had not framed yet and the output its socket had not
+ * taken, so nothing in flight is lost.
+ *
+ * Users of other servers are not handed over, since links drop with
+ * the old process. Each local client's output is followed by a QUIT
+ * for every remote user it shares a channel with, worded as a
+ * netsplit, and channels with no local member are left out; the burst
+ * when the links connect again brings both back. The QUITs only go in
+ * the handoff, so a failed upgrade leaves the clients' view untouched.
+ */
+void Server::capture(Handoff& handoff)
+{
+	handoff.putU32(static_cast<uint32_t>(reactors.size()));
+	handoff.putU32(static_cast<uint32_t>(reactors[0]->getListenFds().size()));
+	for (size_t i = 0; i < reactors.size(); ++i)
+	{
+		std::vector<int> const& listenFDs = reactors[i]->getListenFds();
+		for (size_t l = 0; l < listenFDs.size(); ++l)
+			handoff.putU32(handoff.addFd(listenFDs[l]));
 	}
-	catch (const std::exception& e)
+
+	ChannelCollector collector;
+	channels.forEach(collector);
+	std::vector<Channel*> kept;
+	std::map<Client*, std::set<Client*> > split;
+	for (size_t i = 0; i < collector.channels.size(); ++i)
+	{
+		MemberSnapshot members = collector.channels[i]->getMembers();
+		std::vector<Client*> local;
+		std::vector<Client*> remote;
+		for (MemberSnapshot::const_iterator it = members.begin(); it != members.end(); ++it)
+			((*it)->getRoute() ? remote : local).push_back(*it);
+		if (local.empty())
+			continue;
+		kept.push_back(collector.channels[i]);
+		for (size_t l = 0; l < local.size(); ++l)
+			split[local[l]].insert(remote.begin(), remote.end());
+	}
+
+	std::map<Client*, uint32_t> numbers;
+	uint32_t count = 0;
+	for (size_t i = 0; i < reactors.size(); ++i)
+	{
+		std::map<int, Client*> const& clients = reactors[i]->getClients();
+		for (std::map<int, Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+		{
+			if (!it->second->isLink)
+				++count;
+		}
+	}
+	handoff.putU32(count);
+	for (size_t i = 0; i < reactors.size(); ++i)
 	{
-		std::cerr << "Error handling client: " << e.what() << std::endl;
-		close(clientFD);
-		removeClient(clientFD);
+		std::map<int, Client*> const& clients = reactors[i]->getClients();
+		for (std::map<int, Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+		{
+			Client* client = it->second;
+			if (client->isLink)
+				continue;
+			uint32_t number = static_cast<uint32_t>(numbers.size());
+			numbers[client] = number;
+			handoff.putU32(static_cast<uint32_t>(i));
+			handoff.putU32(handoff.addFd(it->first));
+			handoff.putString(client->getNickname());
+			handoff.putString(client->username);
+			handoff.putString(client->realname);
+			handoff.putString(client->hostname);
+			handoff.putU32((client->passAccepted ? CLIENT_PASS : 0)
+				| (client->registered ? CLIENT_REGISTERED : 0)
+				| (client->isOperator ? CLIENT_OPERATOR : 0)
+				| (client->getCapabilities() & CAP_MESSAGE_TAGS ? CLIENT_MESSAGE_TAGS : 0)
+				| (client->getCapabilities() & CAP_SERVER_TIME ? CLIENT_SERVER_TIME : 0));
+			handoff.putString(client->pendingInput());
+			std::string output = client->unsentOutput();
+			std::set<Client*> const& gone = split[client];
+			for (std::set<Client*>::const_iterator user = gone.begin(); user != gone.end(); ++user)
+				output += ":" + (*user)->prefix() + " QUIT :" + Command::serverName() + " "
+					+ (*user)->server + "\r\n";
+			handoff.putString(output);
+		}
+	}
+
+	handoff.putU32(static_cast<uint32_t>(kept.size()));
+	for (size_t i = 0; i < kept.size(); ++i)
+	{
+		Channel* channel = kept[i];
+		MemberSnapshot members = channel->getMembers();
+		pthread_mutex_lock(&channel->mutex);
+		handoff.putString(channel->name);
+		handoff.putString(channel->topic);
+		handoff.putString(channel->key);
+		handoff.putU32(static_cast<uint32_t>(channel->limit));
+		handoff.putU32((channel->inviteOnly ? CHANNEL_INVITE_ONLY : 0)
+			| (channel->topicRestricted ? CHANNEL_TOPIC_RESTRICTED : 0));
+		std::vector<uint32_t> joined;
+		std::vector<uint32_t> operators;
+		for (MemberSnapshot::const_iterator it = members.begin(); it != members.end(); ++it)
+		{
+			std::map<Client*, uint32_t>::iterator number = numbers.find(*it);
+			if (number == numbers.end())
+				continue;
+			joined.push_back(number->second);
+			if (channel->operators.count(*it))
+				operators.push_back(number->second);
+		}
+		handoff.putU32(static_cast<uint32_t>(joined.size()));
+		for (size_t j = 0; j < joined.size(); ++j)
+			handoff.putU32(joined[j]);
+		handoff.putU32(static_cast<uint32_t>(operators.size()));
+		for (size_t j = 0; j < operators.size(); ++j)
+			handoff.putU32(operators[j]);
+		handoff.putU32(static_cast<uint32_t>(channel->invited.size()));
+		for (std::set<std::string>::iterator it = channel->invited.begin(); it != channel->invited.end(); ++it)
+			handoff.putString(*it);
+		pthread_mutex_unlock(&channel->mutex);
 	}
 }
 
-void Server::run()
+/**
+ * @brief Rebuilds what capture() wrote, after the listeners.
+ */
+void Server::restore(Handoff& handoff)
 {
-	while (true)
+	std::vector<Client*> restored;
+	uint32_t count = handoff.getU32();
+	for (uint32_t i = 0; i < count; ++i)
 	{
-		try
+		uint32_t owner = handoff.getU32();
+		int fd = handoff.fd(handoff.getU32());
+		Reactor* reactor = reactors[owner < reactors.size() ? owner : 0];
+		Client* client = new Client(fd, reactor);
+		std::string nickname = handoff.getString();
+		client->username = handoff.getString();
+		client->realname = handoff.getString();
+		client->hostname = handoff.getString();
+		client->admissionKey = AdmissionTable::keyOf(client->hostname);
+		admissions.track(client->admissionKey);
+		uint32_t flags = handoff.getU32();
+		client->passAccepted = flags & CLIENT_PASS;
+		client->registered = flags & CLIENT_REGISTERED;
+		client->isOperator = flags & CLIENT_OPERATOR;
+		client->setCapabilities((flags & CLIENT_MESSAGE_TAGS ? CAP_MESSAGE_TAGS : 0)
+			| (flags & CLIENT_SERVER_TIME ? CAP_SERVER_TIME : 0));
+		if (!nickname.empty() && nicks.claim(client, "", nickname))
+			client->setNickname(nickname);
+		client->restoreInput(handoff.getString());
+		reactor->adopt(client, handoff.getString());
+		restored.push_back(client);
+	}
+
+	count = handoff.getU32();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Channel* channel = joinChannel(handoff.getString());
+		channel->topic = handoff.getString();
+		channel->key = handoff.getString();
+		channel->limit = handoff.getU32();
+		uint32_t flags = handoff.getU32();
+		channel->inviteOnly = flags & CHANNEL_INVITE_ONLY;
+		channel->topicRestricted = flags & CHANNEL_TOPIC_RESTRICTED;
+		for (uint32_t n = handoff.getU32(); n > 0; --n)
 		{
-			int pollCount = poll(pollFDs.data(), pollFDs.size(), -1);
-			if (pollCount < 0)
-			{
-				throw std::runtime_error("Poll failed: " + std::string(strerror(errno)));
-			}
+			uint32_t number = handoff.getU32();
+			if (number < restored.size())
+				channel->addMember(restored[number]);
+		}
+		for (uint32_t n = handoff.getU32(); n > 0; --n)
+		{
+			uint32_t number = handoff.getU32();
+			if (number < restored.size())
+				channel->operators.insert(restored[number]);
+		}
+		for (uint32_t n = handoff.getU32(); n > 0; --n)
+			channel->invited.insert(handoff.getString());
+	}
+	Logger::log(LOG_INFO, "server.adopted", "clients=%lu channels=%lu",
+		static_cast<unsigned long>(restored.size()), static_cast<unsigned long>(count));
+}
 
-			for (size_t i = 0; i < pollFDs.size(); ++i)
-			{
-				if (pollFDs[i].revents & POLLIN)
-				{
-					if (pollFDs[i].fd == serverFD)
-						handleNewConnection();
-				}
-			}
+/**
+ * @brief Forks and execs the binary again with one end of the handoff
+ * socket left open across exec. Only async-signal-safe calls happen
+ * between fork() and exec().
+ */
+pid_t Server::launchSuccessor(int socket)
+{
+	std::stringstream fd;
+	fd << socket;
+	std::vector<std::string> args(arguments);
+	args.push_back("--upgrade-fd");
+	args.push_back(fd.str());
+	std::vector<char*> argv;
+	for (size_t i = 0; i < args.size(); ++i)
+		argv.push_back(const_cast<char*>(args[i].c_str()));
+	argv.push_back(NULL);
+
+	pid_t pid = fork();
+	if (pid < 0)
+		throw std::runtime_error("fork: " + std::string(strerror(errno)));
+	if (pid == 0)
+	{
+		fcntl(socket, F_SETFD, 0);
+		execv(executable.c_str(), &argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+/**
+ * @brief Hands the whole server over to a freshly exec'd binary.
+ *
+ * Connections never notice: the sockets stay open because the new
+ * process holds them before this one exits, and anything that arrives
+ * in between waits in the kernel. On any failure the old process
+ * resumes serving and the new one, if any, is killed.
+ */
+void Server::upgrade()
+{
+	if (executable.empty())
+	{
+		Logger::log(LOG_ERROR, "server.upgrade_failed", "error=\"no executable recorded\"");
+		return;
+	}
+	Logger::log(LOG_INFO, "server.upgrade_start", "binary=%s", executable.c_str());
+	pauseReactors();
+	reactors[0]->quiesce();
+	int pair[2] = { -1, -1 };
+	pid_t child = -1;
+	try
+	{
+		Handoff handoff;
+		capture(handoff);
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+			throw std::runtime_error("socketpair: " + std::string(strerror(errno)));
+		child = launchSuccessor(pair[1]);
+		close(pair[1]);
+		pair[1] = -1;
+		handoff.send(pair[0]);
+		if (!Handoff::awaitAcknowledge(pair[0], UPGRADE_TIMEOUT * 1000))
+			throw std::runtime_error("successor did not take over");
+		Logger::log(LOG_INFO, "server.upgrade_done", "pid=%d clients=%lu",
+			static_cast<int>(child), static_cast<unsigned long>(handoff.fdCount() - reactors.size() * reactors[0]->getListenFds().size()));
+		snapshots.stop();
+		Logger::stop();
+		_exit(0);
+	}
+	catch (const std::exception& e)
+	{
+		Logger::log(LOG_ERROR, "server.upgrade_failed", "error=\"%s\"", e.what());
+		if (child > 0)
+		{
+			kill(child, SIGKILL);
+			waitpid(child, NULL, 0);
 		}
-		catch (const std::exception& e)
+		for (int i = 0; i < 2; ++i)
 		{
-			std::cerr << "Error in server run loop: " << e.what() << std::endl;
+			if (pair[i] >= 0)
+				close(pair[i]);
 		}
+		resumeReactors();
+		reactors[0]->resume();
 	}
 }
 
-void Server::setupSignalHandlers()
+/**
+ * @brief Looks up a channel by name, ignoring case.
+ *
+ * @return The channel, or NULL if it does not exist.
+ */
+Channel* Server::findChannel(std::string const& name)
 {
-	signal(SIGINT, Server::signalHandler);
-	signal(SIGTERM, Server::signalHandler);
+	return channels.find(name);
 }
 
-void Server::signalHandler(int signum)
+/**
+ * @brief Looks up a channel by name, creating it if needed.
+ */
+Channel* Server::joinChannel(std::string const& name)
+{
+	return channels.findOrCreate(name);
+}
+
+/**
+ * @brief Removes a member; a channel left empty is taken out of the
+ * registry and retired. The caller's pointer stays valid until its
+ * reactor's loop iteration ends.
+ *
+ * @return true if the client was a member.
+ */
+bool Server::leaveChannel(Channel* channel, Client* client)
 {
-	std::cout << "Interrupt signal (" << signum << ") received. Closing server socket." << std::endl;
+	if (!channel->removeMember(client))
+		return false;
+	if (channel->size() == 0 && channels.remove(channel))
+		retire(channel);
+	return true;
+}
+
+/**
+ * @brief Queues a removed channel for reclaimChannels(), with the epoch
+ * every reactor is at now.
+ */
+void Server::retire(Channel* channel)
+{
+	Retired entry;
+	entry.channel = channel;
+	__sync_synchronize();
+	for (size_t i = 0; i < reactors.size(); ++i)
+		entry.epochs.push_back(reactors[i]->getEpoch());
+	pthread_mutex_lock(&retireMutex);
+	retired.push_back(entry);
+	__sync_add_and_fetch(&retiredCount, 1);
+	pthread_mutex_unlock(&retireMutex);
+}
 
-	// Access the server instance
-	Server* server = Server::getInstance();
+/**
+ * @brief True once no reactor can still use the channel: each was
+ * either waiting for events at retirement or has moved on since.
+ */
+bool Server::reclaimable(Retired const& entry) const
+{
+	for (size_t i = 0; i < entry.epochs.size(); ++i)
+	{
+		if ((entry.epochs[i] & 1) && reactors[i]->getEpoch() == entry.epochs[i])
+			return false;
+	}
+	return true;
+}
 
-	// Send a message to each client
-	pthread_mutex_lock(&server->clientsMutex);
-	for (ClientsIte it = server->clients.begin(); it != server->clients.end(); ++it)
+/**
+ * @brief Frees the retired channels no reactor can reach any more.
+ * Called by every reactor between loop iterations.
+ */
+void Server::reclaimChannels()
+{
+	if (__atomic_load_n(&retiredCount, __ATOMIC_RELAXED) == 0)
+		return;
+	std::vector<Channel*> done;
+	pthread_mutex_lock(&retireMutex);
+	for (size_t i = 0; i < retired.size(); )
 	{
-		it->second->sendMessage("Server is shutting down.\n");
+		if (reclaimable(retired[i]))
+		{
+			done.push_back(retired[i].channel);
+			retired[i] = retired.back();
+			retired.pop_back();
+		}
+		else
+			++i;
 	}
-	pthread_mutex_unlock(&server->clientsMutex);
+	__sync_sub_and_fetch(&retiredCount, done.size());
+	pthread_mutex_unlock(&retireMutex);
+	for (size_t i = 0; i < done.size(); ++i)
+		delete done[i];
+}
 
-	// Close the server socket
-	close(server->serverFD);
+/**
+ * @brief Collects every client sharing a channel with client, each
+ * once. The snapshots keep the peers alive while the caller uses them.
+ */
+static std::set<Client*> collectPeers(Client* client, std::vector<MemberSnapshot>& held)
+{
+	std::set<Client*> peers;
+	std::vector<Channel*> joined = client->getChannels();
 
-	// Exit the program
-	exit(signum);
+	for (std::vector<Channel*>::iterator it = joined.begin(); it != joined.end(); ++it)
+	{
+		held.push_back((*it)->getMembers());
+		peers.insert(held.back().begin(), held.back().end());
+	}
+	peers.erase(client);
+	return peers;
 }
 
-Server* Server::getInstance()
+/**
+ * @brief Sends a message once to every local client sharing at least
+ * one channel with client (NICK changes, QUIT). Links get these from
+ * the Network, not once per remote peer.
+ */
+void Server::notifyPeers(Client* client, SharedBuffer const& message)
 {
-	return instance;
+	std::vector<MemberSnapshot> held;
+	std::set<Client*> peers = collectPeers(client, held);
+	for (std::set<Client*>::iterator it = peers.begin(); it != peers.end(); ++it)
+	{
+		if (!(*it)->getRoute())
+			(*it)->sendMessage(message);
+	}
 }
 
-void Server::createLockFile()
+/**
+ * @brief Removes a client from every channel it belongs to and tells
+ * its peers it quit. Called by the owning reactor before the client is
+ * detached, or by the Network for a remote user; the quit of a local
+ * one is also passed on to every link.
+ */
+void Server::leaveChannels(Client* client, std::string const& reason)
 {
-	std::ofstream lockFile(lockFilePath.c_str());
-	if (!lockFile)
+	if (client->registered)
+	{
+		SharedBuffer line(":" + client->prefix() + " QUIT :" + reason + "\r\n");
+		notifyPeers(client, line);
+		if (!client->getRoute())
+			network.propagate(line, NULL);
+	}
+	std::vector<Channel*> joined = client->getChannels();
+	for (std::vector<Channel*>::iterator it = joined.begin(); it != joined.end(); ++it)
 	{
-		throw std::runtime_error("Unable to create lock file");
+		leaveChannel(*it, client);
 	}
-	lockFile.close();
 }
 
-void Server::removeLockFile()
+bool Server::checkPassword(std::string const& candidate) const
+{
+	return candidate == password;
+}
+
+/**
+ * @brief Sets the OPER password; an empty one disables OPER.
+ */
+void Server::setOperPassword(std::string const& secret)
+{
+	operPassword = secret;
+}
+
+bool Server::checkOperPassword(std::string const& candidate) const
+{
+	return !operPassword.empty() && candidate == operPassword;
+}
+
+/**
+ * @brief Moves client to a new nick in the index.
+ *
+ * @return false if another client already holds it (ignoring case).
+ */
+bool Server::claimNick(Client* client, std::string const& nickname)
+{
+	return nicks.claim(client, client->getNickname(), nickname);
+}
+
+void Server::releaseNick(Client* client)
+{
+	nicks.release(client, client->getNickname());
+}
+
+/**
+ * @brief Resolves a nickname with one hash lookup.
+ *
+ * @return A reference to the client, empty if the nick is unknown.
+ */
+ClientRef Server::findClient(std::string const& nickname)
+{
+	return ClientRef(nicks.find(nickname));
+}
+
+void Server::setConnectionLimits(size_t total, size_t perAddress)
 {
-	std::remove(lockFilePath.c_str());
+	admissions.configure(total, perAddress);
 }
 
-void Server::removeClient(int clientFD)
+/**
+ * @brief Counts a new connection against the global and per-address
+ * limits; nothing is counted unless the verdict is ADMIT.
+ */
+AdmissionTable::Verdict Server::admitConnection(uint64_t key)
 {
-	pthread_mutex_lock(&clientsMutex);
-	ClientsIte it = clients.find(clientFD);
-	if (it != clients.end())
+	return admissions.admit(key);
+}
+
+/**
+ * @brief Counts a connection this server opened, such as a link, which
+ * the limits do not apply to.
+ */
+void Server::trackConnection(uint64_t key)
+{
+	admissions.track(key);
+}
+
+void Server::releaseConnection(uint64_t key)
+{
+	admissions.release(key);
+}
+
+size_t Server::nickCount()
+{
+	return nicks.size();
+}
+
+/**
+ * @brief Every channel. The pointers stay valid until the calling
+ * reactor's loop iteration ends.
+ */
+void Server::collectChannels(std::vector<Channel*>& out)
+{
+	ChannelCollector collector;
+	channels.forEach(collector);
+	out.swap(collector.channels);
+}
+
+size_t Server::channelCount()
+{
+	return channels.size();
+}
+
+/**
+ * @brief Listens on a Unix socket that answers every connection with
+ * the metrics in Prometheus text format, then closes it. Served by the
+ * first reactor; a stale socket file from a previous run is replaced.
+ *
+ * @throws std::runtime_error if the socket cannot be set up.
+ */
+void Server::openAdminSocket(std::string const& path)
+{
+	struct sockaddr_un address;
+	if (path.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("Admin socket path too long: " + path);
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::runtime_error("Admin socket: " + std::string(strerror(errno)));
+	unlink(path.c_str());
+	if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0
+		|| listen(fd, 16) < 0)
+	{
+		std::string reason(strerror(errno));
+		close(fd);
+		throw std::runtime_error("Admin socket " + path + ": " + reason);
+	}
+	try
 	{
-		delete it->second;
-		clients.erase(it);
+		setNonBlocking(fd);
+		reactors[0]->setAdminListener(fd);
 	}
-	pthread_mutex_unlock(&clientsMutex);
-}
\ No newline at end of file
+	catch (...)
+	{
+		close(fd);
+		unlink(path.c_str());
+		throw;
+	}
+	adminPath = path;
+	Logger::log(LOG_INFO, "admin.listen", "path=%s", path.c_str());
+}
@@ -0,0 +1,169 @@
+#include "TimerWheel.hpp"
+
+#define TIMER_TICK_NS (static_cast<uint64_t>(TIMER_TICK_MS) * static_cast<uint64_t>(1000000))
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+Timer::Timer() : prev(NULL), next(NULL), expires(0), level(0), kind(0), owner(NULL) {}
+
+bool Timer::armed() const
+{
+	return next != NULL;
+}
+
+TimerWheel::TimerWheel(uint64_t now) : _current(tickOf(now)), _size(0)
+{
+	for (int level = 0; level < TIMER_LEVELS; ++level)
+	{
+		_counts[level] = 0;
+		for (int slot = 0; slot < TIMER_SLOTS; ++slot)
+			_slots[level][slot].prev = _slots[level][slot].next = &_slots[level][slot];
+	}
+}
+
+uint64_t TimerWheel::tickOf(uint64_t ns)
+{
+	return ns / TIMER_TICK_NS;
+}
+
+/**
+ * @brief Links a timer into the slot its distance from the current
+ * tick falls in. Already due timers go to the next tick.
+ */
+void TimerWheel::insert(Timer& timer)
+{
+	if (timer.expires <= _current)
+		timer.expires = _current + 1;
+	uint64_t delta = timer.expires - _current;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= (static_cast<uint64_t>(1) << (TIMER_BITS * (level + 1))))
+		++level;
+	uint64_t expires = timer.expires;
+	if (level == TIMER_LEVELS - 1 && delta >= (static_cast<uint64_t>(1) << (TIMER_BITS * TIMER_LEVELS)))
+		expires = _current + (static_cast<uint64_t>(1) << (TIMER_BITS * TIMER_LEVELS)) - 1;
+	Timer& head = _slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+	timer.prev = head.prev;
+	timer.next = &head;
+	head.prev->next = &timer;
+	head.prev = &timer;
+	timer.level = level;
+	++_counts[level];
+}
+
+void TimerWheel::unlink(Timer& timer)
+{
+	timer.prev->next = timer.next;
+	timer.next->prev = timer.prev;
+	timer.prev = timer.next = NULL;
+	--_counts[timer.level];
+}
+
+/**
+ * @brief (Re)schedules a timer; an armed one is moved.
+ *
+ * @param delayNs Time from `now`, rounded up to whole ticks.
+ */
+void TimerWheel::arm(Timer& timer, uint64_t now, uint64_t delayNs)
+{
+	if (timer.armed())
+		cancel(timer);
+	timer.expires = tickOf(now + delayNs + TIMER_TICK_NS - 1);
+	insert(timer);
+	++_size;
+}
+
+void TimerWheel::cancel(Timer& timer)
+{
+	if (!timer.armed())
+		return;
+	unlink(timer);
+	--_size;
+}
+
+/**
+ * @brief Re-inserts the slot of `level` that has become current; its
+ * timers now land in lower levels.
+ *
+ * @return The slot index, 0 when this level wrapped as well.
+ */
+size_t TimerWheel::cascade(int level)
+{
+	size_t index = static_cast<size_t>((_current >> (TIMER_BITS * level)) & TIMER_MASK);
+	Timer& head = _slots[level][index];
+	Timer* timer = head.next;
+	head.prev = head.next = &head;
+	while (timer != &head)
+	{
+		Timer* next = timer->next;
+		--_counts[level];
+		insert(*timer);
+		timer = next;
+	}
+	return index;
+}
+
+/**
+ * @brief Processes every tick up to `now` and hands back the timers
+ * that fired, already disarmed, in expiry order.
+ */
+void TimerWheel::advance(uint64_t now, std::vector<Timer*>& expired)
+{
+	uint64_t target = tickOf(now);
+	while (_current < target)
+	{
+		if (_size == 0)
+		{
+			_current = target;
+			return;
+		}
+		++_current;
+		size_t index = static_cast<size_t>(_current & TIMER_MASK);
+		if (index == 0)
+		{
+			for (int level = 1; level < TIMER_LEVELS && cascade(level) == 0; ++level)
+				;
+		}
+		Timer& head = _slots[0][index];
+		while (head.next != &head)
+		{
+			Timer* timer = head.next;
+			unlink(*timer);
+			--_size;
+			expired.push_back(timer);
+		}
+	}
+}
+
+/**
+ * @brief Milliseconds until the next tick that has work: the next
+ * non-empty level-0 slot, or the next level-0 wrap if only higher
+ * levels hold timers.
+ *
+ * @return -1 when no timer is armed, as epoll_wait() expects.
+ */
+int TimerWheel::timeout(uint64_t now) const
+{
+	if (_size == 0)
+		return -1;
+	uint64_t due = (_current | TIMER_MASK) + 1;
+	if (_counts[0] > 0)
+	{
+		for (uint64_t tick = _current + 1; tick < due; ++tick)
+		{
+			Timer const& head = _slots[0][tick & TIMER_MASK];
+			if (head.next != &head)
+			{
+				due = tick;
+				break;
+			}
+		}
+	}
+	uint64_t at = due * TIMER_TICK_NS;
+	if (at <= now)
+		return 0;
+	return static_cast<int>((at - now + 999999) / 1000000);
+}
+
+size_t TimerWheel::size() const
+{
+	return _size;
+}
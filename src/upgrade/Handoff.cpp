@@ -0,0 +1,236 @@
+#include "Handoff.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* "IRU" plus the format version. */
+#define HANDOFF_MAGIC 0x49525502u
+
+namespace
+{
+	void sendAll(int socket, char const* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t sent = ::send(socket, data, size, MSG_NOSIGNAL);
+			if (sent < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("Handoff send: " + std::string(strerror(errno)));
+			}
+			data += sent;
+			size -= static_cast<size_t>(sent);
+		}
+	}
+
+	void receiveAll(int socket, char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t got = recv(socket, data, size, 0);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				throw std::runtime_error("Handoff truncated");
+			data += got;
+			size -= static_cast<size_t>(got);
+		}
+	}
+}
+
+Handoff::Handoff() : _cursor(0) {}
+
+/**
+ * @brief Queues a descriptor for transfer.
+ *
+ * @return Its index, which the state refers to it by.
+ */
+uint32_t Handoff::addFd(int fd)
+{
+	_fds.push_back(fd);
+	return static_cast<uint32_t>(_fds.size() - 1);
+}
+
+/**
+ * @brief A received descriptor by index; owned by the caller.
+ */
+int Handoff::fd(uint32_t index) const
+{
+	if (index >= _fds.size())
+		throw std::runtime_error("Handoff: bad descriptor index");
+	return _fds[index];
+}
+
+size_t Handoff::fdCount() const
+{
+	return _fds.size();
+}
+
+void Handoff::putU32(uint32_t value)
+{
+	_state.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void Handoff::putString(std::string const& value)
+{
+	putU32(static_cast<uint32_t>(value.size()));
+	_state.append(value);
+}
+
+void Handoff::need(size_t bytes) const
+{
+	if (_state.size() - _cursor < bytes)
+		throw std::runtime_error("Handoff: state truncated");
+}
+
+uint32_t Handoff::getU32()
+{
+	uint32_t value;
+	need(sizeof(value));
+	std::memcpy(&value, _state.data() + _cursor, sizeof(value));
+	_cursor += sizeof(value);
+	return value;
+}
+
+std::string Handoff::getString()
+{
+	uint32_t size = getU32();
+	need(size);
+	std::string value(_state, _cursor, size);
+	_cursor += size;
+	return value;
+}
+
+/**
+ * @brief Transfers every descriptor and the state. Blocking.
+ *
+ * @throws std::runtime_error if the peer went away.
+ */
+void Handoff::send(int socket) const
+{
+	uint32_t header[4];
+	header[0] = HANDOFF_MAGIC;
+	header[1] = static_cast<uint32_t>(_fds.size());
+	header[2] = static_cast<uint32_t>(_state.size());
+	header[3] = static_cast<uint32_t>(static_cast<uint64_t>(_state.size()) >> 32);
+	sendAll(socket, reinterpret_cast<char const*>(header), sizeof(header));
+
+	for (size_t first = 0; first < _fds.size(); first += HANDOFF_FDS_PER_MESSAGE)
+	{
+		size_t count = _fds.size() - first;
+		if (count > HANDOFF_FDS_PER_MESSAGE)
+			count = HANDOFF_FDS_PER_MESSAGE;
+		char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+		char byte = 'F';
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		struct msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		std::memset(control, 0, sizeof(control));
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		std::memcpy(CMSG_DATA(cmsg), &_fds[first], sizeof(int) * count);
+		while (sendmsg(socket, &message, MSG_NOSIGNAL) < 0)
+		{
+			if (errno != EINTR)
+				throw std::runtime_error("Handoff sendmsg: " + std::string(strerror(errno)));
+		}
+	}
+	sendAll(socket, _state.data(), _state.size());
+}
+
+/**
+ * @brief Counterpart of send(). Received descriptors are close-on-exec.
+ *
+ * @throws std::runtime_error on a malformed or truncated transfer; the
+ * descriptors received so far are closed.
+ */
+void Handoff::receive(int socket)
+{
+	uint32_t header[4];
+	receiveAll(socket, reinterpret_cast<char*>(header), sizeof(header));
+	if (header[0] != HANDOFF_MAGIC)
+		throw std::runtime_error("Handoff: version mismatch");
+	size_t expected = header[1];
+	try
+	{
+		while (_fds.size() < expected)
+		{
+			char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+			char byte;
+			struct iovec iov;
+			iov.iov_base = &byte;
+			iov.iov_len = 1;
+			struct msghdr message;
+			std::memset(&message, 0, sizeof(message));
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+			ssize_t got = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				throw std::runtime_error("Handoff truncated");
+			for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+			{
+				if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+					continue;
+				size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				int const* fds = reinterpret_cast<int const*>(CMSG_DATA(cmsg));
+				for (size_t i = 0; i < count; ++i)
+					_fds.push_back(fds[i]);
+			}
+			if (message.msg_flags & MSG_CTRUNC)
+				throw std::runtime_error("Handoff: descriptors truncated (fd limit?)");
+		}
+		size_t size = static_cast<size_t>(header[2] | (static_cast<uint64_t>(header[3]) << 32));
+		_state.resize(size);
+		if (size > 0)
+			receiveAll(socket, &_state[0], size);
+		_cursor = 0;
+	}
+	catch (...)
+	{
+		for (size_t i = 0; i < _fds.size(); ++i)
+			close(_fds[i]);
+		_fds.clear();
+		throw;
+	}
+}
+
+/**
+ * @brief Tells the old process it may exit.
+ */
+void Handoff::acknowledge(int socket)
+{
+	char byte = 'K';
+	sendAll(socket, &byte, 1);
+}
+
+/**
+ * @return true if the new process acknowledged within timeoutMs.
+ */
+bool Handoff::awaitAcknowledge(int socket, int timeoutMs)
+{
+	struct pollfd entry;
+	entry.fd = socket;
+	entry.events = POLLIN;
+	entry.revents = 0;
+	int ready;
+	while ((ready = poll(&entry, 1, timeoutMs)) < 0 && errno == EINTR)
+		;
+	char byte = 0;
+	return ready == 1 && recv(socket, &byte, 1, 0) == 1 && byte == 'K';
+}